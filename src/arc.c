@@ -11,6 +11,9 @@
 #include "shardcache_internal.h" // for MUTEX_* macros
 
 #include "arc.h"
+#include "slab.h"
+#include "epoch.h"
+#include "sketch.h"
 
 #ifdef USE_PACKED_STRUCTURES
 #define PACK_IF_NECESSARY __attribute__((packed))
@@ -46,46 +49,135 @@ typedef struct _arc_state {
 
 /* This structure represents an object that is stored in the cache. Consider
  * this structure private, don't access the fields directly. When creating
- * a new object, use the arc_object_create() function to allocate and initialize it. */
+ * a new object, use the arc_object_create() function to allocate and initialize it.
+ * NOTE: the user object (of the size provided to arc_create()) is stored
+ *       right after this structure. The fields accessed on the lookup path
+ *       come first and the inline key buffer is sized to use what would
+ *       otherwise be padding (the structure is 96 bytes on 64bit platforms) */
 typedef struct _arc_object {
     arc_state_t *state;
     arc_list_t head;
+    refcnt_node_t *node;
     size_t size;
-    void *ptr;
-    char buf[32];
     void *key;
-    size_t klen;
-    refcnt_node_t *node;
-    int async;
-    int locked;
+    uint32_t klen;
+    uint8_t async;
+    uint8_t locked;
+    uint8_t dead; // set once the user object has been evicted
+    char buf[41];
 } PACK_IF_NECESSARY arc_object_t;
 
-/* The actual cache. */
-struct _arc {
-    struct _arc_ops *ops;
+#define ARC_OBJ_PTR(o) ((o)->dead ? NULL : (void *)((char *)(o) + sizeof(arc_object_t)))
+
+/**********************************************************************
+ * Lossy read buffers used to record hits on objects already in the mfu
+ * list without taking the partition lock. The recorded hits are replayed
+ * (moving the objects to the head of the mfu list) in batches by whoever
+ * manages to acquire the lock. If a buffer is full the hit is just dropped,
+ * the mfu ordering doesn't need to be exact.
+ */
+#define ARC_READ_BUFFER_STRIPES 16
+#define ARC_READ_BUFFER_SIZE 32
+#define ARC_READ_BUFFER_DRAIN_THRESHOLD (ARC_READ_BUFFER_SIZE >> 1)
+
+typedef struct _arc_read_buffer {
+    uint32_t writes; // note must be accessed only via atomic functions
+    uint32_t reads;  // only updated by the drainer (holding the partition lock)
+    struct _arc_object *slots[ARC_READ_BUFFER_SIZE];
+} arc_read_buffer_t;
+
+// the counters of the count-min sketch used by the TinyLFU admission filter
+// (see sketch.h) saturate at this value
+#define ARC_SKETCH_COUNTER_MAX 15
+
+/* A partition is an independent ARC instance (with its own lists,
+ * its own target (p) and its own lock) taking care of the subset
+ * of the keyspace which hashes to it. */
+typedef struct _arc_partition {
     hashtable_t *hash;
 
     size_t c, p;
-    size_t cos;
     struct _arc_state mrug, mru, mfu, mfug;
 
     int needs_balance;
-    int mode;
 
     pthread_mutex_t lock;
 
+    arc_read_buffer_t rb[ARC_READ_BUFFER_STRIPES];
+    uint64_t rb_drains;  // note must be accessed only via atomic functions
+    uint64_t rb_drained; // note must be accessed only via atomic functions
+    uint64_t rb_full;    // note must be accessed only via atomic functions
+
+    sketch_t sketch;           // only used in SHARDCACHE_ARC_MODE_TINYLFU
+    uint64_t tinylfu_admitted; // note must be accessed only via atomic functions
+    uint64_t tinylfu_rejected; // note must be accessed only via atomic functions
+    uint64_t too_big;          // note must be accessed only via atomic functions
+
+    // cursor used by arc_sample() to walk the mru and mfu lists
+    // (from the lru end to the head) across subsequent calls
+    arc_state_t *sample_state; // the list being walked
+    arc_list_t *sample_pos;    // the next object to sample (NULL == the lru end of sample_state)
+} arc_partition_t;
+
+/* The actual cache. */
+struct _arc {
+    struct _arc_ops *ops;
+
+    size_t cos;
+    int mode;
+
     refcnt_t *refcnt;
+
+    int num_partitions;
+    arc_partition_t *partitions;
+
+    int balance_batch; // max number of objects moved by a single arc_balance() call (0 == unlimited)
+
+    int reclamation; // ARC_RECLAMATION_REFCNT or ARC_RECLAMATION_EPOCH (see arc_set_reclamation())
+
+    // objects unlinked from the hashtables waiting for the epoch to advance
+    // before their reference can be released (only in ARC_RECLAMATION_EPOCH mode),
+    // there is one list for each of the last 3 epochs (linked using obj->head.next)
+    pthread_mutex_t limbo_lock;
+    struct _arc_object *limbo[3];
+    uint64_t limbo_epoch[3];
+    int limbo_count;
 };
 
+/* In ARC_RECLAMATION_EPOCH mode, the objects found by arc_lookup() are not
+ * retained but they are kept in the list of the objects pinned by the
+ * calling thread (which is in an epoch critical section until all of them
+ * have been released). If the list is full the object is retained instead. */
+#define ARC_PINNED_MAX 16
+static __thread struct _arc_object *arc_pinned[ARC_PINNED_MAX];
+static __thread int arc_num_pinned = 0;
+
+// the number of retired objects after which the epoch is advanced
+#define ARC_LIMBO_RECLAIM_THRESHOLD 64
+
 
 #define MAX(a, b) ( (a) > (b) ? (a) : (b) )
 #define MIN(a, b) ( (a) < (b) ? (a) : (b) )
 
 #define ARC_OBJ_BASE_SIZE(o) (sizeof(arc_object_t) + (((o)->key == (o)->buf) ? 0 : (o)->klen))
 
-static int arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state);
+static int arc_move(arc_t *cache, arc_partition_t *part, arc_object_t *obj, arc_state_t *state);
 
+/* Select the partition responsible for the given key.
+ * NOTE: we don't use the same hash function used by the hashtable
+ *       implementation to avoid all the keys falling into a partition
+ *       being also clustered in the same subset of its buckets */
+static inline arc_partition_t *
+arc_partition_select(arc_t *cache, const void *key, size_t klen)
+{
+    if (cache->num_partitions == 1)
+        return &cache->partitions[0];
 
+    // NOTE: the upper half of the hash is independent from the lower one
+    //       (which selects the counters in the first row of the sketch)
+    uint32_t hash = (uint32_t)(sketch_hash(key, klen) >> 32);
+    return &cache->partitions[hash % cache->num_partitions];
+}
 
 static inline void
 arc_list_init( arc_list_t * head )
@@ -93,6 +185,117 @@ arc_list_init( arc_list_t * head )
     head->next = head->prev = head;
 }
 
+/* Release the references held by a chain of retired objects */
+static void
+arc_limbo_release(arc_t *cache, arc_object_t *obj)
+{
+    while (obj) {
+        arc_object_t *next = (arc_object_t *)obj->head.next;
+        obj->head.next = NULL;
+        release_ref(cache->refcnt, obj->node);
+        obj = next;
+    }
+}
+
+/* Release the objects retired in epochs which nobody can still be referencing
+ * (all of them if force is true) */
+static void
+arc_limbo_reclaim(arc_t *cache, int force)
+{
+    arc_object_t *release = NULL;
+    uint64_t epoch = force ? 0 : epoch_try_advance();
+    int i;
+
+    MUTEX_LOCK(cache->limbo_lock);
+    for (i = 0; i < 3; i++) {
+        arc_object_t *obj = cache->limbo[i];
+        if (!obj || (!force && !epoch_is_safe(cache->limbo_epoch[i], epoch)))
+            continue;
+        // append the whole list to the chain of objects to release
+        while (obj) {
+            arc_object_t *next = (arc_object_t *)obj->head.next;
+            obj->head.next = (arc_list_t *)release;
+            release = obj;
+            cache->limbo_count--;
+            obj = next;
+        }
+        cache->limbo[i] = NULL;
+    }
+    MUTEX_UNLOCK(cache->limbo_lock);
+
+    arc_limbo_release(cache, release);
+}
+
+/* Drop the reference held by the cache on an object which has been
+ * removed from the hashtable.
+ * In ARC_RECLAMATION_EPOCH mode readers might still be accessing the object
+ * without having retained it, so the reference is released only once the
+ * epoch has advanced */
+static inline void
+arc_object_retire(arc_t *cache, arc_object_t *obj)
+{
+    if (ATOMIC_READ(cache->reclamation) != ARC_RECLAMATION_EPOCH) {
+        release_ref(cache->refcnt, obj->node);
+        return;
+    }
+
+    // NOTE: the object is not in any list anymore,
+    //       so its list head can be used to link it in the limbo
+    arc_object_t *release = NULL;
+    MUTEX_LOCK(cache->limbo_lock);
+    uint64_t epoch = epoch_current();
+    int index = epoch % 3;
+    if (cache->limbo[index] && cache->limbo_epoch[index] != epoch) {
+        // the list holds objects retired 3 (or more) epochs ago
+        release = cache->limbo[index];
+        cache->limbo[index] = NULL;
+        arc_object_t *o = release;
+        while (o) {
+            cache->limbo_count--;
+            o = (arc_object_t *)o->head.next;
+        }
+    }
+    cache->limbo_epoch[index] = epoch;
+    obj->head.prev = NULL;
+    obj->head.next = (arc_list_t *)cache->limbo[index];
+    cache->limbo[index] = obj;
+    int reclaim = (++cache->limbo_count >= ARC_LIMBO_RECLAIM_THRESHOLD);
+    MUTEX_UNLOCK(cache->limbo_lock);
+
+    arc_limbo_release(cache, release);
+
+    if (reclaim)
+        arc_limbo_reclaim(cache, 0);
+}
+
+/* Remember an object found (but not retained) by the calling thread
+ * while in an epoch critical section.
+ * Returns 1 if the object has been pinned, 0 if there is no room left */
+static inline int
+arc_object_pin(arc_object_t *obj)
+{
+    if (UNLIKELY(arc_num_pinned >= ARC_PINNED_MAX))
+        return 0;
+    arc_pinned[arc_num_pinned++] = obj;
+    return 1;
+}
+
+/* Returns 1 if the object was pinned by the calling thread
+ * (and leaves the critical section), 0 otherwise */
+static inline int
+arc_object_unpin(arc_object_t *obj)
+{
+    int i;
+    for (i = arc_num_pinned - 1; i >= 0; i--) {
+        if (arc_pinned[i] == obj) {
+            arc_pinned[i] = arc_pinned[--arc_num_pinned];
+            epoch_exit();
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static inline void
 arc_list_destroy(arc_t *cache, arc_list_t *head)
 {
@@ -102,7 +305,8 @@ arc_list_destroy(arc_t *cache, arc_list_t *head)
         arc_object_t *obj = arc_list_entry(pos, arc_object_t, head);
         pos = pos->next;
         tmp->prev = tmp->next = NULL;
-        release_ref(cache->refcnt, obj->node);
+        ATOMIC_SET(obj->state, NULL);
+        arc_object_retire(cache, obj);
     }
 }
 
@@ -157,43 +361,215 @@ arc_state_lru(arc_state_t *state)
     return arc_list_entry(head, arc_object_t, head);
 }
 
-/* Balance the lists so that we can fit an object with the given size into
- * the cache. */
+static int arc_read_buffer_next_stripe = 0;
+
+static inline arc_read_buffer_t *
+arc_read_buffer_select(arc_partition_t *part)
+{
+    static __thread int stripe = -1;
+    if (UNLIKELY(stripe == -1))
+        stripe = ATOMIC_INCREASE(arc_read_buffer_next_stripe, 1) % ARC_READ_BUFFER_STRIPES;
+    return &part->rb[stripe];
+}
+
+/* Record a hit on an object in the mfu list.
+ * Returns 1 if the buffer needs to be drained, 0 otherwise */
+static inline int
+arc_read_buffer_record(arc_t *cache, arc_partition_t *part, arc_object_t *obj)
+{
+    arc_read_buffer_t *rb = arc_read_buffer_select(part);
+    uint32_t writes = ATOMIC_READ(rb->writes);
+    uint32_t pending = writes - ATOMIC_READ(rb->reads);
+
+    if (UNLIKELY(pending >= ARC_READ_BUFFER_SIZE)) {
+        ATOMIC_INCREMENT(part->rb_full);
+        return 1;
+    }
+
+    // if someone else claimed the slot in the meanwhile we just drop the hit
+    if (!ATOMIC_CAS(rb->writes, writes, writes + 1))
+        return 0;
+
+    // the object is retained until the buffer is drained
+    retain_ref(cache->refcnt, obj->node);
+    if (UNLIKELY(!ATOMIC_CAS(rb->slots[writes % ARC_READ_BUFFER_SIZE], NULL, obj))) {
+        release_ref(cache->refcnt, obj->node);
+        return 1;
+    }
+
+    return (pending + 1 >= ARC_READ_BUFFER_DRAIN_THRESHOLD);
+}
+
+/* Replay the hits recorded in the read buffers.
+ * NOTE: must be called with the partition lock held */
+static void
+arc_read_buffer_drain(arc_t *cache, arc_partition_t *part)
+{
+    int i;
+    uint64_t drained = 0;
+
+    for (i = 0; i < ARC_READ_BUFFER_STRIPES; i++) {
+        arc_read_buffer_t *rb = &part->rb[i];
+        uint32_t reads = rb->reads;
+        uint32_t writes = ATOMIC_READ(rb->writes);
+        while (reads != writes) {
+            arc_object_t *obj = ATOMIC_READ(rb->slots[reads % ARC_READ_BUFFER_SIZE]);
+            // the writer claimed the slot but didn't store the object yet,
+            // we will get it at the next drain
+            if (!obj)
+                break;
+            ATOMIC_CAS(rb->slots[reads % ARC_READ_BUFFER_SIZE], obj, NULL);
+
+            // the object might have been moved to another list (or dropped)
+            // after the hit has been recorded
+            if (ATOMIC_READ(obj->state) == &part->mfu && part->mfu.head.next != &obj->head)
+                arc_list_move_to_head(&obj->head, &part->mfu.head);
+
+            release_ref(cache->refcnt, obj->node);
+            reads++;
+            drained++;
+        }
+        ATOMIC_SET(rb->reads, reads);
+    }
+
+    if (drained) {
+        ATOMIC_INCREMENT(part->rb_drains);
+        ATOMIC_INCREASE(part->rb_drained, drained);
+    }
+}
+
 static inline void
-arc_balance(arc_t *cache)
+arc_read_buffer_try_drain(arc_t *cache, arc_partition_t *part)
 {
-    if (!ATOMIC_READ(cache->needs_balance))
-        return;
+    // if someone else is holding the lock the buffer
+    // will be drained by the next one getting it
+    if (pthread_mutex_trylock(&part->lock) == 0) {
+        arc_read_buffer_drain(cache, part);
+        MUTEX_UNLOCK(part->lock);
+    }
+}
+
+/* Try releasing part of the data of the object at the lru end of a list
+ * instead of evicting it as a whole (see the trim callback in arc_ops_t).
+ * Returns 1 if the object has been trimmed, 0 if it needs to be evicted.
+ * NOTE: must be called with the partition lock held */
+static inline int
+arc_trim(arc_t *cache, arc_partition_t *part, arc_object_t *obj)
+{
+    if (!cache->ops->trim || obj->locked || obj->dead)
+        return 0;
+
+    size_t base = ARC_OBJ_BASE_SIZE(obj) + cache->cos;
+    size_t size = part->mru.size + part->mfu.size;
+    size_t c = ATOMIC_READ(part->c);
+    if (obj->size <= base || size <= c)
+        return 0;
+
+    size_t released = cache->ops->trim(ARC_OBJ_PTR(obj), size - c, cache->ops->priv);
+    if (!released)
+        return 0;
+
+    if (released > obj->size - base)
+        released = obj->size - base;
+
+    arc_state_t *state = ATOMIC_READ(obj->state);
+    ATOMIC_DECREASE(state->size, released);
+    obj->size -= released;
+    return 1;
+}
+
+/* Balance the lists so that we can fit an object with the given size into
+ * the cache. At most balance_batch objects (if not 0) are moved in a single
+ * call so that shrinking the cache won't hold the partition lock for too long,
+ * if there are still objects in excess the partition will be balanced again
+ * by the next call.
+ * Returns the number of objects which have been moved */
+static inline int
+arc_balance(arc_t *cache, arc_partition_t *part)
+{
+    if (!ATOMIC_READ(part->needs_balance))
+        return 0;
+
+    int budget = ATOMIC_READ(cache->balance_batch);
+    int moved = 0;
+
+    MUTEX_LOCK(part->lock);
+    // replay the pending hits first so that the
+    // lru ends of the lists are as accurate as possible
+    arc_read_buffer_drain(cache, part);
 
-    MUTEX_LOCK(cache->lock);
     /* First move objects from MRU/MFU to their respective ghost lists. */
-    while (cache->mru.size + cache->mfu.size > ATOMIC_READ(cache->c)) {
-        if (cache->mru.size > cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mru);
-            arc_move(cache, obj, &cache->mrug);
-        } else if (cache->mfu.size > ATOMIC_READ(cache->c) - cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mfu);
-            arc_move(cache, obj, &cache->mfug);
+    while (part->mru.size + part->mfu.size > ATOMIC_READ(part->c)) {
+        if (budget && moved >= budget) {
+            MUTEX_UNLOCK(part->lock);
+            return moved;
+        }
+        // big objects are trimmed (as long as possible) before being evicted
+        if (part->mru.size > part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mru);
+            if (!arc_trim(cache, part, obj))
+                arc_move(cache, part, obj, &part->mrug);
+        } else if (part->mfu.size > ATOMIC_READ(part->c) - part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mfu);
+            if (!arc_trim(cache, part, obj))
+                arc_move(cache, part, obj, &part->mfug);
         } else {
             break;
         }
+        moved++;
     }
 
     /* Then start removing objects from the ghost lists. */
-    while (cache->mrug.size + cache->mfug.size > ATOMIC_READ(cache->c)) {
-        if (cache->mfug.size > cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mfug);
-            arc_move(cache, obj, NULL);
-        } else if (cache->mrug.size > ATOMIC_READ(cache->c) - cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mrug);
-            arc_move(cache, obj, NULL);
+    while (part->mrug.size + part->mfug.size > ATOMIC_READ(part->c)) {
+        if (budget && moved >= budget) {
+            MUTEX_UNLOCK(part->lock);
+            return moved;
+        }
+        if (part->mfug.size > part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mfug);
+            arc_move(cache, part, obj, NULL);
+        } else if (part->mrug.size > ATOMIC_READ(part->c) - part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mrug);
+            arc_move(cache, part, obj, NULL);
         } else {
             break;
         }
+        moved++;
+    }
+
+    ATOMIC_SET(part->needs_balance, 0);
+    MUTEX_UNLOCK(part->lock);
+    return moved;
+}
+
+/* TinyLFU admission filter.
+ * Returns 1 if the new object (of the given size) can be put into the mru list,
+ * 0 if it should be dropped because it's not more popular than the object which
+ * would be evicted from the mru list to make room for it.
+ * NOTE: must be called with the partition lock held */
+static inline int
+arc_admit(arc_t *cache, arc_partition_t *part, arc_object_t *obj, size_t size)
+{
+    // the filter is consulted only if admitting the object
+    // would force arc_balance() to evict from the mru list
+    if (part->mru.size + part->mfu.size + size <= ATOMIC_READ(part->c) ||
+        part->mru.size + size <= part->p ||
+        part->mru.head.prev == &part->mru.head)
+    {
+        return 1;
+    }
+
+    arc_object_t *victim = arc_state_lru(&part->mru);
+    int candidate_freq = sketch_estimate(&part->sketch, sketch_hash(obj->key, obj->klen));
+    int victim_freq = sketch_estimate(&part->sketch, sketch_hash(victim->key, victim->klen));
+
+    if (candidate_freq > victim_freq) {
+        ATOMIC_INCREMENT(part->tinylfu_admitted);
+        return 1;
     }
 
-    ATOMIC_SET(cache->needs_balance, 0);
-    MUTEX_UNLOCK(cache->lock);
+    ATOMIC_INCREMENT(part->tinylfu_rejected);
+    return 0;
 }
 
 void
@@ -201,22 +577,60 @@ arc_update_resource_size(arc_t *cache, arc_resource_t res, size_t size)
 {
     arc_object_t *obj = (arc_object_t *)res;
     if (obj) {
-        MUTEX_LOCK(cache->lock);
+        arc_partition_t *part = arc_partition_select(cache, obj->key, obj->klen);
+        MUTEX_LOCK(part->lock);
         arc_state_t *state = ATOMIC_READ(obj->state);
-        if (LIKELY(state == &cache->mru || state == &cache->mfu)) {
+        if (LIKELY(state == &part->mru || state == &part->mfu)) {
             ATOMIC_DECREASE(state->size, obj->size);
             obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + size;
             ATOMIC_INCREASE(state->size, obj->size);
         }
-        ATOMIC_INCREMENT(cache->needs_balance);
-        MUTEX_UNLOCK(cache->lock);
+        ATOMIC_INCREMENT(part->needs_balance);
+        MUTEX_UNLOCK(part->lock);
     }
 }
 
+/* Add an object whose data has just been fetched to the given list.
+ * Returns 0 if the object is in the list, 1 if it can't be kept in the cache
+ * (because it doesn't fit or it has not been admitted)
+ * NOTE: must be called with the partition lock held */
+static inline int
+arc_add_fetched(arc_t *cache, arc_partition_t *part, arc_object_t *obj, arc_state_t *state, size_t size)
+{
+    // the (single) object doesn't fit in the cache
+    // NOTE: the limit is the size of the partition (half of its share
+    //       of the whole cache), not the size of the whole cache
+    if (size >= ATOMIC_READ(part->c)) {
+        ATOMIC_INCREMENT(part->too_big);
+        return 1;
+    }
+
+    if (UNLIKELY(ATOMIC_READ(obj->state) != NULL)) {
+        // a concurrent fetcher shared the result of the same
+        // fetch and has already put the object in the cache
+        return 0;
+    }
+
+    obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + size;
+    if (state == &part->mru &&
+        ATOMIC_READ(cache->mode) == SHARDCACHE_ARC_MODE_TINYLFU &&
+        !arc_admit(cache, part, obj, obj->size))
+    {
+        return 1;
+    }
+
+    arc_list_prepend(&obj->head, &state->head);
+    ATOMIC_INCREMENT(state->count);
+    ATOMIC_SET(obj->state, state);
+    ATOMIC_INCREASE(state->size, obj->size);
+    ATOMIC_INCREMENT(part->needs_balance);
+    return 0;
+}
+
 /* Move the object to the given state. If the state transition requires,
 * fetch, evict or destroy the object. */
 static inline int
-arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
+arc_move(arc_t *cache, arc_partition_t *part, arc_object_t *obj, arc_state_t *state)
 {
     // In the first conditional we check If the object is being locked,
     // which means someone is fetching its value and we don't what
@@ -239,10 +653,10 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
     // before it's being deleted it will try putting the object to the mfu list without checking first
     // if it was already in a list or not (new objects should be first moved to the 
     // mru list and not the mfu one)
-    if (UNLIKELY(obj->locked || (state == &cache->mfu && ATOMIC_READ(obj->state) == NULL)))
+    if (UNLIKELY(obj->locked || (state == &part->mfu && ATOMIC_READ(obj->state) == NULL)))
         return 0;
 
-    MUTEX_LOCK(cache->lock);
+    MUTEX_LOCK(part->lock);
 
     arc_state_t *obj_state = ATOMIC_READ(obj->state);
 
@@ -253,7 +667,7 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
             // (those in the mfu list being hit again)
             if (LIKELY(state->head.next != &obj->head))
                 arc_list_move_to_head(&obj->head, &state->head);
-            MUTEX_UNLOCK(cache->lock);
+            MUTEX_UNLOCK(part->lock);
             return 0;
         }
 
@@ -261,23 +675,27 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
         // (and the object is not going to be being removed)
         // move the ^ (p) marker
         if (LIKELY(state != NULL)) {
-            if (obj_state == &cache->mrug) {
-                size_t csize = cache->mrug.size
-                             ? (cache->mfug.size / cache->mrug.size)
-                             : cache->mfug.size / 2;
-                cache->p = MIN(ATOMIC_READ(cache->c), cache->p + MAX(csize, 1));
-            } else if (obj_state == &cache->mfug) {
-                size_t csize = cache->mfug.size
-                             ? (cache->mrug.size / cache->mfug.size)
-                             : cache->mrug.size / 2;
+            if (obj_state == &part->mrug) {
+                size_t csize = part->mrug.size
+                             ? (part->mfug.size / part->mrug.size)
+                             : part->mfug.size / 2;
+                part->p = MIN(ATOMIC_READ(part->c), part->p + MAX(csize, 1));
+            } else if (obj_state == &part->mfug) {
+                size_t csize = part->mfug.size
+                             ? (part->mrug.size / part->mfug.size)
+                             : part->mrug.size / 2;
                 size_t diff = MAX(csize, 1);
-                if (cache->p > diff)
-                    cache->p -= diff;
+                if (part->p > diff)
+                    part->p -= diff;
                 else
-                    cache->p = 0;
+                    part->p = 0;
             }
         }
 
+        // don't leave the sampling cursor on an object which is leaving the list
+        if (UNLIKELY(part->sample_pos == &obj->head))
+            part->sample_pos = obj->head.prev;
+
         ATOMIC_DECREASE(obj_state->size, obj->size);
         arc_list_remove(&obj->head);
         ATOMIC_DECREMENT(obj_state->count);
@@ -285,9 +703,9 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
     }
 
     if (state == NULL) {
-        if (ht_delete_if_equals(ATOMIC_READ(cache->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
-            release_ref(cache->refcnt, obj->node);
-    } else if (state == &cache->mrug || state == &cache->mfug) {
+        if (ht_delete_if_equals(ATOMIC_READ(part->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
+            arc_object_retire(cache, obj);
+    } else if (state == &part->mrug || state == &part->mfug) {
         obj->async = 0;
         arc_list_prepend(&obj->head, &state->head);
         ATOMIC_INCREMENT(state->count);
@@ -300,33 +718,28 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
         // unlock the cache while the backend is fetching the data
         // (the object has been locked while being fetched so nobody
         // will change its state)
-        MUTEX_UNLOCK(cache->lock);
+        MUTEX_UNLOCK(part->lock);
         size_t size = 0;
-        int rc = cache->ops->fetch(obj->ptr, &size, cache->ops->priv);
+        int rc = cache->ops->fetch(ARC_OBJ_PTR(obj), &size, cache->ops->priv);
         switch (rc) {
             case 1:
             case -1:
             {
-                if (ht_delete_if_equals(ATOMIC_READ(cache->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
-                    release_ref(cache->refcnt, obj->node);
+                if (ht_delete_if_equals(ATOMIC_READ(part->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
+                    arc_object_retire(cache, obj);
                 return rc;
             }
             default:
             {
-                if (size >= ATOMIC_READ(cache->c)) {
-                    // the (single) object doesn't fit in the cache, let's return it
-                    // to the getter without (re)adding it to the cache
-                    if (ht_delete_if_equals(ATOMIC_READ(cache->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
-                        release_ref(cache->refcnt, obj->node);
+                MUTEX_LOCK(part->lock);
+                if (arc_add_fetched(cache, part, obj, state, size) != 0) {
+                    // the getter will still get the object
+                    // but it won't be kept in the cache
+                    MUTEX_UNLOCK(part->lock);
+                    if (ht_delete_if_equals(ATOMIC_READ(part->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
+                        arc_object_retire(cache, obj);
                     return 1;
                 }
-                MUTEX_LOCK(cache->lock);
-                obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + size;
-                arc_list_prepend(&obj->head, &state->head);
-                ATOMIC_INCREMENT(state->count);
-                ATOMIC_SET(obj->state, state);
-                ATOMIC_INCREASE(state->size, obj->size);
-                ATOMIC_INCREMENT(cache->needs_balance);
                 break;
             }
         }
@@ -340,7 +753,7 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
         ATOMIC_SET(obj->state, state);
         ATOMIC_INCREASE(state->size, obj->size);
     }
-    MUTEX_UNLOCK(cache->lock);
+    MUTEX_UNLOCK(part->lock);
     return 0;
 }
 
@@ -353,9 +766,11 @@ free_node_ptr_callback(void *node)
     arc_object_t *obj = (arc_object_t *)node;
 
     if (obj->key != obj->buf)
-        free(obj->key);
+        slab_free(obj->key, obj->klen);
 
-    free(obj);
+    // NOTE: obj->size has been set to the size of the allocated
+    //       memory by terminate_node_callback()
+    slab_free(obj, obj->size);
 }
 
 // this is called when the refcount of the node drops to 0
@@ -367,40 +782,72 @@ terminate_node_callback(refcnt_node_t *node, void *priv)
     arc_object_t *obj = (arc_object_t *)get_node_ptr(node);
     arc_t *cache = (arc_t *)priv;
 
-    if (obj->ptr && cache->ops->evict)
-        cache->ops->evict(obj->ptr, cache->ops->priv);
+    if (!obj->dead && cache->ops->evict)
+        cache->ops->evict(ARC_OBJ_PTR(obj), cache->ops->priv);
 
-    obj->ptr = NULL;
+    obj->dead = 1;
     obj->state = NULL;
+
+    // the object is not accounted in any list anymore, let's keep track of
+    // the size which needs to be provided to slab_free() once the memory
+    // is going to be released (free_node_ptr_callback() doesn't get the cache)
+    obj->size = sizeof(arc_object_t) + cache->cos;
 }
 
 /* Create a new cache. */
 arc_t *
-arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, uint64_t *lists_size[4], arc_mode_t mode)
+arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, int num_partitions, arc_mode_t mode)
 {
+    int i;
     arc_t *cache = calloc(1, sizeof(arc_t));
 
     cache->mode = mode;
 
     cache->ops = ops;
 
-    cache->hash = ht_create(1<<16, 1<<25, NULL);
-
-    cache->c = c >> 1;
-    cache->p = cache->c >> 1;
     cache->cos = cached_object_size;
 
-    arc_list_init(&cache->mrug.head);
-    arc_list_init(&cache->mru.head);
-    arc_list_init(&cache->mfu.head);
-    arc_list_init(&cache->mfug.head);
+    if (num_partitions < 1)
+        num_partitions = 1;
+
+    cache->num_partitions = num_partitions;
+    cache->partitions = calloc(num_partitions, sizeof(arc_partition_t));
+
+    // each partition takes care of an equal slice of the total size
+    // (and of the keyspace)
+    size_t initial_table_size = MAX((1<<16) / num_partitions, 1<<10);
+    for (i = 0; i < num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
 
-    lists_size[0] = &cache->mru.size;
-    lists_size[1] = &cache->mfu.size;
-    lists_size[2] = &cache->mrug.size;
-    lists_size[3] = &cache->mfug.size;
+        part->hash = ht_create(initial_table_size, 1<<25, NULL);
+
+        part->c = (c / num_partitions) >> 1;
+        part->p = part->c >> 1;
+
+        arc_list_init(&part->mrug.head);
+        arc_list_init(&part->mru.head);
+        arc_list_init(&part->mfu.head);
+        arc_list_init(&part->mfug.head);
+
+        MUTEX_INIT_RECURSIVE(part->lock);
+
+        // the sketch is sized after the expected number of keys in the partition
+        // (the same estimate used for the initial size of the hashtable)
+        if (sketch_init(&part->sketch, initial_table_size, ARC_SKETCH_COUNTER_MAX) != 0) {
+            fprintf(stderr, "Can't allocate the frequency sketch for the arc partition %d\n", i);
+            while (i >= 0) {
+                part = &cache->partitions[i--];
+                ht_destroy(part->hash);
+                MUTEX_DESTROY(part->lock);
+                sketch_destroy(&part->sketch);
+            }
+            free(cache->partitions);
+            free(cache);
+            return NULL;
+        }
+    }
 
-    MUTEX_INIT_RECURSIVE(cache->lock);
+    MUTEX_INIT(cache->limbo_lock);
 
     cache->refcnt = refcnt_create(1<<8, terminate_node_callback, free_node_ptr_callback);
     return cache;
@@ -410,36 +857,109 @@ arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, uint64_t *lists_
 void
 arc_destroy(arc_t *cache)
 {
-    arc_list_destroy(cache, &cache->mrug.head);
-    arc_list_destroy(cache, &cache->mru.head);
-    arc_list_destroy(cache, &cache->mfu.head);
-    arc_list_destroy(cache, &cache->mfug.head);
-    ht_destroy(cache->hash);
+    int i;
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+        arc_read_buffer_drain(cache, part);
+        arc_list_destroy(cache, &part->mrug.head);
+        arc_list_destroy(cache, &part->mru.head);
+        arc_list_destroy(cache, &part->mfu.head);
+        arc_list_destroy(cache, &part->mfug.head);
+        ht_destroy(part->hash);
+        MUTEX_DESTROY(part->lock);
+        sketch_destroy(&part->sketch);
+    }
+    // nobody can be accessing the objects anymore
+    arc_limbo_reclaim(cache, 1);
+    MUTEX_DESTROY(cache->limbo_lock);
     refcnt_destroy(cache->refcnt);
-    MUTEX_DESTROY(cache->lock);
+    free(cache->partitions);
     free(cache);
 }
 
 void
 arc_clear(arc_t *cache)
 {
-    MUTEX_LOCK(cache->lock);
-    hashtable_t *new_table = ht_create(1<<16, 1<<25, NULL);
-    hashtable_t *old_table = ATOMIC_READ(cache->hash);
-    if (ATOMIC_CAS(cache->hash, old_table, new_table)) {
-        arc_list_destroy(cache, &cache->mrug.head);
-        arc_list_destroy(cache, &cache->mfug.head);
-        arc_list_destroy(cache, &cache->mru.head);
-        arc_list_destroy(cache, &cache->mfu.head);
-        ht_destroy(old_table);
+    int i;
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+        MUTEX_LOCK(part->lock);
+        hashtable_t *new_table = ht_create(MAX((1<<16) / cache->num_partitions, 1<<10), 1<<25, NULL);
+        hashtable_t *old_table = ATOMIC_READ(part->hash);
+        if (ATOMIC_CAS(part->hash, old_table, new_table)) {
+            arc_read_buffer_drain(cache, part);
+            arc_list_destroy(cache, &part->mrug.head);
+            arc_list_destroy(cache, &part->mfug.head);
+            arc_list_destroy(cache, &part->mru.head);
+            arc_list_destroy(cache, &part->mfu.head);
+            part->sample_state = NULL;
+            part->sample_pos = NULL;
+            ht_destroy(old_table);
+        } else {
+            ht_destroy(new_table);
+        }
+        MUTEX_UNLOCK(part->lock);
     }
-    MUTEX_UNLOCK(cache->lock);
 }
 
 void
 arc_set_size(arc_t *cache, size_t size)
 {
-    ATOMIC_SET(cache->c, size >> 1);
+    int i;
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+        MUTEX_LOCK(part->lock);
+        ATOMIC_SET(part->c, (size / cache->num_partitions) >> 1);
+        // the target for the mru list can't exceed the new size
+        if (part->p > part->c)
+            part->p = part->c;
+        MUTEX_UNLOCK(part->lock);
+        // the objects in excess will be evicted by the next calls to arc_balance()
+        // (either triggered by new objects or by arc_shrink())
+        ATOMIC_INCREMENT(part->needs_balance);
+    }
+}
+
+int
+arc_shrink(arc_t *cache, uint64_t *moved)
+{
+    int i;
+    int pending = 0;
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+        int count = arc_balance(cache, part);
+        if (moved)
+            *moved += count;
+        if (ATOMIC_READ(part->needs_balance))
+            pending = 1;
+    }
+    return pending;
+}
+
+int
+arc_set_reclamation(arc_t *cache, arc_reclamation_t reclamation)
+{
+    // objects looked up in one mode can't be released in the other one
+    if (arc_count(cache) > 0)
+        return -1;
+
+    ATOMIC_SET(cache->reclamation, reclamation);
+    if (reclamation != ARC_RECLAMATION_EPOCH)
+        arc_limbo_reclaim(cache, 1);
+    return 0;
+}
+
+void
+arc_reclaim(arc_t *cache)
+{
+    if (ATOMIC_READ(cache->reclamation) == ARC_RECLAMATION_EPOCH)
+        arc_limbo_reclaim(cache, 0);
+}
+
+void
+arc_set_balance_batch(arc_t *cache, int batch)
+{
+    ATOMIC_SET(cache->balance_batch, batch);
 }
 
 static void *
@@ -454,17 +974,18 @@ arc_drop_resource(arc_t *cache, arc_resource_t res)
 {
     arc_object_t *obj = (arc_object_t *)res;
     if (obj) {
-        arc_move(cache, obj, NULL);
-        release_ref(cache->refcnt, obj->node);
+        arc_move(cache, arc_partition_select(cache, obj->key, obj->klen), obj, NULL);
+        arc_release_resource(cache, obj);
     }
 }
 
 void
 arc_remove(arc_t *cache, const void *key, size_t len)
 {
-    arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, len, NULL, retain_obj_cb, cache);
+    arc_partition_t *part = arc_partition_select(cache, key, len);
+    arc_object_t *obj = ht_get_deep_copy(part->hash, (void *)key, len, NULL, retain_obj_cb, cache);
     if (obj) {
-        arc_move(cache, obj, NULL);
+        arc_move(cache, part, obj, NULL);
         release_ref(cache->refcnt, obj->node);
     }
 }
@@ -474,6 +995,9 @@ void
 arc_release_resource(arc_t *cache, arc_resource_t res)
 {
     arc_object_t *obj = (arc_object_t *)res;
+    // objects pinned by this thread (in ARC_RECLAMATION_EPOCH mode) were not retained
+    if (arc_num_pinned && arc_object_unpin(obj))
+        return;
     release_ref(cache->refcnt, obj->node);
 }
 
@@ -490,13 +1014,15 @@ arc_retain_resource(arc_t *cache, arc_resource_t res)
 static inline arc_object_t *
 arc_object_create(arc_t *cache, const void *key, size_t len)
 {
-    arc_object_t *obj = calloc(1, sizeof(arc_object_t) + cache->cos);
+    arc_object_t *obj = slab_calloc(sizeof(arc_object_t) + cache->cos);
+    if (UNLIKELY(!obj))
+        return NULL;
 
     arc_list_init(&obj->head);
 
     obj->node = new_node(cache->refcnt, obj, cache);
     if (len > sizeof(obj->buf))
-        obj->key = malloc(len);
+        obj->key = slab_alloc(len);
     else
         obj->key = obj->buf;
     memcpy(obj->key, key, len);
@@ -504,30 +1030,59 @@ arc_object_create(arc_t *cache, const void *key, size_t len)
 
     obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos;
 
-    obj->ptr = (void *)((char *)obj + sizeof(arc_object_t));
-
     return obj;
 }
 
 // the returned object is retained, the caller must call arc_release_resource(obj) to release it
 static inline arc_resource_t 
-arc_lookup_internal(arc_t *cache, const void *key, size_t len, void **valuep, int async, time_t ttl, int fetch)
+arc_lookup_internal(arc_t *cache, const void *key, size_t len, void **valuep, int async, time_t ttl, int fetch, int count)
 {
-    // NOTE: this is an atomic operation ensured by the hashtable implementation,
-    //       we don't do any real copy in our callback but we just increase the refcount
-    //       of the object (if found)
-    arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, len, NULL, retain_obj_cb, cache);
+    arc_partition_t *part = arc_partition_select(cache, key, len);
+
+    // the admission filter needs to know about all the accesses
+    // (both hits and misses)
+    // NOTE: count is 0 when retrying a lookup whose access has already been counted
+    if (count && ATOMIC_READ(cache->mode) == SHARDCACHE_ARC_MODE_TINYLFU)
+        sketch_add(&part->sketch, sketch_hash(key, len), NULL);
+
+    arc_object_t *obj = NULL;
+    if (ATOMIC_READ(cache->reclamation) == ARC_RECLAMATION_EPOCH) {
+        // the object (if found) can't be released until we leave the critical
+        // section, which will happen when the caller releases the resource
+        epoch_enter();
+        obj = ht_get(part->hash, (void *)key, len, NULL);
+        if (obj && !arc_object_pin(obj)) {
+            // too many objects pinned by this thread, retain it instead
+            retain_ref(cache->refcnt, obj->node);
+            epoch_exit();
+        } else if (!obj) {
+            epoch_exit();
+        }
+    } else {
+        // NOTE: this is an atomic operation ensured by the hashtable implementation,
+        //       we don't do any real copy in our callback but we just increase the refcount
+        //       of the object (if found)
+        obj = ht_get_deep_copy(part->hash, (void *)key, len, NULL, retain_obj_cb, cache);
+    }
     if (obj) {
-        if (!ATOMIC_READ(cache->mode) || UNLIKELY(ATOMIC_READ(obj->state) != &cache->mfu)) {
-            if (UNLIKELY(arc_move(cache, obj, &cache->mfu) == -1)) {
+        if (LIKELY(ATOMIC_READ(obj->state) == &part->mfu)) {
+            // hits on objects already in the mfu list don't need to take the lock,
+            // they are recorded in the read buffer and replayed in batches
+            // (in loose mode we don't even care about their order)
+            if (ATOMIC_READ(cache->mode) != SHARDCACHE_ARC_MODE_LOOSE &&
+                arc_read_buffer_record(cache, part, obj))
+                arc_read_buffer_try_drain(cache, part);
+        } else {
+            if (UNLIKELY(arc_move(cache, part, obj, &part->mfu) == -1)) {
                 fprintf(stderr, "Can't move the object into the cache\n");
+                arc_release_resource(cache, obj);
                 return NULL;
             }
-            arc_balance(cache);
+            arc_balance(cache, part);
         }
 
         if (valuep)
-            *valuep = obj->ptr;
+            *valuep = ARC_OBJ_PTR(obj);
 
         return obj;
     }
@@ -540,12 +1095,13 @@ arc_lookup_internal(arc_t *cache, const void *key, size_t len, void **valuep, in
         return NULL;
 
     // let our cache user initialize the underlying object
-    cache->ops->init(key, len, async, ttl, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
+    // NOTE: the user object can keep a (weak) reference to our copy of the key
+    cache->ops->init(obj->key, len, async, ttl, (arc_resource_t)obj, ARC_OBJ_PTR(obj), cache->ops->priv);
     obj->async = async;
 
     retain_ref(cache->refcnt, obj->node);
     // NOTE: atomicity here is ensured by the hashtable implementation
-    int rc = ht_set_if_not_exists(cache->hash, (void *)key, len, obj, sizeof(arc_object_t));
+    int rc = ht_set_if_not_exists(part->hash, (void *)key, len, obj, sizeof(arc_object_t));
     switch(rc) {
         case -1:
             fprintf(stderr, "Can't set the new value in the internal hashtable\n");
@@ -556,14 +1112,15 @@ arc_lookup_internal(arc_t *cache, const void *key, size_t len, void **valuep, in
             release_ref(cache->refcnt, obj->node);
             // XXX - yes, we have to release it twice
             release_ref(cache->refcnt, obj->node);
-            return arc_lookup(cache, key, len, valuep, async, ttl);
+            // this access has already been counted in the sketch
+            return arc_lookup_internal(cache, key, len, valuep, async, ttl, 1, 0);
         case 0:
             /* New objects are always moved to the MRU list. */
-            rc  = arc_move(cache, obj, &cache->mru);
+            rc  = arc_move(cache, part, obj, &part->mru);
             if (rc >= 0) {
-                arc_balance(cache);
+                arc_balance(cache, part);
                 if (valuep)
-                    *valuep = obj->ptr;
+                    *valuep = ARC_OBJ_PTR(obj);
                 return obj;
             }
             break;
@@ -580,7 +1137,7 @@ arc_lookup_internal(arc_t *cache, const void *key, size_t len, void **valuep, in
 arc_resource_t 
 arc_lookup_nofetch(arc_t *cache, const void *key, size_t len, void **valuep)
 {
-    return arc_lookup_internal(cache, key, len, valuep, 0, 0, 0);
+    return arc_lookup_internal(cache, key, len, valuep, 0, 0, 0, 1);
 }
 
 
@@ -588,7 +1145,7 @@ arc_lookup_nofetch(arc_t *cache, const void *key, size_t len, void **valuep)
 arc_resource_t 
 arc_lookup(arc_t *cache, const void *key, size_t len, void **valuep, int async, time_t ttl)
 {
-    return arc_lookup_internal(cache, key, len, valuep, async, ttl, 1);
+    return arc_lookup_internal(cache, key, len, valuep, async, ttl, 1, 1);
 }
 
 int arc_lookup_multi(arc_t *cache,
@@ -598,131 +1155,197 @@ int arc_lookup_multi(arc_t *cache,
                      int num_keys,
                      time_t ttl)
 {
-    int i;
+    if (num_keys <= 0)
+        return 0;
+
+    // the partition of each key, the indexes of the keys being processed
+    // and a flag telling if a key has already been processed
+    int *parts = malloc(sizeof(int) * num_keys * 2 + num_keys);
+    if (!parts)
+        return -1;
+    int *indexes = parts + num_keys;
+    char *done = (char *)(indexes + num_keys);
+
+    int tinylfu = (ATOMIC_READ(cache->mode) == SHARDCACHE_ARC_MODE_TINYLFU);
+    int num_hits = 0;
+    int i, j;
+
+    // first resolve all the keys (the objects are retained, regardless of the
+    // reclamation mode, since they are held across several operations) ...
+    for (i = 0; i < num_keys; i++) {
+        arc_partition_t *part = arc_partition_select(cache, keys[i], klens[i]);
+        parts[i] = part - cache->partitions;
+        arc_object_t *obj = ht_get_deep_copy(part->hash, keys[i], klens[i], NULL, retain_obj_cb, cache);
+        resources[i] = obj;
+        if (obj) {
+            // the object is going to be moved to the head of the mfu list
+            __builtin_prefetch(obj, 1);
+            indexes[num_hits++] = i;
+            if (tinylfu)
+                sketch_add(&part->sketch, sketch_hash(keys[i], klens[i]), NULL);
+        }
+    }
+
+    // ... then promote the hits taking the lock of each partition only once
+    // NOTE: the partition lock is recursive, so arc_move() won't block on it
+    //       (and won't release it since the objects are already in a list)
+    memset(done, 0, num_keys);
+    for (i = 0; i < num_hits; i++) {
+        if (done[i])
+            continue;
+        arc_partition_t *part = &cache->partitions[parts[indexes[i]]];
+        MUTEX_LOCK(part->lock);
+        for (j = i; j < num_hits; j++) {
+            if (done[j] || parts[indexes[j]] != parts[indexes[i]])
+                continue;
+            arc_move(cache, part, (arc_object_t *)resources[indexes[j]], &part->mfu);
+            done[j] = 1;
+        }
+        ATOMIC_INCREMENT(part->needs_balance);
+        MUTEX_UNLOCK(part->lock);
+        arc_balance(cache, part);
+    }
 
-    if (cache->ops->fetch_multi) {
-        int *missing = NULL;
-        int missing_count = 0;
+    if (num_hits == num_keys || !cache->ops->fetch_multi) {
+        // the misses (if any) are fetched one by one
         for (i = 0; i < num_keys; i++) {
-            resources[i] = arc_lookup_nofetch(cache, keys[i], klens[i], NULL);
-            if (!resources[i]) {
-                missing = realloc(missing, sizeof(int) * (missing_count + 1));
-                missing[missing_count++] = i;
-            }
+            if (!resources[i])
+                resources[i] = arc_lookup(cache, keys[i], klens[i], NULL, 1, ttl);
         }
+        free(parts);
+        return 0;
+    }
 
-        if (missing_count) {
-            void *mem = malloc((sizeof(void *) + sizeof(size_t) + sizeof(int)) * missing_count);
-            void **missing_objects = &mem;
-            size_t *sizes = (size_t *)(mem + missing_count);
-            int *statuses = (int *)(sizes + missing_count); 
-            int to_fetch = 0;
-            for (i = 0; i < missing_count; i++) {
-                void *key = keys[missing[i]];
-                size_t klen = klens[missing[i]];
-                arc_object_t *obj = arc_object_create(cache, key, klen);
-                if (UNLIKELY(!obj)) {
-                    //TODO - handle error and release resources
-                    free(mem);
-                    free(missing);
-                    return -1;
-                }
+    // create the objects for the missing keys, they are locked (so that
+    // nobody else moves them) until their data has been fetched
+    int num_missing = 0;
+    for (i = 0; i < num_keys; i++) {
+        if (resources[i])
+            continue;
 
-                // let our cache user initialize the underlying object
-                cache->ops->init(key, klen, 1, ttl, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
-                obj->async = 1;
-                obj->locked = 1;
+        arc_partition_t *part = &cache->partitions[parts[i]];
+        if (tinylfu)
+            sketch_add(&part->sketch, sketch_hash(keys[i], klens[i]), NULL);
 
-                retain_ref(cache->refcnt, obj->node);
-                // NOTE: atomicity here is ensured by the hashtable implementation
-                int rc = ht_set_if_not_exists(cache->hash, (void *)key, klen, obj, sizeof(arc_object_t));
-                switch(rc) {
-                    case -1:
-                        fprintf(stderr, "Can't set the new value in the internal hashtable\n");
-                        release_ref(cache->refcnt, obj->node);
-                        break;
-                    case 1:
-                        // the object has been created in the meanwhile
-                        release_ref(cache->refcnt, obj->node);
-                        // XXX - yes, we have to release it twice
-                        release_ref(cache->refcnt, obj->node);
-                        resources[missing[i]] = arc_lookup(cache, key, klen, NULL, 1, ttl);
-                        break;
-                    case 0:
-                        missing_objects[to_fetch++] = obj;
-                        resources[missing[i]] = obj;
-                        break;
-                    default:
-                        fprintf(stderr, "Unknown return code from ht_set_if_not_exists() : %d\n", rc);
-                        release_ref(cache->refcnt, obj->node);
-                        break;
-                }
-            }
-            if (to_fetch &&
-                cache->ops->fetch_multi(missing_objects, sizes, statuses, to_fetch, cache->ops->priv) != 0)
-            {
-                // TODO - Handle error
-                free(mem);
-                free(missing);
-                return -1;
-            }
-            
-            for (i = 0; i < to_fetch; i++) {
-                switch (statuses[i]) {
-                    case 0:
-                        break;
-                    case 1:
-                        break;
-                    case -1:
-                        break;
-                    default:
-                        break;
+        arc_object_t *obj = arc_object_create(cache, keys[i], klens[i]);
+        if (UNLIKELY(!obj))
+            continue;
+
+        // let our cache user initialize the underlying object
+        cache->ops->init(obj->key, klens[i], 1, ttl, (arc_resource_t)obj, ARC_OBJ_PTR(obj), cache->ops->priv);
+        obj->async = 1;
+        obj->locked = 1;
+
+        retain_ref(cache->refcnt, obj->node);
+        // NOTE: atomicity here is ensured by the hashtable implementation
+        int rc = ht_set_if_not_exists(part->hash, keys[i], klens[i], obj, sizeof(arc_object_t));
+        switch(rc) {
+            case 0:
+                resources[i] = obj;
+                indexes[num_missing++] = i;
+                break;
+            case 1:
+                // the object has been created in the meanwhile
+                release_ref(cache->refcnt, obj->node);
+                // XXX - yes, we have to release it twice
+                release_ref(cache->refcnt, obj->node);
+                // this access has already been counted in the sketch
+                resources[i] = arc_lookup_internal(cache, keys[i], klens[i], NULL, 1, ttl, 1, 0);
+                break;
+            default:
+                fprintf(stderr, "Can't set the new value in the internal hashtable\n");
+                release_ref(cache->refcnt, obj->node);
+                release_ref(cache->refcnt, obj->node);
+                break;
+        }
+    }
+
+    void **objs = num_missing
+                ? malloc((sizeof(void *) + sizeof(size_t) + sizeof(int)) * num_missing)
+                : NULL;
+    int *statuses = NULL;
+
+    if (objs) {
+        size_t *sizes = (size_t *)(objs + num_missing);
+        statuses = (int *)(sizes + num_missing);
+        for (i = 0; i < num_missing; i++) {
+            objs[i] = ARC_OBJ_PTR((arc_object_t *)resources[indexes[i]]);
+            sizes[i] = 0;
+            statuses[i] = -1;
+        }
+
+        // all the missing objects are fetched at once
+        if (cache->ops->fetch_multi(objs, sizes, statuses, num_missing, cache->ops->priv) != 0) {
+            for (i = 0; i < num_missing; i++)
+                statuses[i] = -1;
+        }
+
+        // add the fetched objects to the mru lists, taking the lock of each partition only once
+        memset(done, 0, num_missing);
+        for (i = 0; i < num_missing; i++) {
+            if (done[i])
+                continue;
+            arc_partition_t *part = &cache->partitions[parts[indexes[i]]];
+            MUTEX_LOCK(part->lock);
+            for (j = i; j < num_missing; j++) {
+                if (done[j] || parts[indexes[j]] != parts[indexes[i]])
+                    continue;
+                arc_object_t *obj = (arc_object_t *)resources[indexes[j]];
+                if (statuses[j] == 0) {
+                    if (arc_add_fetched(cache, part, obj, &part->mru, sizes[j]) == 0)
+                        obj->locked = 0;
+                    else
+                        statuses[j] = 1;
                 }
+                done[j] = 1;
             }
-
-            free(mem);
-            free(missing);
+            MUTEX_UNLOCK(part->lock);
+            arc_balance(cache, part);
         }
-    } else {
-        for (i = 0; i < num_keys; i++) {
-            resources[i] = arc_lookup(cache, keys[i], klens[i], NULL, 1, ttl);
+    }
+
+    // the objects not kept in the cache are still returned to the getter,
+    // unless the fetch failed (or couldn't even be started)
+    for (i = 0; i < num_missing; i++) {
+        int status = statuses ? statuses[i] : -1;
+        if (status == 0)
+            continue;
+        arc_object_t *obj = (arc_object_t *)resources[indexes[i]];
+        arc_partition_t *part = &cache->partitions[parts[indexes[i]]];
+        if (ht_delete_if_equals(ATOMIC_READ(part->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
+            arc_object_retire(cache, obj);
+        if (status == -1) {
+            release_ref(cache->refcnt, obj->node);
+            resources[indexes[i]] = NULL;
         }
     }
+
+    free(objs);
+    free(parts);
     return 0;
 }
 
-typedef struct {
-    arc_t *cache;
-    time_t ttl;
-    void *data;
-    size_t dlen;
- } upload_obj_cb_arg_t;
-
-static void *
-update_obj_cb(void *data, size_t dlen, void *user)
+static int
+arc_load_internal(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl, int frequent)
 {
-    upload_obj_cb_arg_t *arg = (upload_obj_cb_arg_t *)user;
-    arc_object_t *obj = (arc_object_t *)data;
-    arc_t *cache = (arc_t *)arg->cache;
-    cache->ops->store(obj->ptr, arg->data, arg->dlen, cache->ops->priv);
-    if (arg->ttl) {
+    arc_partition_t *part = arc_partition_select(cache, key, klen);
+
+    // the (single) object doesn't fit in the cache (see arc_add_fetched()),
+    // an existing copy (if any) can't be updated and would be stale
+    if (vlen >= ATOMIC_READ(part->c)) {
+        ATOMIC_INCREMENT(part->too_big);
+        arc_remove(cache, key, klen);
+        return -1;
     }
-    //retain_ref(cache->refcnt, obj->node);
-    return arg->data;
-}
 
-int
-arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl)
-{
-    upload_obj_cb_arg_t arg = {
-        .cache = cache,
-        .ttl = ttl,
-        .data = valuep,
-        .dlen = vlen
-    };
-    arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, klen, NULL, update_obj_cb, &arg);
+    arc_object_t *obj = ht_get_deep_copy(part->hash, (void *)key, klen, NULL, retain_obj_cb, cache);
     if (obj) {
-        //release_ref(cache->refcnt, obj->node);
+        // NOTE: the store callback is called out of the hashtable lock
+        //       since it might need to acquire other locks
+        cache->ops->store(ARC_OBJ_PTR(obj), valuep, vlen, cache->ops->priv);
+        arc_update_resource_size(cache, obj, vlen);
+        arc_balance(cache, part);
+        release_ref(cache->refcnt, obj->node);
         return 1;
     }
 
@@ -731,12 +1354,12 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen,
         return -1;
 
     // let our cache user initialize the underlying object
-    cache->ops->init(key, klen, 0, ttl, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
-    cache->ops->store(obj->ptr, valuep, vlen, cache->ops->priv);
+    cache->ops->init(obj->key, klen, 0, ttl, (arc_resource_t)obj, ARC_OBJ_PTR(obj), cache->ops->priv);
+    cache->ops->store(ARC_OBJ_PTR(obj), valuep, vlen, cache->ops->priv);
 
     retain_ref(cache->refcnt, obj->node);
     // NOTE: atomicity here is ensured by the hashtable implementation
-    int rc = ht_set_if_not_exists(cache->hash, (void *)key, klen, obj, sizeof(arc_object_t));
+    int rc = ht_set_if_not_exists(part->hash, (void *)key, klen, obj, sizeof(arc_object_t));
     switch(rc) {
         case -1:
             fprintf(stderr, "Can't set the new value in the internal hashtable\n");
@@ -747,9 +1370,23 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen,
             release_ref(cache->refcnt, obj->node);
             // XXX - yes, we have to release it twice
             release_ref(cache->refcnt, obj->node);
-            return arc_load(cache, key, klen, valuep, vlen, ttl);
+            return arc_load_internal(cache, key, klen, valuep, vlen, ttl, frequent);
         case 0:
+        {
+            // the data is already there, the object can go
+            // straight to the mru (or mfu) list (no fetch is needed)
+            arc_state_t *state = frequent ? &part->mfu : &part->mru;
+            MUTEX_LOCK(part->lock);
+            obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + vlen;
+            arc_list_prepend(&obj->head, &state->head);
+            ATOMIC_INCREMENT(state->count);
+            ATOMIC_SET(obj->state, state);
+            ATOMIC_INCREASE(state->size, obj->size);
+            ATOMIC_INCREMENT(part->needs_balance);
+            MUTEX_UNLOCK(part->lock);
+            arc_balance(cache, part);
             break;
+        }
         default:
             fprintf(stderr, "Unknown return code from ht_set_if_not_exists() : %d\n", rc);
             release_ref(cache->refcnt, obj->node);
@@ -760,56 +1397,213 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen,
     return rc;
 }
 
+int
+arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl)
+{
+    return arc_load_internal(cache, key, klen, valuep, vlen, ttl, 0);
+}
+
+int
+arc_load_frequent(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl)
+{
+    return arc_load_internal(cache, key, klen, valuep, vlen, ttl, 1);
+}
+
 size_t
 arc_size(arc_t *cache)
 {
-    return ATOMIC_READ(cache->mru.size) + ATOMIC_READ(cache->mfu.size);
+    int i;
+    size_t size = 0;
+    for (i = 0; i < cache->num_partitions; i++)
+        size += ATOMIC_READ(cache->partitions[i].mru.size) + ATOMIC_READ(cache->partitions[i].mfu.size);
+    return size;
 }
 
 size_t
 arc_mru_size(arc_t *cache)
 {
-    return ATOMIC_READ(cache->mru.size);
+    int i;
+    size_t size = 0;
+    for (i = 0; i < cache->num_partitions; i++)
+        size += ATOMIC_READ(cache->partitions[i].mru.size);
+    return size;
 }
 
 size_t
 arc_mfu_size(arc_t *cache)
 {
-    return ATOMIC_READ(cache->mfu.size);
+    int i;
+    size_t size = 0;
+    for (i = 0; i < cache->num_partitions; i++)
+        size += ATOMIC_READ(cache->partitions[i].mfu.size);
+    return size;
 }
 
 size_t
 arc_mrug_size(arc_t *cache)
 {
-    return ATOMIC_READ(cache->mrug.size);
+    int i;
+    size_t size = 0;
+    for (i = 0; i < cache->num_partitions; i++)
+        size += ATOMIC_READ(cache->partitions[i].mrug.size);
+    return size;
 }
 
 size_t
 arc_mfug_size(arc_t *cache)
 {
-    return ATOMIC_READ(cache->mfug.size);
+    int i;
+    size_t size = 0;
+    for (i = 0; i < cache->num_partitions; i++)
+        size += ATOMIC_READ(cache->partitions[i].mfug.size);
+    return size;
 }
 
 void
 arc_get_size(arc_t *cache, size_t *mru_size, size_t *mfu_size, size_t *mrug_size, size_t *mfug_size)
 {
-    *mru_size = ATOMIC_READ(cache->mru.size);
-    *mfu_size = ATOMIC_READ(cache->mfu.size);
-    *mrug_size = ATOMIC_READ(cache->mrug.size);
-    *mfug_size = ATOMIC_READ(cache->mfug.size);
+    int i;
+    *mru_size = *mfu_size = *mrug_size = *mfug_size = 0;
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+        *mru_size += ATOMIC_READ(part->mru.size);
+        *mfu_size += ATOMIC_READ(part->mfu.size);
+        *mrug_size += ATOMIC_READ(part->mrug.size);
+        *mfug_size += ATOMIC_READ(part->mfug.size);
+    }
 }
 
 uint64_t
 arc_count(arc_t *cache)
 {
-    return ATOMIC_READ(cache->mru.count) + ATOMIC_READ(cache->mfu.count) +
-           ATOMIC_READ(cache->mrug.count) + ATOMIC_READ(cache->mfug.count);
+    int i;
+    uint64_t count = 0;
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+        count += ATOMIC_READ(part->mru.count) + ATOMIC_READ(part->mfu.count) +
+                 ATOMIC_READ(part->mrug.count) + ATOMIC_READ(part->mfug.count);
+    }
+    return count;
+}
+
+void
+arc_get_stats(arc_t *cache, arc_stats_t *stats)
+{
+    int i;
+    memset(stats, 0, sizeof(arc_stats_t));
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+        stats->rb_drains += ATOMIC_READ(part->rb_drains);
+        stats->rb_drained += ATOMIC_READ(part->rb_drained);
+        stats->rb_full += ATOMIC_READ(part->rb_full);
+        stats->tinylfu_admitted += ATOMIC_READ(part->tinylfu_admitted);
+        stats->tinylfu_rejected += ATOMIC_READ(part->tinylfu_rejected);
+        stats->too_big += ATOMIC_READ(part->too_big);
+    }
+}
+
+int
+arc_sample(arc_t *cache, int partition, arc_resource_t *resources, int num)
+{
+    arc_partition_t *part = &cache->partitions[partition % cache->num_partitions];
+    int count = 0;
+    int wraps = 0;
+
+    MUTEX_LOCK(part->lock);
+    if (!part->sample_state) {
+        part->sample_state = &part->mru;
+        part->sample_pos = NULL;
+    }
+
+    // stop once both lists have been walked till the end
+    // (so that the same object is never returned twice)
+    while (count < num && wraps < 2) {
+        arc_state_t *state = part->sample_state;
+        arc_list_t *pos = part->sample_pos ? part->sample_pos : state->head.prev;
+        if (pos == &state->head) {
+            // reached the head of the list, continue with the other one
+            part->sample_state = (state == &part->mru) ? &part->mfu : &part->mru;
+            part->sample_pos = NULL;
+            wraps++;
+            continue;
+        }
+        part->sample_pos = pos->prev;
+
+        arc_object_t *obj = arc_list_entry(pos, arc_object_t, head);
+        retain_ref(cache->refcnt, obj->node);
+        resources[count++] = obj;
+    }
+    MUTEX_UNLOCK(part->lock);
+
+    return count;
+}
+
+int
+arc_foreach(arc_t *cache, arc_foreach_callback_t cb, void *priv)
+{
+    int count = 0;
+    int i;
+    for (i = 0; i < cache->num_partitions; i++) {
+        arc_partition_t *part = &cache->partitions[i];
+
+        // the objects are retained while holding the partition lock
+        // and passed to the callback once the lock has been released
+        MUTEX_LOCK(part->lock);
+        size_t num = ATOMIC_READ(part->mru.count) + ATOMIC_READ(part->mfu.count);
+        arc_object_t **objects = num ? malloc(num * sizeof(arc_object_t *)) : NULL;
+        size_t n = 0;
+        size_t num_mru = 0;
+        int s;
+        for (s = 0; objects && s < 2; s++) {
+            arc_state_t *state = s ? &part->mfu : &part->mru;
+            // from the lru end to the head
+            arc_list_t *pos = state->head.prev;
+            while (pos != &state->head && n < num) {
+                arc_object_t *obj = arc_list_entry(pos, arc_object_t, head);
+                retain_ref(cache->refcnt, obj->node);
+                objects[n++] = obj;
+                pos = pos->prev;
+            }
+            if (!s)
+                num_mru = n;
+        }
+        MUTEX_UNLOCK(part->lock);
+
+        if (num && !objects)
+            return -1;
+
+        size_t j;
+        int stop = 0;
+        for (j = 0; j < n; j++) {
+            arc_object_t *obj = objects[j];
+            void *ptr = ARC_OBJ_PTR(obj);
+            // objects evicted in the meanwhile are skipped
+            if (!stop && ptr) {
+                if (cb(obj, ptr, j >= num_mru, priv) != 0)
+                    stop = 1;
+                else
+                    count++;
+            }
+            release_ref(cache->refcnt, obj->node);
+        }
+        free(objects);
+
+        if (stop)
+            break;
+    }
+    return count;
+}
+
+int
+arc_num_partitions(arc_t *cache)
+{
+    return cache->num_partitions;
 }
 
 void *
 arc_get_resource_ptr(arc_resource_t res)
 {
-    return ((arc_object_t *)res)->ptr;
+    return ARC_OBJ_PTR((arc_object_t *)res);
 }
 
 void
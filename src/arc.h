@@ -14,6 +14,21 @@ typedef struct _arc arc_t;
 
 typedef void * arc_resource_t;
 
+/**
+ * @brief How the memory of the objects removed from the cache is reclaimed
+ */
+typedef enum {
+    //! The objects returned by arc_lookup() are retained (using an atomic
+    //! reference count shared by all the threads accessing the object)
+    ARC_RECLAMATION_REFCNT = 0,
+    //! The threads looking up objects only announce the epoch they are running in
+    //! (in a thread-local record) and the objects removed from the cache are released
+    //! once the epoch has advanced (see epoch.h). The objects returned by arc_lookup()
+    //! MUST be released by the same thread (call arc_retain_resource() first to hand
+    //! them over to another thread)
+    ARC_RECLAMATION_EPOCH
+} arc_reclamation_t;
+
 typedef struct _arc_ops {
     /**
      * @brief Initialize a new object.
@@ -45,6 +60,17 @@ typedef struct _arc_ops {
      */
     void (*evict) (void *obj, void *priv);
 
+    /**
+     * @brief Optional callback allowing big objects to be evicted a piece at a time.
+     *
+     * Called (holding the partition lock) on the object which would be evicted
+     * otherwise, the callback can release part of its data (trying to release at
+     * least 'excess' bytes) while keeping the object in the cache.
+     * @return The number of bytes released, 0 if the object can't be trimmed
+     *         (in which case it will be evicted)
+     */
+    size_t (*trim) (void *obj, size_t excess, void *priv);
+
     //! Pointer to private data which will provided to all callbacks
     void *priv;
 } arc_ops_t;
@@ -54,10 +80,18 @@ typedef struct _arc_ops {
  *
  * @param ops : A valid pointer to an initialized arc_ops_t structure
  * @param c   : The size of the cache
- * @param mode : 0 for strict mode, 1 for loose_mode
+ * @param cached_object_size : The size of the user object attached to each cached item
+ * @param num_partitions : The number of independent partitions (each with its own
+ *                         lists, target and lock) the cache will be split into.
+ *                         Keys are distributed among the partitions by hash and
+ *                         each partition will be sized half of c / num_partitions
+ *                         (which is also the limit for the size of a single
+ *                         object, bigger ones are never cached, see arc_stats_t)
+ * @param mode : SHARDCACHE_ARC_MODE_STRICT, SHARDCACHE_ARC_MODE_LOOSE
+ *               or SHARDCACHE_ARC_MODE_TINYLFU (see arc_mode_t in shardcache.h)
  * @return    : A valid pointer to an initialized arc_t structure
  */
-arc_t *arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, uint64_t *lists_size[4], arc_mode_t mode);
+arc_t *arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, int num_partitions, arc_mode_t mode);
 
 /**
  * @brief Release an existing ARC cache instance
@@ -78,6 +112,45 @@ void arc_clear(arc_t *cache);
  */
 void arc_set_size(arc_t *cache, size_t size);
 
+/**
+ * @brief Evict one batch of the objects exceeding the size of the cache
+ *        from each partition (the partition lock is released between batches)
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param moved : If not NULL, the number of objects moved to the ghost lists
+ *                (or out of the cache) will be added to the pointed value
+ * @return 1 if there are still objects in excess, 0 otherwise
+ */
+int arc_shrink(arc_t *cache, uint64_t *moved);
+
+/**
+ * @brief Set the maximum number of objects evicted while holding the lock
+ *        of a partition, objects still in excess will be evicted by the next
+ *        lookups or by the next call to arc_shrink()
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param batch : The maximum number of objects to evict in a single batch (0 == unlimited)
+ */
+void arc_set_balance_batch(arc_t *cache, int batch);
+
+/**
+ * @brief Set the reclamation mode (see arc_reclamation_t)
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param reclamation : The new reclamation mode
+ * @return 0 on success, -1 if the cache is not empty
+ * @note The mode can be changed only while the cache is empty,
+ *       so it's expected to be set right after arc_create()
+ */
+int arc_set_reclamation(arc_t *cache, arc_reclamation_t reclamation);
+
+/**
+ * @brief Release the objects removed from the cache which can't be
+ *        referenced anymore (only in ARC_RECLAMATION_EPOCH mode)
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @note This is done automatically once enough objects are waiting to be
+ *       released, calling it periodically ensures the memory is not held
+ *       for too long when the cache is not being modified
+ */
+void arc_reclaim(arc_t *cache);
+
 /**
  * @brief Lookup an object in the cache.
  *
@@ -106,8 +179,26 @@ int arc_lookup_multi(arc_t *cache,
                      int num_keys,
                      time_t ttl);
 
+/**
+ * @brief Store a value in the cache (without fetching it)
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param key    : The key
+ * @param klen   : The length of the key
+ * @param valuep : The value to store (passed to the store callback)
+ * @param vlen   : The size of the value
+ * @param ttl    : The ttl provided to the init callback if a new object is created
+ * @return 0 if a new object has been created, 1 if an existing one has been updated,
+ *         -1 on errors or if the value is too big to be cached (see arc_create()),
+ *         in which case an existing copy is removed from the cache
+ */
 int arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl);
 
+/**
+ * @brief Like arc_load() but a newly created object goes straight to the mfu list
+ *        (used to restore objects which were frequently accessed)
+ */
+int arc_load_frequent(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl);
+
 /**
  * @brief Release the resource previously alloc'd by arc_lookup()
  * @note  The retain count will be decreased by 1.\nThe underlying
@@ -161,7 +252,7 @@ void arc_update_resource_size(arc_t *cache, arc_resource_t res, size_t size);
 /**
  * @brief Returns the actual cache size (in bytes)
  * @param cache  : A valid pointer to an initialized arc_t structure
- * @return The actual size of the cache
+ * @return The actual size of the cache (summed across all the partitions)
  */
 size_t arc_size(arc_t *cache);
 
@@ -214,6 +305,82 @@ void arc_get_size(arc_t *cache,
  */
 uint64_t arc_count(arc_t *cache);
 
+/**
+ * @brief Statistics collected by the ARC cache (aggregated across all the partitions)
+ */
+typedef struct {
+    //! number of times the read buffers have been drained
+    uint64_t rb_drains;
+    //! total number of hits replayed by the drains
+    //! (rb_drained / rb_drains gives the average drain-batch size)
+    uint64_t rb_drained;
+    //! number of hits dropped because the read buffer was full
+    uint64_t rb_full;
+    //! number of new keys admitted by the TinyLFU filter
+    //! (only those which would have forced an eviction are accounted)
+    uint64_t tinylfu_admitted;
+    //! number of new keys rejected by the TinyLFU filter
+    uint64_t tinylfu_rejected;
+    //! number of objects not cached because they don't fit in their partition
+    uint64_t too_big;
+} arc_stats_t;
+
+/**
+ * @brief Get the statistics collected by the cache
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param stats : A valid pointer to an arc_stats_t structure which will be filled in
+ */
+void arc_get_stats(arc_t *cache, arc_stats_t *stats);
+
+/**
+ * @brief Returns the number of partitions the cache has been split into
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @return The number of partitions
+ */
+int arc_num_partitions(arc_t *cache);
+
+/**
+ * @brief Sample the objects held in the mru and mfu lists of a partition
+ *
+ * Each partition keeps a cursor walking its lists (from the lru end to the head)
+ * across subsequent calls, so all the objects will be eventually sampled.
+ *
+ * @param cache     : A valid pointer to an initialized arc_t structure
+ * @param partition : The index of the partition to sample
+ * @param resources : An array where to store (at most num) sampled resources
+ * @param num       : The maximum number of objects to sample
+ * @return The number of sampled objects
+ * @note The sampled resources are retained and MUST be released using
+ *       arc_release_resource() (or arc_drop_resource())
+ */
+int arc_sample(arc_t *cache, int partition, arc_resource_t *resources, int num);
+
+/**
+ * @brief Callback called by arc_foreach() for each object in the mru and mfu lists
+ * @param res      : The (retained) ARC resource
+ * @param ptr      : The user object held by the resource
+ * @param frequent : 1 if the object is in the mfu list, 0 if it's in the mru list
+ * @param priv     : The priv pointer passed to arc_foreach()
+ * @return 0 to continue the iteration, -1 to stop it
+ */
+typedef int (*arc_foreach_callback_t)(arc_resource_t res, void *ptr, int frequent, void *priv);
+
+/**
+ * @brief Call the callback for all the objects held in the mru and mfu lists
+ *
+ * The lists of each partition are walked from the lru end to the head, so
+ * reloading the objects in the same order (using arc_load() or
+ * arc_load_frequent()) preserves their recency.
+ * The partition lock is not held while the callback is called.
+ *
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param cb    : The callback
+ * @param priv  : A pointer which will be passed to the callback
+ * @return The number of objects the callback has been called for
+ *         (without counting the one which stopped the iteration), -1 on errors
+ */
+int arc_foreach(arc_t *cache, arc_foreach_callback_t cb, void *priv);
+
 void arc_set_mode(arc_t *cache, arc_mode_t mode);
 
 #endif /* SHARDCACHE_ARC_H */
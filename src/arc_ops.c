@@ -2,18 +2,376 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <limits.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 
 #include "shardcache.h"
 #include "shardcache_internal.h"
 #include "arc_ops.h"
 #include "messaging.h"
+#include "slab.h"
 
 /**
  * * Here are the operations implemented
  *
  * */
 
+__thread int cobj_locks_held = 0;
+
+// Move the value of an object into a chunk list
+// NOTE: must be called holding the object lock
+static int
+cobj_chunkify(cached_object_t *obj)
+{
+    uint32_t num_chunks = (obj->dlen + SHARDCACHE_CHUNK_SIZE - 1) / SHARDCACHE_CHUNK_SIZE;
+    void **chunks = calloc(num_chunks ? num_chunks : 1, sizeof(void *));
+    if (UNLIKELY(!chunks))
+        return -1;
+
+    size_t offset = 0;
+    uint32_t i;
+    for (i = 0; i < num_chunks; i++) {
+        size_t len = obj->dlen - offset < SHARDCACHE_CHUNK_SIZE ? obj->dlen - offset : SHARDCACHE_CHUNK_SIZE;
+        chunks[i] = slab_alloc(len);
+        if (UNLIKELY(!chunks[i])) {
+            while (i > 0) {
+                i--;
+                slab_free(chunks[i], SHARDCACHE_CHUNK_SIZE);
+            }
+            free(chunks);
+            return -1;
+        }
+        memcpy(chunks[i], (char *)obj->data + offset, len);
+        offset += len;
+    }
+
+    if (obj->data)
+        slab_free(obj->data, obj->dlen);
+    obj->data = NULL;
+    obj->chunks = chunks;
+    obj->num_chunks = num_chunks;
+    return 0;
+}
+
+// Append data to the value of an object, values growing beyond
+// SHARDCACHE_CHUNKED_THRESHOLD are moved to a chunk list (unless the
+// object is not in the cache) so that they are never reallocated as a whole
+// NOTE: must be called holding the object lock
+static int
+cobj_append(cached_object_t *obj, void *data, size_t len)
+{
+    if (!obj->chunks) {
+        if (obj->dlen + len <= SHARDCACHE_CHUNKED_THRESHOLD || !obj->res) {
+            size_t olen = obj->dlen;
+            void *ndata = slab_realloc(obj->data, olen, olen + len);
+            if (UNLIKELY(!ndata))
+                return -1;
+            memcpy((char *)ndata + olen, data, len);
+            obj->data = ndata;
+            obj->dlen += len;
+            return 0;
+        }
+        if (cobj_chunkify(obj) != 0)
+            return -1;
+    }
+
+    while (len) {
+        size_t used = obj->dlen % SHARDCACHE_CHUNK_SIZE;
+        if (!used) {
+            void **chunks = realloc(obj->chunks, sizeof(void *) * (obj->num_chunks + 1));
+            if (UNLIKELY(!chunks))
+                return -1;
+            chunks[obj->num_chunks++] = NULL;
+            obj->chunks = chunks;
+        }
+        // the last chunk grows (up to SHARDCACHE_CHUNK_SIZE) as the data arrives
+        uint32_t idx = obj->num_chunks - 1;
+        size_t n = SHARDCACHE_CHUNK_SIZE - used < len ? SHARDCACHE_CHUNK_SIZE - used : len;
+        void *chunk = slab_realloc(obj->chunks[idx], used, used + n);
+        if (UNLIKELY(!chunk))
+            return -1;
+        memcpy((char *)chunk + used, data, n);
+        obj->chunks[idx] = chunk;
+        obj->dlen += n;
+        data = (char *)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Release the value of the object (chunks included)
+// NOTE: must be called holding the object lock (or once nobody can access the object anymore)
+static void
+cobj_release_data(shardcache_t *cache, cached_object_t *obj)
+{
+    if (obj->chunks) {
+        uint32_t i;
+        for (i = 0; i < obj->num_chunks; i++) {
+            if (obj->chunks[i])
+                shardcache_free_deferred(cache, obj->chunks[i], COBJ_CHUNK_LEN(obj, i));
+        }
+        free(obj->chunks);
+        obj->chunks = NULL;
+        obj->num_chunks = 0;
+    } else if (obj->data) {
+        shardcache_free_deferred(cache, obj->data, obj->dlen);
+    }
+    obj->data = NULL;
+}
+
+// Store a copy of the value (chunked if it's big), replacing the current one
+// NOTE: must be called holding the object lock
+static void
+cobj_set_data(shardcache_t *cache, cached_object_t *obj, void *data, size_t len)
+{
+    cobj_release_data(cache, obj);
+    obj->dlen = 0;
+    if (cobj_append(obj, data, len) != 0)
+        SHC_ERROR("Can't allocate %lu bytes for key %.*s", (unsigned long)len, obj->klen, obj->key);
+}
+
+typedef struct {
+    size_t offset;
+    size_t len;
+    size_t total;
+    void *out;
+} cobj_range_arg_t;
+
+static void *
+cobj_copy_volatile_range_cb(void *ptr, size_t len, void *user)
+{
+    cobj_range_arg_t *arg = (cobj_range_arg_t *)user;
+    volatile_object_t *item = (volatile_object_t *)ptr;
+    if (item->dlen == arg->total) {
+        arg->out = slab_alloc(arg->len);
+        if (arg->out)
+            memcpy(arg->out, (char *)item->data + arg->offset, arg->len);
+    }
+    return arg;
+}
+
+// Fetch again a chunk released by arc_ops_trim(), from the owner of the key
+// (the value is expected to be still of the same size, otherwise the chunk
+// is not loaded and the object should be dropped).
+// The object lock is released while talking to the peer or to the storage,
+// so the chunk is returned only if the value hasn't been replaced in the
+// meanwhile (if someone else fetched the same chunk, that one is returned)
+// NOTE: must be called holding the object lock
+static void *
+cobj_fetch_chunk(shardcache_t *cache, cached_object_t *obj, uint32_t idx)
+{
+    cobj_range_arg_t arg = {
+        .offset = (size_t)idx * SHARDCACHE_CHUNK_SIZE,
+        .len = COBJ_CHUNK_LEN(obj, idx),
+        .total = obj->dlen,
+        .out = NULL
+    };
+    void **chunks = obj->chunks;
+    uint32_t num_chunks = obj->num_chunks;
+
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    memset(node_name, 0, node_len);
+    if (!shardcache_test_ownership(cache, obj->key, obj->klen, node_name, &node_len)) {
+        shardcache_node_t *node = shardcache_node_select(cache, node_name);
+        if (!node)
+            return NULL;
+        char *peer_addr = shardcache_node_get_address(node);
+        COBJ_UNLOCK(cache, obj);
+        int fd = shardcache_get_connection_for_peer(cache, peer_addr);
+        fbuf_t value = FBUF_STATIC_INITIALIZER;
+        if (offset_from_peer(peer_addr, obj->key, obj->klen, arg.offset, arg.len, &value, fd) == 0) {
+            shardcache_release_connection_for_peer(cache, peer_addr, fd);
+            if (fbuf_used(&value) == arg.len) {
+                arg.out = slab_alloc(arg.len);
+                if (arg.out)
+                    memcpy(arg.out, fbuf_data(&value), arg.len);
+            }
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        fbuf_destroy(&value);
+        COBJ_LOCK(cache, obj);
+    } else {
+        ht_get_deep_copy(cache->volatile_storage, obj->key, obj->klen, NULL,
+                         cobj_copy_volatile_range_cb, &arg);
+        if (!arg.out && cache->use_persistent_storage &&
+            (cache->storage.fetch_range || cache->storage.fetch))
+        {
+            void *data = NULL;
+            size_t dlen = 0;
+            size_t total = 0;
+            COBJ_UNLOCK(cache, obj);
+            if (cache->storage.fetch_range) {
+                // read only the missing chunk
+                if (cache->storage.fetch_range(obj->key, obj->klen, arg.offset, arg.len,
+                                               &data, &dlen, &total, cache->storage.priv) == 0 &&
+                    dlen == arg.len && total == arg.total)
+                {
+                    arg.out = slab_alloc(arg.len);
+                    if (arg.out)
+                        memcpy(arg.out, data, arg.len);
+                }
+            } else if (cache->storage.fetch(obj->key, obj->klen, &data, &dlen, cache->storage.priv) == 0 &&
+                       dlen == arg.total)
+            {
+                arg.out = slab_alloc(arg.len);
+                if (arg.out)
+                    memcpy(arg.out, (char *)data + arg.offset, arg.len);
+            }
+            free(data);
+            COBJ_LOCK(cache, obj);
+        }
+    }
+
+    if (obj->chunks != chunks || obj->num_chunks != num_chunks || obj->dlen != arg.total) {
+        // the value has been replaced while the object was unlocked
+        if (arg.out)
+            slab_free(arg.out, arg.len);
+        SHC_WARNING("The value of key %.*s changed while fetching chunk %u", obj->klen, obj->key, idx);
+        return NULL;
+    }
+
+    if (obj->chunks[idx]) {
+        // someone else fetched the same chunk in the meanwhile
+        if (arg.out)
+            slab_free(arg.out, arg.len);
+        return obj->chunks[idx];
+    }
+
+    if (arg.out)
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_CHUNK_FETCHES].value);
+    else
+        SHC_WARNING("Can't fetch chunk %u of key %.*s", idx, obj->klen, obj->key);
+
+    return arg.out;
+}
+
+uint32_t
+cobj_num_pieces(cached_object_t *obj)
+{
+    if (obj->chunks)
+        return obj->num_chunks;
+    return obj->data ? 1 : 0;
+}
+
+void *
+cobj_piece(shardcache_t *cache, cached_object_t *obj, uint32_t idx, size_t *len, size_t *resident)
+{
+    if (!obj->chunks) {
+        *len = obj->dlen;
+        return idx == 0 ? obj->data : NULL;
+    }
+
+    if (idx >= obj->num_chunks)
+        return NULL;
+
+    *len = COBJ_CHUNK_LEN(obj, idx);
+    if (!obj->chunks[idx]) {
+        obj->chunks[idx] = cobj_fetch_chunk(cache, obj, idx);
+        if (!obj->chunks[idx])
+            return NULL;
+        if (resident) {
+            size_t size = 0;
+            uint32_t i;
+            for (i = 0; i < obj->num_chunks; i++) {
+                if (obj->chunks[i])
+                    size += COBJ_CHUNK_LEN(obj, i);
+            }
+            *resident = size;
+        }
+    }
+    return obj->chunks[idx];
+}
+
+ssize_t
+cobj_read(shardcache_t *cache, cached_object_t *obj, size_t offset, void *out, size_t len, size_t *resident)
+{
+    if (offset >= obj->dlen)
+        return 0;
+    if (len > obj->dlen - offset)
+        len = obj->dlen - offset;
+
+    if (!obj->chunks) {
+        if (!obj->data)
+            return 0;
+        memcpy(out, (char *)obj->data + offset, len);
+        return len;
+    }
+
+    size_t copied = 0;
+    while (copied < len) {
+        uint32_t idx = offset / SHARDCACHE_CHUNK_SIZE;
+        size_t skip = offset % SHARDCACHE_CHUNK_SIZE;
+        size_t clen = 0;
+        void *chunk = cobj_piece(cache, obj, idx, &clen, resident);
+        if (!chunk)
+            return -1;
+        size_t n = clen - skip < len - copied ? clen - skip : len - copied;
+        memcpy((char *)out + copied, (char *)chunk + skip, n);
+        copied += n;
+        offset += n;
+    }
+    return copied;
+}
+
+// NOTE: the data of a cached object is always expected to have been allocated
+//       using slab_alloc(dlen) (which passes through to malloc() values bigger
+//       than SLAB_MAX_SIZE)
+// Returns 0 on success, -1 if the data couldn't be moved into slab memory
+// (in which case it has been released and the fetch has to fail)
+static inline int
+arc_ops_adopt_data(cached_object_t *obj)
+{
+    // big values held by the cache are split in chunks
+    // NOTE: if it fails the data is kept as it is, which is fine
+    //       since it's bigger than SLAB_MAX_SIZE
+    if (obj->data && obj->dlen > SHARDCACHE_CHUNKED_THRESHOLD && obj->res) {
+        cobj_chunkify(obj);
+        return 0;
+    }
+
+    // move the data returned by the storage (or by a peer) into slab memory,
+    // releasing the original buffer
+    if (!obj->data || obj->dlen > SLAB_MAX_SIZE)
+        return 0;
+
+    void *data = slab_alloc(obj->dlen);
+    if (UNLIKELY(!data)) {
+        // a malloc()ed buffer must never reach slab_free()
+        SHC_ERROR("Can't allocate %lu bytes for key %.*s",
+                  (unsigned long)obj->dlen, obj->klen, obj->key);
+        free(obj->data);
+        obj->data = NULL;
+        obj->dlen = 0;
+        return -1;
+    }
+
+    memcpy(data, obj->data, obj->dlen);
+    free(obj->data);
+    obj->data = data;
+    return 0;
+}
+
+// Install a value fetched (with the object lock released) from the storage
+// or from a peer, unless a value has been stored in the meanwhile
+// (in which case the fetched one is discarded)
+// Returns 0 on success, -1 if the data couldn't be adopted
+// NOTE: must be called holding the object lock, data is a malloc()ed
+//       buffer which is owned by the object (or released) after the call
+static int
+arc_ops_install_data(cached_object_t *obj, void *data, size_t dlen)
+{
+    if (COBJ_HAS_DATA(obj) || !data || !dlen) {
+        free(data);
+        return 0;
+    }
+    obj->data = data;
+    obj->dlen = dlen;
+    return arc_ops_adopt_data(obj);
+}
+
 typedef struct {
     cached_object_t *obj;
     void *data;
@@ -40,7 +398,9 @@ arc_ops_fetch_from_peer_notify_listener_complete(void *item, size_t idx, void *u
 {
     shardcache_get_listener_t *listener = (shardcache_get_listener_t *)item;
     cached_object_t *obj = (cached_object_t *)user;
-    listener->cb(obj->key, obj->klen, NULL, 0, obj->dlen, &obj->ts, listener->priv);
+    struct timeval ts;
+    COBJ_GET_TIMESTAMP(obj, &ts);
+    listener->cb(obj->key, obj->klen, NULL, 0, obj->dlen, &ts, listener->priv);
     free(listener);
     return -1;
 }
@@ -55,10 +415,33 @@ arc_ops_fetch_from_peer_notify_listener_error(void *item, size_t idx, void *user
     return -1;
 }
 
+// Turn an object whose key has not been found into a tombstone which will be
+// kept in the cache (accounted only for the size of the object header) for
+// negative_caching_ttl seconds, so that the storage (or the owner peer) won't
+// be queried again for the same key in the meanwhile.
+// Returns 1 if the object has been turned into a tombstone, 0 if negative caching is off
+// NOTE: must be called holding the object lock
+static inline int
+arc_ops_make_tombstone(shardcache_t *cache, cached_object_t *obj)
+{
+    int ttl = ATOMIC_READ(cache->negative_caching_ttl);
+    if (ttl <= 0)
+        return 0;
+
+    COBJ_SET_FLAG(obj, COBJ_FLAG_TOMBSTONE);
+    obj->ttl = ttl;
+
+    if (!cache->lazy_expiration)
+        shardcache_schedule_expiration(cache, obj->key, obj->klen, ttl, 0);
+
+    return 1;
+}
+
 typedef struct
 {
     cached_object_t *obj;
     shardcache_t *cache;
+    arc_t *arc; // the arc instance holding the object
     char *peer_addr;
     int fd;
     char status;
@@ -79,59 +462,67 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
     shardcache_t *cache = arg->cache;
     char *peer_addr = arg->peer_addr;
     int fd = arg->fd;
+    arc_t *arc = arg->arc;
 
-    MUTEX_LOCK(obj->lock);
+    COBJ_LOCK(cache, obj);
 
     if (!obj->res) {
-        list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
+        if (obj->listeners)
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
         if (fd >= 0)
             close(fd);
-        COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_FETCH_DONE(cache, obj);
+        COBJ_UNLOCK(cache, obj);
         return -1;
     }
 
-    if (!obj->listeners) {
+    if (!COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
         if (fd >= 0)
             close(fd);
-        COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_FETCH_DONE(cache, obj);
+        COBJ_UNLOCK(cache, obj);
         free(arg);
-        arc_release_resource(cache->arc, obj->res);
+        arc_release_resource(arc, obj->res);
         return -1;
     }
 
     switch(idx) {
         case -1:
         {
-            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
+            if (obj->listeners)
+                list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
             COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
-            COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
+            COBJ_FETCH_DONE(cache, obj);
             size_t total_dlen = obj->dlen;
 
             int evicted = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
                           COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED);
 
             if (total_dlen && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP)) {
-                arc_update_resource_size(cache->arc, obj->res, (obj->data == obj->dbuf) ? 0 : total_dlen);
+                arc_update_resource_size(arc, obj->res, total_dlen);
 
                 if (cache->expire_time > 0 && !evicted && !cache->lazy_expiration)
                     shardcache_schedule_expiration(cache, key, klen, cache->expire_time, 0);
 
             }
-            if (!total_dlen)
+            if (!total_dlen &&
+                (evicted || arg->status != SHC_RES_OK ||
+                 COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) || !arc_ops_make_tombstone(cache, obj)))
+            {
                 COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+            }
 
             break;
         }
         case -2:
         {
-            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
+            if (obj->listeners)
+                list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
             if (fd >= 0)
                 close(fd);
-            COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-            MUTEX_UNLOCK(obj->lock);
-            arc_drop_resource(cache->arc, obj->res);
+            COBJ_FETCH_DONE(cache, obj);
+            COBJ_UNLOCK(cache, obj);
+            arc_drop_resource(arc, obj->res);
             free(arg);
             return -1;
         }
@@ -142,36 +533,27 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
                 shardcache_release_connection_for_peer(cache, peer_addr, fd);
             free(arg);
 
-            COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-            int drop = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) || COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) || !obj->dlen);
+            COBJ_FETCH_DONE(cache, obj);
+            int drop = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) || COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
+                        (!obj->dlen && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_TOMBSTONE)));
 
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(cache, obj);
 
             if (drop)
-                arc_drop_resource(cache->arc, obj->res);
+                arc_drop_resource(arc, obj->res);
             else
-                arc_release_resource(cache->arc, obj->res);
+                arc_release_resource(arc, obj->res);
 
             return 0;
         }
         case 0:
         {
-            size_t olen = obj->dlen;
-            obj->dlen += len;
-            if (obj->dlen > sizeof(obj->dbuf)) {
-                if (obj->data == obj->dbuf) {
-                    obj->data = malloc(obj->dlen);
-                    if (olen)
-                        memcpy(obj->data, obj->dbuf, olen);
-                } else {
-                    obj->data = realloc(obj->data, obj->dlen);
-                }
-            } else {
-                obj->data = obj->dbuf;
-            }
-
             if (len) {
-                memcpy(obj->data + olen, data, len);
+                if (cobj_append(obj, data, len) != 0) {
+                    SHC_ERROR("Can't allocate memory for key %.*s", obj->klen, obj->key);
+                    COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+                    break;
+                }
 
                 shardcache_fetch_from_peer_notify_arg notify_arg = {
                     .obj = obj,
@@ -179,7 +561,8 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
                     .len = len,
                     .total_size = total_len
                 };
-                list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener, &notify_arg);
+                if (obj->listeners)
+                    list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener, &notify_arg);
             }
             break;
         }
@@ -191,10 +574,22 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         default:
             break;
     }
-    MUTEX_UNLOCK(obj->lock);
+    COBJ_UNLOCK(cache, obj);
     return 0;
 }
 
+// Keep the remote object in the cache only if it's hot, which means
+// that it has been accessed at least remote_caching_threshold times
+// among the most recent accesses to remote keys
+// (the access is recorded also when force_caching is on,
+// so that the hottest remote keys are still tracked)
+static inline int
+arc_ops_is_hot_remote_key(shardcache_t *cache, cached_object_t *obj)
+{
+    uint32_t freq = hotkeys_touch(cache->remote_hotkeys, obj->key, obj->klen);
+    return (ATOMIC_READ(cache->force_caching) ||
+            freq >= (uint32_t)ATOMIC_READ(cache->remote_caching_threshold));
+}
 
 static int
 arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
@@ -210,16 +605,22 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
     char *peer_addr = shardcache_node_get_address(node);
 
     // another peer is responsible for this item, let's get the value from there
-
+    // NOTE: the object lock is released while talking to the peer,
+    //       the FETCHING flag keeps the other getters away in the meanwhile
+    COBJ_UNLOCK(cache, obj);
     int fd = shardcache_get_connection_for_peer(cache, peer_addr);
+    COBJ_LOCK(cache, obj);
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
+        arc_t *arc = shardcache_arc_for_key(cache, obj->key, obj->klen);
         shc_fetch_async_arg_t *arg = malloc(sizeof(shc_fetch_async_arg_t));
         arg->obj = obj;
         arg->cache = cache;
+        arg->arc = arc;
         arg->peer_addr = peer_addr;
         arg->fd = fd;
+        arg->status = SHC_RES_OK;
         async_read_wrk_t *wrk = NULL;
-        arc_retain_resource(cache->arc, obj->res);
+        arc_retain_resource(arc, obj->res);
         rc = fetch_from_peer_async(peer_addr,
                                    obj->key,
                                    obj->klen,
@@ -230,13 +631,11 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
                                    fd,
                                    &wrk);
         if (rc == 0) {
-            // Keep the remote object in the cache only 10% of the time.
-            // This is the same logic applied by groupcache to determine hot keys.
-            // Better approaches are possible but maybe unnecessary.
-            if (!cache->force_caching && random() % 10 != 0)
-                COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
-            else
+            COBJ_SET_FLAG(obj, COBJ_FLAG_REMOTE);
+            if (arc_ops_is_hot_remote_key(cache, obj))
                 COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
+            else
+                COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
 
             shardcache_queue_async_read_wrk(cache, wrk);
         } else {
@@ -252,24 +651,31 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
             }
             if (fd >= 0)
                 close(fd);
-            arc_release_resource(cache->arc, obj->res);
+            arc_release_resource(arc, obj->res);
 
             free(arg);
         }
     } else { 
         fbuf_t value = FBUF_STATIC_INITIALIZER;
+        COBJ_UNLOCK(cache, obj);
         rc = fetch_from_peer(peer_addr, obj->key, obj->klen, &value, fd);
-        COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
+        COBJ_LOCK(cache, obj);
         if (rc == 0) {
             shardcache_release_connection_for_peer(cache, peer_addr, fd);
             if (fbuf_used(&value)) {
-                obj->data = fbuf_data(&value);
-                obj->dlen = fbuf_used(&value);
+                if (arc_ops_install_data(obj, fbuf_data(&value), fbuf_used(&value)) != 0)
+                    return -1;
                 COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
-                if (!cache->force_caching && rand() % 10 != 0)
-                    COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
-                else
+                COBJ_SET_FLAG(obj, COBJ_FLAG_REMOTE);
+                if (arc_ops_is_hot_remote_key(cache, obj))
                     COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
+                else
+                    COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+            } else if (arc_ops_is_hot_remote_key(cache, obj) && arc_ops_make_tombstone(cache, obj)) {
+                // the owner doesn't have the key, remember it
+                COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+                COBJ_SET_FLAG(obj, COBJ_FLAG_REMOTE);
+                COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
             }
         } else {
             // if succeded the fbuf buffer has been moved to the obj structure
@@ -290,35 +696,161 @@ arc_ops_init(const void *key, size_t len, int async, time_t ttl, arc_resource_t
     // as argument to arc_create()
     cached_object_t *obj = (cached_object_t *)ptr;
 
+    // NOTE: the key is owned by the arc resource and will be
+    //       valid as long as the resource is alive
+    obj->key = (void *)key;
     obj->klen = len;
-    if (obj->klen > sizeof(obj->kbuf))
-        obj->key = malloc(obj->klen);
-    else
-        obj->key = obj->kbuf;
-    memcpy(obj->key, key, obj->klen);
     obj->data = NULL;
+    obj->chunks = NULL;
+    obj->num_chunks = 0;
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_COMPLETE);
     obj->res = res;
-    if (async) {
+    // NOTE: the listeners list will be created only if necessary
+    //       by cobj_add_listener()
+    if (async)
         COBJ_SET_FLAG(obj, COBJ_FLAG_ASYNC);
+    obj->ttl = ttl;
+}
+
+// NOTE: must be called holding the object lock
+void
+cobj_add_listener(cached_object_t *obj, shardcache_get_listener_t *listener)
+{
+    if (!obj->listeners) {
         obj->listeners = list_create();
         list_set_free_value_callback(obj->listeners, free);
     }
-    obj->ttl = ttl;
-    MUTEX_INIT(obj->lock);
+    list_push_value(obj->listeners, listener);
+}
+
+// Wait for a fetch already in progress to complete
+// (for at most fetch_wait_timeout milliseconds)
+// Returns 0 if the fetch completed, -1 if timed out (or if it can't wait)
+// NOTE: must be called holding the object lock exactly once, and no other
+//       object lock, since waiting on the condition releases the (recursive)
+//       stripe lock only once. If more locks are held the fetch is not waited
+//       for, since it would be undefined behaviour and could deadlock with
+//       the fetcher (which might need a stripe held by this thread)
+int
+cobj_wait_fetch(shardcache_t *cache, cached_object_t *obj)
+{
+    if (UNLIKELY(cobj_locks_held != 1)) {
+        SHC_WARNING("Can't wait for the fetch of key %.*s holding %d object locks",
+                    obj->klen, obj->key, cobj_locks_held);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_COALESCED_TIMEOUTS].value);
+        return -1;
+    }
+
+    int timeout = ATOMIC_READ(cache->fetch_wait_timeout);
+    struct timeval now, wait = { timeout / 1000, (timeout % 1000) * 1000 }, deadline;
+    gettimeofday(&now, NULL);
+    timeradd(&now, &wait, &deadline);
+    struct timespec abstime = { deadline.tv_sec, deadline.tv_usec * 1000 };
+
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_COALESCED].value);
+
+    while (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING)) {
+        int rc = pthread_cond_timedwait(&cache->cobj_conds[COBJ_LOCK_INDEX(obj)],
+                                        &cache->cobj_locks[COBJ_LOCK_INDEX(obj)],
+                                        &abstime);
+        if (rc == ETIMEDOUT && COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING)) {
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_COALESCED_TIMEOUTS].value);
+            return -1;
+        }
+    }
+    return 0;
 }
 
+typedef struct {
+    shardcache_t *cache;
+    cached_object_t *obj;
+} arc_ops_copy_volatile_arg_t;
+
 static void *
 arc_ops_fetch_copy_volatile_object_cb(void *ptr, size_t len, void *user)
 {
-    cached_object_t *obj = (cached_object_t *)user;
+    arc_ops_copy_volatile_arg_t *arg = (arc_ops_copy_volatile_arg_t *)user;
     volatile_object_t *item = (volatile_object_t *)ptr;
-    if (item->dlen) {
-        obj->data = (item->dlen > sizeof(obj->dbuf)) ? malloc(item->dlen) : obj->dbuf;
-        memcpy(obj->data, item->data, item->dlen);
-        obj->dlen = item->dlen;
+    if (item->dlen)
+        cobj_set_data(arg->cache, arg->obj, item->data, item->dlen);
+    return (void *)arg->obj;
+}
+
+// NOTE: must be called holding the object lock, which is released
+static void
+arc_ops_fetch_error(shardcache_t *cache, cached_object_t *obj)
+{
+    if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
+        list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+    COBJ_FETCH_DONE(cache, obj);
+    COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+    COBJ_UNLOCK(cache, obj);
+}
+
+// Complete the fetch of a local object (whose data, if any, has been
+// already set) notifying the listeners and keeping a tombstone if not found
+// Returns 0 if the object can be kept in the cache, 1 otherwise
+// NOTE: must be called holding the object lock, which is released
+static int
+arc_ops_fetch_complete(shardcache_t *cache, cached_object_t *obj, size_t *size)
+{
+    COBJ_SET_TIMESTAMP(obj);
+
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+    COBJ_FETCH_DONE(cache, obj);
+
+    if (!COBJ_HAS_DATA(obj)) {
+        if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
+
+        SHC_DEBUG("Item not found for key %.*s", obj->klen, obj->key);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_NOT_FOUND].value);
+
+        int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
+                       COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
+
+        // keep the tombstone in the cache (unless the key has been
+        // evicted while we were fetching it)
+        if (!evicted && arc_ops_make_tombstone(cache, obj)) {
+            *size = 0;
+            COBJ_UNLOCK(cache, obj);
+            ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, shardcache_arc_count(cache));
+            return 0;
+        }
+
+        COBJ_UNLOCK(cache, obj);
+        return 1;
+    }
+
+    if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners) {
+        // the value has just been fetched, so all the pieces are in memory
+        uint32_t num_pieces = cobj_num_pieces(obj);
+        uint32_t i;
+        for (i = 0; i < num_pieces; i++) {
+            shardcache_fetch_from_peer_notify_arg arg = {
+                .obj = obj,
+                .total_size = (i == num_pieces - 1) ? obj->dlen : 0
+            };
+            arg.data = cobj_piece(cache, obj, i, &arg.len, NULL);
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener, &arg);
+        }
+        list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
     }
-    return (void *)obj;
+
+    *size = obj->dlen;
+
+    int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
+                   COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
+
+    if (cache->expire_time > 0 && !evicted && !cache->lazy_expiration)
+        shardcache_schedule_expiration(cache, obj->key, obj->klen, cache->expire_time, 0);
+
+    COBJ_UNLOCK(cache, obj);
+
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, shardcache_arc_count(cache));
+
+    return evicted;
 }
 
 int
@@ -327,19 +859,34 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     cached_object_t *obj = (cached_object_t *)item;
     shardcache_t *cache = (shardcache_t *)priv;
 
-    MUTEX_LOCK(obj->lock);
+    COBJ_LOCK(cache, obj);
 
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING)) {
-        MUTEX_UNLOCK(obj->lock);
-        return 1;
-    } else if (obj->data) {
-        MUTEX_UNLOCK(obj->lock);
+        // someone else is already fetching the value for this key,
+        // share its result instead of fetching it again
+        if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
+            // the data will be delivered to the listeners as it arrives
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_COALESCED].value);
+            *size = obj->dlen;
+            COBJ_UNLOCK(cache, obj);
+            return 0;
+        }
+        int rc = (cobj_wait_fetch(cache, obj) == 0 && COBJ_HAS_DATA(obj) &&
+                  !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP)) ? 0 : 1;
+        *size = obj->dlen;
+        COBJ_UNLOCK(cache, obj);
+        return rc;
+    } else if (COBJ_HAS_DATA(obj)) {
+        COBJ_UNLOCK(cache, obj);
         return 0;
     }
 
     COBJ_SET_FLAG(obj, COBJ_FLAG_FETCHING);
 
     ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+    shardcache_namespace_t *ns = shardcache_namespace_for_key(cache, obj->key, obj->klen);
+    if (ns)
+        ATOMIC_INCREMENT(ns->cache_misses);
 
     // this object is not evicted anymore (if it eventually was)
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_EVICTED);
@@ -373,15 +920,19 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
         if (done) {
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_FETCH_REMOTE].value);
             if (ret == 0) {
-                ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
-                gettimeofday(&obj->ts, NULL);
-                *size = (obj->data == obj->dbuf) ? 0 : obj->dlen;
+                // an asynchronous fetch is completed by arc_ops_fetch_from_peer_async_cb()
+                if (!COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC))
+                    COBJ_FETCH_DONE(cache, obj);
+                ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, shardcache_arc_count(cache));
+                COBJ_SET_TIMESTAMP(obj);
+                *size = obj->dlen;
                 int drop = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP|COBJ_FLAG_COMPLETE);
-                MUTEX_UNLOCK(obj->lock);
-                ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+                COBJ_UNLOCK(cache, obj);
+                ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, shardcache_arc_count(cache));
                 return drop ? 1 : 0;
             }
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_FETCH_DONE(cache, obj);
+            COBJ_UNLOCK(cache, obj);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
             return -1;
         }
@@ -392,164 +943,276 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     // we are responsible for this item ... 
     // let's first check if it's among the volatile keys otherwise
     // fetch it from the storage
+    arc_ops_copy_volatile_arg_t copy_arg = { cache, obj };
     ht_get_deep_copy(cache->volatile_storage,
                      obj->key,
                      obj->klen,
                      NULL,
                      arc_ops_fetch_copy_volatile_object_cb,
-                     obj);
-    if (obj->data && obj->dlen) {
-        SHC_DEBUG3("Found volatile value %s (%lu) for key %.*s",
-               shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
+                     &copy_arg);
+    if (COBJ_HAS_DATA(obj) && obj->dlen) {
+        SHC_DEBUG3("Found volatile value (%lu) for key %.*s",
                (unsigned long)obj->dlen, obj->klen, obj->key);
     } else if (cache->use_persistent_storage && cache->storage.fetch) {
-        int rc = cache->storage.fetch(obj->key, obj->klen, &obj->data, &obj->dlen, cache->storage.priv);
+        void *data = NULL;
+        size_t dlen = 0;
+        // NOTE: the FETCHING flag keeps the other getters away
+        //       while the object is unlocked
+        COBJ_UNLOCK(cache, obj);
+        int rc = cache->storage.fetch(obj->key, obj->klen, &data, &dlen, cache->storage.priv);
+        COBJ_LOCK(cache, obj);
         if (rc == -1) {
-            if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
-                list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
             SHC_ERROR("Fetch storage callback returned an error (%d)", rc);
-            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
-            COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-            COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
-            MUTEX_UNLOCK(obj->lock);
+            free(data);
+            arc_ops_fetch_error(cache, obj);
             return -1;
         }
-        if (obj->data && obj->dlen) {
+        if (data && dlen) {
             SHC_DEBUG3("Fetch storage callback returned value %s (%lu) for key %.*s",
-                   shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
-                   (unsigned long)obj->dlen, obj->klen, obj->key);
+                   shardcache_hex_escape(data, dlen, DEBUG_DUMP_MAXSIZE, 0),
+                   (unsigned long)dlen, obj->klen, obj->key);
+            if (arc_ops_install_data(obj, data, dlen) != 0) {
+                arc_ops_fetch_error(cache, obj);
+                return -1;
+            }
         } else {
             SHC_DEBUG3("Fetch storage callback returned an empty value for key %.*s", obj->klen, obj->key);
+            free(data);
         }
     }
 
-    gettimeofday(&obj->ts, NULL);
-
-    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
-    COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-
-    if (!obj->data) {
-        if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
-            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
-
-        MUTEX_UNLOCK(obj->lock);
-        SHC_DEBUG("Item not found for key %.*s", obj->klen, obj->key);
-        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_NOT_FOUND].value);
-        return 1;
-    }
-
-    if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
-        shardcache_fetch_from_peer_notify_arg arg = {
-            .obj = obj,
-            .data = obj->data,
-            .len = obj->dlen,
-            .total_size = obj->dlen
-        };
-        list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener, &arg);
-        list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
-    }
-
-    *size = (obj->data == obj->dbuf) ? 0 : obj->dlen;
-
-    int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
-                   COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
-
-    if (cache->expire_time > 0 && !evicted && !cache->lazy_expiration)
-        shardcache_schedule_expiration(cache, obj->key, obj->klen, cache->expire_time, 0);
-
-    MUTEX_UNLOCK(obj->lock);
-
-    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
-
-    return evicted;
+    return arc_ops_fetch_complete(cache, obj, size);
 }
 
 int
 arc_ops_fetch_multi(void **objs, size_t *sizes, int *statuses, int num_objects, void *priv)
 {
     shardcache_t *cache = (shardcache_t *)priv;
+    int i;
 
-    hashtable_t *remote = ht_create(cache->num_shards, cache->num_shards,  (ht_free_item_callback_t)list_destroy);
-    linked_list_t *local = list_create();
+    if (!cache->use_persistent_storage || !cache->storage.fetch_multi) {
+        for (i = 0; i < num_objects; i++)
+            statuses[i] = arc_ops_fetch(objs[i], &sizes[i], priv);
+        return 0;
+    }
 
-    // first determine for which objects we are responsible for
-    // and which need to be retrieved from a peer (and from which peer)
-    int i;
+    cached_object_t **local = malloc(sizeof(cached_object_t *) * num_objects);
+    int *local_index = malloc(sizeof(int) * num_objects);
+    int n_local = 0;
+
+    // the objects we are responsible for (and which are not being fetched
+    // already or among the volatile keys) are retrieved from the storage
+    // all at once, the others go through the usual path
     for (i = 0; i < num_objects; i++) {
         cached_object_t *obj = (cached_object_t *)objs[i];
-        MUTEX_LOCK(obj->lock);
-        COBJ_SET_FLAG(obj, COBJ_FLAG_FETCHING);
-        MUTEX_UNLOCK(obj->lock);
         char node_name[1024];
         size_t node_len = sizeof(node_name);
         memset(node_name, 0, node_len);
-        if (shardcache_test_ownership(cache, obj->key, obj->klen, node_name, &node_len) ||
-            shardcache_test_migration_ownership(cache, obj->key, obj->klen, node_name, &node_len))
+
+        COBJ_LOCK(cache, obj);
+        if (!local || !local_index ||
+            COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING) || COBJ_HAS_DATA(obj) ||
+            !shardcache_test_ownership(cache, obj->key, obj->klen, node_name, &node_len))
         {
-            linked_list_t *remote_list = ht_get(remote, node_name, node_len, NULL);
-            if (!remote_list)
-                remote_list = list_create();
-            list_push_value(remote_list, obj);
-        } else {
-            list_push_value(local, obj);
+            COBJ_UNLOCK(cache, obj);
+            statuses[i] = arc_ops_fetch(obj, &sizes[i], priv);
+            continue;
         }
+
+        COBJ_SET_FLAG(obj, COBJ_FLAG_FETCHING);
+
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+        shardcache_namespace_t *ns = shardcache_namespace_for_key(cache, obj->key, obj->klen);
+        if (ns)
+            ATOMIC_INCREMENT(ns->cache_misses);
+
+        COBJ_UNSET_FLAG(obj, COBJ_FLAG_EVICTED);
+        COBJ_UNSET_FLAG(obj, COBJ_FLAG_EVICT);
+
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_FETCH_LOCAL].value);
+
+        arc_ops_copy_volatile_arg_t copy_arg = { cache, obj };
+        ht_get_deep_copy(cache->volatile_storage,
+                         obj->key,
+                         obj->klen,
+                         NULL,
+                         arc_ops_fetch_copy_volatile_object_cb,
+                         &copy_arg);
+        if (COBJ_HAS_DATA(obj) && obj->dlen) {
+            statuses[i] = arc_ops_fetch_complete(cache, obj, &sizes[i]);
+            continue;
+        }
+
+        // NOTE: the FETCHING flag keeps the other getters away
+        //       while the object is unlocked
+        COBJ_UNLOCK(cache, obj);
+        local[n_local] = obj;
+        local_index[n_local] = i;
+        n_local++;
     }
 
-    int n_local = list_count(local);
-    if (LIKELY(n_local)) {
-        if (cache->storage.fetch_multi) {
-            void *mem = malloc(((sizeof(void *) * 2) + (sizeof(size_t) * 2)) * n_local);
-            void **keys = mem;
-            void **values = keys + n_local;
-            size_t *klens = (size_t *)(values + n_local);
-            size_t *vlens = klens + n_local;
-            int i;
+    if (n_local) {
+        void *mem = calloc(n_local, (sizeof(void *) * 2) + (sizeof(size_t) * 2));
+        void **keys = mem;
+        void **values = keys + n_local;
+        size_t *klens = (size_t *)(values + n_local);
+        size_t *vlens = klens + n_local;
+        int fetched = -1;
+        if (mem) {
             for (i = 0; i < n_local; i++) {
-                cached_object_t *obj = list_pick_value(local, i);
-                keys[i] = obj->key;
-                klens[i] = obj->klen;
+                keys[i] = local[i]->key;
+                klens[i] = local[i]->klen;
             }
-            cache->storage.fetch_multi(keys, klens, n_local, values, vlens, cache->storage.priv);
-            free(mem);
-        } else {
-            cached_object_t *obj = list_shift_value(local);
-            while(obj) {
-                MUTEX_LOCK(obj->lock);
-                int rc = cache->storage.fetch(obj->key, obj->klen, &obj->data, &obj->dlen, cache->storage.priv);
-                COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-                if (rc != 0) {
-                    COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
-                }
-                MUTEX_UNLOCK(obj->lock);
-                obj = list_shift_value(local);
+            int rc = cache->storage.fetch_multi(keys, klens, n_local, values, vlens, cache->storage.priv);
+            fetched = (rc == 0) ? n_local : rc;
+            if (fetched < n_local)
+                SHC_ERROR("Fetch multi storage callback returned an error (%d of %d items fetched)", rc, n_local);
+        }
+
+        for (i = 0; i < n_local; i++) {
+            cached_object_t *obj = local[i];
+            COBJ_LOCK(cache, obj);
+            if (i >= fetched) {
+                arc_ops_fetch_error(cache, obj);
+                statuses[local_index[i]] = -1;
+                continue;
+            }
+            if (arc_ops_install_data(obj, values[i], vlens[i]) != 0) {
+                arc_ops_fetch_error(cache, obj);
+                statuses[local_index[i]] = -1;
+                continue;
             }
+            statuses[local_index[i]] = arc_ops_fetch_complete(cache, obj, &sizes[local_index[i]]);
+        }
+
+        free(mem);
+    }
+
+    free(local);
+    free(local_index);
+    return 0;
+}
+
+typedef struct {
+    void *data;
+    size_t dlen;
+} arc_ops_value_t;
+
+static void *
+arc_ops_copy_volatile_value_cb(void *ptr, size_t len, void *user)
+{
+    arc_ops_value_t *value = (arc_ops_value_t *)user;
+    volatile_object_t *item = (volatile_object_t *)ptr;
+    if (item->dlen) {
+        value->data = malloc(item->dlen);
+        if (value->data) {
+            memcpy(value->data, item->data, item->dlen);
+            value->dlen = item->dlen;
         }
     }
+    return value;
+}
 
-    if (ht_count(remote)) {
-        
+static int
+arc_ops_fetch_value_from_peer(shardcache_t *cache, void *key, size_t klen, char *peer, arc_ops_value_t *value)
+{
+    shardcache_node_t *node = shardcache_node_select(cache, peer);
+    if (!node) {
+        SHC_ERROR("Can't find address for node %s\n", peer);
+        return -1;
     }
+    char *peer_addr = shardcache_node_get_address(node);
 
-    ht_destroy(remote);
-    list_destroy(local);
+    int fd = shardcache_get_connection_for_peer(cache, peer_addr);
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    if (fetch_from_peer(peer_addr, key, klen, &out, fd) != 0) {
+        fbuf_destroy(&out);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    shardcache_release_connection_for_peer(cache, peer_addr, fd);
+
+    if (fbuf_used(&out)) {
+        // the fbuf buffer is moved to the caller
+        value->data = fbuf_data(&out);
+        value->dlen = fbuf_used(&out);
+    } else {
+        fbuf_destroy(&out);
+    }
     return 0;
 }
 
+int
+arc_ops_fetch_value(shardcache_t *cache, void *key, size_t klen, void **data, size_t *dlen)
+{
+    arc_ops_value_t value = { NULL, 0 };
+    int rc = -1;
+
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    memset(node_name, 0, node_len);
+    if (!shardcache_test_ownership(cache, key, klen, node_name, &node_len)) {
+        rc = arc_ops_fetch_value_from_peer(cache, key, klen, node_name, &value);
+        if (rc == -1) {
+            int check = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
+            if (check == 0)
+                rc = arc_ops_fetch_value_from_peer(cache, key, klen, node_name, &value);
+            // as in arc_ops_fetch(), fall back to the local storage if it's global
+            // or if we are responsible for the key in the migration context
+            if (rc == -1 && check != 1 && !cache->storage.global)
+                return -1;
+        }
+    }
+
+    if (rc == -1) {
+        ht_get_deep_copy(cache->volatile_storage, key, klen, NULL,
+                         arc_ops_copy_volatile_value_cb, &value);
+        rc = 0;
+        if (!value.data && cache->use_persistent_storage && cache->storage.fetch) {
+            rc = cache->storage.fetch(key, klen, &value.data, &value.dlen, cache->storage.priv);
+            if (rc == -1) {
+                SHC_ERROR("Fetch storage callback returned an error (%d)", rc);
+                free(value.data);
+                return -1;
+            }
+            rc = 0;
+        }
+    }
+
+    if (!value.dlen) {
+        free(value.data);
+        value.data = NULL;
+    }
+    *data = value.data;
+    *dlen = value.dlen;
+    return rc;
+}
+
 void
 arc_ops_store(void *item, void *data, size_t size, void *priv)
 {
     cached_object_t *obj = (cached_object_t *)item;
-    //shardcache_t *cache = (shardcache_t *)priv;
-    MUTEX_LOCK(obj->lock); // XXX - this shouldn't be really necessary
+    shardcache_t *cache = (shardcache_t *)priv;
+    COBJ_LOCK(cache, obj); // XXX - this shouldn't be really necessary
 
-    if (obj->data != obj->dbuf)
-        free(obj->data);
+    cobj_set_data(cache, obj, data, size);
 
-    obj->data = (size > sizeof(obj->dbuf)) ? malloc(size) : obj->dbuf;
-    memcpy(obj->data, data, size);
-    obj->dlen = size;
+    // the object is now complete (and fresh), there is nothing to fetch
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+    COBJ_UNSET_FLAG(obj, COBJ_FLAG_STALE);
+    COBJ_SET_TIMESTAMP(obj);
+
+    // a value for a key which was not found has been loaded,
+    // the short ttl of the tombstone doesn't apply anymore
+    if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_TOMBSTONE)) {
+        COBJ_UNSET_FLAG(obj, COBJ_FLAG_TOMBSTONE);
+        obj->ttl = 0;
+        if (!cache->lazy_expiration)
+            shardcache_unschedule_expiration(cache, obj->key, obj->klen, 0);
+    }
 
-    MUTEX_UNLOCK(obj->lock);
+    COBJ_UNLOCK(cache, obj);
 }
 
 void
@@ -558,7 +1221,7 @@ arc_ops_evict(void *item, void *priv)
     cached_object_t *obj = (cached_object_t *)item;
     shardcache_t *cache = (shardcache_t *)priv;
 
-    MUTEX_LOCK(obj->lock); // XXX - this shouldn't be really necessary
+    COBJ_LOCK(cache, obj); // XXX - this shouldn't be really necessary
                             // TODO : try removing it and see what happens
                             //        during stress tests
 
@@ -574,25 +1237,68 @@ arc_ops_evict(void *item, void *priv)
         //       of making them wait forever
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
         list_destroy(obj->listeners);
+        obj->listeners = NULL;
     }
-    MUTEX_UNLOCK(obj->lock);
+    COBJ_UNLOCK(cache, obj);
 
-    if (obj->data)
+    if (COBJ_HAS_DATA(obj))
         ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EVICTS].value);
 
     // no lock is necessary here ... if we are here
     // nobody is referencing us anymore
-    if (obj->data != obj->dbuf)
-        free(obj->data);
+    // NOTE: we might be called while the arc partition lock is being held,
+    //       so releasing big buffers is deferred to the reclaimer thread
+    cobj_release_data(cache, obj);
 
-    if (obj->key != obj->kbuf)
-        free(obj->key);
-
-    MUTEX_DESTROY(obj->lock);
     // NOTE : we don't need to free the memory used to store the actual cached_object_t
     // structure because it's managed by the arc subsystem, which provided us a pointer
     // to the prealloc'd memory as argument to the arc_ops_init() callback
 }
 
+size_t
+arc_ops_trim(void *item, size_t excess, void *priv)
+{
+    cached_object_t *obj = (cached_object_t *)item;
+    shardcache_t *cache = (shardcache_t *)priv;
+
+    // we are called holding the arc partition lock, so we don't wait
+    // for the object lock (a busy object will be evicted as usual)
+    if (pthread_mutex_trylock(&cache->cobj_locks[COBJ_LOCK_INDEX(obj)]) != 0)
+        return 0;
+    cobj_locks_held++;
+
+    size_t released = 0;
+    if (obj->chunks && COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+        !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING))
+    {
+        uint32_t resident = 0;
+        uint32_t i;
+        for (i = 0; i < obj->num_chunks; i++) {
+            if (obj->chunks[i])
+                resident++;
+        }
+
+        // release the chunks starting from the end of the value (the beginning
+        // is usually accessed more often), the last chunk in memory is never
+        // released so that the object will be evicted once there is nothing else
+        // to trim
+        i = obj->num_chunks;
+        while (i > 0 && resident > 1 && released < excess) {
+            i--;
+            if (!obj->chunks[i])
+                continue;
+            size_t len = COBJ_CHUNK_LEN(obj, i);
+            shardcache_free_deferred(cache, obj->chunks[i], len);
+            obj->chunks[i] = NULL;
+            released += len;
+            resident--;
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_CHUNK_TRIMS].value);
+        }
+    }
+
+    COBJ_UNLOCK(cache, obj);
+    return released;
+}
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
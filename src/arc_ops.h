@@ -3,34 +3,21 @@
  */
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifdef USE_PACKED_STRUCTURES
 #pragma pack(push, 1)
 #endif
 typedef struct {
-    void *key;   // The key (weak reference to the actual key stored in the arc resource)
-    size_t klen; // The length of the key
-    char kbuf[32];
-
-    // internal storage for data which doesn't exceeds 256 bytes.
-    // If the complete data is bigger than 256 bytes, the required
-    // memory will be allocated and the data pointer will be set
-    // to point to the newly allocated memory.
-    char dbuf[32];
-
     void *data;  // The data (if any, NULL otherwise)
-                 // Note that if the data is less than 256 bytes this pointer
-                 // will point back to the internal buffer (buf pointer)
-
+                 // NOTE: unless NULL, data is always allocated using slab_alloc(dlen)
     size_t dlen; // The length of the data (if any, 0 otherwise)
 
-    struct timeval ts; // the timestamp of when the object has been loaded
-                       // into the cache
-    
-    time_t ttl;
-
-    linked_list_t *listeners; // list of listeners which will be notified
-                              // while the object data is being retreived
+    void **chunks;       // The chunks holding a value bigger than SHARDCACHE_CHUNKED_THRESHOLD
+                         // (data is NULL in such a case). Each chunk is allocated using
+                         // slab_alloc(COBJ_CHUNK_LEN()) and is NULL if it has been released
+                         // by arc_ops_trim() (it will be fetched again when accessed)
+    uint32_t num_chunks; // The number of chunks
 
     uint16_t flags;
     #define COBJ_FLAG_ASYNC    (1)
@@ -39,29 +26,116 @@ typedef struct {
     #define COBJ_FLAG_EVICT    (1<<3)
     #define COBJ_FLAG_DROP     (1<<4)
     #define COBJ_FLAG_FETCHING (1<<5)
+    #define COBJ_FLAG_REMOTE   (1<<6) // the data has been fetched from a peer
+    #define COBJ_FLAG_TOMBSTONE (1<<7) // the key has not been found (negative caching)
+    #define COBJ_FLAG_STALE    (1<<8) // expired, served while being refreshed
 
-    pthread_mutex_t lock; // All operations on this structure should be
-                          // synchronized using this lock
+    uint32_t klen; // The length of the key
+    void *key;     // The key (weak reference to the actual key stored in the arc resource)
 
     arc_resource_t res;
+
+    linked_list_t *listeners; // list of listeners which will be notified
+                              // while the object data is being retreived
+                              // (created when the first listener is registered)
+
+    // the timestamp of when the object has been loaded into the cache
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    
+    uint32_t ttl;
+
+    // NOTE: there is no lock in the object itself, all operations on this
+    //       structure should be synchronized using COBJ_LOCK()/COBJ_UNLOCK()
+    //       which use the striped locks owned by the shardcache instance
 } cached_object_t;
 #ifdef USE_PACKED_STRUCTURES
 #pragma pack(pop)
 #endif
 
+// the object has a value (either contiguous or chunked)
+#define COBJ_HAS_DATA(_o) ((_o)->data || (_o)->chunks)
+
+// the length of a chunk (only the last one can be shorter than SHARDCACHE_CHUNK_SIZE)
+#define COBJ_CHUNK_LEN(_o, _i) \
+    (((_i) == (_o)->num_chunks - 1) ? (_o)->dlen - (size_t)(_i) * SHARDCACHE_CHUNK_SIZE : SHARDCACHE_CHUNK_SIZE)
+
 #define COBJ_CHECK_FLAGS(_o, _f) ((((_o)->flags) & (_f)) == (_f))
 #define COBJ_SET_FLAG(_o, _f) ((_o)->flags |= (_f))
 #define COBJ_UNSET_FLAG(_o, _f) ((_o)->flags &= ~(_f))
 
+#define COBJ_LOCK_INDEX(_o) \
+    (((((uintptr_t)(_o)) >> 5) ^ (((uintptr_t)(_o)) >> 15)) & (SHARDCACHE_COBJ_LOCKS - 1))
+
+// the number of object locks held by the current thread
+// (the striped locks are recursive, see cobj_wait_fetch())
+extern __thread int cobj_locks_held;
+
+#define COBJ_LOCK(_c, _o) do {\
+    MUTEX_LOCK((_c)->cobj_locks[COBJ_LOCK_INDEX(_o)]); \
+    cobj_locks_held++; \
+} while (0)
+
+#define COBJ_UNLOCK(_c, _o) do {\
+    cobj_locks_held--; \
+    MUTEX_UNLOCK((_c)->cobj_locks[COBJ_LOCK_INDEX(_o)]); \
+} while (0)
+
+// NOTE: must be used holding the object lock, the threads
+//       waiting for the fetch to complete will be woken up
+#define COBJ_FETCH_DONE(_c, _o) {\
+    COBJ_UNSET_FLAG(_o, COBJ_FLAG_FETCHING); \
+    pthread_cond_broadcast(&(_c)->cobj_conds[COBJ_LOCK_INDEX(_o)]); \
+}
+
+#define COBJ_SET_TIMESTAMP(_o) {\
+    struct timeval _tv; \
+    gettimeofday(&_tv, NULL); \
+    (_o)->ts_sec = _tv.tv_sec; \
+    (_o)->ts_usec = _tv.tv_usec; \
+}
+
+#define COBJ_GET_TIMESTAMP(_o, _tv) {\
+    (_tv)->tv_sec = (_o)->ts_sec; \
+    (_tv)->tv_usec = (_o)->ts_usec; \
+}
+
 typedef struct {
     shardcache_get_async_callback_t cb;
     void *priv;
 } shardcache_get_listener_t;
 
+void cobj_add_listener(cached_object_t *obj, shardcache_get_listener_t *listener);
+int cobj_wait_fetch(shardcache_t *cache, cached_object_t *obj);
+
+// Get the data of the object one piece at a time, idx goes from 0 to cobj_num_pieces() - 1
+// (there is a single piece unless the value is chunked). Chunks released by arc_ops_trim()
+// are fetched again, in which case *resident is set to the new amount of data held in memory
+// (which needs to be provided to arc_update_resource_size(), after releasing the object lock).
+// Returns NULL if the piece can't be fetched
+// NOTE: must be called holding the object lock
+void *cobj_piece(shardcache_t *cache, cached_object_t *obj, uint32_t idx, size_t *len, size_t *resident);
+uint32_t cobj_num_pieces(cached_object_t *obj);
+
+// Copy (at most) len bytes of the value starting at offset, only the chunks
+// overlapping the requested range are accessed (see cobj_piece() for resident)
+// Returns the number of bytes copied or -1 if a chunk can't be fetched
+// NOTE: must be called holding the object lock
+ssize_t cobj_read(shardcache_t *cache, cached_object_t *obj, size_t offset, void *out, size_t len, size_t *resident);
+
+// Fetch the current value of a key from its owner (or from the local storage)
+// without going through the cache: no cached object is involved, so no
+// counters are updated, no tombstones are made and no hot keys are tracked.
+// Returns 0 on success (with *data set to a malloc()ed buffer holding the
+// value, or NULL if the key doesn't exist), -1 in case of errors
+int arc_ops_fetch_value(shardcache_t *cache, void *key, size_t klen, void **data, size_t *dlen);
+
 void arc_ops_init(const void *key, size_t len, int async, time_t ttl, arc_resource_t res, void *ptr, void *priv);
 int arc_ops_fetch(void *item, size_t *size, void * priv);
+int arc_ops_fetch_multi(void **objs, size_t *sizes, int *statuses, int num_objects, void *priv);
 void arc_ops_evict(void *item, void *priv);
 void arc_ops_store(void *item, void *data, size_t size, void *priv);
+size_t arc_ops_trim(void *item, size_t excess, void *priv);
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -112,17 +112,9 @@ string2sockaddr(const char *host, int port, struct sockaddr_in *sockaddr)
 
     return 0;
 }
-/*!
- * \brief Open a listen socket.
- * \param host hostname to listen on
- * \param port port to listen on
- * \returns file handle for socket to call accept() on or -1 otherwise (errno is set).
- *
- * \note Examples of valid port combinations: ("*", 3456), ("localhost", 3456),
- * or ("10.0.0.9", 4546).
- */
-int
-open_socket(const char *host, int port)
+
+static int
+open_socket_internal(const char *host, int port, int reuseport)
 {
     int val = 1;
     struct sockaddr_in sockaddr;
@@ -133,19 +125,36 @@ open_socket(const char *host, int port)
     if ((host == NULL || !*host) && port == 0)
         return -1;
 
+#ifndef SO_REUSEPORT
+    if (reuseport) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
     sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock == -1)
         return -1;
 
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) != 0) {
+        close(sock);
+        return -1;
+    }
+#endif
     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val,  sizeof(val));
     setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
 
     if (string2sockaddr(host, port, &sockaddr) == -1
         || bind(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
     {
+        // preserve the bind() error (EADDRINUSE is expected
+        // while the address is being handed over among sockets)
+        int err = errno;
         shutdown(sock, SHUT_RDWR);
         close(sock);
+        errno = err;
         return -1;
     }
 
@@ -155,6 +164,37 @@ open_socket(const char *host, int port)
     return sock;
 }
 
+/*!
+ * \brief Open a listen socket.
+ * \param host hostname to listen on
+ * \param port port to listen on
+ * \returns file handle for socket to call accept() on or -1 otherwise (errno is set).
+ *
+ * \note Examples of valid port combinations: ("*", 3456), ("localhost", 3456),
+ * or ("10.0.0.9", 4546).
+ */
+int
+open_socket(const char *host, int port)
+{
+    return open_socket_internal(host, port, 0);
+}
+
+/*!
+ * \brief Open a listen socket sharing its address with other sockets (SO_REUSEPORT).
+ * \param host hostname to listen on
+ * \param port port to listen on
+ * \returns file handle for socket to call accept() on or -1 otherwise (errno is set).
+ *
+ * \note The kernel balances the incoming connections among all the sockets
+ * listening on the same address, which must all be opened with this function.
+ * errno is set to ENOTSUP if SO_REUSEPORT is not available on this platform.
+ */
+int
+open_shared_socket(const char *host, int port)
+{
+    return open_socket_internal(host, port, 1);
+}
+
 /*!
  * \brief Writes to a socket
  * \param fd socket
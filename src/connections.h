@@ -6,6 +6,7 @@ extern "C" {
 #define CONN_QUICK_TIMEOUT	2000		// For connections on localhost or LAN
 
 int open_socket(const char *host, int port);
+int open_shared_socket(const char *host, int port);
 int open_connection(const char *host, int port, unsigned int timeout);
 int open_lsocket(const char *filename);
 int open_fifo(const char *filename);
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+// NOTE: the readers' path can't use the ATOMIC_* macros, ATOMIC_READ() is
+//       implemented as an atomic add which would make all the readers write
+//       to the cache line holding the global epoch (defeating the purpose)
+#define EPOCH_LOAD(_v) __atomic_load_n(&(_v), __ATOMIC_ACQUIRE)
+#define EPOCH_STORE(_v, _n) __atomic_store_n(&(_v), (_n), __ATOMIC_RELEASE)
+
+#define EPOCH_CACHE_LINE 64
+
+typedef struct _epoch_record_s {
+    uint64_t state;    // (epoch << 1) | 1 while in a critical section, 0 otherwise
+    uint32_t nesting;  // only accessed by the owner thread
+    int in_use;        // the record belongs to a running thread
+    struct _epoch_record_s *next;
+} __attribute__((aligned(EPOCH_CACHE_LINE))) epoch_record_t;
+
+static uint64_t epoch_global __attribute__((aligned(EPOCH_CACHE_LINE))) = 0;
+
+// the records are never released, the ones left by terminated
+// threads are reused by the new ones
+static epoch_record_t *epoch_records = NULL;
+
+static __thread epoch_record_t *epoch_self = NULL;
+
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+static void
+epoch_record_release(void *priv)
+{
+    epoch_record_t *rec = (epoch_record_t *)priv;
+    rec->nesting = 0;
+    EPOCH_STORE(rec->state, 0);
+    EPOCH_STORE(rec->in_use, 0);
+}
+
+static void
+epoch_key_create()
+{
+    pthread_key_create(&epoch_key, epoch_record_release);
+}
+
+static epoch_record_t *
+epoch_register()
+{
+    pthread_once(&epoch_key_once, epoch_key_create);
+
+    epoch_record_t *rec = EPOCH_LOAD(epoch_records);
+    while (rec) {
+        if (!EPOCH_LOAD(rec->in_use) && __sync_bool_compare_and_swap(&rec->in_use, 0, 1))
+            break;
+        rec = rec->next;
+    }
+
+    if (!rec) {
+        if (posix_memalign((void **)&rec, EPOCH_CACHE_LINE, sizeof(epoch_record_t)) != 0)
+            abort();
+        memset(rec, 0, sizeof(epoch_record_t));
+        rec->in_use = 1;
+        do {
+            rec->next = EPOCH_LOAD(epoch_records);
+        } while (!__sync_bool_compare_and_swap(&epoch_records, rec->next, rec));
+    }
+
+    pthread_setspecific(epoch_key, rec);
+    epoch_self = rec;
+    return rec;
+}
+
+void
+epoch_enter()
+{
+    epoch_record_t *rec = epoch_self;
+    if (__builtin_expect(!rec, 0))
+        rec = epoch_register();
+
+    if (rec->nesting++ == 0) {
+        uint64_t epoch = EPOCH_LOAD(epoch_global);
+        EPOCH_STORE(rec->state, (epoch << 1) | 1);
+        // the announcement must be visible before any shared object is accessed
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void
+epoch_exit()
+{
+    epoch_record_t *rec = epoch_self;
+    if (--rec->nesting == 0)
+        EPOCH_STORE(rec->state, 0);
+}
+
+uint64_t
+epoch_current()
+{
+    return EPOCH_LOAD(epoch_global);
+}
+
+uint64_t
+epoch_try_advance()
+{
+    uint64_t epoch = EPOCH_LOAD(epoch_global);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    epoch_record_t *rec = EPOCH_LOAD(epoch_records);
+    while (rec) {
+        uint64_t state = EPOCH_LOAD(rec->state);
+        // a thread still in a critical section entered in a previous epoch
+        if ((state & 1) && (state >> 1) != epoch)
+            return epoch;
+        rec = rec->next;
+    }
+
+    __sync_bool_compare_and_swap(&epoch_global, epoch, epoch + 1);
+    return EPOCH_LOAD(epoch_global);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,63 @@
+#ifndef SHARDCACHE_EPOCH_H
+#define SHARDCACHE_EPOCH_H
+
+#include <stdint.h>
+
+/*
+ * Epoch based reclamation.
+ *
+ * Readers announce the epoch they are running in by calling epoch_enter()
+ * before accessing shared objects and epoch_exit() once done. The announcement
+ * is stored in a record owned by the calling thread, so (unlike reference
+ * counting) readers never write to shared memory.
+ *
+ * Objects unlinked from the shared structures are retired by the writers
+ * (tagging them with epoch_current()) and can be released once the global
+ * epoch has been advanced twice since then, which can't happen while a thread
+ * is still in a critical section started before the object has been unlinked.
+ *
+ * The epoch and the thread records are shared by the whole process.
+ * Critical sections can be nested and must start and end on the same thread,
+ * they are expected to be short since they prevent the epoch from advancing.
+ */
+
+/**
+ * @brief Enter a critical section (announcing the current epoch)
+ */
+void epoch_enter();
+
+/**
+ * @brief Leave the critical section previously entered with epoch_enter()
+ */
+void epoch_exit();
+
+/**
+ * @brief Get the current global epoch
+ * @return The current epoch
+ */
+uint64_t epoch_current();
+
+/**
+ * @brief Try advancing the global epoch
+ * @return The (possibly new) current epoch
+ * @note The epoch can't be advanced if any thread is still
+ *       in a critical section entered in a previous epoch
+ */
+uint64_t epoch_try_advance();
+
+/**
+ * @brief Check if the objects retired at the given epoch can be released
+ * @param epoch : The epoch at which the objects have been retired
+ * @param current : The current epoch (as returned by epoch_try_advance())
+ * @return 1 if the objects can be released, 0 otherwise
+ */
+static inline int
+epoch_is_safe(uint64_t epoch, uint64_t current)
+{
+    return (current >= epoch + 2);
+}
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "shardcache_internal.h" // for MUTEX_* macros
+
+#include "hotkeys.h"
+#include "sketch.h"
+
+typedef struct {
+    void *key;
+    size_t klen;
+    uint32_t freq;
+} hotkeys_entry_t;
+
+struct _hotkeys_s {
+    sketch_t sketch;      // the estimated number of recent accesses to each key
+
+    hotkeys_entry_t *top;
+    int num_top;
+    int top_count;
+    uint32_t top_min;     // the lowest frequency in the (full) top-K table,
+                          // note must be accessed only via atomic functions
+    pthread_mutex_t top_lock;
+};
+
+hotkeys_t *
+hotkeys_create(size_t width, int num_top)
+{
+    hotkeys_t *hk = calloc(1, sizeof(hotkeys_t));
+    if (!hk)
+        return NULL;
+
+    if (sketch_init(&hk->sketch, width, UINT32_MAX) != 0) {
+        free(hk);
+        return NULL;
+    }
+
+    hk->top = calloc(num_top > 0 ? num_top : 1, sizeof(hotkeys_entry_t));
+    if (!hk->top) {
+        sketch_destroy(&hk->sketch);
+        free(hk);
+        return NULL;
+    }
+
+    hk->num_top = num_top;
+
+    MUTEX_INIT(hk->top_lock);
+
+    return hk;
+}
+
+void
+hotkeys_destroy(hotkeys_t *hk)
+{
+    int i;
+    for (i = 0; i < hk->top_count; i++)
+        free(hk->top[i].key);
+    free(hk->top);
+    sketch_destroy(&hk->sketch);
+    MUTEX_DESTROY(hk->top_lock);
+    free(hk);
+}
+
+// the frequencies in the top-K table are halved together with the sketch
+static void
+hotkeys_age(hotkeys_t *hk)
+{
+    MUTEX_LOCK(hk->top_lock);
+    int n;
+    for (n = 0; n < hk->top_count; n++)
+        hk->top[n].freq >>= 1;
+    ATOMIC_SET(hk->top_min, ATOMIC_READ(hk->top_min) >> 1);
+    MUTEX_UNLOCK(hk->top_lock);
+}
+
+// NOTE: must be called with the top_lock held
+static void
+hotkeys_update_top(hotkeys_t *hk, void *key, size_t klen, uint32_t freq)
+{
+    int i;
+    int min_index = 0;
+    for (i = 0; i < hk->top_count; i++) {
+        hotkeys_entry_t *entry = &hk->top[i];
+        if (entry->klen == klen && memcmp(entry->key, key, klen) == 0) {
+            entry->freq = freq;
+            break;
+        }
+        if (entry->freq < hk->top[min_index].freq)
+            min_index = i;
+    }
+
+    if (i == hk->top_count) {
+        // not in the table yet
+        void *key_copy = malloc(klen);
+        if (!key_copy)
+            return;
+        memcpy(key_copy, key, klen);
+
+        hotkeys_entry_t *entry;
+        if (hk->top_count < hk->num_top) {
+            entry = &hk->top[hk->top_count++];
+        } else if (freq > hk->top[min_index].freq) {
+            entry = &hk->top[min_index];
+            free(entry->key);
+        } else {
+            free(key_copy);
+            return;
+        }
+        entry->key = key_copy;
+        entry->klen = klen;
+        entry->freq = freq;
+    }
+
+    if (hk->top_count == hk->num_top) {
+        uint32_t min = hk->top[0].freq;
+        for (i = 1; i < hk->top_count; i++) {
+            if (hk->top[i].freq < min)
+                min = hk->top[i].freq;
+        }
+        ATOMIC_SET(hk->top_min, min);
+    }
+}
+
+uint32_t
+hotkeys_touch(hotkeys_t *hk, void *key, size_t klen)
+{
+    int aged = 0;
+    uint32_t estimate = sketch_add(&hk->sketch, sketch_hash(key, klen), &aged);
+    if (aged)
+        hotkeys_age(hk);
+
+    // if someone else is updating the top-K table we just skip
+    // the update, the key will be considered again on its next access
+    if (hk->num_top > 0 && estimate > ATOMIC_READ(hk->top_min) &&
+        pthread_mutex_trylock(&hk->top_lock) == 0)
+    {
+        hotkeys_update_top(hk, key, klen, estimate);
+        MUTEX_UNLOCK(hk->top_lock);
+    }
+
+    return estimate;
+}
+
+static int
+hotkeys_cmp(const void *a, const void *b)
+{
+    uint32_t fa = ((shardcache_hot_key_t *)a)->frequency;
+    uint32_t fb = ((shardcache_hot_key_t *)b)->frequency;
+    return (fa < fb) ? 1 : (fa > fb) ? -1 : 0;
+}
+
+int
+hotkeys_get_top(hotkeys_t *hk, shardcache_hot_key_t **keys)
+{
+    int i;
+    int count = 0;
+
+    MUTEX_LOCK(hk->top_lock);
+    shardcache_hot_key_t *out = calloc(hk->top_count ? hk->top_count : 1, sizeof(shardcache_hot_key_t));
+    if (!out) {
+        MUTEX_UNLOCK(hk->top_lock);
+        *keys = NULL;
+        return 0;
+    }
+    for (i = 0; i < hk->top_count; i++) {
+        hotkeys_entry_t *entry = &hk->top[i];
+        // entries which have been aged to 0 are not hot anymore
+        if (!entry->freq)
+            continue;
+        out[count].key = malloc(entry->klen);
+        if (!out[count].key)
+            break;
+        memcpy(out[count].key, entry->key, entry->klen);
+        out[count].klen = entry->klen;
+        out[count].frequency = entry->freq;
+        count++;
+    }
+    MUTEX_UNLOCK(hk->top_lock);
+
+    qsort(out, count, sizeof(shardcache_hot_key_t), hotkeys_cmp);
+
+    *keys = out;
+    return count;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
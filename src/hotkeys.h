@@ -0,0 +1,63 @@
+#ifndef SHARDCACHE_HOTKEYS_H
+#define SHARDCACHE_HOTKEYS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "shardcache.h"
+
+/*
+ * Hot keys detector.
+ *
+ * Accesses are recorded in a count-min sketch (see sketch.h) which gives an
+ * estimate of how many times each key has been accessed recently.
+ *
+ * The hottest keys (according to the estimates) are also tracked in a small
+ * top-K table which can be retrieved using hotkeys_get_top(). Its frequencies
+ * are halved together with the counters of the sketch.
+ *
+ * NOTE: updates are lossy (concurrent increments, or updates of the top-K table
+ *       while someone else is updating it, might be lost) which is fine for
+ *       the purpose of detecting hot keys
+ */
+
+typedef struct _hotkeys_s hotkeys_t;
+
+/**
+ * @brief Create a new hot keys detector
+ * @param width : The number of counters in each row of the sketch
+ *                (rounded up to the next power of 2)
+ * @param num_top : The number of hottest keys to keep track of
+ * @return A newly initialized hotkeys_t instance, NULL in case of errors
+ */
+hotkeys_t *hotkeys_create(size_t width, int num_top);
+
+/**
+ * @brief Release all the resources used by a hot keys detector
+ * @param hk : A valid pointer to an initialized hotkeys_t structure
+ */
+void hotkeys_destroy(hotkeys_t *hk);
+
+/**
+ * @brief Record an access to the given key
+ * @param hk : A valid pointer to an initialized hotkeys_t structure
+ * @param key : The key
+ * @param klen : The length of the key
+ * @return The estimated number of recent accesses to the key (including this one)
+ */
+uint32_t hotkeys_touch(hotkeys_t *hk, void *key, size_t klen);
+
+/**
+ * @brief Get the hottest keys
+ * @param hk : A valid pointer to an initialized hotkeys_t structure
+ * @param keys : A reference to a pointer which will be set to a newly allocated array
+ *               holding copies of the hottest keys sorted by decreasing frequency
+ * @return The number of keys in the array
+ * @note The array needs to be released using shardcache_free_hot_keys()
+ */
+int hotkeys_get_top(hotkeys_t *hk, shardcache_hot_key_t **keys);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -1329,6 +1329,68 @@ touch_on_peer(char *peer,
 }
 
 
+int
+load_on_peer(char *peer,
+             void *key,
+             size_t klen,
+             void *value,
+             size_t vlen,
+             uint32_t ttl,
+             int fd,
+             int expect_response)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        if (fd < 0)
+            return -1;
+        should_close = 1;
+    }
+
+    SHC_DEBUG2("Sending load command to peer %s", peer);
+
+    uint32_t ttl_nbo = htonl(ttl);
+    shardcache_record_t record[3] = {
+        {
+            .v = key,
+            .l = klen
+        },
+        {
+            .v = value,
+            .l = vlen
+        },
+        {
+            .v = &ttl_nbo,
+            .l = sizeof(ttl_nbo)
+        }
+    };
+
+    int rc = write_message(fd, SHC_HDR_LOAD, record, ttl ? 3 : 2);
+
+    // the owner pushing hot keys to its peers
+    // doesn't need to wait for the response
+    if (rc == 0 && expect_response) {
+        shardcache_hdr_t hdr = 0;
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp = &resp;
+        int num_records = read_message(fd, &respp, 1, &hdr, 0);
+        rc = -1;
+        if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
+            SHC_DEBUG2("Got (load) response from peer %s : %02x\n",
+                      peer, *((char *)fbuf_data(&resp)));
+            char *res = fbuf_data(&resp);
+            if (res && *res == SHC_RES_OK)
+                rc = 0;
+        }
+        fbuf_destroy(&resp);
+    }
+
+    if (should_close)
+        close(fd);
+
+    return (rc == 0) ? 0 : -1;
+}
+
 int
 stats_from_peer(char *peer,
                 char **out,
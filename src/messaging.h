@@ -167,6 +167,18 @@ touch_on_peer(char *peer,
               size_t klen,
               int fd);
 
+// load a value into the cache of a peer (without touching its storage),
+// the cached value will be expired after ttl seconds (if not 0)
+int
+load_on_peer(char *peer,
+             void *key,
+             size_t klen,
+             void *value,
+             size_t vlen,
+             uint32_t ttl,
+             int fd,
+             int expect_response);
+
 // retrieve all the stats counters from a peer
 int stats_from_peer(char *peer,
                     char **out,
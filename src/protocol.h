@@ -32,6 +32,9 @@ typedef enum {
     SHC_HDR_DELETE_MULTI     = 0x0D,
     SHC_HDR_EVICT_MULTI      = 0x0E,
 
+    // cache commands (the storage is not involved)
+    SHC_HDR_LOAD             = 0x0F,
+
     // atomic commands (assuming that the value is a 64bit integer)
     SHC_HDR_INCREMENT        = 0x10,
     SHC_HDR_DECREMENT        = 0x11,
@@ -8,6 +8,8 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <errno.h>
 #include <iomux.h>
 #include <queue.h>
@@ -22,9 +24,39 @@
 #include "counters.h"
 
 #include "serving.h"
+#include "uring_mux.h"
 
 #include "shardcache_internal.h" // for the replica memeber
 
+// a worker which didn't complete a loop for this long (in millisecs)
+// is considered stuck (most likely in a slow storage fetch)
+#define SHARDCACHE_WORKER_STALL_TIME         1000
+#define SHARDCACHE_WORKER_STALL_PENALTY      (1<<20)
+// how often (in millisecs) a worker compares its load with the others'
+#define SHARDCACHE_WORKER_BALANCE_INTERVAL   1000
+// a worker is overloaded if it has at least OVERLOAD_MIN connections and
+// OVERLOAD_FACTOR times the average, for OVERLOAD_CHECKS consecutive checks
+#define SHARDCACHE_WORKER_OVERLOAD_MIN       32
+#define SHARDCACHE_WORKER_OVERLOAD_FACTOR    2
+#define SHARDCACHE_WORKER_OVERLOAD_CHECKS    3
+
+// size of the submission queue of the workers running on io_uring
+#define SHARDCACHE_WORKER_URING_ENTRIES      1024
+
+// max number of released requests each worker keeps for reuse, the buffers
+// of a request are kept only up to REQUEST_POOL_FBUF_MAX bytes (bigger ones
+// are freed, so that an occasional huge request doesn't pin its memory)
+#define SHARDCACHE_REQUEST_POOL_SIZE         32
+#define SHARDCACHE_REQUEST_POOL_FBUF_MAX     (1<<14)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 #ifdef USE_PACKED_STRUCTURES
 #pragma pack(push, 1)
 #endif
@@ -36,15 +68,27 @@ typedef struct {
     pthread_mutex_t wakeup_lock;
     shardcache_serving_t *serv;
     iomux_t *iomux;
+    uring_mux_t *uring; // used instead of the iomux if running on io_uring
     linked_list_t *prune;
     uint64_t numfds;
     int id;
+    int sock; // the listening socket of the worker (SO_REUSEPORT mode), -1 otherwise
+    uint64_t pending;   // connections queued to the worker but not yet in its mux
+    uint64_t loop_time; // when the worker started its last loop (in millisecs)
+    uint64_t balance_time;
+    int overloaded;     // number of consecutive checks which found the worker overloaded
+    TAILQ_HEAD (, _shardcache_connection_context_s) connections;
+    TAILQ_HEAD (, _shardcache_request_s) free_requests; // the requests available for reuse
+    int num_free_requests;
     //uint64_t pruning;
 } shardcache_worker_context_t;
 
 struct _shardcache_serving_s {
     shardcache_t *cache;
-    int sock;
+    int sock;      // the listening socket, -1 while the workers accept the connections
+    char *host;
+    int port;
+    int reuseport; // each worker accepts the connections on its own SO_REUSEPORT socket
     pthread_t io_thread;
     iomux_t *io_mux;
     int leave;
@@ -53,6 +97,10 @@ struct _shardcache_serving_s {
     linked_list_t *workers;
     uint64_t num_connections;
     uint64_t total_workers;
+    uint64_t migrated_connections;
+    uint64_t request_pool_hits;
+    uint64_t request_pool_misses;
+    uint64_t uring_workers;
 };
 
 typedef struct _shardcache_connection_context_s shardcache_connection_context_t;
@@ -114,6 +162,10 @@ struct _shardcache_connection_context_s {
     shardcache_worker_context_t *worker;
     int closed;
     struct timeval in_prune_since;
+    TAILQ_ENTRY(_shardcache_connection_context_s) wnext; // in the connections of the worker
+    int linked;         // the context is in the connections of its worker
+    int output_pending; // the output callback is set
+    int input_pending;  // the mux holds input data not yet processed
 };
 #ifdef USE_PACKED_STRUCTURES
 #pragma pack(pop)
@@ -158,7 +210,7 @@ shardcache_connection_context_create(shardcache_serving_t *serv, int fd)
 }
 
 static void
-shardcache_request_destroy(shardcache_request_t *req)
+shardcache_request_free(shardcache_request_t *req)
 {
     int i;
     for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++) {
@@ -170,6 +222,43 @@ shardcache_request_destroy(shardcache_request_t *req)
     free(req);
 }
 
+// empty a buffer of a request being recycled, keeping its memory unless it's too big
+static inline void
+shardcache_request_fbuf_reset(fbuf_t *buf)
+{
+    if (fbuf_len(buf) > SHARDCACHE_REQUEST_POOL_FBUF_MAX) {
+        fbuf_destroy(buf);
+        FBUF_STATIC_INITIALIZER_POINTER(buf, FBUF_MAXLEN_NONE, 64, 1024, 512);
+    } else {
+        fbuf_clear(buf);
+    }
+}
+
+// NOTE: must be called by the worker owning the connection (or once it has exited)
+static void
+shardcache_request_destroy(shardcache_request_t *req)
+{
+    shardcache_worker_context_t *wrk = req->ctx ? req->ctx->worker : NULL;
+
+    // only completed requests are recycled, nobody else can be
+    // still referencing them
+    if (!wrk || !ATOMIC_READ(req->done) ||
+        wrk->num_free_requests >= SHARDCACHE_REQUEST_POOL_SIZE)
+    {
+        shardcache_request_free(req);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++)
+        shardcache_request_fbuf_reset(&req->records[i]);
+    shardcache_request_fbuf_reset(&req->output);
+    shardcache_request_fbuf_reset(&req->fetch_accumulator);
+
+    TAILQ_INSERT_HEAD(&wrk->free_requests, req, next);
+    wrk->num_free_requests++;
+}
+
 static void
 shardcache_connection_context_destroy(shardcache_connection_context_t *ctx)
 {
@@ -184,6 +273,8 @@ shardcache_connection_context_destroy(shardcache_connection_context_t *ctx)
         ctx->num_requests--;
         req = TAILQ_FIRST(&ctx->requests);
     }
+    if (ctx->linked)
+        TAILQ_REMOVE(&ctx->worker->connections, ctx, wnext);
     async_read_context_destroy(ctx->reader_ctx);
     ATOMIC_DECREMENT(ctx->serv->num_connections);
     free(ctx);
@@ -197,6 +288,20 @@ send_data(shardcache_request_t *req, fbuf_t *data)
     SPIN_UNLOCK(req->output_lock);
 }
 
+// keys are binary, escape whatever would break the STATS line format
+static void
+write_escaped_key(fbuf_t *buf, char *key, size_t klen)
+{
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        unsigned char c = (unsigned char)key[i];
+        if (c < 0x20 || c > 0x7e || c == ',' || c == ':' || c == ';' || c == '\\')
+            fbuf_printf(buf, "\\x%02x", c);
+        else
+            fbuf_add_binary(buf, (char *)&c, 1);
+    }
+}
+
 static void
 write_statuses(shardcache_request_t *req, char mode, int num_items, ...)
 {
@@ -634,6 +739,84 @@ get_async_data(shardcache_t *cache,
     return rc;
 }
 
+// Write the whole response to a get straight from the memory of the cached
+// object (see shardcache_get_inplace()), only what doesn't fit in the socket
+// buffer is copied to the output buffer (to be sent by the mux)
+static int
+send_inplace_data_response(const struct iovec *iov, int iovcnt, size_t total, void *priv)
+{
+    shardcache_request_t *req = (shardcache_request_t *)priv;
+
+    if (total > UINT32_MAX || iovcnt > IOV_MAX - 2)
+        return 1;
+
+    // the preamble (magic, header and size of the record) ...
+    char version = async_read_context_protocol_version(req->ctx->reader_ctx);
+    uint32_t magic = htonl((SHC_MAGIC & 0xFFFFFF00) | version);
+    uint32_t size = htonl(total);
+    unsigned char preamble[sizeof(magic) + 1 + sizeof(size)];
+    memcpy(preamble, &magic, sizeof(magic));
+    preamble[sizeof(magic)] = SHC_HDR_RESPONSE;
+    memcpy(preamble + sizeof(magic) + 1, &size, sizeof(size));
+
+    // ... and the epilogue (the status record, see send_async_data_response_epilogue())
+    uint32_t status_size = htonl(1);
+    unsigned char epilogue[1 + sizeof(status_size) + 2];
+    epilogue[0] = SHARDCACHE_RSEP;
+    memcpy(epilogue + 1, &status_size, sizeof(status_size));
+    epilogue[1 + sizeof(status_size)] = SHC_RES_OK;
+    epilogue[2 + sizeof(status_size)] = SHARDCACHE_EOM;
+
+    struct iovec vec[iovcnt + 2];
+    vec[0].iov_base = preamble;
+    vec[0].iov_len = sizeof(preamble);
+    memcpy(&vec[1], iov, sizeof(struct iovec) * iovcnt);
+    vec[iovcnt + 1].iov_base = epilogue;
+    vec[iovcnt + 1].iov_len = sizeof(epilogue);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = iovcnt + 2;
+
+    // NOTE: errors will be caught by the mux when sending the remainder
+    ssize_t wb = sendmsg(req->ctx->fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+    size_t written = (wb > 0) ? wb : 0;
+
+    SPIN_LOCK(req->output_lock);
+    int i;
+    for (i = 0; i < iovcnt + 2; i++) {
+        if (written >= vec[i].iov_len) {
+            written -= vec[i].iov_len;
+            continue;
+        }
+        fbuf_add_binary(&req->output, (char *)vec[i].iov_base + written, vec[i].iov_len - written);
+        written = 0;
+    }
+    SPIN_UNLOCK(req->output_lock);
+
+    ATOMIC_INCREMENT(req->done);
+    return 0;
+}
+
+// Serve a get without copying the value if it's in the cache and the response
+// can be written right away (nothing else is waiting to be sent on the connection)
+// Returns 0 if the request has been served, 1 if it must go through get_async_data()
+static int
+get_inplace_data(shardcache_t *cache, void *key, size_t klen, shardcache_request_t *req)
+{
+    shardcache_connection_context_t *ctx = req->ctx;
+
+    if (async_read_context_protocol_version(ctx->reader_ctx) < 2 ||
+        TAILQ_FIRST(&ctx->requests) != req || ctx->output_pending ||
+        fbuf_used(&req->output))
+    {
+        return 1;
+    }
+
+    return shardcache_get_inplace(cache, key, klen, send_inplace_data_response, req) == 0 ? 0 : 1;
+}
+
 static void
 shardcache_async_command_response(void *key, size_t klen, int64_t ret, void *priv)
 {
@@ -702,6 +885,12 @@ process_request(shardcache_request_t *req)
                 }
             }
 
+            if (req->hdr != SHC_HDR_GET_OFFSET) {
+                shardcache_hot_key_access(cache, key, klen);
+                if (get_inplace_data(cache, key, klen, req) == 0)
+                    break;
+            }
+
             get_async_data(cache, key, klen, get_async_data_handler, req);
             break;
         }
@@ -762,6 +951,20 @@ process_request(shardcache_request_t *req)
             write_status(req, WRITE_STATUS_MODE_SIMPLE, 0);
             break;
         }
+        case SHC_HDR_LOAD:
+        {
+            uint32_t ttl = 0;
+            if (fbuf_used(&req->records[2]) == sizeof(uint32_t)) {
+                memcpy(&ttl, fbuf_data(&req->records[2]), sizeof(uint32_t));
+                ttl = ntohl(ttl);
+            }
+            rc = shardcache_load_pushed(cache, key, klen,
+                                        fbuf_data(&req->records[1]),
+                                        fbuf_used(&req->records[1]),
+                                        ttl);
+            write_status(req, WRITE_STATUS_MODE_SIMPLE, rc);
+            break;
+        }
         case SHC_HDR_CAS:
         {
             if (!fbuf_used(&req->records[2])) {
@@ -937,6 +1140,19 @@ process_request(shardcache_request_t *req)
                                 counters[i].name, counters[i].value);
                 }
 
+                shardcache_hot_key_t *hot_keys = NULL;
+                int num_hot_keys = shardcache_get_hot_remote_keys(cache, &hot_keys);
+                fbuf_add(&buf, "hot_remote_keys;");
+                for (i = 0; i < num_hot_keys; i++) {
+                    if (i > 0)
+                        fbuf_add(&buf, ",");
+                    write_escaped_key(&buf, hot_keys[i].key, hot_keys[i].klen);
+                    fbuf_printf(&buf, ":%u", hot_keys[i].frequency);
+                }
+                fbuf_add(&buf, "\r\n");
+                if (hot_keys)
+                    shardcache_free_hot_keys(hot_keys, num_hot_keys);
+
                 fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
                 shardcache_record_t record = {
                     .v = fbuf_data(&buf),
@@ -1053,47 +1269,232 @@ process_request(shardcache_request_t *req)
 
 static void * worker(void *priv);
 
+static inline uint64_t
+serving_now_ms()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// the load of a worker is given by the connections it handles (or is about
+// to handle), a worker stuck for too long is avoided as much as possible
+static inline uint64_t
+shardcache_worker_load(shardcache_worker_context_t *wrk, uint64_t now)
+{
+    uint64_t load = ATOMIC_READ(wrk->numfds) + ATOMIC_READ(wrk->pending);
+    uint64_t loop_time = ATOMIC_READ(wrk->loop_time);
+    if (now > loop_time && now - loop_time > SHARDCACHE_WORKER_STALL_TIME)
+        load += SHARDCACHE_WORKER_STALL_PENALTY;
+    return load;
+}
+
+typedef struct {
+    uint64_t now;
+    uint64_t total;
+    int count;
+    shardcache_worker_context_t *min;
+    uint64_t min_load;
+} shardcache_workers_load_arg_t;
+
+static int
+shardcache_workers_load_cb(void *item, size_t idx, void *user)
+{
+    shardcache_worker_context_t *wrk = (shardcache_worker_context_t *)item;
+    shardcache_workers_load_arg_t *arg = (shardcache_workers_load_arg_t *)user;
+    uint64_t load = shardcache_worker_load(wrk, arg->now);
+    if (!arg->min || load < arg->min_load) {
+        arg->min = wrk;
+        arg->min_load = load;
+    }
+    arg->total += load;
+    arg->count++;
+    return 1;
+}
+
 static shardcache_worker_context_t *
 shardcache_select_worker(shardcache_serving_t *serv)
 {
     if (ATOMIC_READ(serv->leave))
         return NULL;
 
-    shardcache_worker_context_t *wrk = list_pick_value(serv->workers,
-            __sync_fetch_and_add(&serv->next_worker_index, 1)%list_count(serv->workers));
+    int num_workers = list_count(serv->workers);
+    if (!num_workers)
+        return NULL;
+
+    uint32_t idx = __sync_fetch_and_add(&serv->next_worker_index, 1);
+    shardcache_worker_context_t *wrk = NULL;
+
+    switch(ATOMIC_READ(serv->cache->workers_balancing)) {
+        case SHARDCACHE_WORKERS_BALANCING_LEAST_LOADED:
+        {
+            shardcache_workers_load_arg_t arg = { .now = serving_now_ms() };
+            list_foreach_value(serv->workers, shardcache_workers_load_cb, &arg);
+            wrk = arg.min;
+            break;
+        }
+        case SHARDCACHE_WORKERS_BALANCING_TWO_CHOICES:
+        {
+            wrk = list_pick_value(serv->workers, idx % num_workers);
+            if (num_workers > 1) {
+                // the second choice is a (pseudo)random worker other than the first one
+                uint32_t hash = idx * 2654435761U;
+                shardcache_worker_context_t *other = list_pick_value(serv->workers,
+                        (idx + 1 + (hash >> 16) % (num_workers - 1)) % num_workers);
+                uint64_t now = serving_now_ms();
+                if (other && (!wrk || shardcache_worker_load(other, now) < shardcache_worker_load(wrk, now)))
+                    wrk = other;
+            }
+            break;
+        }
+        default:
+            wrk = list_pick_value(serv->workers, idx % num_workers);
+            break;
+    }
 
     return wrk;
 }
 
+static shardcache_request_t *
+shardcache_request_alloc(shardcache_worker_context_t *wrk)
+{
+    shardcache_request_t *req = wrk ? TAILQ_FIRST(&wrk->free_requests) : NULL;
+    if (req) {
+        TAILQ_REMOVE(&wrk->free_requests, req, next);
+        wrk->num_free_requests--;
+        req->fd = 0;
+        req->error = 0;
+        req->skipped = 0;
+        req->copied = 0;
+        req->done = 0;
+        ATOMIC_INCREMENT(wrk->serv->request_pool_hits);
+        return req;
+    }
+
+    req = calloc(1, sizeof(shardcache_request_t));
+    SPIN_INIT(req->output_lock);
+
+    int i;
+    for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++)
+        FBUF_STATIC_INITIALIZER_POINTER(&req->records[i], FBUF_MAXLEN_NONE, 64, 1024, 512);
+
+    FBUF_STATIC_INITIALIZER_POINTER(&req->fetch_accumulator, FBUF_MAXLEN_NONE, 64, 1024, 512);
+    FBUF_STATIC_INITIALIZER_POINTER(&req->output, FBUF_MAXLEN_NONE, 64, 1024, 512);
+
+    if (wrk)
+        ATOMIC_INCREMENT(wrk->serv->request_pool_misses);
+
+    return req;
+}
+
 shardcache_request_t *
 shardcache_request_create(shardcache_connection_context_t *ctx)
 {
-    shardcache_request_t *req = calloc(1, sizeof(shardcache_request_t));
+    shardcache_request_t *req = shardcache_request_alloc(ctx->worker);
     req->hdr = async_read_context_hdr(ctx->reader_ctx);
     req->ctx = ctx;
-    SPIN_INIT(req->output_lock);
 
     int i;
     for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++) {
-        FBUF_STATIC_INITIALIZER_POINTER(&req->records[i], FBUF_MAXLEN_NONE, 64, 1024, 512);
         char *buf = NULL;
         int len = 0;
         int used = fbuf_detach(&ctx->records[i], &buf, &len);
-        if (buf)
+        if (buf) {
+            // the (empty) buffer of a recycled request goes to the
+            // connection context, which will use it for the next request
+            char *spare = NULL;
+            int spare_len = 0;
+            fbuf_detach(&req->records[i], &spare, &spare_len);
+            if (spare)
+                fbuf_attach(&ctx->records[i], spare, spare_len, 0);
             fbuf_attach(&req->records[i], buf, len, used);
+        }
     }
 
-    FBUF_STATIC_INITIALIZER_POINTER(&req->fetch_accumulator, FBUF_MAXLEN_NONE, 64, 1024, 512);
-    FBUF_STATIC_INITIALIZER_POINTER(&req->output, FBUF_MAXLEN_NONE, 64, 1024, 512);
-
     return req;
 }
 
+// the event loop of a worker is either an iomux or an uring mux,
+// the callbacks must use these wrappers instead of the iomux they get
+// (which is NULL when called by an uring mux)
+
+static inline int
+shardcache_worker_io_add(shardcache_worker_context_t *wrkctx, int fd, iomux_callbacks_t *cbs)
+{
+    return wrkctx->uring ? uring_mux_add(wrkctx->uring, fd, cbs)
+                         : iomux_add(wrkctx->iomux, fd, cbs);
+}
+
+static inline void
+shardcache_worker_io_listen(shardcache_worker_context_t *wrkctx, int fd)
+{
+    if (wrkctx->uring)
+        uring_mux_listen(wrkctx->uring, fd);
+    else
+        iomux_listen(wrkctx->iomux, fd);
+}
+
+static inline void
+shardcache_worker_io_remove(shardcache_worker_context_t *wrkctx, int fd)
+{
+    if (wrkctx->uring)
+        uring_mux_remove(wrkctx->uring, fd);
+    else
+        iomux_remove(wrkctx->iomux, fd);
+}
+
+static inline int
+shardcache_worker_io_close(shardcache_worker_context_t *wrkctx, int fd)
+{
+    return wrkctx->uring ? uring_mux_close(wrkctx->uring, fd)
+                         : iomux_close(wrkctx->iomux, fd);
+}
+
+static inline void
+shardcache_worker_io_set_output(shardcache_worker_context_t *wrkctx, int fd, iomux_output_callback_t cb)
+{
+    if (wrkctx->uring)
+        uring_mux_set_output_callback(wrkctx->uring, fd, cb);
+    else
+        iomux_set_output_callback(wrkctx->iomux, fd, cb);
+}
+
+static inline void
+shardcache_worker_io_unset_output(shardcache_worker_context_t *wrkctx, int fd)
+{
+    if (wrkctx->uring)
+        uring_mux_unset_output_callback(wrkctx->uring, fd);
+    else
+        iomux_unset_output_callback(wrkctx->iomux, fd);
+}
+
+static inline void
+shardcache_worker_io_run(shardcache_worker_context_t *wrkctx, struct timeval *tv)
+{
+    if (wrkctx->uring)
+        uring_mux_run(wrkctx->uring, tv);
+    else
+        iomux_run(wrkctx->iomux, tv);
+}
+
+static inline int
+shardcache_worker_io_num_fds(shardcache_worker_context_t *wrkctx)
+{
+    return wrkctx->uring ? uring_mux_num_fds(wrkctx->uring)
+                         : iomux_num_fds(wrkctx->iomux);
+}
+
+static inline int
+shardcache_worker_io_isempty(shardcache_worker_context_t *wrkctx)
+{
+    return wrkctx->uring ? uring_mux_isempty(wrkctx->uring)
+                         : iomux_isempty(wrkctx->iomux);
+}
+
 static int shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len, void *priv);
 
 static inline int
-shardcache_check_context_state(iomux_t *iomux,
-                               int fd,
+shardcache_check_context_state(int fd,
                                shardcache_connection_context_t *ctx,
                                async_read_context_state_t state)
 {
@@ -1104,7 +1505,8 @@ shardcache_check_context_state(iomux_t *iomux,
         TAILQ_INSERT_TAIL(&ctx->requests, req, next);
         ctx->num_requests++;
         process_request(req);
-        iomux_set_output_callback(iomux, fd, shardcache_output_handler);
+        shardcache_worker_io_set_output(ctx->worker, fd, shardcache_output_handler);
+        ctx->output_pending = 1;
     }
     else if (UNLIKELY(state == SHC_STATE_READING_ERR))
     {
@@ -1136,7 +1538,7 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
         if (UNLIKELY(ATOMIC_READ(req->error))) {
             // abort the request and close the connection
             // if there was an error while fetching a remote object
-            if (!iomux_close(iomux, fd)) {
+            if (!shardcache_worker_io_close(ctx->worker, fd)) {
                 close(fd);
                 shardcache_connection_context_destroy(ctx);
             }
@@ -1157,13 +1559,14 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
             // if we have pending input data this is time
             // to process it and move to the next request
             int state = async_read_context_update(ctx->reader_ctx);
-            if (shardcache_check_context_state(iomux, fd, ctx, state) != 0) {
-                iomux_close(iomux, fd);
+            if (shardcache_check_context_state(fd, ctx, state) != 0) {
+                shardcache_worker_io_close(ctx->worker, fd);
                 *len = 0;
             }
         }
     } else {
-        iomux_unset_output_callback(iomux, fd);
+        shardcache_worker_io_unset_output(ctx->worker, fd);
+        ctx->output_pending = 0;
     }
     return IOMUX_OUTPUT_MODE_FREE;
 }
@@ -1184,6 +1587,7 @@ shardcache_input_handler(iomux_t *iomux,
     if (ctx) {
         if (ctx->num_requests > ctx->serv->cache->serving_look_ahead) {
             SHC_DEBUG2("Too many pipelined requests, waiting");
+            ctx->input_pending = 1;
             return 0;
         }
 
@@ -1192,9 +1596,10 @@ shardcache_input_handler(iomux_t *iomux,
 
         // updating the context state might eventually push a new requeset
         // (if entirely dowloaded) to a worker
-        if (shardcache_check_context_state(iomux, fd, ctx, state) != 0) {
-            iomux_close(iomux, fd);
+        if (shardcache_check_context_state(fd, ctx, state) != 0) {
+            shardcache_worker_io_close(ctx->worker, fd);
         }
+        ctx->input_pending = (processed < len);
     }
 
     return processed;
@@ -1209,6 +1614,10 @@ shardcache_eof_handler(iomux_t *iomux, int fd, void *priv)
     close(fd);
 
     if (ctx) {
+        if (ctx->linked) {
+            TAILQ_REMOVE(&ctx->worker->connections, ctx, wnext);
+            ctx->linked = 0;
+        }
         if (TAILQ_FIRST(&ctx->requests) != NULL) {
             ctx->closed = 1;
             gettimeofday(&ctx->in_prune_since, NULL);
@@ -1232,8 +1641,11 @@ shardcache_connection_handler(iomux_t *iomux, int fd, void *priv)
                 shardcache_connection_context_create(serv, fd);
 
             ctx->worker = wrkctx;
+            ATOMIC_INCREMENT(wrkctx->pending);
             if (queue_push_right(wrkctx->jobs, ctx) != 0) {
+                ATOMIC_DECREMENT(wrkctx->pending);
                 close(fd);
+                shardcache_connection_context_destroy(ctx);
                 SHC_WARNING("Can't push the new job to the worker queue");
                 return;
             }
@@ -1244,6 +1656,168 @@ shardcache_connection_handler(iomux_t *iomux, int fd, void *priv)
     }
 }
 
+static void
+shardcache_worker_add_connection(shardcache_worker_context_t *wrkctx,
+                                 shardcache_connection_context_t *ctx)
+{
+    iomux_callbacks_t connection_callbacks = {
+        .mux_connection = NULL,
+        .mux_input = shardcache_input_handler,
+        .mux_output = NULL,
+        .mux_eof = shardcache_eof_handler,
+        .priv = ctx
+    };
+    if (!shardcache_worker_io_add(wrkctx, ctx->fd, &connection_callbacks)) {
+        close(ctx->fd);
+        shardcache_connection_context_destroy(ctx);
+        return;
+    }
+    TAILQ_INSERT_TAIL(&wrkctx->connections, ctx, wnext);
+    ctx->linked = 1;
+}
+
+// a connection can be handed over to another worker only if there
+// is nothing in flight (neither in our buffers nor in the mux ones)
+static inline int
+shardcache_connection_is_idle(shardcache_connection_context_t *ctx)
+{
+    return (!ctx->closed && !ctx->output_pending && !ctx->input_pending &&
+            TAILQ_FIRST(&ctx->requests) == NULL &&
+            async_read_context_state(ctx->reader_ctx) == SHC_STATE_READING_NONE);
+}
+
+// move some idle connections to the least loaded worker
+// if this worker stays overloaded
+static void
+shardcache_worker_balance(shardcache_worker_context_t *wrkctx, uint64_t now)
+{
+    shardcache_serving_t *serv = wrkctx->serv;
+
+    // NOTE: an uring mux always has a receive in flight on the connections,
+    //       so they can't be handed over without losing data
+    if (!ATOMIC_READ(serv->cache->workers_migration) || wrkctx->uring) {
+        wrkctx->overloaded = 0;
+        return;
+    }
+
+    if (now - wrkctx->balance_time < SHARDCACHE_WORKER_BALANCE_INTERVAL)
+        return;
+    wrkctx->balance_time = now;
+
+    shardcache_workers_load_arg_t arg = { .now = now };
+    list_foreach_value(serv->workers, shardcache_workers_load_cb, &arg);
+
+    uint64_t load = ATOMIC_READ(wrkctx->numfds);
+    if (arg.count < 2 || !arg.min || arg.min == wrkctx ||
+        load < SHARDCACHE_WORKER_OVERLOAD_MIN ||
+        load < (arg.total / arg.count) * SHARDCACHE_WORKER_OVERLOAD_FACTOR)
+    {
+        wrkctx->overloaded = 0;
+        return;
+    }
+
+    if (++wrkctx->overloaded < SHARDCACHE_WORKER_OVERLOAD_CHECKS)
+        return;
+    wrkctx->overloaded = 0;
+
+    shardcache_worker_context_t *target = arg.min;
+    uint64_t to_move = (load > arg.min_load) ? (load - arg.min_load) / 2 : 0;
+    uint64_t moved = 0;
+
+    shardcache_connection_context_t *ctx = TAILQ_FIRST(&wrkctx->connections);
+    while (ctx && moved < to_move) {
+        shardcache_connection_context_t *next = TAILQ_NEXT(ctx, wnext);
+        if (!shardcache_connection_is_idle(ctx)) {
+            ctx = next;
+            continue;
+        }
+
+        // NOTE: iomux_remove() doesn't close the filedescriptor
+        TAILQ_REMOVE(&wrkctx->connections, ctx, wnext);
+        ctx->linked = 0;
+        shardcache_worker_io_remove(wrkctx, ctx->fd);
+
+        ctx->worker = target;
+        ATOMIC_INCREMENT(target->pending);
+        if (queue_push_right(target->jobs, ctx) != 0) {
+            ATOMIC_DECREMENT(target->pending);
+            close(ctx->fd);
+            shardcache_connection_context_destroy(ctx);
+        } else {
+            moved++;
+        }
+        ctx = next;
+    }
+
+    if (moved) {
+        ATOMIC_INCREASE(serv->migrated_connections, moved);
+        CONDITION_SIGNAL(target->wakeup_cond, target->wakeup_lock);
+        SHC_DEBUG("Worker %d moved %"PRIu64" connections to worker %d",
+                  wrkctx->id, moved, target->id);
+    }
+}
+
+// connections accepted by a worker on its own listening socket
+// are handled by the worker itself (no hop through the jobs queue)
+static void
+shardcache_worker_connection_handler(iomux_t *iomux, int fd, void *priv)
+{
+    shardcache_worker_context_t *wrkctx = (shardcache_worker_context_t *)priv;
+
+    if (ATOMIC_READ(wrkctx->leave) || ATOMIC_READ(wrkctx->serv->leave)) {
+        close(fd);
+        return;
+    }
+
+    shardcache_connection_context_t *ctx =
+        shardcache_connection_context_create(wrkctx->serv, fd);
+    ctx->worker = wrkctx;
+    shardcache_worker_add_connection(wrkctx, ctx);
+}
+
+// open (or close) the listening socket of the worker
+// according to the current serving mode
+static void
+shardcache_worker_update_listener(shardcache_worker_context_t *wrkctx)
+{
+    shardcache_serving_t *serv = wrkctx->serv;
+    int reuseport = ATOMIC_READ(serv->reuseport);
+
+    if (reuseport && wrkctx->sock == -1) {
+        // the address can't be shared until the main listener has been closed
+        if (ATOMIC_READ(serv->sock) != -1)
+            return;
+
+        int sock = open_shared_socket(serv->host, serv->port);
+        if (sock == -1) {
+            if (errno != EADDRINUSE)
+                SHC_ERROR("Worker %d can't open its listening socket %s:%d : %s",
+                          wrkctx->id, serv->host, serv->port, strerror(errno));
+            return;
+        }
+
+        iomux_callbacks_t connection_callbacks = {
+            .mux_connection = shardcache_worker_connection_handler,
+            .mux_input = NULL,
+            .mux_eof = NULL,
+            .mux_output = NULL,
+            .mux_timeout = NULL,
+            .priv = wrkctx
+        };
+        if (!shardcache_worker_io_add(wrkctx, sock, &connection_callbacks)) {
+            SHC_ERROR("Can't add the listening socket to the mux of worker %d", wrkctx->id);
+            close(sock);
+            return;
+        }
+        shardcache_worker_io_listen(wrkctx, sock);
+        wrkctx->sock = sock;
+    } else if (!reuseport && wrkctx->sock != -1) {
+        // NOTE: the connections still in the backlog of the socket are lost
+        shardcache_worker_io_remove(wrkctx, wrkctx->sock);
+        close(wrkctx->sock);
+        wrkctx->sock = -1;
+    }
+}
 
 static void *
 worker(void *priv)
@@ -1254,26 +1828,22 @@ worker(void *priv)
     shardcache_thread_init(wrkctx->serv->cache);
 
     while (ATOMIC_READ(wrkctx->leave) == 0) {
+        uint64_t now = serving_now_ms();
+        ATOMIC_SET(wrkctx->loop_time, now);
+
+        shardcache_worker_update_listener(wrkctx);
+
         shardcache_connection_context_t *ctx = queue_pop_left(jobs);
         while(ctx) {
-            iomux_callbacks_t connection_callbacks = {
-                .mux_connection = NULL,
-                .mux_input = shardcache_input_handler,
-                .mux_output = NULL,
-                .mux_eof = shardcache_eof_handler,
-                .priv = ctx
-            };
-            if (!iomux_add(wrkctx->iomux, ctx->fd, &connection_callbacks)) {
-                close(ctx->fd);
-                shardcache_connection_context_destroy(ctx);
-            }
+            ATOMIC_DECREMENT(wrkctx->pending);
+            shardcache_worker_add_connection(wrkctx, ctx);
             ctx = queue_pop_left(jobs);
         }
 
 
         int timeout = ATOMIC_READ(wrkctx->serv->cache->iomux_run_timeout_low);
         struct timeval tv = { timeout/1e6, timeout%(int)1e6 };
-        iomux_run(wrkctx->iomux, &tv);
+        shardcache_worker_io_run(wrkctx, &tv);
 
         int to_check = list_count(wrkctx->prune);
         while (to_check--) {
@@ -1301,9 +1871,11 @@ worker(void *priv)
             }
         }
 
-        ATOMIC_SET(wrkctx->numfds, iomux_num_fds(wrkctx->iomux));
+        ATOMIC_SET(wrkctx->numfds, shardcache_worker_io_num_fds(wrkctx));
+
+        shardcache_worker_balance(wrkctx, now);
 
-        if (iomux_isempty(wrkctx->iomux)) {
+        if (shardcache_worker_io_isempty(wrkctx)) {
             // we don't have any filedescriptor to handle in the mux,
             // let's sit for 1 second waiting for the listener thread to wake
             // us up if new filedescriptors arrive
@@ -1328,18 +1900,13 @@ worker(void *priv)
     return NULL;
 }
 
-void *
-serve_cache(void *priv)
+static int
+serve_cache_listen(shardcache_serving_t *serv, int sock)
 {
-    shardcache_serving_t *serv = (shardcache_serving_t *)priv;
-
-    SHC_NOTICE("Listening on %s (num_workers: %d)",
-               serv->cache->addr, serv->num_workers);
-
-    if (listen(serv->sock, -1) != 0) {
+    if (listen(sock, -1) != 0) {
         SHC_ERROR("Error listening on fd %d: %s",
-                  serv->sock, strerror(errno));
-        return NULL;
+                  sock, strerror(errno));
+        return -1;
     }
 
     iomux_callbacks_t connection_callbacks = {
@@ -1351,14 +1918,63 @@ serve_cache(void *priv)
         .priv = serv
     };
 
-    if (!iomux_add(serv->io_mux, serv->sock, &connection_callbacks)) {
+    if (!iomux_add(serv->io_mux, sock, &connection_callbacks)) {
         SHC_ERROR("Can't add the listening socket to the mux");
-        return NULL;
+        return -1;
     }
-    iomux_listen(serv->io_mux, serv->sock);
+    iomux_listen(serv->io_mux, sock);
+    return 0;
+}
+
+// close the listening socket when the workers are accepting the connections
+// on their own sockets, open it again when they stop doing so
+static void
+serve_cache_update_listener(shardcache_serving_t *serv)
+{
+    int reuseport = ATOMIC_READ(serv->reuseport);
+
+    if (reuseport && serv->sock != -1) {
+        // NOTE: the connections still in the backlog of the socket are lost
+        iomux_remove(serv->io_mux, serv->sock);
+        close(serv->sock);
+        ATOMIC_SET(serv->sock, -1);
+        SHC_NOTICE("The workers are now accepting the connections on %s", serv->cache->addr);
+    } else if (!reuseport && serv->sock == -1) {
+        // this fails until all the workers have released the address
+        int sock = open_socket(serv->host, serv->port);
+        if (sock == -1)
+            return;
+
+        if (serve_cache_listen(serv, sock) != 0) {
+            close(sock);
+            return;
+        }
+        ATOMIC_SET(serv->sock, sock);
+        SHC_NOTICE("Listening again on %s", serv->cache->addr);
+    }
+}
+
+void *
+serve_cache(void *priv)
+{
+    shardcache_serving_t *serv = (shardcache_serving_t *)priv;
+
+    SHC_NOTICE("Listening on %s (num_workers: %d)",
+               serv->cache->addr, serv->num_workers);
+
+    if (serve_cache_listen(serv, serv->sock) != 0)
+        return NULL;
 
     while (!ATOMIC_READ(serv->leave)) {
+        serve_cache_update_listener(serv);
+
         int timeout = ATOMIC_READ(serv->cache->iomux_run_timeout_high);
+        if (serv->sock == -1) {
+            // nothing to do until the listening socket is needed again
+            usleep(timeout);
+            continue;
+        }
+
         struct timeval tv = { timeout/1e6, timeout%(int)1e6 };
         iomux_run(serv->io_mux, &tv);
     }
@@ -1372,6 +1988,10 @@ create_serving_worker(shardcache_serving_t *s, int id)
     shardcache_worker_context_t *wrk = calloc(1, sizeof(shardcache_worker_context_t));
     wrk->id = id;
     wrk->serv = s;
+    wrk->sock = -1;
+    wrk->loop_time = serving_now_ms();
+    TAILQ_INIT(&wrk->connections);
+    TAILQ_INIT(&wrk->free_requests);
     wrk->jobs = queue_create();
     queue_set_free_value_callback(wrk->jobs,
             (queue_free_value_callback_t)shardcache_connection_context_destroy);
@@ -1384,7 +2004,15 @@ create_serving_worker(shardcache_serving_t *s, int id)
 
     MUTEX_INIT(wrk->wakeup_lock);
     CONDITION_INIT(wrk->wakeup_cond);
-    wrk->iomux = iomux_create(1<<13, 0);
+    if (ATOMIC_READ(s->cache->io_backend) == SHARDCACHE_IO_BACKEND_IO_URING) {
+        wrk->uring = uring_mux_create(SHARDCACHE_WORKER_URING_ENTRIES, 1<<13);
+        if (wrk->uring)
+            ATOMIC_INCREMENT(s->uring_workers);
+        else
+            SHC_WARNING("Can't use io_uring for worker %d, falling back to iomux", id);
+    }
+    if (!wrk->uring)
+        wrk->iomux = iomux_create(1<<13, 0);
     pthread_create(&wrk->thread, NULL, worker, wrk);
     list_push_value(s->workers, wrk);
     ATOMIC_INCREMENT(s->total_workers);
@@ -1413,6 +2041,11 @@ start_serving(shardcache_t *cache, unsigned int num_workers)
         return NULL;
     }
 
+    // keep the address to open the listening sockets again
+    // if the serving mode changes (see configure_serving_reuseport())
+    s->host = host ? strdup(host) : NULL;
+    s->port = port;
+
     free(addr); // we don't need it anymore
 
     // create the workers' pool
@@ -1421,6 +2054,10 @@ start_serving(shardcache_t *cache, unsigned int num_workers)
     if (cache->counters) {
         shardcache_counter_add(cache->counters, "connections", &s->num_connections);
         shardcache_counter_add(cache->counters, "num_workers", &s->total_workers);
+        shardcache_counter_add(cache->counters, "migrated_connections", &s->migrated_connections);
+        shardcache_counter_add(cache->counters, "request_pool_hits", &s->request_pool_hits);
+        shardcache_counter_add(cache->counters, "request_pool_misses", &s->request_pool_misses);
+        shardcache_counter_add(cache->counters, "io_uring_workers", &s->uring_workers);
     }
 
     int i;
@@ -1450,6 +2087,11 @@ destroy_serving_worker(shardcache_worker_context_t *wrk)
 
     pthread_join(wrk->thread, NULL);
 
+    if (wrk->sock != -1) {
+        shardcache_worker_io_remove(wrk, wrk->sock);
+        close(wrk->sock);
+    }
+
     queue_destroy(wrk->jobs);
 
     MUTEX_DESTROY(wrk->wakeup_lock);
@@ -1469,10 +2111,22 @@ destroy_serving_worker(shardcache_worker_context_t *wrk)
         ctx = list_shift_value(wrk->prune);
     }
 
-    iomux_destroy(wrk->iomux);
+    if (wrk->uring) {
+        uring_mux_destroy(wrk->uring);
+        ATOMIC_DECREMENT(wrk->serv->uring_workers);
+    } else {
+        iomux_destroy(wrk->iomux);
+    }
 
     list_destroy(wrk->prune);
 
+    shardcache_request_t *req = TAILQ_FIRST(&wrk->free_requests);
+    while (req) {
+        TAILQ_REMOVE(&wrk->free_requests, req, next);
+        shardcache_request_free(req);
+        req = TAILQ_FIRST(&wrk->free_requests);
+    }
+
     char label[64];
     snprintf(label, sizeof(label), "worker[%d].numfds", wrk->id);
     shardcache_counter_remove(wrk->serv->cache->counters, label);
@@ -1511,6 +2165,21 @@ configure_serving_workers(shardcache_serving_t *s, unsigned int num_workers)
     return ret;
 }
 
+int
+configure_serving_reuseport(shardcache_serving_t *s, int enabled)
+{
+#ifndef SO_REUSEPORT
+    if (enabled) {
+        SHC_ERROR("SO_REUSEPORT is not supported on this platform");
+        return -1;
+    }
+#endif
+    // the listening sockets are opened (and closed) by the threads
+    // owning the muxes they belong to, next time they wake up
+    ATOMIC_SET(s->reuseport, enabled ? 1 : 0);
+    return 0;
+}
+
 static void
 clear_workers_list(linked_list_t *list)
 {
@@ -1526,8 +2195,14 @@ stop_serving(shardcache_serving_t *s)
 {
     ATOMIC_INCREMENT(s->leave);
 
-    iomux_remove(s->io_mux, s->sock);
-    close(s->sock);
+    // the listening socket is owned by the io thread
+    // (which might be closing or opening it)
+    pthread_join(s->io_thread, NULL);
+
+    if (s->sock != -1) {
+        iomux_remove(s->io_mux, s->sock);
+        close(s->sock);
+    }
 
     // now the workers
     SHC_NOTICE("Collecting worker threads (might have to wait until i/o is finished)");
@@ -1538,13 +2213,16 @@ stop_serving(shardcache_serving_t *s)
     if (s->cache->counters) {
         shardcache_counter_remove(s->cache->counters, "connections");
         shardcache_counter_remove(s->cache->counters, "num_workers");
+        shardcache_counter_remove(s->cache->counters, "migrated_connections");
+        shardcache_counter_remove(s->cache->counters, "request_pool_hits");
+        shardcache_counter_remove(s->cache->counters, "request_pool_misses");
+        shardcache_counter_remove(s->cache->counters, "io_uring_workers");
     }
 
-    pthread_join(s->io_thread, NULL);
-
     iomux_destroy(s->io_mux);
     list_destroy(s->workers);
 
+    free(s->host);
     free(s);
 }
 
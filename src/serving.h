@@ -11,6 +11,8 @@ shardcache_serving_t *start_serving(shardcache_t *cache, unsigned int num_worker
 
 int configure_serving_workers(shardcache_serving_t *s, unsigned int num_workers);
 
+int configure_serving_reuseport(shardcache_serving_t *s, int enabled);
+
 void stop_serving(shardcache_serving_t *s);
 
 #endif
@@ -15,6 +15,7 @@
 #include <dlfcn.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <sched.h>
 
 #include "shardcache.h"
 #include "shardcache_internal.h"
@@ -22,6 +23,7 @@
 #include "connections.h"
 #include "messaging.h"
 #include "shardcache_replica.h"
+#include "sketch.h"
 
 #ifndef BUILD_INFO
 #define BUILD_INFO
@@ -36,7 +38,12 @@ const char *LIBSHARDCACHE_BUILD_INFO = X_STRINGIFY(BUILD_INFO);
 extern int shardcache_log_initialized;
 extern unsigned int shardcache_loglevel;
 
+static int shardcache_io_backend = SHARDCACHE_IO_BACKEND_DEFAULT;
 
+// migration: 0 tests the ownership using the current continuum, 1 using the
+//            migration continuum (returning -1 if no migration is in progress),
+//            2 using the migration continuum if a migration is in progress and
+//            the current one otherwise
 static int
 shardcache_test_ownership_internal(shardcache_t *cache,
                                    void *key,
@@ -64,6 +71,8 @@ shardcache_test_ownership_internal(shardcache_t *cache,
     if (migration) {
         if (cache->migration) {
             continuum = cache->migration;
+        } else if (migration == 2) {
+            continuum = cache->chash;
         } else {
             SPIN_UNLOCK(cache->migration_lock);
             return -1;
@@ -97,6 +106,18 @@ shardcache_test_migration_ownership(shardcache_t *cache,
     return ret;
 }
 
+// test the ownership in the migration context (if a migration is in progress)
+// with a single lookup
+static inline int
+shardcache_test_actual_ownership(shardcache_t *cache,
+                                 void *key,
+                                 size_t klen,
+                                 char *owner,
+                                 size_t *len)
+{
+    return shardcache_test_ownership_internal(cache, key, klen, owner, len, 2);
+}
+
 int
 shardcache_test_ownership(shardcache_t *cache,
                           void *key,
@@ -144,12 +165,11 @@ typedef struct {
 } shardcache_key_t;
 
 typedef struct {
-    shardcache_t *cache;
-    shardcache_key_t item;
-    int is_volatile;
-} expire_key_ctx_t;
-
-typedef shardcache_key_t shardcache_evictor_job_t;
+    void *key;
+    size_t klen;
+    int push; // if true the actual value is pushed to the peers
+              // instead of asking them to evict it
+} shardcache_evictor_job_t;
 
 static void
 destroy_evictor_job(shardcache_evictor_job_t *job)
@@ -159,12 +179,13 @@ destroy_evictor_job(shardcache_evictor_job_t *job)
 }
 
 static
-shardcache_evictor_job_t *create_evictor_job(void *key, size_t klen)
+shardcache_evictor_job_t *create_evictor_job(void *key, size_t klen, int push)
 {
     shardcache_evictor_job_t *job = malloc(sizeof(shardcache_evictor_job_t)); 
     job->key = malloc(klen);
     memcpy(job->key, key, klen);
     job->klen = klen; 
+    job->push = push;
     return job;
 }
 
@@ -179,15 +200,175 @@ evict_key(hashtable_t *table, void *value, size_t vlen, void *user)
     return -2;
 }
 
+static int shardcache_queue_refresh(shardcache_t *cache, void *key, size_t klen);
+
+// Mark the object as stale and queue the (single) background refresh
+// which will load the new value
+// Returns 1 if the object has been marked as stale, 0 if it was already stale
+// NOTE: must be called holding the object lock
+static inline int
+shardcache_cobj_set_stale(shardcache_t *cache, cached_object_t *obj)
+{
+    if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_STALE))
+        return 0;
+    COBJ_SET_FLAG(obj, COBJ_FLAG_STALE);
+    shardcache_queue_refresh(cache, obj->key, obj->klen);
+    return 1;
+}
+
+// NOTE: the ttl the object has been loaded with (if any)
+//       takes precedence over the global expire time.
+//       Objects expired for less than stale_grace_time seconds
+//       are not considered expired, they are marked as stale instead
+//       (and will be served while being refreshed)
+// NOTE: must be called holding the object lock
+static inline int
+shardcache_cobj_is_expired(shardcache_t *cache, cached_object_t *obj)
+{
+    time_t ttl = obj->ttl ? obj->ttl : ATOMIC_READ(cache->expire_time);
+    time_t now = time(NULL);
+    if (ttl <= 0 || obj->ts_sec + ttl >= now)
+        return 0;
+
+    int grace = ATOMIC_READ(cache->stale_grace_time);
+    if (grace > 0 && COBJ_HAS_DATA(obj) && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_TOMBSTONE) &&
+        obj->ts_sec + ttl + grace >= now)
+    {
+        shardcache_cobj_set_stale(cache, obj);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Like shardcache_cobj_is_expired() but without marking the object as stale,
+// objects within the grace period are not considered expired
+// NOTE: must be called holding the object lock
+static inline int
+shardcache_cobj_is_dead(shardcache_t *cache, cached_object_t *obj, time_t now)
+{
+    if (!COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE))
+        return 0;
+
+    time_t ttl = obj->ttl ? obj->ttl : ATOMIC_READ(cache->expire_time);
+    if (ttl <= 0)
+        return 0;
+
+    int grace = ATOMIC_READ(cache->stale_grace_time);
+    if (grace > 0 && COBJ_HAS_DATA(obj) && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_TOMBSTONE))
+        ttl += grace;
+
+    return (obj->ts_sec + ttl < now);
+}
+
+// NOTE: must be called holding the object lock
+static inline void
+shardcache_cobj_served(shardcache_t *cache, cached_object_t *obj)
+{
+    if (UNLIKELY(COBJ_CHECK_FLAGS(obj, COBJ_FLAG_STALE)))
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_STALE_SERVES].value);
+}
+
+// Pass the data held by the object to the callback, one piece at a time
+// (chunks which have been trimmed are fetched again). If a timestamp is
+// provided the last piece also carries the total size and the timestamp.
+// Returns 0 on success, -1 if the callback or a refetch failed
+// NOTE: must be called holding the object lock
+static int
+shardcache_cobj_send(shardcache_t *cache,
+                     cached_object_t *obj,
+                     void *key,
+                     size_t klen,
+                     shardcache_get_async_callback_t cb,
+                     struct timeval *ts,
+                     size_t *resident,
+                     void *priv)
+{
+    size_t total = ts ? obj->dlen : 0;
+    uint32_t num_pieces = cobj_num_pieces(obj);
+    if (!num_pieces)
+        return cb(key, klen, NULL, 0, total, ts, priv);
+
+    uint32_t i;
+    for (i = 0; i < num_pieces; i++) {
+        size_t len = 0;
+        void *piece = cobj_piece(cache, obj, i, &len, resident);
+        if (!piece)
+            return -1;
+        int last = (i == num_pieces - 1);
+        if (cb(key, klen, piece, len, last ? total : 0, last ? ts : NULL, priv) != 0)
+            return -1;
+    }
+    return 0;
+}
+
 static inline void
 shardcache_update_size_counters(shardcache_t *cache)
 {
+    size_t mru_size, mfu_size, mrug_size, mfug_size;
+    arc_get_size(cache->arc, &mru_size, &mfu_size, &mrug_size, &mfug_size);
+
+    arc_stats_t stats;
+    arc_get_stats(cache->arc, &stats);
+
+    // the namespaces are accounted in the global counters as well
+    int num_namespaces = ATOMIC_READ(cache->num_namespaces);
+    int i;
+    for (i = 0; i < num_namespaces; i++) {
+        shardcache_namespace_t *ns = &cache->namespaces[i];
+        size_t ns_mru_size, ns_mfu_size, ns_mrug_size, ns_mfug_size;
+        arc_get_size(ns->arc, &ns_mru_size, &ns_mfu_size, &ns_mrug_size, &ns_mfug_size);
+        ATOMIC_SET(ns->cache_size, ns_mru_size + ns_mfu_size);
+        mru_size += ns_mru_size;
+        mfu_size += ns_mfu_size;
+        mrug_size += ns_mrug_size;
+        mfug_size += ns_mfug_size;
+
+        arc_stats_t ns_stats;
+        arc_get_stats(ns->arc, &ns_stats);
+        stats.rb_drains += ns_stats.rb_drains;
+        stats.rb_drained += ns_stats.rb_drained;
+        stats.rb_full += ns_stats.rb_full;
+        stats.tinylfu_admitted += ns_stats.tinylfu_admitted;
+        stats.tinylfu_rejected += ns_stats.tinylfu_rejected;
+        stats.too_big += ns_stats.too_big;
+    }
+
+    ATOMIC_SET(cache->arc_lists_size[0], mru_size);
+    ATOMIC_SET(cache->arc_lists_size[1], mfu_size);
+    ATOMIC_SET(cache->arc_lists_size[2], mrug_size);
+    ATOMIC_SET(cache->arc_lists_size[3], mfug_size);
     ATOMIC_CAS(cache->cnt[SHARDCACHE_COUNTER_CACHE_SIZE].value,
                ATOMIC_READ(cache->cnt[SHARDCACHE_COUNTER_CACHE_SIZE].value),
-               ATOMIC_READ(*cache->arc_lists_size[0]) +
-               ATOMIC_READ(*cache->arc_lists_size[1]) +
-               ATOMIC_READ(*cache->arc_lists_size[2]) +
-               ATOMIC_READ(*cache->arc_lists_size[3]));
+               mru_size + mfu_size + mrug_size + mfug_size);
+
+    ATOMIC_SET(cache->arc_stats.rb_drains, stats.rb_drains);
+    ATOMIC_SET(cache->arc_stats.rb_drained, stats.rb_drained);
+    ATOMIC_SET(cache->arc_stats.rb_full, stats.rb_full);
+    ATOMIC_SET(cache->arc_stats.tinylfu_admitted, stats.tinylfu_admitted);
+    ATOMIC_SET(cache->arc_stats.tinylfu_rejected, stats.tinylfu_rejected);
+    ATOMIC_SET(cache->arc_stats.too_big, stats.too_big);
+
+    slab_stats_t slab_stats;
+    slab_get_stats(&slab_stats);
+    ATOMIC_SET(cache->slab_stats.allocated, slab_stats.allocated);
+    ATOMIC_SET(cache->slab_stats.used, slab_stats.used);
+    ATOMIC_SET(cache->slab_stats.requested, slab_stats.requested);
+    uint64_t fragmentation = (slab_stats.allocated && slab_stats.allocated > slab_stats.requested)
+                           ? ((slab_stats.allocated - slab_stats.requested) * 100) / slab_stats.allocated
+                           : 0;
+    ATOMIC_SET(cache->slab_fragmentation, fragmentation);
+
+    uint64_t timers = 0;
+    uint64_t expirations = 0;
+    if (cache->expirers) {
+        for (i = 0; i < cache->num_expirers; i++) {
+            timers += ATOMIC_READ(cache->expirers[i].num_timers);
+            expirations += ATOMIC_READ(cache->expirers[i].tick_expirations);
+        }
+    }
+    ATOMIC_SET(cache->expirer_timers, timers);
+    ATOMIC_SET(cache->expirer_tick_expirations, expirations);
 }
 
 
@@ -207,9 +388,21 @@ evictor(void *priv)
         // this will extract only the first value
         shardcache_evictor_job_t *job = NULL;
         ht_foreach_value(jobs, evict_key, &job);
+        void *value = NULL;
+        size_t vlen = 0;
+        if (job && job->push) {
+            // a hot key, send the actual value to all the peers
+            if (shardcache_get_sync(cache, job->key, job->klen, &value, &vlen, NULL) != 0 || !value) {
+                SHC_DEBUG2("Can't get the value to push for key '%.*s'", job->klen, job->key);
+                destroy_evictor_job(job);
+                job = NULL;
+            }
+        }
+
         if (job) {
 
-            SHC_DEBUG2("Eviction job for key '%.*s' started", job->klen, job->key);
+            SHC_DEBUG2("%s job for key '%.*s' started",
+                       job->push ? "Push" : "Eviction", job->klen, job->key);
 
             int i;
             for (i = 0; i < cache->num_shards; i++) {
@@ -255,18 +448,26 @@ evictor(void *priv)
                         break;
                     }
 
-                    int rc = evict_from_peer(addr, job->key, job->klen, fd, 0);
+                    int rc = job->push
+                           ? load_on_peer(addr, job->key, job->klen, value, vlen,
+                                          ATOMIC_READ(cache->hot_key_push_ttl), fd, 0)
+                           : evict_from_peer(addr, job->key, job->klen, fd, 0);
                     if (rc == 0) {
                         connections_pool_add(connections, addr, fd);
                     } else {
-                        SHC_WARNING("evict_from_peer return %d for peer %s", rc, peer);
+                        SHC_WARNING("%s return %d for peer %s",
+                                    job->push ? "load_on_peer" : "evict_from_peer", rc, peer);
                         close(fd);
                     }
                 }
             }
 
-            SHC_DEBUG2("Eviction job for key '%.*s' completed", job->klen, job->key);
+            SHC_DEBUG2("%s job for key '%.*s' completed",
+                       job->push ? "Push" : "Eviction", job->klen, job->key);
+            if (job->push)
+                ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_HOT_KEY_PUSHES].value);
             destroy_evictor_job(job);
+            free(value);
         }
 
         if (!ht_count(jobs)) {
@@ -296,125 +497,344 @@ destroy_volatile(volatile_object_t *obj)
     free(obj);
 }
 
+// Instead of removing an expired object right away, keep serving it
+// for stale_grace_time seconds while it's being refreshed in the background
+// Returns 1 if the object has been kept (as stale), 0 if it needs to be removed
+static int
+shardcache_expire_stale(shardcache_t *cache, void *key, size_t klen)
+{
+    int grace = ATOMIC_READ(cache->stale_grace_time);
+    if (grace <= 0)
+        return 0;
+
+    arc_t *arc = shardcache_arc_for_key(cache, key, klen);
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_nofetch(arc, (const void *)key, klen, &obj_ptr);
+    if (!res)
+        return 0;
+
+    int stale = 0;
+    if (obj_ptr) {
+        cached_object_t *obj = (cached_object_t *)obj_ptr;
+        COBJ_LOCK(cache, obj);
+        // objects already stale have been given their grace period
+        if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) && COBJ_HAS_DATA(obj) &&
+            !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_TOMBSTONE))
+        {
+            stale = shardcache_cobj_set_stale(cache, obj);
+        }
+        COBJ_UNLOCK(cache, obj);
+    }
+    arc_release_resource(arc, res);
+
+    // the object will be removed when the grace period ends, unless the
+    // refresh succeeds in the meanwhile (which will reschedule the expiration)
+    if (stale)
+        shardcache_schedule_expiration(cache, key, klen, grace, 0);
+
+    return stale;
+}
+
+// Fetch the new value for a stale object and load it in the cache
 static void
-shardcache_expire_key_cb(iomux_t *iomux, void *priv)
+shardcache_refresh_stale(shardcache_t *cache, void *key, size_t klen)
 {
-    expire_key_ctx_t *ctx = (expire_key_ctx_t *)priv;
-    void *ptr = NULL;
-    if (ctx->is_volatile) {
-        ht_delete(ctx->cache->volatile_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
+    arc_t *arc = shardcache_arc_for_key(cache, key, klen);
+    // the value is fetched bypassing the cache, so that the stale one can
+    // still be served while the fetch is in progress (and a key which
+    // doesn't exist anymore doesn't leave any tombstone behind)
+    void *data = NULL;
+    size_t dlen = 0;
+    int rc = arc_ops_fetch_value(cache, key, klen, &data, &dlen);
+
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_STALE_REFRESHES].value);
+
+    if (data) {
+        arc_load(arc, (const void *)key, klen, data, dlen, 0);
+        // replaces the timeout of the grace period
+        int expire = ATOMIC_READ(cache->expire_time);
+        if (expire > 0 && !ATOMIC_READ(cache->lazy_expiration))
+            shardcache_schedule_expiration(cache, key, klen, expire, 0);
+    } else if (rc == 0) {
+        // the key doesn't exist anymore
+        arc_remove(arc, (const void *)key, klen);
+    }
+    // NOTE: in case of errors the stale object is kept
+    //       until the end of the grace period
+
+    free(data);
+}
 
-        free(ptr);
-        ht_delete(ctx->cache->volatile_storage, ctx->item.key, ctx->item.klen, &ptr, NULL);
+// the expiration timer of a key, linked in the timing wheel of the expirer
+// responsible for the key and indexed by key in its timers table
+typedef struct {
+    timing_wheel_node_t node; // NOTE: must be the first member
+    int is_volatile;
+    size_t klen;
+    char key[];
+} shardcache_expire_entry_t;
+
+// the clock driving the timing wheels (one tick per second)
+static inline uint64_t
+shardcache_expirer_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static inline shardcache_expirer_t *
+shardcache_expirer_select(shardcache_t *cache, void *key, size_t klen)
+{
+    if (cache->num_expirers == 1)
+        return &cache->expirers[0];
+
+    uint32_t hash = (uint32_t)(sketch_hash(key, klen) >> 32);
+    return &cache->expirers[hash % cache->num_expirers];
+}
+
+static void
+shardcache_expire_entry(shardcache_t *cache, shardcache_expire_entry_t *entry)
+{
+    void *ptr = NULL;
+    if (entry->is_volatile) {
+        ht_delete(cache->volatile_storage, entry->key, entry->klen, &ptr, NULL);
         if (ptr) {
             volatile_object_t *prev = (volatile_object_t *)ptr;
-            ATOMIC_DECREASE(ctx->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
                             prev->dlen);
             destroy_volatile(prev);
         }
-    } else {
-        ht_delete(ctx->cache->cache_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
-        free(ptr);
+    } else if (shardcache_expire_stale(cache, entry->key, entry->klen)) {
+        return;
     }
-    ATOMIC_INCREMENT(ctx->cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
-    arc_remove(ctx->cache->arc, (const void *)ctx->item.key, ctx->item.klen);
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
+    arc_remove(shardcache_arc_for_key(cache, entry->key, entry->klen), (const void *)entry->key, entry->klen);
 }
 
 typedef struct {
-    int cmd;
-#define SHARDACHE_EXPIRE_SCHEDULE 1
-#define SHARDACHE_EXPIRE_UNSCHEDULE 2
-    void *key;
-    size_t klen;
-    time_t expire;
-    int is_volatile;
-} shardcache_expire_job_t;
+    shardcache_expirer_t *expirer;
+    shardcache_expire_entry_t *batch;
+} shardcache_expirer_collect_arg_t;
 
+// NOTE: called while advancing the wheel (holding the expirer lock),
+//       the expired entries are only collected and will be handled
+//       once the lock has been released
 static void
-shardcache_expire_context_destroy(expire_key_ctx_t *ctx)
+shardcache_expirer_collect(timing_wheel_node_t *node, void *priv)
+{
+    shardcache_expirer_collect_arg_t *arg = (shardcache_expirer_collect_arg_t *)priv;
+    shardcache_expire_entry_t *entry = (shardcache_expire_entry_t *)node;
+
+    void *ptr = NULL;
+    ht_delete(arg->expirer->timers[entry->is_volatile], entry->key, entry->klen, &ptr, NULL);
+
+    // the node is not linked in the wheel anymore,
+    // so it can be used to link the batch
+    entry->node.next = (timing_wheel_node_t *)arg->batch;
+    arg->batch = entry;
+}
+
+// Probe a bounded number of cached objects (out of the arc partitions handled
+// by the expirer) and drop the expired ones. As long as a significant fraction
+// of the sampled objects turns out to be expired another round is done right away.
+// Returns 1 if the cycle stopped because of the rounds limit (so there are
+// likely still many expired objects around), 0 otherwise
+static int
+shardcache_expire_sample(shardcache_t *cache, shardcache_expirer_t *expirer)
 {
-    free(ctx->item.key);
-    free(ctx);
+    arc_resource_t resources[SHARDCACHE_EXPIRE_SAMPLE_SIZE];
+    int num_partitions = arc_num_partitions(cache->arc); // the same for all the namespaces
+    int index = expirer - cache->expirers;
+    int rounds;
+
+    for (rounds = 0; rounds < SHARDCACHE_EXPIRE_SAMPLE_ROUNDS_MAX; rounds++) {
+        // the expirer handles the partitions index, index + num_expirers, ...
+        // which are sampled in turn
+        int partition = index + expirer->sample_partition * cache->num_expirers;
+        if (partition >= num_partitions) {
+            expirer->sample_partition = 0;
+            partition = index;
+            // all the partitions of the current arc have been sampled,
+            // move to the next one (the namespaces come after the shared cache)
+            expirer->sample_arc = (expirer->sample_arc + 1) % (ATOMIC_READ(cache->num_namespaces) + 1);
+        }
+        expirer->sample_partition++;
+
+        arc_t *arc = expirer->sample_arc ? cache->namespaces[expirer->sample_arc - 1].arc : cache->arc;
+        int num = arc_sample(arc, partition, resources, SHARDCACHE_EXPIRE_SAMPLE_SIZE);
+        time_t now = time(NULL);
+        int expired = 0;
+        int i;
+        for (i = 0; i < num; i++) {
+            cached_object_t *obj = (cached_object_t *)arc_get_resource_ptr(resources[i]);
+            int dead = 0;
+            if (obj) {
+                COBJ_LOCK(cache, obj);
+                dead = shardcache_cobj_is_dead(cache, obj, now);
+                COBJ_UNLOCK(cache, obj);
+            }
+            if (dead) {
+                arc_drop_resource(arc, resources[i]);
+                expired++;
+            } else {
+                arc_release_resource(arc, resources[i]);
+            }
+        }
+
+        ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_SAMPLED_KEYS].value, num);
+        if (expired) {
+            ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value, expired);
+            ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_SAMPLED_EXPIRES].value, expired);
+        }
+
+        if (expired * 100 <= num * SHARDCACHE_EXPIRE_SAMPLE_THRESHOLD)
+            return 0;
+    }
+
+    return 1;
 }
 
+static void shardcache_namespaces_rebalance(shardcache_t *cache);
+static void shardcache_hot_pushed_keys_prune(shardcache_t *cache);
+
 void *
 shardcache_expire_keys(void *priv)
 {
-    shardcache_t *cache = (shardcache_t *)priv;
+    shardcache_expirer_t *expirer = (shardcache_expirer_t *)priv;
+    shardcache_t *cache = expirer->cache;
+
     while (!ATOMIC_READ(cache->quit))
     {
-        shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
-        while (job) {
-            if (job->cmd == SHARDACHE_EXPIRE_UNSCHEDULE) {
-                void *ptr = NULL;
-                hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
-
-                ht_delete(table, job->key, job->klen, &ptr, NULL);
-                if (ptr) {
-                    iomux_timeout_id_t *tid = (iomux_timeout_id_t *)ptr;
-                    iomux_unschedule(cache->expirer_mux, *tid);
-                    free(tid);
-                } else {
-                    // TODO - Error messages ?
-                }
-                free(job->key);
-                free(job);
-                job = queue_pop_left(cache->expirer_queue);
-                continue;
-            }
+        shardcache_key_t *item = queue_pop_left(expirer->refresh_queue);
+        while (item) {
+            shardcache_refresh_stale(cache, item->key, item->klen);
+            free(item->key);
+            free(item);
+            item = queue_pop_left(expirer->refresh_queue);
+        }
 
-            expire_key_ctx_t *ctx = calloc(1, sizeof(expire_key_ctx_t));
-            ctx->item.key = job->key;
-            ctx->item.klen = job->klen;
-            ctx->cache = cache;
-            ctx->is_volatile = job->is_volatile;
-            hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
-            struct timeval timeout = { job->expire, (int)random()%(int)1e6 };
-            iomux_timeout_id_t *tid_ptr = NULL;
-            void *prev = NULL;
-            iomux_timeout_id_t tid = 0;
-            ht_delete(table, job->key, job->klen, &prev, NULL);
-
-            if (prev) {
-                tid_ptr = (iomux_timeout_id_t *)prev;
-                tid = iomux_reschedule(cache->expirer_mux,
-                                       *tid_ptr,
-                                       &timeout,
-                                       shardcache_expire_key_cb,
-                                       ctx,
-                                       (iomux_timeout_free_context_cb)shardcache_expire_context_destroy);
-                *tid_ptr = tid;
-            } else {
-                tid = iomux_schedule(cache->expirer_mux,
-                                     &timeout, shardcache_expire_key_cb,
-                                     ctx,
-                                     (iomux_timeout_free_context_cb)shardcache_expire_context_destroy);
-                tid_ptr = malloc(sizeof(iomux_timeout_id_t));
-                *tid_ptr = tid;
-            }
-            if (tid && tid_ptr) {
-                ht_set(table, job->key, job->klen, tid_ptr, sizeof(iomux_timeout_id_t));
-            } else {
-                free(tid_ptr);
-                shardcache_expire_context_destroy(ctx);
-                // TODO - Erro message
-            }
+        shardcache_expirer_collect_arg_t arg = {
+            .expirer = expirer,
+            .batch = NULL
+        };
 
-            free(job);
-            job = queue_pop_left(cache->expirer_queue);
+        MUTEX_LOCK(expirer->lock);
+        int expired = timing_wheel_advance(expirer->wheel,
+                                           shardcache_expirer_now(),
+                                           shardcache_expirer_collect,
+                                           &arg);
+        uint64_t num_timers = timing_wheel_count(expirer->wheel);
+        MUTEX_UNLOCK(expirer->lock);
+
+        shardcache_expire_entry_t *entry = arg.batch;
+        while (entry) {
+            shardcache_expire_entry_t *next = (shardcache_expire_entry_t *)entry->node.next;
+            shardcache_expire_entry(cache, entry);
+            free(entry);
+            entry = next;
         }
 
-        struct timeval tv = { 1, 0 };
-        iomux_run(cache->expirer_mux, &tv);
-        shardcache_update_size_counters(cache);
+        ATOMIC_SET(expirer->num_timers, num_timers);
+        ATOMIC_SET(expirer->tick_expirations, expired);
+
+        // in lazy expiration mode there are no timers for the cached objects,
+        // so the expired ones which are not accessed anymore are found by sampling
+        int busy = 0;
+        if (ATOMIC_READ(cache->lazy_expiration))
+            busy = shardcache_expire_sample(cache, expirer);
+
+        if (expirer == &cache->expirers[0]) {
+            shardcache_hot_pushed_keys_prune(cache);
+            shardcache_update_size_counters(cache);
+            shardcache_namespaces_rebalance(cache);
+            arc_reclaim(cache->arc);
+            int num_namespaces = ATOMIC_READ(cache->num_namespaces);
+            int i;
+            for (i = 0; i < num_namespaces; i++)
+                arc_reclaim(cache->namespaces[i].arc);
+        }
+
+        // wait for the next tick (or for the next sampling cycle
+        // if there are still many expired objects)
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        struct timespec abstime = { now.tv_sec + 1, now.tv_usec * 1000 };
+        if (busy) {
+            uint64_t nsec = now.tv_usec * 1000ULL + SHARDCACHE_EXPIRE_SAMPLE_BUSY_INTERVAL * 1000000ULL;
+            abstime.tv_sec = now.tv_sec + nsec / 1000000000ULL;
+            abstime.tv_nsec = nsec % 1000000000ULL;
+        }
+        MUTEX_LOCK(expirer->lock);
+        if (!ATOMIC_READ(cache->quit))
+            pthread_cond_timedwait(&expirer->cond, &expirer->lock, &abstime);
+        MUTEX_UNLOCK(expirer->lock);
     }
     return NULL;
 }
 
+void
+shardcache_free_deferred(shardcache_t *cache, void *data, size_t dlen)
+{
+    // buffers served by the slab allocator are cheap to release,
+    // the bigger ones (which come from malloc()) are released by the reclaimer
+    // thread, as long as its backlog doesn't grow too much
+    if (dlen <= SLAB_MAX_SIZE || !cache->reclaim_queue ||
+        ATOMIC_READ(cache->reclaim_pending) + dlen > SHARDCACHE_RECLAIM_BACKLOG_MAX)
+    {
+        slab_free(data, dlen);
+        return;
+    }
+
+    // the size is needed only for accounting, so it can be stored
+    // in the buffer itself (which is way bigger than a size_t)
+    *((size_t *)data) = dlen;
+    uint64_t pending = ATOMIC_INCREASE(cache->reclaim_pending, dlen);
+    if (queue_push_right(cache->reclaim_queue, data) != 0) {
+        ATOMIC_DECREASE(cache->reclaim_pending, dlen);
+        slab_free(data, dlen);
+        return;
+    }
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_DEFERRED_FREES].value);
+
+    // don't wait for the next round if the backlog is getting big
+    if (pending > SHARDCACHE_RECLAIM_BACKLOG_MAX / 2)
+        pthread_cond_signal(&cache->reclaimer_cond);
+}
+
+static void
+shardcache_reclaim(shardcache_t *cache)
+{
+    void *data = queue_pop_left(cache->reclaim_queue);
+    while (data) {
+        size_t dlen = *((size_t *)data);
+        slab_free(data, dlen);
+        ATOMIC_DECREASE(cache->reclaim_pending, dlen);
+        data = queue_pop_left(cache->reclaim_queue);
+    }
+}
+
+static void *
+shardcache_reclaimer(void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+
+    while (!ATOMIC_READ(cache->quit)) {
+        shardcache_reclaim(cache);
+
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        uint64_t nsec = now.tv_usec * 1000ULL + SHARDCACHE_RECLAIM_INTERVAL * 1000000ULL;
+        struct timespec abstime = { now.tv_sec + nsec / 1000000000ULL, nsec % 1000000000ULL };
+        MUTEX_LOCK(cache->reclaimer_lock);
+        if (!ATOMIC_READ(cache->quit))
+            pthread_cond_timedwait(&cache->reclaimer_cond, &cache->reclaimer_lock, &abstime);
+        MUTEX_UNLOCK(cache->reclaimer_lock);
+    }
+
+    return NULL;
+}
+
 void
 shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk)
 {
@@ -465,7 +885,8 @@ shardcache_create(char *me,
                   shardcache_storage_t *st,
                   int num_workers,
                   int num_async,
-                  size_t cache_size)
+                  size_t cache_size,
+                  int arc_partitions)
 {
     int i, n;
     size_t shard_lens[nnodes];
@@ -473,11 +894,20 @@ shardcache_create(char *me,
 
     shardcache_t *cache = calloc(1, sizeof(shardcache_t));
 
+    for (i = 0; i < SHARDCACHE_COBJ_LOCKS; i++) {
+        MUTEX_INIT_RECURSIVE(cache->cobj_locks[i]);
+        CONDITION_INIT(cache->cobj_conds[i]);
+    }
+
     cache->evict_on_delete = 1;
     cache->use_persistent_connections = 1;
     cache->tcp_timeout = SHARDCACHE_TCP_TIMEOUT_DEFAULT;
+    cache->fetch_wait_timeout = SHARDCACHE_FETCH_WAIT_TIMEOUT_DEFAULT;
+    cache->resize_batch = SHARDCACHE_RESIZE_BATCH_DEFAULT;
     cache->expire_time = SHARDCACHE_EXPIRE_TIME_DEFAULT;
     cache->serving_look_ahead = SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT;
+    cache->workers_balancing = SHARDCACHE_WORKERS_BALANCING_DEFAULT;
+    cache->io_backend = ATOMIC_READ(shardcache_io_backend);
     cache->iomux_run_timeout_low = SHARDCACHE_IOMUX_RUN_TIMEOUT_LOW;
     cache->iomux_run_timeout_high = SHARDCACHE_IOMUX_RUN_TIMEOUT_HIGH;
     if (num_async > 0)
@@ -487,7 +917,20 @@ shardcache_create(char *me,
     else
         cache->num_async = SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT;
 
+    if (arc_partitions > 0)
+        cache->arc_partitions = arc_partitions;
+    else if (arc_partitions < 0)
+        cache->arc_partitions = num_workers > 1 ? num_workers : 1; // 1 arc partition for each worker
+    else
+        cache->arc_partitions = SHARDCACHE_ARC_PARTITIONS_DEFAULT;
+
     SPIN_INIT(cache->migration_lock);
+    MUTEX_INIT(cache->resize_lock);
+    MUTEX_INIT(cache->namespaces_lock);
+    MUTEX_INIT(cache->reclaimer_lock);
+    CONDITION_INIT(cache->reclaimer_cond);
+    MUTEX_INIT(cache->snapshot_lock);
+    CONDITION_INIT(cache->snapshot_cond);
 
     if (st) {
         if (st->version != SHARDCACHE_STORAGE_API_VERSION) {
@@ -508,8 +951,10 @@ shardcache_create(char *me,
 
     cache->ops.init    = arc_ops_init;
     cache->ops.fetch   = arc_ops_fetch;
+    cache->ops.fetch_multi = arc_ops_fetch_multi;
     cache->ops.evict   = arc_ops_evict;
     cache->ops.store   = arc_ops_store;
+    cache->ops.trim    = arc_ops_trim;
 
     cache->ops.priv = cache;
     cache->shards = malloc(sizeof(shardcache_node_t *) * nnodes);
@@ -557,9 +1002,26 @@ shardcache_create(char *me,
 
     // we need to tell the arc subsystem how big are the cached objects (well ... at least the container struct
     // which is attached to each cached object to encapsulate its actual data and extra flags/members
-    cache->arc = arc_create(&cache->ops, cache_size, sizeof(cached_object_t), cache->arc_lists_size, cache->arc_mode);
+    cache->arc = arc_create(&cache->ops, cache_size, sizeof(cached_object_t), cache->arc_partitions, cache->arc_mode);
+    if (!cache->arc) {
+        SHC_ERROR("Can't create the arc cache");
+        shardcache_destroy(cache);
+        return NULL;
+    }
+    arc_set_balance_batch(cache->arc, cache->resize_batch);
     cache->arc_size = cache_size;
 
+    cache->remote_caching_threshold = SHARDCACHE_REMOTE_CACHING_THRESHOLD_DEFAULT;
+    cache->remote_hotkeys = hotkeys_create(SHARDCACHE_REMOTE_HOTKEYS_WIDTH, SHARDCACHE_HOT_REMOTE_KEYS_MAX);
+    cache->hot_key_push_ttl = SHARDCACHE_HOT_KEY_PUSH_TTL_DEFAULT;
+    cache->owned_hotkeys = hotkeys_create(SHARDCACHE_REMOTE_HOTKEYS_WIDTH, 0);
+    cache->hot_pushed_keys = ht_create(128, 1<<16, free);
+    if (!cache->remote_hotkeys || !cache->owned_hotkeys || !cache->hot_pushed_keys) {
+        SHC_ERROR("Can't create the hot keys detector");
+        shardcache_destroy(cache);
+        return NULL;
+    }
+
     // check if there is already signal handler registered on SIGPIPE
     struct sigaction sa;
     if (sigaction(SIGPIPE, NULL, &sa) != 0) {
@@ -581,10 +1043,24 @@ shardcache_create(char *me,
         shardcache_counter_add(cache->counters, cache->cnt[i].name, &cache->cnt[i].value); 
     }
 
-    shardcache_counter_add(cache->counters, "mru_size", (uint64_t *)cache->arc_lists_size[0]);
-    shardcache_counter_add(cache->counters, "mfu_size", (uint64_t *)cache->arc_lists_size[1]);
-    shardcache_counter_add(cache->counters, "mrug_size", (uint64_t *)cache->arc_lists_size[2]);
-    shardcache_counter_add(cache->counters, "mfug_size", (uint64_t *)cache->arc_lists_size[3]);
+    shardcache_counter_add(cache->counters, "mru_size", &cache->arc_lists_size[0]);
+    shardcache_counter_add(cache->counters, "mfu_size", &cache->arc_lists_size[1]);
+    shardcache_counter_add(cache->counters, "mrug_size", &cache->arc_lists_size[2]);
+    shardcache_counter_add(cache->counters, "mfug_size", &cache->arc_lists_size[3]);
+    shardcache_counter_add(cache->counters, "arc_rb_drains", &cache->arc_stats.rb_drains);
+    shardcache_counter_add(cache->counters, "arc_rb_drained", &cache->arc_stats.rb_drained);
+    shardcache_counter_add(cache->counters, "arc_rb_full", &cache->arc_stats.rb_full);
+    shardcache_counter_add(cache->counters, "arc_tinylfu_admits", &cache->arc_stats.tinylfu_admitted);
+    shardcache_counter_add(cache->counters, "arc_tinylfu_rejects", &cache->arc_stats.tinylfu_rejected);
+    shardcache_counter_add(cache->counters, "arc_too_big", &cache->arc_stats.too_big);
+    shardcache_counter_add(cache->counters, "slab_allocated", &cache->slab_stats.allocated);
+    shardcache_counter_add(cache->counters, "slab_used", &cache->slab_stats.used);
+    shardcache_counter_add(cache->counters, "slab_requested", &cache->slab_stats.requested);
+    shardcache_counter_add(cache->counters, "slab_fragmentation", &cache->slab_fragmentation);
+    shardcache_counter_add(cache->counters, "expirer_timers", &cache->expirer_timers);
+    shardcache_counter_add(cache->counters, "expirer_tick_expirations", &cache->expirer_tick_expirations);
+    shardcache_counter_add(cache->counters, "resize_in_progress", &cache->resizing);
+    shardcache_counter_add(cache->counters, "deferred_free_bytes", &cache->reclaim_pending);
 
     if (ATOMIC_READ(cache->evict_on_delete)) {
         MUTEX_INIT(cache->evictor_lock);
@@ -624,11 +1100,48 @@ shardcache_create(char *me,
     if (!shardcache_log_initialized)
         shardcache_log_init("libshardcache", LOG_WARNING);
 
-    cache->cache_timeouts = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)free);
-    cache->volatile_timeouts = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)free);
-    cache->expirer_mux = iomux_create(0, 1);
-    cache->expirer_queue = queue_create();
-    pthread_create(&cache->expirer_th, NULL, shardcache_expire_keys, cache);
+    cache->reclaim_queue = queue_create();
+    if (!cache->reclaim_queue ||
+        pthread_create(&cache->reclaimer_th, NULL, shardcache_reclaimer, cache) != 0)
+    {
+        SHC_ERROR("Can't create the reclaimer thread");
+        if (cache->reclaim_queue) {
+            queue_destroy(cache->reclaim_queue);
+            cache->reclaim_queue = NULL;
+        }
+        shardcache_destroy(cache);
+        return NULL;
+    }
+
+    // one expirer for each arc partition (up to SHARDCACHE_EXPIRERS_MAX)
+    cache->num_expirers = cache->arc_partitions < SHARDCACHE_EXPIRERS_MAX
+                        ? cache->arc_partitions
+                        : SHARDCACHE_EXPIRERS_MAX;
+    cache->expirers = calloc(cache->num_expirers, sizeof(shardcache_expirer_t));
+    if (!cache->expirers) {
+        SHC_ERROR("Can't create the expirers");
+        shardcache_destroy(cache);
+        return NULL;
+    }
+    uint64_t now = shardcache_expirer_now();
+    size_t timers_size = (1<<16) / cache->num_expirers;
+    for (i = 0; i < cache->num_expirers; i++) {
+        shardcache_expirer_t *expirer = &cache->expirers[i];
+        expirer->cache = cache;
+        MUTEX_INIT(expirer->lock);
+        CONDITION_INIT(expirer->cond);
+        expirer->wheel = timing_wheel_create(now);
+        expirer->timers[0] = ht_create(timers_size, 1<<20, (ht_free_item_callback_t)free);
+        expirer->timers[1] = ht_create(timers_size, 1<<20, (ht_free_item_callback_t)free);
+        expirer->refresh_queue = queue_create();
+        if (!expirer->wheel || !expirer->timers[0] || !expirer->timers[1] || !expirer->refresh_queue ||
+            pthread_create(&expirer->th, NULL, shardcache_expire_keys, expirer) != 0)
+        {
+            SHC_ERROR("Can't create the expirers");
+            shardcache_destroy(cache);
+            return NULL;
+        }
+    }
 
     // start the replica subsystem now
     // NOTE: this needs to happen after the cache has been fully initialized
@@ -711,10 +1224,41 @@ shardcache_destroy(shardcache_t *cache)
     SPIN_UNLOCK(cache->migration_lock);
     SPIN_DESTROY(cache->migration_lock);
 
-    if (cache->expirer_th) {
-        SHC_DEBUG2("Stopping expirer thread");
-        pthread_join(cache->expirer_th, NULL);
-        SHC_DEBUG2("Expirer thread stopped");
+    if (cache->expirers) {
+        SHC_DEBUG2("Stopping expirer threads");
+        for (i = 0; i < cache->num_expirers; i++) {
+            shardcache_expirer_t *expirer = &cache->expirers[i];
+            if (!expirer->th)
+                continue;
+            MUTEX_LOCK(expirer->lock);
+            pthread_cond_signal(&expirer->cond);
+            MUTEX_UNLOCK(expirer->lock);
+            pthread_join(expirer->th, NULL);
+        }
+        SHC_DEBUG2("Expirer threads stopped");
+    }
+
+    // NOTE: the first expirer might start the resize thread
+    //       (when rebalancing the namespaces), so it's stopped afterwards
+    MUTEX_LOCK(cache->resize_lock);
+    if (cache->resize_th_started) {
+        SHC_DEBUG2("Stopping the resize thread");
+        pthread_join(cache->resize_th, NULL);
+        cache->resize_th_started = 0;
+    }
+    MUTEX_UNLOCK(cache->resize_lock);
+    MUTEX_DESTROY(cache->resize_lock);
+
+    // NOTE: the cache is not going to change anymore
+    shardcache_snapshot_stop(cache);
+    MUTEX_DESTROY(cache->snapshot_lock);
+    CONDITION_DESTROY(cache->snapshot_cond);
+
+    if (cache->reclaim_queue) {
+        MUTEX_LOCK(cache->reclaimer_lock);
+        pthread_cond_signal(&cache->reclaimer_cond);
+        MUTEX_UNLOCK(cache->reclaimer_lock);
+        pthread_join(cache->reclaimer_th, NULL);
     }
 
     if (cache->replica)
@@ -728,6 +1272,25 @@ shardcache_destroy(shardcache_t *cache)
         shardcache_counter_remove(cache->counters, "mfu_size");
         shardcache_counter_remove(cache->counters, "mrug_size");
         shardcache_counter_remove(cache->counters, "mfug_size");
+        shardcache_counter_remove(cache->counters, "arc_rb_drains");
+        shardcache_counter_remove(cache->counters, "arc_rb_drained");
+        shardcache_counter_remove(cache->counters, "arc_rb_full");
+        shardcache_counter_remove(cache->counters, "arc_tinylfu_admits");
+        shardcache_counter_remove(cache->counters, "arc_tinylfu_rejects");
+        shardcache_counter_remove(cache->counters, "arc_too_big");
+        shardcache_counter_remove(cache->counters, "slab_allocated");
+        shardcache_counter_remove(cache->counters, "slab_used");
+        shardcache_counter_remove(cache->counters, "slab_requested");
+        shardcache_counter_remove(cache->counters, "slab_fragmentation");
+        shardcache_counter_remove(cache->counters, "expirer_timers");
+        shardcache_counter_remove(cache->counters, "expirer_tick_expirations");
+        shardcache_counter_remove(cache->counters, "resize_in_progress");
+        shardcache_counter_remove(cache->counters, "deferred_free_bytes");
+        for (i = 0; i < cache->num_namespaces; i++) {
+            int n;
+            for (n = 0; n < SHARDCACHE_NAMESPACE_COUNTERS; n++)
+                shardcache_counter_remove(cache->counters, cache->namespaces[i].labels[n]);
+        }
         shardcache_release_counters(cache->counters);
     }
 
@@ -737,28 +1300,69 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->arc)
         arc_destroy(cache->arc);
 
+    for (i = 0; i < cache->num_namespaces; i++) {
+        arc_destroy(cache->namespaces[i].arc);
+        free(cache->namespaces[i].prefix);
+    }
+    MUTEX_DESTROY(cache->namespaces_lock);
+
+    // NOTE: the reclaimer thread has been already stopped,
+    //       the buffers of the objects released by arc_destroy()
+    //       (and whatever was still pending) are released here
+    if (cache->reclaim_queue) {
+        shardcache_reclaim(cache);
+        queue_destroy(cache->reclaim_queue);
+    }
+    MUTEX_DESTROY(cache->reclaimer_lock);
+    CONDITION_DESTROY(cache->reclaimer_cond);
+
+    for (i = 0; i < SHARDCACHE_COBJ_LOCKS; i++) {
+        MUTEX_DESTROY(cache->cobj_locks[i]);
+        CONDITION_DESTROY(cache->cobj_conds[i]);
+    }
+
+    if (cache->remote_hotkeys)
+        hotkeys_destroy(cache->remote_hotkeys);
+
+    if (cache->owned_hotkeys)
+        hotkeys_destroy(cache->owned_hotkeys);
+
+    if (cache->hot_pushed_keys)
+        ht_destroy(cache->hot_pushed_keys);
+
     if (cache->chash)
         chash_free(cache->chash);
 
-    if (cache->expirer_mux)
-        iomux_destroy(cache->expirer_mux);
-
-    if (cache->expirer_queue) {
-        shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
-        while(job) {
-            free(job->key);
-            free(job);
-            job = queue_pop_left(cache->expirer_queue);
+    // NOTE: the expirers need to be destroyed after the arc
+    //       since evicting objects unschedules their expiration
+    if (cache->expirers) {
+        for (i = 0; i < cache->num_expirers; i++) {
+            shardcache_expirer_t *expirer = &cache->expirers[i];
+            if (!expirer->cache) // not initialized
+                continue;
+            if (expirer->refresh_queue) {
+                shardcache_key_t *item = queue_pop_left(expirer->refresh_queue);
+                while (item) {
+                    free(item->key);
+                    free(item);
+                    item = queue_pop_left(expirer->refresh_queue);
+                }
+                queue_destroy(expirer->refresh_queue);
+            }
+            // NOTE: the entries still linked in the wheel are
+            //       released by the timers tables
+            if (expirer->timers[0])
+                ht_destroy(expirer->timers[0]);
+            if (expirer->timers[1])
+                ht_destroy(expirer->timers[1]);
+            if (expirer->wheel)
+                timing_wheel_destroy(expirer->wheel);
+            MUTEX_DESTROY(expirer->lock);
+            CONDITION_DESTROY(expirer->cond);
         }
-        queue_destroy(cache->expirer_queue);
+        free(cache->expirers);
     }
 
-    if (cache->cache_timeouts)
-        ht_destroy(cache->cache_timeouts);
-
-    if (cache->volatile_timeouts)
-        ht_destroy(cache->volatile_timeouts);
-
     free(cache->me);
 
     free(cache->addr);
@@ -777,12 +1381,228 @@ void
 shardcache_clear(shardcache_t *cache)
 {
     arc_clear(cache->arc);
+    int num_namespaces = ATOMIC_READ(cache->num_namespaces);
+    int i;
+    for (i = 0; i < num_namespaces; i++)
+        arc_clear(cache->namespaces[i].arc);
+}
+
+// Evict (a batch of) the objects exceeding the size of the shared
+// cache and of the namespaces. Returns 1 if there are still objects
+// in excess, 0 otherwise
+static int
+shardcache_shrink(shardcache_t *cache, uint64_t *evicted)
+{
+    int pending = arc_shrink(cache->arc, evicted);
+    int num_namespaces = ATOMIC_READ(cache->num_namespaces);
+    int i;
+    for (i = 0; i < num_namespaces; i++)
+        pending |= arc_shrink(cache->namespaces[i].arc, evicted);
+    return pending;
+}
+
+static void *
+shardcache_resize(void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+
+    while (!ATOMIC_READ(cache->quit)) {
+        uint64_t evicted = 0;
+        int pending = shardcache_shrink(cache, &evicted);
+        if (evicted)
+            ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_RESIZE_EVICTIONS].value, evicted);
+
+        if (!pending) {
+            // check again holding the lock, the size might have been
+            // changed again before shardcache_set_size() found us running
+            MUTEX_LOCK(cache->resize_lock);
+            pending = shardcache_shrink(cache, &evicted);
+            if (!pending) {
+                ATOMIC_SET(cache->resizing, 0);
+                MUTEX_UNLOCK(cache->resize_lock);
+                break;
+            }
+            MUTEX_UNLOCK(cache->resize_lock);
+        }
+
+        // let the workers get the partition locks between the batches
+        sched_yield();
+    }
+
+    SHC_DEBUG2("Resize completed");
+    return NULL;
+}
+
+// the objects in excess (if any) are evicted in background
+static void
+shardcache_start_resize(shardcache_t *cache)
+{
+    MUTEX_LOCK(cache->resize_lock);
+    if (!ATOMIC_READ(cache->resizing) && !ATOMIC_READ(cache->quit)) {
+        if (cache->resize_th_started)
+            pthread_join(cache->resize_th, NULL);
+        ATOMIC_SET(cache->resizing, 1);
+        if (pthread_create(&cache->resize_th, NULL, shardcache_resize, cache) != 0) {
+            SHC_ERROR("Can't create the resize thread");
+            ATOMIC_SET(cache->resizing, 0);
+            cache->resize_th_started = 0;
+        } else {
+            cache->resize_th_started = 1;
+        }
+    }
+    MUTEX_UNLOCK(cache->resize_lock);
 }
 
 void
 shardcache_set_size(shardcache_t *cache, size_t new_size)
 {
-    arc_set_size(cache->arc, new_size);
+    // the quotas of the namespaces are carved out of the total size
+    MUTEX_LOCK(cache->namespaces_lock);
+    if (new_size <= cache->namespaces_quota) {
+        SHC_ERROR("Can't set the cache size to %lu, the namespaces already reserve %lu bytes",
+                  (unsigned long)new_size, (unsigned long)cache->namespaces_quota);
+        MUTEX_UNLOCK(cache->namespaces_lock);
+        return;
+    }
+    ATOMIC_SET(cache->arc_size, new_size);
+    arc_set_size(cache->arc, new_size - cache->namespaces_quota);
+    MUTEX_UNLOCK(cache->namespaces_lock);
+
+    shardcache_start_resize(cache);
+}
+
+int
+shardcache_add_namespace(shardcache_t *cache,
+                         const char *name,
+                         const char *prefix,
+                         size_t quota,
+                         int borrow)
+{
+    static const char *suffixes[SHARDCACHE_NAMESPACE_COUNTERS] =
+        { "gets", "cache_misses", "cache_size", "cache_limit", "borrowed" };
+
+    if (!name || !*name || strlen(name) > SHARDCACHE_NAMESPACE_NAME_MAX ||
+        !prefix || !*prefix || !quota)
+    {
+        return -1;
+    }
+
+    MUTEX_LOCK(cache->namespaces_lock);
+
+    int num_namespaces = ATOMIC_READ(cache->num_namespaces);
+    if (num_namespaces >= SHARDCACHE_NAMESPACES_MAX) {
+        SHC_ERROR("Can't add namespace %s, too many namespaces", name);
+        MUTEX_UNLOCK(cache->namespaces_lock);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < num_namespaces; i++) {
+        if (strcmp(cache->namespaces[i].name, name) == 0 ||
+            strcmp(cache->namespaces[i].prefix, prefix) == 0)
+        {
+            SHC_ERROR("Can't add namespace %s, the name or the prefix is already in use", name);
+            MUTEX_UNLOCK(cache->namespaces_lock);
+            return -1;
+        }
+    }
+
+    size_t size = ATOMIC_READ(cache->arc_size);
+    if (cache->namespaces_quota + quota >= size) {
+        SHC_ERROR("Can't add namespace %s, the quota (%lu) doesn't fit in the cache (%lu bytes, %lu already reserved)",
+                  name, (unsigned long)quota, (unsigned long)size, (unsigned long)cache->namespaces_quota);
+        MUTEX_UNLOCK(cache->namespaces_lock);
+        return -1;
+    }
+
+    shardcache_namespace_t *ns = &cache->namespaces[num_namespaces];
+    memset(ns, 0, sizeof(shardcache_namespace_t));
+    ns->arc = arc_create(&cache->ops, quota, sizeof(cached_object_t),
+                         cache->arc_partitions, ATOMIC_READ(cache->arc_mode));
+    if (!ns->arc) {
+        SHC_ERROR("Can't create the arc cache for namespace %s", name);
+        MUTEX_UNLOCK(cache->namespaces_lock);
+        return -1;
+    }
+    arc_set_balance_batch(ns->arc, ATOMIC_READ(cache->resize_batch));
+    if (ATOMIC_READ(cache->epoch_reclamation))
+        arc_set_reclamation(ns->arc, ARC_RECLAMATION_EPOCH);
+
+    snprintf(ns->name, sizeof(ns->name), "%s", name);
+    ns->prefix = strdup(prefix);
+    ns->plen = strlen(prefix);
+    ns->quota = quota;
+    ns->borrow = borrow;
+    ns->cache_limit = quota;
+
+    uint64_t *values[SHARDCACHE_NAMESPACE_COUNTERS] =
+        { &ns->gets, &ns->cache_misses, &ns->cache_size, &ns->cache_limit, &ns->borrowed };
+    for (i = 0; i < SHARDCACHE_NAMESPACE_COUNTERS; i++) {
+        snprintf(ns->labels[i], sizeof(ns->labels[i]), "%s_%s", name, suffixes[i]);
+        shardcache_counter_add(cache->counters, ns->labels[i], values[i]);
+    }
+
+    cache->namespaces_quota += quota;
+    arc_set_size(cache->arc, size - cache->namespaces_quota);
+
+    // from now on the keys matching the prefix are routed to the namespace
+    ATOMIC_INCREMENT(cache->num_namespaces);
+
+    MUTEX_UNLOCK(cache->namespaces_lock);
+
+    SHC_NOTICE("Added namespace %s (prefix: %s, quota: %lu bytes%s)",
+               name, prefix, (unsigned long)quota, borrow ? ", borrowing" : "");
+
+    // the shared cache has been shrunk
+    shardcache_start_resize(cache);
+    return 0;
+}
+
+// Let the namespaces allowed to borrow grow beyond their quota using (half of)
+// the capacity left idle by the other namespaces. The borrowed capacity is
+// recomputed at each tick, so it's given back as soon as the lenders need it
+// (the objects in excess are evicted by the resize thread)
+static void
+shardcache_namespaces_rebalance(shardcache_t *cache)
+{
+    int num_namespaces = ATOMIC_READ(cache->num_namespaces);
+    if (num_namespaces < 2)
+        return;
+
+    // a namespace is considered full when using at least 90% of its quota
+    // (the arc never reaches exactly its size), the ones below that threshold
+    // lend what they are not using
+    size_t idle = 0;
+    int num_borrowers = 0;
+    int i;
+    for (i = 0; i < num_namespaces; i++) {
+        shardcache_namespace_t *ns = &cache->namespaces[i];
+        size_t used = ATOMIC_READ(ns->cache_size);
+        if (used < ns->quota - ns->quota / 10)
+            idle += ns->quota - used;
+        else if (ns->borrow)
+            num_borrowers++;
+    }
+
+    size_t share = num_borrowers ? (idle / 2) / num_borrowers : 0;
+    int shrunk = 0;
+    for (i = 0; i < num_namespaces; i++) {
+        shardcache_namespace_t *ns = &cache->namespaces[i];
+        size_t borrowed = 0;
+        if (ns->borrow && ATOMIC_READ(ns->cache_size) >= ns->quota - ns->quota / 10)
+            borrowed = share;
+        size_t old_borrowed = ATOMIC_READ(ns->borrowed);
+        if (borrowed == old_borrowed)
+            continue;
+        arc_set_size(ns->arc, ns->quota + borrowed);
+        ATOMIC_SET(ns->borrowed, borrowed);
+        ATOMIC_SET(ns->cache_limit, ns->quota + borrowed);
+        if (borrowed < old_borrowed)
+            shrunk = 1;
+    }
+
+    if (shrunk)
+        shardcache_start_resize(cache);
 }
 
 int
@@ -791,6 +1611,12 @@ shardcache_set_workers_num(shardcache_t *cache, unsigned int num_workers)
     return configure_serving_workers(cache->serv, num_workers);
 }
 
+int
+shardcache_set_listeners_reuseport(shardcache_t *cache, int enabled)
+{
+    return configure_serving_reuseport(cache->serv, enabled);
+}
+
 typedef struct {
     int stat;
     size_t dlen;
@@ -798,6 +1624,7 @@ typedef struct {
     size_t len;
     size_t sent;
     shardcache_t *cache;
+    arc_t *arc; // the arc instance the resource has been retrieved from
     arc_resource_t res;
     shardcache_get_async_callback_t cb;
     void *priv;
@@ -814,7 +1641,7 @@ shardcache_get_async_helper(void *key,
 {
     shardcache_get_async_helper_arg_t *arg = (shardcache_get_async_helper_arg_t *)priv;
 
-    arc_t *arc = arg->cache->arc;
+    arc_t *arc = arg->arc;
 
     if (ATOMIC_READ(arg->cache->async_quit)) {
         arc_release_resource(arc, arg->res);
@@ -860,6 +1687,63 @@ shardcache_get_async_helper(void *key,
     return 0;
 }
 
+// Read the requested range of a key which is not in the cache straight from
+// the storage (without loading the value into the cache).
+// Returns 0 if the range has been served, 1 if the request needs to go through
+// the cache (the key is cached, not owned by us or not found in the storage)
+// or -1 if the callback failed
+static int
+shardcache_get_offset_uncached(shardcache_t *cache,
+                               arc_t *arc,
+                               void *key,
+                               size_t klen,
+                               size_t offset,
+                               size_t length,
+                               shardcache_get_async_callback_t cb,
+                               void *priv)
+{
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_nofetch(arc, (const void *)key, klen, &obj_ptr);
+    if (res) {
+        arc_release_resource(arc, res);
+        return 1;
+    }
+
+    if (!cache->storage.global) {
+        char node_name[1024];
+        size_t node_len = sizeof(node_name);
+        if (!shardcache_test_ownership(cache, key, klen, node_name, &node_len))
+            return 1;
+    }
+
+    if (ht_exists(cache->volatile_storage, key, klen))
+        return 1;
+
+    void *data = NULL;
+    size_t dlen = 0;
+    size_t total = 0;
+    int rc = cache->storage.fetch_range(key, klen, offset, length, &data, &dlen, &total, cache->storage.priv);
+    if (rc != 0 || !total) {
+        // let the regular fetch deal with errors and missing keys
+        // (so that they are accounted and negatively cached as usual)
+        free(data);
+        return 1;
+    }
+
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_FETCH_LOCAL].value);
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_RANGE_FETCHES].value);
+
+    if (dlen > length)
+        dlen = length;
+
+    struct timeval ts;
+    gettimeofday(&ts, NULL);
+    rc = cb(key, klen, dlen ? data : NULL, dlen, total, &ts, priv);
+    free(data);
+    return rc == 0 ? 0 : -1;
+}
+
 int
 shardcache_get_offset(shardcache_t *cache,
                       void *key,
@@ -873,69 +1757,97 @@ shardcache_get_offset(shardcache_t *cache,
         return -1;
     }
 
-    if (offset == 0)
-        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+    shardcache_namespace_t *ns = shardcache_namespace_for_key(cache, key, klen);
+    arc_t *arc = ns ? ns->arc : cache->arc;
 
+    if (offset == 0) {
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+        if (ns)
+            ATOMIC_INCREMENT(ns->gets);
+    }
 
+    if (ATOMIC_READ(cache->range_fetch_bypass) &&
+        cache->use_persistent_storage && cache->storage.fetch_range)
+    {
+        int rc = shardcache_get_offset_uncached(cache, arc, key, klen, offset, length, cb, priv);
+        if (rc != 1)
+            return rc;
+    }
 
     void *obj_ptr = NULL;
-    arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
+    arc_resource_t res = arc_lookup(arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
     if (!res) {
         return -1;
     }
 
     if (!obj_ptr) {
-        arc_release_resource(cache->arc, res);
+        arc_release_resource(arc, res);
         return -1;
     }
 
     cached_object_t *obj = (cached_object_t *)obj_ptr;
-    MUTEX_LOCK(obj->lock);
+    COBJ_LOCK(cache, obj);
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED)) {
         // if marked for eviction we don't want to return this object
-        MUTEX_UNLOCK(obj->lock);
-        arc_release_resource(cache->arc, res);
+        COBJ_UNLOCK(cache, obj);
+        arc_release_resource(arc, res);
         // but we will try to fetch it again
         SHC_DEBUG("The retreived object has been already evicted, try fetching it again (offset)");
         return shardcache_get_offset(cache, key, klen, offset, length, cb, priv);
     } else if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE)) {
         size_t dlen = obj->dlen;
         void *data = NULL;
+        // keep counting the accesses to the hot remote items we are caching
+        if (offset == 0 && COBJ_CHECK_FLAGS(obj, COBJ_FLAG_REMOTE))
+            hotkeys_touch(cache->remote_hotkeys, key, klen);
         if (offset) {
             if (offset < dlen) {
                 dlen -= offset;
             } else {
-                cb(key, klen, NULL, 0, 0, &obj->ts, priv);
-                MUTEX_UNLOCK(obj->lock);
-                arc_release_resource(cache->arc, res);
+                struct timeval ts;
+                COBJ_GET_TIMESTAMP(obj, &ts);
+                cb(key, klen, NULL, 0, 0, &ts, priv);
+                COBJ_UNLOCK(cache, obj);
+                arc_release_resource(arc, res);
                 free(data);
                 return 0;
             }
         }
         if (dlen > length)
             dlen = length;
-        if (dlen && obj->data) {
-            data = malloc(dlen);
-            memcpy(data, obj->data + offset, dlen);
-        }
-
-        time_t obj_expiration = obj->ts.tv_sec + cache->expire_time;
 
-        if (UNLIKELY(cache->lazy_expiration && obj_expiration &&
-            cache->expire_time > 0 && obj_expiration < time(NULL)))
+        if (UNLIKELY(cache->lazy_expiration && shardcache_cobj_is_expired(cache, obj)))
         {
-            MUTEX_UNLOCK(obj->lock);
-            arc_drop_resource(cache->arc, res);
-            free(data);
+            COBJ_UNLOCK(cache, obj);
+            arc_drop_resource(arc, res);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
             return shardcache_get_offset(cache, key, klen, offset, length, cb, priv);
-        } else {
-            cb(key, klen, data, dlen, obj->dlen, &obj->ts, priv);
-            MUTEX_UNLOCK(obj->lock);
-            arc_release_resource(cache->arc, res);
-            free(data);
-            return 0;
         }
+
+        // only the chunks covering the requested range are read
+        // (and fetched again if they have been trimmed)
+        size_t resident = 0;
+        if (dlen && COBJ_HAS_DATA(obj)) {
+            data = malloc(dlen);
+            if (cobj_read(cache, obj, offset, data, dlen, &resident) != dlen) {
+                COBJ_UNLOCK(cache, obj);
+                arc_drop_resource(arc, res);
+                free(data);
+                SHC_ERROR("Can't read the requested range from the cached object");
+                return -1;
+            }
+        }
+
+        struct timeval ts;
+        COBJ_GET_TIMESTAMP(obj, &ts);
+        shardcache_cobj_served(cache, obj);
+        cb(key, klen, data, dlen, obj->dlen, &ts, priv);
+        COBJ_UNLOCK(cache, obj);
+        if (resident)
+            arc_update_resource_size(arc, res, resident);
+        arc_release_resource(arc, res);
+        free(data);
+        return 0;
     } else {
         if (obj->dlen) {
             // check if we have enough so far
@@ -947,9 +1859,13 @@ shardcache_get_offset(shardcache_t *cache,
                     dlen -= offset;
                 if (dlen > length)
                     dlen = length;
-                if (dlen && obj->data) {
+                if (dlen && COBJ_HAS_DATA(obj)) {
                     data = malloc(dlen);
-                    memcpy(data, obj->data + offset, dlen);
+                    if (cobj_read(cache, obj, offset, data, dlen, NULL) != dlen) {
+                        free(data);
+                        data = NULL;
+                        dlen = 0;
+                    }
                 }
                 cb(key, klen, data, dlen, obj->dlen, NULL, priv); // XXX - obj->dlen is not complete yet
                 if (data)
@@ -961,6 +1877,10 @@ shardcache_get_offset(shardcache_t *cache,
         arg->cb = cb;
         arg->priv = priv;
         arg->cache = cache;
+        // the resource is going to be released by the listener
+        // (possibly by another thread)
+        arc_retain_resource(arc, res);
+        arg->arc = arc;
         arg->res = res;
         arg->offset = offset;
         arg->len = length;
@@ -968,11 +1888,11 @@ shardcache_get_offset(shardcache_t *cache,
         shardcache_get_listener_t *listener = malloc(sizeof(shardcache_get_listener_t));
         listener->cb = shardcache_get_async_helper;
         listener->priv = arg;
-        list_push_value(obj->listeners, listener);
-        MUTEX_UNLOCK(obj->lock);
+        cobj_add_listener(obj, listener);
+        COBJ_UNLOCK(cache, obj);
     }
 
-    arc_release_resource(cache->arc, res);
+    arc_release_resource(arc, res);
     return 0;
 }
 
@@ -987,36 +1907,52 @@ shardcache_get_offset_sync(shardcache_t *cache,
 {
     size_t vlen = 0;
     size_t copied = 0;
+    size_t resident = 0;
     if (!key)
         return 0;
 
-    if (offset == 0)
+    shardcache_namespace_t *ns = shardcache_namespace_for_key(cache, key, klen);
+    arc_t *arc = ns ? ns->arc : cache->arc;
+
+    if (offset == 0) {
         ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+        if (ns)
+            ATOMIC_INCREMENT(ns->gets);
+    }
 
     void *obj_ptr = NULL;
-    arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 0, cache->expire_time);
+    arc_resource_t res = arc_lookup(arc, (const void *)key, klen, &obj_ptr, 0, cache->expire_time);
     if (!res)
         return 0;
 
     if (obj_ptr) {
         cached_object_t *obj = (cached_object_t *)obj_ptr;
-        MUTEX_LOCK(obj->lock);
-        if (obj->data) {
+        COBJ_LOCK(cache, obj);
+        // if someone else is fetching the value, wait for it
+        // instead of returning an incomplete (or empty) value
+        if (!COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+            COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING))
+        {
+            cobj_wait_fetch(cache, obj);
+        }
+        if (COBJ_HAS_DATA(obj)) {
             if (dlen && data) {
                 if (offset < obj->dlen) {
-                    int size = obj->dlen - offset;
-                    copied = size < *dlen ? size : *dlen;
-                    memcpy(data, obj->data + offset, copied);
+                    ssize_t rb = cobj_read(cache, obj, offset, data, *dlen, &resident);
+                    copied = rb > 0 ? rb : 0;
                     *dlen = copied;
                 }
             }
             if (timestamp)
-                memcpy(timestamp, &obj->ts, sizeof(struct timeval));
+                COBJ_GET_TIMESTAMP(obj, timestamp);
+            shardcache_cobj_served(cache, obj);
         }
         vlen = obj->dlen;
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(cache, obj);
+        if (resident)
+            arc_update_resource_size(arc, res, resident);
     }
-    arc_release_resource(cache->arc, res);
+    arc_release_resource(arc, res);
     return (offset < vlen + copied) ? (vlen - offset - copied) : 0;
 }
 
@@ -1030,15 +1966,20 @@ shardcache_get(shardcache_t *cache,
     if (!key)
         return -1;
 
+    shardcache_namespace_t *ns = shardcache_namespace_for_key(cache, key, klen);
+    arc_t *arc = ns ? ns->arc : cache->arc;
+
     ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+    if (ns)
+        ATOMIC_INCREMENT(ns->gets);
 
     SHC_DEBUG4("Getting value for key: %.*s", klen, key);
 
     void *obj_ptr = NULL;
-    arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
+    arc_resource_t res = arc_lookup(arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
     if ((!res || !obj_ptr) && cache->storage.fetch_local != NULL) {
         if (res) { // should never happen, maybe an assertion would make more sense
-            arc_release_resource(cache->arc, res);
+            arc_release_resource(arc, res);
             return -1;
         }
 
@@ -1064,24 +2005,24 @@ shardcache_get(shardcache_t *cache,
         }
     }
 
-    res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
+    res = arc_lookup(arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
     if (!res)
         return -1;
 
     if (!obj_ptr) {
-        arc_release_resource(cache->arc, res);
+        arc_release_resource(arc, res);
         return -1;
     }
 
     cached_object_t *obj = (cached_object_t *)obj_ptr;
-    MUTEX_LOCK(obj->lock);
+    COBJ_LOCK(cache, obj);
 
     uint32_t retry_timeout = 1<<7;
     while (UNLIKELY(COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED))) {
         // if marked for eviction we don't want to return this object
         // but we will try to fetch it again
-        MUTEX_UNLOCK(obj->lock);
-        arc_release_resource(cache->arc, res);
+        COBJ_UNLOCK(cache, obj);
+        arc_release_resource(arc, res);
 
         if (retry_timeout > 1<<11) {
             SHC_DEBUG("The retreived object has been already evicted, try fetching it again");
@@ -1093,54 +2034,139 @@ shardcache_get(shardcache_t *cache,
         retry_timeout <<= 1;
 
         obj_ptr = NULL;
-        res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
+        res = arc_lookup(arc, (const void *)key, klen, &obj_ptr, 1, cache->expire_time);
         if (!res)
             return -1;
 
         if (!obj_ptr) {
-            arc_release_resource(cache->arc, res);
+            arc_release_resource(arc, res);
             return -1;
         }
 
         obj = (cached_object_t *)obj_ptr;
-        MUTEX_LOCK(obj->lock);
+        COBJ_LOCK(cache, obj);
     }
 
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE)) {
-        time_t obj_expiration = obj->ts.tv_sec + cache->expire_time;
-        if (UNLIKELY(cache->lazy_expiration && obj_expiration &&
-                     cache->expire_time > 0 && obj_expiration < time(NULL)))
+        // keep counting the accesses to the hot remote items we are caching
+        if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_REMOTE))
+            hotkeys_touch(cache->remote_hotkeys, key, klen);
+
+        if (UNLIKELY(cache->lazy_expiration && shardcache_cobj_is_expired(cache, obj)))
         {
-            MUTEX_UNLOCK(obj->lock);
-            arc_drop_resource(cache->arc, res);
+            COBJ_UNLOCK(cache, obj);
+            arc_drop_resource(arc, res);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
             return shardcache_get(cache, key, klen, cb, priv);
 
         } else {
-            cb(key, klen, obj->data, obj->dlen, obj->dlen, &obj->ts, priv);
-            MUTEX_UNLOCK(obj->lock);
-            arc_release_resource(cache->arc, res);
+            struct timeval ts;
+            size_t resident = 0;
+            COBJ_GET_TIMESTAMP(obj, &ts);
+            shardcache_cobj_served(cache, obj);
+            int rc = shardcache_cobj_send(cache, obj, key, klen, cb, &ts, &resident, priv);
+            COBJ_UNLOCK(cache, obj);
+            if (resident)
+                arc_update_resource_size(arc, res, resident);
+            arc_release_resource(arc, res);
+            if (rc != 0)
+                return -1;
         }
     } else {
         if (obj->dlen) // let's send what we have so far
-            cb(key, klen, obj->data, obj->dlen, 0, NULL, priv);
+            shardcache_cobj_send(cache, obj, key, klen, cb, NULL, NULL, priv);
 
         shardcache_get_async_helper_arg_t *arg = calloc(1, sizeof(shardcache_get_async_helper_arg_t));
         arg->cb = cb;
         arg->priv = priv;
         arg->cache = cache;
+        // the resource is going to be released by the listener
+        // (possibly by another thread)
+        arc_retain_resource(arc, res);
+        arg->arc = arc;
         arg->res = res;
 
         shardcache_get_listener_t *listener = malloc(sizeof(shardcache_get_listener_t));
         listener->cb = shardcache_get_async_helper;
         listener->priv = arg;
-        list_push_value(obj->listeners, listener);
-        MUTEX_UNLOCK(obj->lock);
+        cobj_add_listener(obj, listener);
+        COBJ_UNLOCK(cache, obj);
+        arc_release_resource(arc, res);
     }
 
     return 0;
 }
 
+int
+shardcache_get_inplace(shardcache_t *cache,
+                       void *key,
+                       size_t klen,
+                       shardcache_get_inplace_callback_t cb,
+                       void *priv)
+{
+    if (!key)
+        return -1;
+
+    shardcache_namespace_t *ns = shardcache_namespace_for_key(cache, key, klen);
+    arc_t *arc = ns ? ns->arc : cache->arc;
+
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_nofetch(arc, (const void *)key, klen, &obj_ptr);
+    if (!res)
+        return 1;
+
+    if (!obj_ptr) {
+        arc_release_resource(arc, res);
+        return 1;
+    }
+
+    cached_object_t *obj = (cached_object_t *)obj_ptr;
+    COBJ_LOCK(cache, obj);
+
+    // anything but a complete value held in memory (being fetched, evicted,
+    // expired, not found or with chunks released by a trim) is left to shardcache_get()
+    uint32_t num_pieces = cobj_num_pieces(obj);
+    int usable = (num_pieces && obj->dlen &&
+                  COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+                  !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) &&
+                  !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING) &&
+                  !(cache->lazy_expiration && shardcache_cobj_is_expired(cache, obj)));
+
+    struct iovec *iov = usable ? malloc(sizeof(struct iovec) * num_pieces) : NULL;
+    uint32_t i;
+    for (i = 0; iov && i < num_pieces; i++) {
+        iov[i].iov_base = obj->chunks ? obj->chunks[i] : obj->data;
+        iov[i].iov_len = obj->chunks ? COBJ_CHUNK_LEN(obj, i) : obj->dlen;
+        if (!iov[i].iov_base) {
+            free(iov);
+            iov = NULL;
+        }
+    }
+
+    if (!iov) {
+        COBJ_UNLOCK(cache, obj);
+        arc_release_resource(arc, res);
+        return 1;
+    }
+
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+    if (ns)
+        ATOMIC_INCREMENT(ns->gets);
+
+    if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_REMOTE))
+        hotkeys_touch(cache->remote_hotkeys, key, klen);
+
+    shardcache_cobj_served(cache, obj);
+
+    int rc = cb(iov, num_pieces, obj->dlen, priv);
+
+    COBJ_UNLOCK(cache, obj);
+    arc_release_resource(arc, res);
+    free(iov);
+
+    return rc;
+}
+
 typedef struct {
     pthread_mutex_t lock;
     pthread_cond_t cond;
@@ -1279,6 +2305,80 @@ shardcache_head(shardcache_t *cache,
     return remainder + rlen;
 }
 
+// Look up the keys in the arc instances holding them
+// (the keys belonging to the same namespace are looked up at once)
+// (the arc each resource has been retrieved from is stored in the arcs array)
+static int
+shardcache_lookup_multi(shardcache_t *cache,
+                        void **keys,
+                        size_t *lens,
+                        arc_resource_t *resources,
+                        arc_t **arcs,
+                        int num_keys)
+{
+    int i;
+    int num_namespaces = ATOMIC_READ(cache->num_namespaces);
+    if (!num_namespaces) {
+        for (i = 0; i < num_keys; i++)
+            arcs[i] = cache->arc;
+        return arc_lookup_multi(cache->arc, keys, lens, resources, num_keys, cache->expire_time);
+    }
+
+    void **ns_keys = malloc(sizeof(void *) * num_keys);
+    size_t *ns_lens = malloc(sizeof(size_t) * num_keys);
+    int *ns_index = malloc(sizeof(int) * num_keys);
+    arc_resource_t *ns_resources = malloc(sizeof(arc_resource_t) * num_keys);
+    shardcache_namespace_t **namespaces = malloc(sizeof(shardcache_namespace_t *) * num_keys);
+
+    for (i = 0; i < num_keys; i++) {
+        namespaces[i] = shardcache_namespace_for_key(cache, keys[i], lens[i]);
+        arcs[i] = namespaces[i] ? namespaces[i]->arc : cache->arc;
+    }
+
+    int rc = 0;
+    int n;
+    // n == -1 selects the shared cache
+    for (n = -1; n < num_namespaces && rc == 0; n++) {
+        shardcache_namespace_t *ns = (n >= 0) ? &cache->namespaces[n] : NULL;
+        int num = 0;
+        for (i = 0; i < num_keys; i++) {
+            if (namespaces[i] == ns) {
+                ns_keys[num] = keys[i];
+                ns_lens[num] = lens[i];
+                ns_index[num] = i;
+                num++;
+            }
+        }
+        if (!num)
+            continue;
+
+        arc_t *arc = ns ? ns->arc : cache->arc;
+        rc = arc_lookup_multi(arc, ns_keys, ns_lens, ns_resources, num, cache->expire_time);
+        if (rc == 0) {
+            for (i = 0; i < num; i++)
+                resources[ns_index[i]] = ns_resources[i];
+        }
+    }
+
+    if (rc != 0) {
+        // release what has been retrieved from the other namespaces
+        for (i = 0; i < num_keys; i++) {
+            if (resources[i]) {
+                arc_release_resource(arcs[i], resources[i]);
+                resources[i] = NULL;
+            }
+        }
+    }
+
+    free(ns_keys);
+    free(ns_lens);
+    free(ns_index);
+    free(ns_resources);
+    free(namespaces);
+
+    return rc;
+}
+
 int shardcache_get_multi(shardcache_t *cache,
                          void **keys,
                          size_t *lens,
@@ -1287,11 +2387,13 @@ int shardcache_get_multi(shardcache_t *cache,
                          void *priv)
 {
 
-    arc_resource_t *resources = malloc(sizeof(arc_resource_t) * num_keys);
-    int rc = arc_lookup_multi(cache->arc, keys, lens, resources, num_keys, cache->expire_time);
-        
+    arc_resource_t *resources = calloc(num_keys, sizeof(arc_resource_t));
+    arc_t **arcs = malloc(sizeof(arc_t *) * num_keys);
+    int rc = shardcache_lookup_multi(cache, keys, lens, resources, arcs, num_keys);
+
     if (rc != 0) {
         free(resources);
+        free(arcs);
         return -1;
     }
 
@@ -1300,46 +2402,64 @@ int shardcache_get_multi(shardcache_t *cache,
         arc_resource_t res = resources[i];
         if (res) {
             cached_object_t *obj = (cached_object_t *)arc_get_resource_ptr(res);
-            MUTEX_LOCK(obj->lock);
+            arc_t *arc = arcs[i];
+            COBJ_LOCK(cache, obj);
 
             int complete = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE);
             if (complete) {
-                time_t obj_expiration = obj->ts.tv_sec + cache->expire_time;
-                if (UNLIKELY(cache->lazy_expiration && obj_expiration &&
-                             cache->expire_time > 0 && obj_expiration < time(NULL)))
+                if (UNLIKELY(cache->lazy_expiration && shardcache_cobj_is_expired(cache, obj)))
                 {
-                    MUTEX_UNLOCK(obj->lock);
-                    arc_drop_resource(cache->arc, res);
+                    COBJ_UNLOCK(cache, obj);
+                    arc_drop_resource(arc, res);
                     cb(keys[i], lens[i], NULL, 0, 0, NULL, priv);
                     continue;
                 }
-                cb(obj->key, obj->klen, obj->data, obj->dlen, obj->dlen, &obj->ts, priv);
-                arc_release_resource(cache->arc, res);
+                struct timeval ts;
+                size_t resident = 0;
+                COBJ_GET_TIMESTAMP(obj, &ts);
+                shardcache_cobj_served(cache, obj);
+                shardcache_cobj_send(cache, obj, obj->key, obj->klen, cb, &ts, &resident, priv);
+                if (resident) {
+                    // the object lock can't be held while updating the size
+                    COBJ_UNLOCK(cache, obj);
+                    arc_update_resource_size(arc, res, resident);
+                    arc_release_resource(arc, res);
+                    continue;
+                }
+                arc_release_resource(arc, res);
             } else {
                 // send what we have so far
                 if (obj->dlen)
-                    cb(obj->key, obj->klen, obj->data, obj->dlen, 0, NULL, priv);
+                    shardcache_cobj_send(cache, obj, obj->key, obj->klen, cb, NULL, NULL, priv);
 
                 // and then register the listener
                 shardcache_get_async_helper_arg_t *arg = calloc(1, sizeof(shardcache_get_async_helper_arg_t));
                 arg->cb = cb;
                 arg->priv = priv;
                 arg->cache = cache;
+                // the resource is going to be released by the listener
+                // (possibly by another thread)
+                arc_retain_resource(arc, res);
+                arg->arc = arc;
                 arg->res = res;
 
                 shardcache_get_listener_t *listener = malloc(sizeof(shardcache_get_listener_t));
                 listener->cb = shardcache_get_async_helper;
                 listener->priv = arg;
-                list_push_value(obj->listeners, listener);
+                cobj_add_listener(obj, listener);
+                COBJ_UNLOCK(cache, obj);
+                arc_release_resource(arc, res);
+                continue;
             }
 
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(cache, obj);
         } else {
             cb(keys[i], lens[i], NULL, 0, 0, NULL, priv);
         }
     }
 
     free(resources);
+    free(arcs);
 
     return 0;
 }
@@ -1446,6 +2566,39 @@ shardcache_fetch_async_response(shardcache_t *cache,
     return rc;
 }
 
+// Check if a (still valid) tombstone is cached for the given key,
+// if drop is true the tombstone is also removed from the cache
+static int
+shardcache_check_tombstone(shardcache_t *cache, void *key, size_t klen, int drop)
+{
+    if (!ATOMIC_READ(cache->negative_caching_ttl))
+        return 0;
+
+    arc_t *arc = shardcache_arc_for_key(cache, key, klen);
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_nofetch(arc, (const void *)key, klen, &obj_ptr);
+    if (!res)
+        return 0;
+
+    if (!obj_ptr) {
+        arc_release_resource(arc, res);
+        return 0;
+    }
+
+    cached_object_t *obj = (cached_object_t *)obj_ptr;
+    COBJ_LOCK(cache, obj);
+    int found = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_TOMBSTONE|COBJ_FLAG_COMPLETE);
+    int expired = found && cache->lazy_expiration && shardcache_cobj_is_expired(cache, obj);
+    COBJ_UNLOCK(cache, obj);
+
+    if (found && (drop || expired))
+        arc_drop_resource(arc, res);
+    else
+        arc_release_resource(arc, res);
+
+    return (found && !expired);
+}
+
 int
 shardcache_exists(shardcache_t *cache,
                   void *key,
@@ -1467,6 +2620,13 @@ shardcache_exists(shardcache_t *cache,
 
     int rc = -1;
 
+    // the key is known not to exist
+    if (shardcache_check_tombstone(cache, key, klen, 0)) {
+        if (cb)
+            cb(key, klen, 0, priv);
+        return 0;
+    }
+
     if (is_mine == 1)
     {
         // TODO - clean this bunch of nested conditions
@@ -1527,14 +2687,15 @@ shardcache_touch(shardcache_t *cache, void *key, size_t klen)
 
     if (is_mine == 1)
     {
+        arc_t *arc = shardcache_arc_for_key(cache, key, klen);
         void *obj_ptr = NULL;
-        arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 0, cache->expire_time);
+        arc_resource_t res = arc_lookup(arc, (const void *)key, klen, &obj_ptr, 0, cache->expire_time);
         if (res) {
             cached_object_t *obj = (cached_object_t *)obj_ptr;
-            MUTEX_LOCK(obj->lock);
-            gettimeofday(&obj->ts, NULL);
-            MUTEX_UNLOCK(obj->lock);
-            arc_release_resource(cache->arc, res);
+            COBJ_LOCK(cache, obj);
+            COBJ_SET_TIMESTAMP(obj);
+            COBJ_UNLOCK(cache, obj);
+            arc_release_resource(arc, res);
             return obj ? 0 : -1;
         }
     } else {
@@ -1556,10 +2717,41 @@ shardcache_touch(shardcache_t *cache, void *key, size_t klen)
 static void
 shardcache_commence_eviction(shardcache_t *cache, void *key, size_t klen)
 {
-    shardcache_evictor_job_t *job = create_evictor_job(key, klen);
+    shardcache_evictor_job_t *job = create_evictor_job(key, klen, 0);
 
     SHC_DEBUG2("Adding evictor job for key %.*s", klen, key);
 
+    // an eviction job replaces any pending job for the same key
+    // (pushing a value which has just been changed makes no sense)
+    void *prev = NULL;
+    int rc = ht_get_and_set(cache->evictor_jobs, key, klen, job, sizeof(shardcache_evictor_job_t), &prev, NULL);
+
+    if (rc != 0) {
+        destroy_evictor_job(job);
+        return;
+    }
+
+    if (prev)
+        destroy_evictor_job((shardcache_evictor_job_t *)prev);
+
+    // the new value will be pushed again if the key is still hot
+    if (cache->hot_pushed_keys)
+        ht_delete(cache->hot_pushed_keys, key, klen, NULL, NULL);
+
+    MUTEX_LOCK(cache->evictor_lock);
+    pthread_cond_signal(&cache->evictor_cond);
+    MUTEX_UNLOCK(cache->evictor_lock);
+}
+
+static void
+shardcache_commence_push(shardcache_t *cache, void *key, size_t klen)
+{
+    shardcache_evictor_job_t *job = create_evictor_job(key, klen, 1);
+
+    SHC_DEBUG2("Adding push job for key %.*s", klen, key);
+
+    // if there is already a pending job for this key (either a push or an eviction)
+    // there is no need to push it
     int rc = ht_set_if_not_exists(cache->evictor_jobs, key, klen, job, sizeof(shardcache_evictor_job_t));
 
     if (rc != 0) {
@@ -1572,31 +2764,143 @@ shardcache_commence_eviction(shardcache_t *cache, void *key, size_t klen)
     MUTEX_UNLOCK(cache->evictor_lock);
 }
 
+typedef struct {
+    time_t now;
+    int interval;
+    int expired;
+} shardcache_hot_push_arg_t;
+
+// the owner pushes a key again (if still hot) once half of the ttl
+// of the copies held by the peers has elapsed
 static inline int
-shardcache_queue_expiration_job(shardcache_t *cache, void *key, size_t klen, int expire, int is_volatile, int cmd)
+shardcache_hot_push_interval(shardcache_t *cache)
 {
-    shardcache_expire_job_t *job = calloc(1, sizeof(shardcache_expire_job_t));
-    job->cmd = cmd;
+    int ttl = ATOMIC_READ(cache->hot_key_push_ttl);
+    return ttl > 1 ? ttl / 2 : 1;
+}
 
-    job->key = malloc(klen);
-    job->klen = klen;
-    memcpy(job->key, key, klen);
-    job->expire = expire;
-    job->is_volatile = is_volatile;
+// check (and refresh, if the key has to be pushed again)
+// the time of the last push of a hot key
+// NOTE: called by ht_get_deep_copy() holding the hashtable lock,
+//       so the timestamp can be updated in place
+static void *
+shardcache_hot_push_check(void *ptr, size_t len, void *user)
+{
+    shardcache_hot_push_arg_t *arg = (shardcache_hot_push_arg_t *)user;
+    time_t *last_push = (time_t *)ptr;
+    if (arg->now - *last_push >= arg->interval) {
+        *last_push = arg->now;
+        arg->expired = 1;
+    }
+    return arg;
+}
 
-    int rc = queue_push_right(cache->expirer_queue, job);
-    if (rc != 0) {
-        free(job->key);
-        free(job);
+static int
+shardcache_hot_push_prune(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    shardcache_hot_push_arg_t *arg = (shardcache_hot_push_arg_t *)user;
+    // the key would be pushed again anyway (if still hot)
+    return (arg->now - *((time_t *)value) >= arg->interval) ? -1 : 1;
+}
+
+// forget the keys whose pushed copies are about to expire,
+// so that the table holds only the keys pushed recently
+static void
+shardcache_hot_pushed_keys_prune(shardcache_t *cache)
+{
+    if (!cache->hot_pushed_keys || !ht_count(cache->hot_pushed_keys))
+        return;
+
+    shardcache_hot_push_arg_t arg = {
+        .now = time(NULL),
+        .interval = shardcache_hot_push_interval(cache),
+        .expired = 0
+    };
+    ht_foreach_pair(cache->hot_pushed_keys, shardcache_hot_push_prune, &arg);
+}
+
+void
+shardcache_hot_key_access(shardcache_t *cache, void *key, size_t klen)
+{
+    int threshold = ATOMIC_READ(cache->hot_key_push_threshold);
+
+    // both the pushes and the invalidations go through the evictor
+    if (!threshold || !cache->evictor_jobs || cache->num_shards < 2)
+        return;
+
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    if (shardcache_test_actual_ownership(cache, key, klen, node_name, &node_len) != 1)
+        return;
+
+    if (hotkeys_touch(cache->owned_hotkeys, key, klen) < (uint32_t)threshold)
+        return;
+
+    // the key is hot, push it again only if the copies
+    // held by the peers are about to expire
+    shardcache_hot_push_arg_t arg = {
+        .now = time(NULL),
+        .interval = shardcache_hot_push_interval(cache),
+        .expired = 0
+    };
+    if (!ht_get_deep_copy(cache->hot_pushed_keys, key, klen, NULL, shardcache_hot_push_check, &arg)) {
+        // not pushed recently
+        time_t *ts = malloc(sizeof(time_t));
+        if (!ts)
+            return;
+        *ts = arg.now;
+        // if someone else got here first, it will push the key
+        if (ht_set_if_not_exists(cache->hot_pushed_keys, key, klen, ts, sizeof(time_t)) != 0) {
+            free(ts);
+            return;
+        }
+        arg.expired = 1;
     }
 
-    return rc;
+    if (arg.expired)
+        shardcache_commence_push(cache, key, klen);
+}
+
+int
+shardcache_load_pushed(shardcache_t *cache, void *key, size_t klen, void *value, size_t vlen, uint32_t ttl)
+{
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    // the owner already has its own copy
+    if (shardcache_test_actual_ownership(cache, key, klen, node_name, &node_len) == 1)
+        return -1;
+
+    // a copy pushed without a ttl is not kept longer than any other cached item
+    if (!ttl && ATOMIC_READ(cache->expire_time) > 0)
+        ttl = ATOMIC_READ(cache->expire_time);
+
+    arc_t *arc = shardcache_arc_for_key(cache, key, klen);
+    // drop the existing copy (if any) so that the new object
+    // will be initialized with the ttl provided by the owner
+    arc_remove(arc, (const void *)key, klen);
+    if (arc_load(arc, (const void *)key, klen, value, vlen, ttl) < 0)
+        return -1;
+
+    if (ttl && !ATOMIC_READ(cache->lazy_expiration))
+        shardcache_schedule_expiration(cache, key, klen, ttl, 0);
+
+    return 0;
 }
 
 int
 shardcache_unschedule_expiration(shardcache_t *cache, void *key, size_t klen, int is_volatile)
 {
-    return shardcache_queue_expiration_job(cache, key, klen, 0, is_volatile, SHARDACHE_EXPIRE_UNSCHEDULE);
+    shardcache_expirer_t *expirer = shardcache_expirer_select(cache, key, klen);
+    void *ptr = NULL;
+
+    MUTEX_LOCK(expirer->lock);
+    ht_delete(expirer->timers[is_volatile ? 1 : 0], key, klen, &ptr, NULL);
+    if (ptr)
+        timing_wheel_remove(expirer->wheel, &((shardcache_expire_entry_t *)ptr)->node);
+    MUTEX_UNLOCK(expirer->lock);
+
+    free(ptr);
+    return 0;
 }
 
 int
@@ -1606,8 +2910,52 @@ shardcache_schedule_expiration(shardcache_t *cache,
                                time_t expire,
                                int is_volatile)
 {
+    shardcache_expirer_t *expirer = shardcache_expirer_select(cache, key, klen);
+    hashtable_t *table = expirer->timers[is_volatile ? 1 : 0];
+
+    MUTEX_LOCK(expirer->lock);
+    shardcache_expire_entry_t *entry = (shardcache_expire_entry_t *)ht_get(table, key, klen, NULL);
+    if (entry) {
+        // reschedule
+        timing_wheel_remove(expirer->wheel, &entry->node);
+    } else {
+        entry = malloc(sizeof(shardcache_expire_entry_t) + klen);
+        if (!entry) {
+            MUTEX_UNLOCK(expirer->lock);
+            return -1;
+        }
+        entry->is_volatile = is_volatile ? 1 : 0;
+        entry->klen = klen;
+        memcpy(entry->key, key, klen);
+        if (ht_set(table, key, klen, entry, sizeof(shardcache_expire_entry_t)) != 0) {
+            MUTEX_UNLOCK(expirer->lock);
+            free(entry);
+            return -1;
+        }
+    }
+    timing_wheel_add(expirer->wheel, &entry->node, shardcache_expirer_now() + expire);
+    MUTEX_UNLOCK(expirer->lock);
+
+    return 0;
+}
+
+static int
+shardcache_queue_refresh(shardcache_t *cache, void *key, size_t klen)
+{
+    shardcache_expirer_t *expirer = shardcache_expirer_select(cache, key, klen);
+
+    shardcache_key_t *item = malloc(sizeof(shardcache_key_t));
+    item->key = malloc(klen);
+    memcpy(item->key, key, klen);
+    item->klen = klen;
+
+    int rc = queue_push_right(expirer->refresh_queue, item);
+    if (rc != 0) {
+        free(item->key);
+        free(item);
+    }
 
-    return shardcache_queue_expiration_job(cache, key, klen, expire, is_volatile, SHARDACHE_EXPIRE_SCHEDULE);
+    return rc;
 }
 
 typedef struct {
@@ -1715,9 +3063,9 @@ shardcache_store_volatile(shardcache_t *cache,
         }
         destroy_volatile(prev); 
         if (cache->cache_on_set)
-            arc_load(cache->arc, (const void *)key, klen, value, vlen, cexpire);
+            arc_load(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen, value, vlen, cexpire);
         else
-            arc_remove(cache->arc, (const void *)key, klen);
+            arc_remove(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen);
 
         if (!replica)
             shardcache_commence_eviction(cache, key, klen);
@@ -1787,9 +3135,9 @@ shardcache_store(shardcache_t *cache,
     rc = cache->storage.store(key, klen, value, vlen, mode, cache->storage.priv);
 
     if (cache->cache_on_set)
-        arc_load(cache->arc, (const void *)key, klen, value, vlen, cexpire);
+        arc_load(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen, value, vlen, cexpire);
     else
-        arc_remove(cache->arc, (const void *)key, klen);
+        arc_remove(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen);
 
     if (!replica)
         shardcache_commence_eviction(cache, key, klen);
@@ -1843,6 +3191,12 @@ shardcache_set_internal(shardcache_t *cache,
                    (int)vlen, klen, key);
 
         rc = shardcache_store(cache, key, klen, value, vlen, prev_value, prev_vlen, expire, cexpire, mode == 1 ? 1 : 0, replica);
+
+        // not all the store paths touch the cache
+        // (e.g. new volatile keys), ensure the key is not
+        // considered missing anymore
+        if (rc == 0)
+            shardcache_check_tombstone(cache, key, klen, 1);
     }
     else if (node_len)
     {
@@ -1906,9 +3260,9 @@ shardcache_set_internal(shardcache_t *cache,
 
         if (rc == 0) {
             if (cache->cache_on_set)
-                arc_load(cache->arc, (const void *)key, klen, value, vlen, cexpire);
+                arc_load(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen, value, vlen, cexpire);
             else
-                arc_remove(cache->arc, (const void *)key, klen);
+                arc_remove(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen);
         }
 
     }
@@ -2179,7 +3533,7 @@ shardcache_increment_internal(shardcache_t *cache,
         }
 
         if (v) {
-            arc_remove(cache->arc, (const void *)key, klen);
+            arc_remove(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen);
             shardcache_commence_eviction(cache, key, klen);
             int64_t output_value = *((int64_t *)v);
             if (out)
@@ -2277,7 +3631,7 @@ shardcache_increment_internal(shardcache_t *cache,
             if (rc == 0) {
                 if (out)
                     *out = value;
-                arc_remove(cache->arc, (const void *)key, klen);
+                arc_remove(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen);
             }
         }
     }
@@ -2373,7 +3727,7 @@ shardcache_del_internal(shardcache_t *cache,
 
         if (ATOMIC_READ(cache->evict_on_delete))
         {
-            arc_remove(cache->arc, (const void *)key, klen);
+            arc_remove(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen);
 
             if (!replica)
                 shardcache_commence_eviction(cache, key, klen);
@@ -2467,7 +3821,7 @@ shardcache_evict(shardcache_t *cache, void *key, size_t klen)
     if (cache->replica)
         return shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_EVICT, key, klen, NULL, 0, NULL, 0, 0, 0);
 
-    arc_remove(cache->arc, (const void *)key, klen);
+    arc_remove(shardcache_arc_for_key(cache, key, klen), (const void *)key, klen);
 
     return 0;
 }
@@ -2961,8 +4315,14 @@ int
 shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value)
 {
     int old_value = shardcache_get_set_option(&cache->arc_mode, (int)new_value);
-    if ((int)new_value != -1 && old_value != new_value)
+    if ((int)new_value != -1 && old_value != new_value) {
+        MUTEX_LOCK(cache->namespaces_lock);
         arc_set_mode(cache->arc, new_value);
+        int i;
+        for (i = 0; i < cache->num_namespaces; i++)
+            arc_set_mode(cache->namespaces[i].arc, new_value);
+        MUTEX_UNLOCK(cache->namespaces_lock);
+    }
     return old_value;
 }
 
@@ -2984,6 +4344,107 @@ shardcache_force_caching(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->force_caching, new_value);
 }
 
+int
+shardcache_remote_caching_threshold(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->remote_caching_threshold, new_value);
+}
+
+int
+shardcache_hot_key_push_threshold(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->hot_key_push_threshold, new_value);
+}
+
+int
+shardcache_hot_key_push_ttl(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->hot_key_push_ttl, new_value);
+}
+
+int
+shardcache_fetch_wait_timeout(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_FETCH_WAIT_TIMEOUT_DEFAULT;
+
+    return shardcache_get_set_option(&cache->fetch_wait_timeout, new_value);
+}
+
+int
+shardcache_negative_caching_ttl(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->negative_caching_ttl, new_value);
+}
+
+int
+shardcache_range_fetch_bypass(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->range_fetch_bypass, new_value);
+}
+
+int
+shardcache_epoch_reclamation(shardcache_t *cache, int new_value)
+{
+    int old_value = ATOMIC_READ(cache->epoch_reclamation);
+    if (new_value >= 0 && (new_value ? 1 : 0) != old_value) {
+        arc_reclamation_t reclamation = new_value ? ARC_RECLAMATION_EPOCH : ARC_RECLAMATION_REFCNT;
+        MUTEX_LOCK(cache->namespaces_lock);
+        if (arc_set_reclamation(cache->arc, reclamation) != 0) {
+            MUTEX_UNLOCK(cache->namespaces_lock);
+            return -1;
+        }
+        int i;
+        for (i = 0; i < cache->num_namespaces; i++) {
+            if (arc_set_reclamation(cache->namespaces[i].arc, reclamation) != 0) {
+                // restore the arcs already switched (which are empty)
+                arc_reclamation_t previous = old_value ? ARC_RECLAMATION_EPOCH : ARC_RECLAMATION_REFCNT;
+                arc_set_reclamation(cache->arc, previous);
+                while (--i >= 0)
+                    arc_set_reclamation(cache->namespaces[i].arc, previous);
+                MUTEX_UNLOCK(cache->namespaces_lock);
+                return -1;
+            }
+        }
+        ATOMIC_SET(cache->epoch_reclamation, new_value ? 1 : 0);
+        MUTEX_UNLOCK(cache->namespaces_lock);
+    }
+    return old_value;
+}
+
+int
+shardcache_resize_batch(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_RESIZE_BATCH_DEFAULT;
+
+    int old_value = shardcache_get_set_option(&cache->resize_batch, new_value);
+    if (new_value >= 0 && old_value != new_value) {
+        MUTEX_LOCK(cache->namespaces_lock);
+        arc_set_balance_batch(cache->arc, new_value);
+        int i;
+        for (i = 0; i < cache->num_namespaces; i++)
+            arc_set_balance_batch(cache->namespaces[i].arc, new_value);
+        MUTEX_UNLOCK(cache->namespaces_lock);
+    }
+    return old_value;
+}
+
+int
+shardcache_get_hot_remote_keys(shardcache_t *cache, shardcache_hot_key_t **keys)
+{
+    return hotkeys_get_top(cache->remote_hotkeys, keys);
+}
+
+void
+shardcache_free_hot_keys(shardcache_hot_key_t *keys, int num_keys)
+{
+    int i;
+    for (i = 0; i < num_keys; i++)
+        free(keys[i].key);
+    free(keys);
+}
+
 int
 shardcache_iomux_run_timeout_low(shardcache_t *cache, int new_value)
 {
@@ -3006,12 +4467,40 @@ shardcache_expire_time(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->expire_time, new_value);
 }
 
+int
+shardcache_stale_grace_time(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->stale_grace_time, new_value);
+}
+
 int
 shardcache_serving_look_ahead(shardcache_t *cache, int new_value)
 {
     return shardcache_get_set_option(&cache->serving_look_ahead, new_value);
 }
 
+int
+shardcache_workers_balancing(shardcache_t *cache, shardcache_workers_balancing_t new_value)
+{
+    if ((int)new_value > SHARDCACHE_WORKERS_BALANCING_TWO_CHOICES)
+        return -1;
+    return shardcache_get_set_option(&cache->workers_balancing, (int)new_value);
+}
+
+int
+shardcache_workers_migration(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->workers_migration, new_value);
+}
+
+int
+shardcache_set_io_backend(shardcache_io_backend_t backend)
+{
+    if ((int)backend > SHARDCACHE_IO_BACKEND_IO_URING)
+        return -1;
+    return shardcache_get_set_option(&shardcache_io_backend, (int)backend);
+}
+
 int
 shardcache_lazy_expiration(shardcache_t *cache, int new_value)
 {
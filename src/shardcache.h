@@ -26,6 +26,7 @@ typedef struct _shardcache_s shardcache_t;
 
 #define SHARDCACHE_PORT_DEFAULT               4444
 #define SHARDCACHE_TCP_TIMEOUT_DEFAULT        5000   // (in millisecs) == 5 secs
+#define SHARDCACHE_FETCH_WAIT_TIMEOUT_DEFAULT 5000   // (in millisecs) == 5 secs
 #define SHARDCACHE_EXPIRE_TIME_DEFAULT        0      // don't expire keys by default
 #define SHARDCACHE_IOMUX_RUN_TIMEOUT_LOW      100000 // (in microsecs)
 #define SHARDCACHE_IOMUX_RUN_TIMEOUT_HIGH     500000 // (in microsecs)
@@ -34,6 +35,21 @@ typedef struct _shardcache_s shardcache_t;
                                                      // requests to handle ahead
 #define SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT  1      // number of async i/o threads used
                                                      // for inter-node communication
+#define SHARDCACHE_ARC_PARTITIONS_DEFAULT     1      // number of independent partitions
+                                                     // the arc cache is split into
+#define SHARDCACHE_RESIZE_BATCH_DEFAULT       1024   // max number of objects evicted from an arc
+                                                     // partition without releasing its lock
+#define SHARDCACHE_NAMESPACES_MAX             16     // max number of cache namespaces
+                                                     // (see shardcache_add_namespace())
+#define SHARDCACHE_NAMESPACE_NAME_MAX         32     // max length of a namespace name
+#define SHARDCACHE_REMOTE_CACHING_THRESHOLD_DEFAULT 5 // number of recent accesses after which
+                                                      // a key owned by a peer is considered hot
+                                                      // (and its value kept in the local cache)
+#define SHARDCACHE_HOT_REMOTE_KEYS_MAX        16     // number of hot remote keys tracked
+#define SHARDCACHE_HOT_KEY_PUSH_TTL_DEFAULT   5      // ttl (in seconds) of the copies of the hot keys
+                                                     // pushed by their owner to the peers
+#define SHARDCACHE_WORKERS_BALANCING_DEFAULT  SHARDCACHE_WORKERS_BALANCING_TWO_CHOICES
+#define SHARDCACHE_IO_BACKEND_DEFAULT         SHARDCACHE_IO_BACKEND_IOMUX
 extern const char *LIBSHARDCACHE_VERSION;
 extern const char *LIBSHARDCACHE_BUILD_INFO;
 
@@ -65,6 +81,27 @@ void shardcache_storage_dispose(shardcache_storage_t *st);
  */
 int shardcache_storage_reset(shardcache_storage_t *st, char **options);
 
+typedef enum {
+    // the workers use libiomux (poll/epoll/kqueue)
+    SHARDCACHE_IO_BACKEND_IOMUX = 0,
+    // the workers use io_uring, submitting all their receives and sends
+    // (and waiting for their completions) with a single syscall per loop
+    SHARDCACHE_IO_BACKEND_IO_URING = 1
+} shardcache_io_backend_t;
+
+/**
+ * @brief Select the event loop used by the serving workers
+ * @param backend  The backend used by the instances created afterwards
+ *                 (or -1 to only query the actual value)
+ * @return the previous value for the io backend, -1 if not a valid one
+ * @note This is a process-wide setting which must be changed before calling
+ *       shardcache_create(), workers which can't use io_uring (because not
+ *       supported by the platform or by the kernel) fall back to iomux
+ *       (the "io_uring_workers" counter reports how many are using it)
+ * @note defaults to SHARDCACHE_IO_BACKEND_DEFAULT
+ */
+int shardcache_set_io_backend(shardcache_io_backend_t backend);
+
 /**
  * @brief Create a new shardcache instance
  * @param me              A valid <address:port> null-terminated string
@@ -85,6 +122,20 @@ int shardcache_storage_reset(shardcache_storage_t *st, char **options);
  *                        async thread will be created every 20 workers\n
  *                        If 0 the default value (SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT) will be used
  * @param cache_size      The maximum size of the ARC cache
+ * @param arc_partitions  The number of independent partitions (each one with its own lists
+ *                        and its own lock) the ARC cache will be split into\n
+ *                        If greater than 0 it will indicate the actual number of partitions\n
+ *                        If smaller than 0 (negative) one partition for each worker will be created\n
+ *                        If 0 the default value (SHARDCACHE_ARC_PARTITIONS_DEFAULT) will be used\n
+ *                        NOTE: each partition gets an equal share of cache_size, and a value
+ *                        is cached only if smaller than half the share of its partition
+ *                        (values too big are still served but never cached, the
+ *                        "arc_too_big" counter reports how many times it happened),
+ *                        so more partitions means a lower limit for the size of the
+ *                        cached values\n
+ *                        One expirer thread (each one handling the expiration of
+ *                        a subset of the keys) is also created for each partition
+ *                        (up to 8)
  * @return a newly initialized shardcache descriptor
  * 
  * @note The returned shardcache_t structure MUST be disposed using shardcache_destroy()
@@ -99,15 +150,26 @@ shardcache_t *shardcache_create(char *me,
                         shardcache_storage_t *storage,
                         int num_workers,
                         int num_async,
-                        size_t cache_size);
+                        size_t cache_size,
+                        int arc_partitions);
 
 
 
 typedef enum {
     SHARDCACHE_ARC_MODE_STRICT = 0,
-    SHARDCACHE_ARC_MODE_LOOSE = 1
+    SHARDCACHE_ARC_MODE_LOOSE = 1,
+    // strict mode plus a TinyLFU admission filter: when inserting a new key
+    // would force an eviction from the mru list, the key is admitted only if
+    // its estimated access frequency is higher than the one of the victim
+    SHARDCACHE_ARC_MODE_TINYLFU = 2
 } arc_mode_t;
 
+/*
+ * @brief Allows to change the arc mode at runtime
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The new arc mode (or -1 to only query the actual value)
+ * @return the previous value for the arc mode
+ */
 int shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value);
 
 int shardcache_cache_on_set(shardcache_t *cache, int new_value);
@@ -152,6 +214,137 @@ int shardcache_use_persistent_connections(shardcache_t *cache, int new_value);
  */
 int shardcache_force_caching(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Allows to change the threshold used to determine if a remote item is hot
+ *        and its value should be kept in the local cache
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The number of recent accesses to a key owned by a peer after
+ *                    which its value will be cached locally (1 caches everything)\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the remote_caching_threshold setting
+ * @note The access frequency is estimated over a sliding window of the most
+ *       recent accesses to remote keys
+ * @note Ignored if force_caching is on
+ * @note defaults to SHARDCACHE_REMOTE_CACHING_THRESHOLD_DEFAULT
+ */
+int shardcache_remote_caching_threshold(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows the owner of a hot key to push its value to all the peers
+ *        (instead of waiting for all of them to fetch it)
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The number of recent requests for a key owned by this node
+ *                    after which the key is considered hot and pushed to all the
+ *                    peers, 0 disables pushing hot keys\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the hot_key_push_threshold setting
+ * @note Only requests received over the network are accounted
+ * @note Pushes (as well as the invalidations of the pushed keys when they change)
+ *       are sent by the evictor thread, so they happen only if evict_on_delete was
+ *       enabled when the shardcache instance has been created
+ * @note defaults to 0
+ */
+int shardcache_hot_key_push_threshold(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the ttl of the hot keys pushed to the peers
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The ttl (in seconds) the peers will apply to the pushed copies.
+ *                    The owner will push the key again (if still hot)
+ *                    once half of the ttl has elapsed\n
+ *                    If 0 the peers apply their own expire time to the pushed copies\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the hot_key_push_ttl setting
+ * @note defaults to SHARDCACHE_HOT_KEY_PUSH_TTL_DEFAULT
+ */
+int shardcache_hot_key_push_ttl(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the maximum time a synchronous fetcher waits for
+ *        the result of a fetch already in progress for the same key
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The new value (in milliseconds), 0 restores the default\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the fetch_wait_timeout setting
+ * @note Concurrent misses for the same key are coalesced into a single fetch
+ *       from the storage (or from the owner peer), if the fetch doesn't complete
+ *       in time the waiting fetchers give up and the key is looked up again
+ * @note defaults to SHARDCACHE_FETCH_WAIT_TIMEOUT_DEFAULT
+ */
+int shardcache_fetch_wait_timeout(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to cache the keys which have not been found (negative caching)
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The ttl (in seconds) of the tombstones kept in the cache for
+ *                    the keys which have not been found either in the storage or
+ *                    on the owner peer, 0 disables negative caching\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the negative_caching_ttl setting
+ * @note While a tombstone is cached get(), head() and exists() for its key
+ *       are answered without querying the storage or the peers.
+ *       Tombstones are invalidated when the key is set
+ * @note defaults to 0
+ */
+int shardcache_negative_caching_ttl(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to serve the ranges requested for keys not found in the cache
+ *        straight from the storage
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   1 if the ranges should be read using the fetch_range storage
+ *                    callback without caching the value, 0 otherwise\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the range_fetch_bypass setting
+ * @note Only applies to shardcache_get_offset() for the keys owned by this node
+ *       (or any key if the storage is global) and only if the storage provides
+ *       the fetch_range callback. Keys which are already cached (or being fetched)
+ *       are still served from the cache. The range reads are exposed by the
+ *       'range_fetches' counter
+ * @note defaults to 0
+ */
+int shardcache_range_fetch_bypass(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Structure representing a hot key
+ */
+typedef struct {
+    void *key;          // a copy of the key
+    size_t klen;        // the length of the key
+    uint32_t frequency; // the estimated number of recent accesses
+} shardcache_hot_key_t;
+
+/*
+ * @brief Get the hottest keys owned by other peers which have been
+ *        accessed through this node
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param keys  A reference to a pointer which will be set to a newly allocated array
+ *              holding the hot keys, sorted by decreasing frequency
+ * @return The number of keys in the array
+ *         (at most SHARDCACHE_HOT_REMOTE_KEYS_MAX)
+ * @note The array must be released using shardcache_free_hot_keys()
+ */
+int shardcache_get_hot_remote_keys(shardcache_t *cache, shardcache_hot_key_t **keys);
+
+/*
+ * @brief Release an array of hot keys returned by shardcache_get_hot_remote_keys()
+ * @param keys     The array of keys
+ * @param num_keys The number of keys in the array
+ */
+void shardcache_free_hot_keys(shardcache_hot_key_t *keys, int num_keys);
+
 /*
  * @brief Allows to change the timeout used when creating tcp connections
  * @param cache       A valid pointer to a shardcache_t structure
@@ -218,6 +411,23 @@ int shardcache_iomux_run_timeout_high(shardcache_t *cache, int new_value);
  */
 int shardcache_expire_time(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Allows to change the grace period during which expired items
+ *        can still be served while being refreshed
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The amount of seconds an expired item will still be served
+ *                  (as stale) while its value is being fetched again in the
+ *                  background. If 0 expired items are removed right away\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status)
+ * @return the previous value for the stale_grace_time setting
+ * @note Only one refresh is performed for each expired item, if the refresh
+ *       fails the stale item is removed at the end of the grace period
+ * @note defaults to 0
+ */
+int shardcache_stale_grace_time(shardcache_t *cache, int new_value);
+
 /*
  * @brief Allows to change the number of queued/pipelined requests to handle ahead
  *        while still serving the response to the first request
@@ -236,9 +446,13 @@ int shardcache_serving_look_ahead(shardcache_t *cache, int new_value);
  *                    but the actual value will still be returned
  *                    (effectively querying the actual status)
  * @return the previous value for the lazy_expiration setting
- * @note When lazy expiration is enabled, cached items will be expired
- *       only when fetched, otherwise the expirer thread will take care
- *       of expiring the cached items as well as volatile items
+ * @note When lazy expiration is enabled, no expiration timers are scheduled
+ *       for the cached items which will be expired when fetched or when found
+ *       expired by the expirer threads (which periodically probe a bounded
+ *       number of cached items, doing more rounds as long as a significant
+ *       fraction of the probed ones turns out to be expired).
+ *       Otherwise the expirer threads will take care of expiring the cached
+ *       items (as well as the volatile items) as soon as their ttl is reached
  * @note defaults to 0
  */
 int shardcache_lazy_expiration(shardcache_t *cache, int new_value);
@@ -260,11 +474,171 @@ void shardcache_clear(shardcache_t *cache);
  *        (overriding the initial size set at construction time)
  * @param cache   the instance to release
  * @param new_size the new size
+ * @note The size includes the quotas of the namespaces (see shardcache_add_namespace()),
+ *       sizes not leaving any room for the shared cache are refused
+ * @note When shrinking the cache the objects in excess are evicted incrementally
+ *       by a background thread, in batches of at most resize_batch objects per
+ *       arc partition (see shardcache_resize_batch()), so that lookups are never
+ *       blocked for long. The progress can be followed through the 'resize_evictions'
+ *       and 'resize_in_progress' counters
  */
 void shardcache_set_size(shardcache_t *cache, size_t new_size);
 
+/**
+ * @brief Reserve a dedicated portion of the cache for the keys starting with a given prefix
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param name    The name of the namespace (used to label its counters)
+ * @param prefix  The prefix selecting the keys belonging to the namespace
+ * @param quota   The amount of memory (in bytes) reserved to the namespace,
+ *                subtracted from the size of the shared cache
+ * @param borrow  If not zero the namespace can grow beyond its quota using the
+ *                capacity left idle by the other namespaces
+ * @return 0 on success, -1 otherwise (too many namespaces, duplicated name or prefix,
+ *         or a quota which doesn't fit in the actual cache size)
+ * @note Each namespace has its own arc cache, so the keys of a namespace can't evict
+ *       (or be evicted by) the keys of the other namespaces. Keys not matching any
+ *       prefix are stored in the shared cache, when more prefixes match a key the
+ *       longest one wins.
+ * @note The borrowed capacity is recomputed every second (giving out at most half of
+ *       the idle capacity) and is reclaimed as soon as the lending namespaces need it
+ *       back. Each namespace exports the counters '<name>_gets', '<name>_cache_misses',
+ *       '<name>_cache_size', '<name>_cache_limit' and '<name>_borrowed'
+ * @note Keys already cached in the shared cache are not moved to the new namespace,
+ *       they will be evicted as the shared cache fills up. Namespaces are meant to be
+ *       configured right after shardcache_create(), before the keys matching their
+ *       prefix are requested
+ */
+int shardcache_add_namespace(shardcache_t *cache,
+                             const char *name,
+                             const char *prefix,
+                             size_t quota,
+                             int borrow);
+
+/*
+ * @brief Allows to switch the cache to epoch based reclamation
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   1 to use epoch based reclamation, 0 to use reference counting\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the epoch_reclamation setting,
+ *         -1 if the setting can't be changed because the cache is not empty
+ * @note With epoch based reclamation the threads looking up cached items don't
+ *       need to retain them (which requires atomic operations on a counter shared
+ *       by all the threads accessing the same item), they only announce the epoch
+ *       they are running in. Items removed from the cache are released once all
+ *       the threads which might still be accessing them have moved on.
+ * @note Can be changed only while the cache is empty (right after shardcache_create())
+ * @note defaults to 0
+ */
+int shardcache_epoch_reclamation(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the maximum number of objects evicted from an arc
+ *        partition in a single batch (while holding the partition lock)
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The new batch size, 0 restores the default\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the resize_batch setting
+ * @note Applies to the evictions triggered by new objects as well as to the
+ *       ones done in background after shrinking the cache
+ * @note defaults to SHARDCACHE_RESIZE_BATCH_DEFAULT
+ */
+int shardcache_resize_batch(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Save the content of the cache to a snapshot file
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param path    The path of the snapshot file (replaced atomically)
+ * @return The number of objects saved, -1 in case of errors
+ * @note Only the complete values of the keys owned by this node are saved
+ *       (together with their expiration time and the arc list they were in).
+ *       The copies of remote keys, the volatile keys and the big values which
+ *       are only partially held in memory are skipped
+ */
+int shardcache_snapshot_save(shardcache_t *cache, const char *path);
+
+/**
+ * @brief Load the objects saved in a snapshot file into the cache
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param path    The path of the snapshot file
+ * @return The number of objects loaded, -1 in case of errors
+ * @note The file is memory-mapped and loaded in parallel by up to one thread
+ *       for each arc partition. Keys which are not owned by this node anymore,
+ *       keys already expired and keys already present in the cache are skipped
+ * @note Values changed in the storage after the snapshot has been saved are
+ *       served from the cache until they expire (or are set/evicted)
+ */
+int shardcache_snapshot_load(shardcache_t *cache, const char *path);
+
+/**
+ * @brief Keep a snapshot of the cache to warm it up after a restart
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param path      The path of the snapshot file, NULL disables the snapshots
+ * @param interval  Save a snapshot every 'interval' seconds,
+ *                  0 saves it only when the instance is destroyed
+ * @return 0 on success, -1 otherwise
+ * @note If the file exists when it's set for the first time, it's loaded right
+ *       away (see shardcache_snapshot_load()), so this is meant to be called
+ *       right after shardcache_create() (and after shardcache_add_namespace())
+ */
+int shardcache_set_snapshot(shardcache_t *cache, const char *path, int interval);
+
 int shardcache_set_workers_num(shardcache_t *cache, unsigned int num_workers);
 
+typedef enum {
+    // the connections are handed to the workers in turn
+    SHARDCACHE_WORKERS_BALANCING_ROUND_ROBIN = 0,
+    // each connection goes to the worker with the lowest load
+    SHARDCACHE_WORKERS_BALANCING_LEAST_LOADED = 1,
+    // each connection goes to the less loaded of two workers
+    // (the next one in turn and a pseudo-random one)
+    SHARDCACHE_WORKERS_BALANCING_TWO_CHOICES = 2
+} shardcache_workers_balancing_t;
+
+/*
+ * @brief Allows to change how the new connections are assigned to the workers
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The new balancing mode (or -1 to only query the actual value)
+ * @return the previous value for the balancing mode
+ * @note The load of a worker is the number of connections it's handling (or
+ *       which have been queued to it), workers which didn't complete a loop
+ *       for a while (stuck in a slow operation) are avoided
+ * @note defaults to SHARDCACHE_WORKERS_BALANCING_DEFAULT
+ */
+int shardcache_workers_balancing(shardcache_t *cache, shardcache_workers_balancing_t new_value);
+
+/*
+ * @brief Allows to enable/disable the migration of connections among the workers
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   1 if a worker which stays overloaded (compared to the
+ *                    average) should move some of its idle connections to
+ *                    the least loaded worker, 0 otherwise.\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the workers_migration setting
+ * @note defaults to 0
+ */
+int shardcache_workers_migration(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Let each worker accept the connections on its own listening socket
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param enabled  If not zero each worker opens a SO_REUSEPORT socket on the
+ *                 node address and serves the connections it accepts, bypassing
+ *                 the listener thread (and the queue to the workers) which becomes
+ *                 a bottleneck when lots of clients (re)connect at once\n
+ *                 If zero the connections are accepted by the listener thread
+ *                 and dispatched round-robin to the workers (the default)
+ * @return 0 on success, -1 if SO_REUSEPORT is not supported on this platform
+ * @note The switch happens asynchronously (as soon as the threads wake up),
+ *       the connections queued on the sockets being closed are lost
+ */
+int shardcache_set_listeners_reuseport(shardcache_t *cache, int enabled);
+
 /**
  * @brief Get partial value data value for a key
  * @param cache   A valid pointer to a shardcache_t structure
@@ -10,6 +10,9 @@
 #define THREAD_SAFE
 #include <atomic_defs.h>
 
+#include <string.h>
+#include <sys/uio.h>
+
 #include <linklist.h>
 #include <chash.h>
 #include <hashtable.h>
@@ -18,6 +21,9 @@
 
 #include "connections_pool.h"
 #include "arc.h"
+#include "slab.h"
+#include "hotkeys.h"
+#include "timing_wheel.h"
 #include "serving.h"
 #include "counters.h"
 #include "shardcache.h"
@@ -25,6 +31,34 @@
 
 #define DEBUG_DUMP_MAXSIZE 128
 
+#define SHARDCACHE_REMOTE_HOTKEYS_WIDTH 4096 // number of counters in each row of the
+                                             // sketch used to detect hot remote keys
+
+#define SHARDCACHE_EXPIRERS_MAX 8 // maximum number of expirers (and expirer threads),
+                                  // one expirer is created for each arc partition
+
+// active expiration in lazy_expiration mode (where no timers are scheduled for the cached objects)
+#define SHARDCACHE_EXPIRE_SAMPLE_SIZE 20       // number of objects probed in each sampling round
+#define SHARDCACHE_EXPIRE_SAMPLE_ROUNDS_MAX 16 // maximum number of rounds in a single cycle
+#define SHARDCACHE_EXPIRE_SAMPLE_THRESHOLD 25  // percentage of expired objects in a round
+                                               // above which another round is done right away
+#define SHARDCACHE_EXPIRE_SAMPLE_BUSY_INTERVAL 100 // ms to wait before the next cycle if the previous
+                                                   // one reached the rounds limit
+
+#define SHARDCACHE_RECLAIM_BACKLOG_MAX (256<<20) // max amount of bytes waiting to be released by the
+                                                 // reclaimer thread, beyond that buffers are released inline
+#define SHARDCACHE_RECLAIM_INTERVAL 100 // how often (in milliseconds) the reclaimer thread drains its queue
+
+#define SHARDCACHE_CHUNK_SIZE (1<<20)             // size of the chunks holding the big values
+#define SHARDCACHE_CHUNKED_THRESHOLD (4<<20)      // values bigger than this are stored as a chunk list,
+                                                  // which can be released (and fetched again) chunk by chunk
+
+#define SHARDCACHE_SNAPSHOT_LOADERS_MAX 8 // maximum number of threads loading a snapshot
+                                         // (one for each arc partition)
+
+#define SHARDCACHE_COBJ_LOCKS 1024 // number of striped locks used to synchronize
+                                   // access to the cached objects (must be a power of 2)
+
 #define LIKELY(__e) __builtin_expect((__e), 1)
 #define UNLIKELY(__e) __builtin_expect((__e), 0)
 
@@ -76,6 +110,42 @@ typedef struct {
     queue_t *queue;
 } shardcache_async_io_context_t;
  
+typedef struct {
+    shardcache_t *cache;
+    pthread_t th;            // the thread expiring the keys handled by this expirer
+    pthread_mutex_t lock;    // lock protecting the wheel and the timers tables
+    pthread_cond_t cond;     // used to wake up the thread (when quitting)
+    timing_wheel_t *wheel;   // the expiration timers (one tick per second)
+    hashtable_t *timers[2];  // the expiration timer of each key, indexed by key
+                             // (one table for cached objects and one for volatile items)
+    queue_t *refresh_queue;  // the keys of the stale objects which need to be refreshed
+    uint64_t num_timers;       // the number of timers in the wheel and the number of keys
+    uint64_t tick_expirations; // expired during the last tick (updated after each tick)
+    int sample_partition;      // the next arc partition to sample (in lazy expiration mode)
+    int sample_arc;            // the arc being sampled (0 for the shared cache,
+                               // the namespace index + 1 otherwise)
+} shardcache_expirer_t;
+
+#define SHARDCACHE_NAMESPACE_COUNTERS 5
+
+typedef struct {
+    char name[SHARDCACHE_NAMESPACE_NAME_MAX + 1];
+    char *prefix;          // the prefix selecting the keys belonging to the namespace
+    size_t plen;           // the length of the prefix
+    arc_t *arc;            // the arc instance holding the keys of the namespace
+    size_t quota;          // the amount of memory reserved to the namespace
+    int borrow;            // boolean flag indicating if the namespace can borrow idle capacity
+    // NOTE: the following members are exported as counters
+    //       and must be accessed only via atomic functions
+    uint64_t gets;         // the number of gets for keys in the namespace
+    uint64_t cache_misses; // the number of cache misses for keys in the namespace
+    uint64_t cache_size;   // the memory actually used by the namespace
+                           // (refreshed by shardcache_update_size_counters())
+    uint64_t cache_limit;  // the actual size of the arc (quota + borrowed)
+    uint64_t borrowed;     // the capacity borrowed from the other namespaces
+    char labels[SHARDCACHE_NAMESPACE_COUNTERS][SHARDCACHE_NAMESPACE_NAME_MAX + 32]; // the counter labels
+} shardcache_namespace_t;
+
 struct _shardcache_s {
     char *me;   // a copy of the label for this node
                 // it won't be changed until destruction
@@ -89,12 +159,56 @@ struct _shardcache_s {
     int num_shards;   // the number of shards in the array
 
     arc_t *arc;       // the internal arc instance
+    pthread_mutex_t cobj_locks[SHARDCACHE_COBJ_LOCKS]; // striped (recursive) locks protecting the
+                                                      // cached objects (see COBJ_LOCK() in arc_ops.h)
+    pthread_cond_t cobj_conds[SHARDCACHE_COBJ_LOCKS];  // signaled (using the matching striped lock) when an
+                                                      // in-flight fetch completes (see cobj_wait_fetch())
+    int fetch_wait_timeout; // how long (in milliseconds) a synchronous fetcher waits for the result of
+                            // a fetch already in progress for the same key
     arc_ops_t ops;    // the structure holding the arc operations callbacks
     size_t arc_size;  // the actual size of the arc cache
                       // NOTE: arc_size is updated using the atomic builtins,
                       // don't access it directly but use ATOMIC_READ() instead
                       // (see deps/libhl/src/atomic_defs.h)
-    uint64_t *arc_lists_size[4];
+    uint64_t arc_lists_size[4]; // the size of the mru, mfu, mrug and mfug lists
+                                // (aggregated across all the arc partitions and
+                                // refreshed by shardcache_update_size_counters())
+    int arc_partitions; // the number of partitions the arc cache has been split into
+    shardcache_namespace_t namespaces[SHARDCACHE_NAMESPACES_MAX]; // the namespaces, each one with its own arc
+    int num_namespaces;                // the number of initialized namespaces (to be accessed using
+                                       // ATOMIC_READ(), a namespace is never modified once published)
+    pthread_mutex_t namespaces_lock;   // serializes the creation of the namespaces
+    size_t namespaces_quota;           // the sum of the quotas of all the namespaces
+    queue_t *reclaim_queue;          // the buffers of the evicted objects waiting to be released
+    pthread_t reclaimer_th;          // the thread releasing the buffers in the reclaim_queue
+    pthread_mutex_t reclaimer_lock;  // used with reclaimer_cond
+    pthread_cond_t reclaimer_cond;   // used to wake up the reclaimer thread (when the backlog
+                                     // grows or when quitting)
+    uint64_t reclaim_pending;        // the amount of bytes in the reclaim_queue
+                                     // (note must be accessed only via atomic functions)
+    int epoch_reclamation; // boolean flag indicating if the arc cache uses epoch based reclamation
+                           // instead of reference counting (see arc_reclamation_t in arc.h)
+    int resize_batch;   // max number of objects evicted from an arc partition in a single batch
+                        // (the partition lock is released between batches)
+    pthread_mutex_t resize_lock; // serializes the start/stop of the resize thread
+    pthread_t resize_th;         // the thread evicting (in batches) the objects exceeding
+                                 // the size set by shardcache_set_size()
+    int resize_th_started;       // the resize thread has been started (and needs to be joined)
+    uint64_t resizing;           // 1 while the resize thread is running, 0 otherwise
+                                 // (note must be accessed only via atomic functions)
+    char *snapshot_path;           // the file where the snapshots are saved (NULL == disabled)
+    int snapshot_interval;         // seconds between the periodic snapshots (0 == only on destroy)
+    pthread_mutex_t snapshot_lock; // protects snapshot_path and snapshot_interval
+    pthread_cond_t snapshot_cond;  // wakes up the snapshot thread (when the settings change
+                                   // or when quitting)
+    pthread_t snapshot_th;         // the thread saving the periodic snapshots
+    int snapshot_th_started;       // the snapshot thread has been started (and needs to be joined)
+    arc_stats_t arc_stats; // a snapshot of the arc statistics
+                           // (refreshed by shardcache_update_size_counters())
+    slab_stats_t slab_stats;     // a snapshot of the (process-wide) slab allocator statistics
+    uint64_t slab_fragmentation; // percentage of the memory held by the slab allocator
+                                 // which is not storing requested bytes
+                                 // (refreshed by shardcache_update_size_counters())
 
     // lock used internally during the migration procedures
     // and when selecting the node owner for a key
@@ -119,16 +233,14 @@ struct _shardcache_s {
 
     hashtable_t *volatile_storage; // an hashtable used as volatile storage
 
-    hashtable_t *cache_timeouts; // hashtable holding the timeout_id of the expiration timers
-                                 // for cached objects
-    hashtable_t *volatile_timeouts; // hashtable holding the timeout_id for the expiration timers
-                                    // for volatile items
+    shardcache_expirer_t *expirers; // the expirers, each one taking care of a subset of the keys
+    int num_expirers;               // the number of expirers
+    uint64_t expirer_timers;        // the number of scheduled expiration timers and
+    uint64_t expirer_tick_expirations; // the number of keys expired during the last tick,
+                                       // summed across all the expirers
+                                       // (refreshed by shardcache_update_size_counters())
 
-    iomux_t *expirer_mux; // iomux used to handle the expiration timers
-    pthread_t expirer_th; // the thread taking care of propagating expiration commands
-    queue_t *expirer_queue; // the queue holding shedule/unschedule expiration jobs
-
-    int arc_mode; // the arc mode to use **TODO - DOCUMENT**
+    int arc_mode; // the arc mode to use (strict, loose or tinylfu, see arc_mode_t in shardcache.h)
 
     int cache_on_set; // cache the value on set commands (instead of waiting for a get
                       // to happen before loading the new value into the cache)
@@ -144,12 +256,33 @@ struct _shardcache_s {
                          // by a background thread
 
     int force_caching; // boolean flag indicating if the items fetched from remote peers should be
-                       // always cached instead of applying th 10% chance of being kept
+                       // always cached instead of only when they are hot
+
+    int remote_caching_threshold; // number of recent accesses after which a remote item
+                                  // is considered hot and kept in the local cache
+    hotkeys_t *remote_hotkeys;    // estimates the access frequency of the remote items
+                                  // (and keeps track of the hottest ones)
+
+    int hot_key_push_threshold;   // number of recent requests (served to peers and clients) after which
+                                  // a key owned by this node is pushed to all the peers (0 == disabled)
+    int hot_key_push_ttl;         // ttl of the copies pushed to the peers
+    hotkeys_t *owned_hotkeys;     // estimates the request rate of the keys owned by this node
+    hashtable_t *hot_pushed_keys; // the time of the last push for the keys which have been pushed
+                                  // recently (the older ones are pruned by the expirer)
+
+    int negative_caching_ttl;     // ttl of the tombstones cached for the keys which
+                                  // have not been found (0 == disabled)
+
+    int range_fetch_bypass;       // boolean flag indicating if the ranges requested for keys not
+                                  // in the cache are read straight from the storage (using the
+                                  // fetch_range callback) without loading the whole value
 
     int expire_time;   // global expire time for cached items, if 0 items in the cache will never
                        // expire and will need to be either explicitly or naturally evicted to be
                        // removed from the cache
-    
+    int stale_grace_time; // number of seconds during which expired items are still served
+                          // (as stale) while being refreshed in the background
+
     int iomux_run_timeout_low;  // timeout passed to iomux_run()
                                 // by both the expirer and the listener
     int iomux_run_timeout_high; // timeout passed to iomux_run()
@@ -159,6 +292,10 @@ struct _shardcache_s {
     int serving_look_ahead;     // amount of pipelined requests to handle in parallel
                                 // while the current is being served
 
+    int workers_balancing;      // how the new connections are assigned to the workers
+    int workers_migration;      // overloaded workers move idle connections to the other ones
+    int io_backend;             // the event loop used by the serving workers
+
     shardcache_serving_t *serv; // the serving-subsystem instance
 
     pthread_t migrate_th; // the migration thread
@@ -177,7 +314,11 @@ struct _shardcache_s {
 #define SHARDCACHE_COUNTER_LABELS_ARRAY  \
         { "gets", "sets", "dels", "heads", "evicts", "expires", \
           "cache_misses", "fetch_remote", "fetch_local", "not_found", \
-          "volatile_table_size", "cache_size", "cached_items", "errors" }
+          "volatile_table_size", "cache_size", "cached_items", "errors", \
+          "hot_key_pushes", "coalesced_fetches", "coalesced_timeouts", \
+          "stale_serves", "stale_refreshes", "sampled_keys", \
+          "sampled_expires", "resize_evictions", "deferred_frees", \
+          "chunk_trims", "chunk_fetches", "range_fetches" }
 
 #define SHARDCACHE_COUNTER_GETS             0
 #define SHARDCACHE_COUNTER_SETS             1
@@ -193,7 +334,19 @@ struct _shardcache_s {
 #define SHARDCACHE_COUNTER_CACHE_SIZE       11
 #define SHARDCACHE_COUNTER_CACHED_ITEMS     12
 #define SHARDCACHE_COUNTER_ERRORS           13
-#define SHARDCACHE_NUM_COUNTERS             14
+#define SHARDCACHE_COUNTER_HOT_KEY_PUSHES   14
+#define SHARDCACHE_COUNTER_COALESCED        15
+#define SHARDCACHE_COUNTER_COALESCED_TIMEOUTS 16
+#define SHARDCACHE_COUNTER_STALE_SERVES     17
+#define SHARDCACHE_COUNTER_STALE_REFRESHES  18
+#define SHARDCACHE_COUNTER_SAMPLED_KEYS    19
+#define SHARDCACHE_COUNTER_SAMPLED_EXPIRES 20
+#define SHARDCACHE_COUNTER_RESIZE_EVICTIONS 21
+#define SHARDCACHE_COUNTER_DEFERRED_FREES   22
+#define SHARDCACHE_COUNTER_CHUNK_TRIMS      23
+#define SHARDCACHE_COUNTER_CHUNK_FETCHES    24
+#define SHARDCACHE_COUNTER_RANGE_FETCHES    25
+#define SHARDCACHE_NUM_COUNTERS             26
     struct {
         const char *name; // the exported label of the counter
         uint64_t value;   // the actual value (accessed using the atomic builtins)
@@ -220,6 +373,45 @@ typedef struct {
     uint32_t expire;
 } volatile_object_t;
 
+// returns the namespace the key belongs to (the one with the longest matching prefix)
+// or NULL if the key belongs to the shared cache
+static inline shardcache_namespace_t *
+shardcache_namespace_for_key(shardcache_t *cache, const void *key, size_t klen)
+{
+    shardcache_namespace_t *match = NULL;
+    int num = ATOMIC_READ(cache->num_namespaces);
+    int i;
+    for (i = 0; i < num; i++) {
+        shardcache_namespace_t *ns = &cache->namespaces[i];
+        if (klen >= ns->plen && (!match || ns->plen > match->plen) &&
+            memcmp(key, ns->prefix, ns->plen) == 0)
+        {
+            match = ns;
+        }
+    }
+    return match;
+}
+
+// returns the arc instance holding the key
+static inline arc_t *
+shardcache_arc_for_key(shardcache_t *cache, const void *key, size_t klen)
+{
+    shardcache_namespace_t *ns = shardcache_namespace_for_key(cache, key, klen);
+    return ns ? ns->arc : cache->arc;
+}
+
+// returns the number of objects cached across the shared cache and all the namespaces
+static inline uint64_t
+shardcache_arc_count(shardcache_t *cache)
+{
+    uint64_t count = arc_count(cache->arc);
+    int num = ATOMIC_READ(cache->num_namespaces);
+    int i;
+    for (i = 0; i < num; i++)
+        count += arc_count(cache->namespaces[i].arc);
+    return count;
+}
+
 int shardcache_test_migration_ownership(shardcache_t *cache,
         void *key, size_t klen, char *owner, size_t *len);
 
@@ -253,7 +445,35 @@ int shardcache_set_migration_continuum(shardcache_t *cache, shardcache_node_t **
 int shardcache_schedule_expiration(shardcache_t *cache, void *key, size_t klen, time_t expire, int is_volatile);
 int shardcache_unschedule_expiration(shardcache_t *cache, void *key, size_t klen, int is_volatile);
 
+// release the data of an evicted object, big buffers are handed to the
+// reclaimer thread (unless its backlog is full) instead of being freed inline
+void shardcache_free_deferred(shardcache_t *cache, void *data, size_t dlen);
+
+// stop the snapshot thread and save the final snapshot (if a snapshot file has been set)
+void shardcache_snapshot_stop(shardcache_t *cache);
+
 void shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk);
 
+// iov points straight at the memory of the cached object (the value is
+// split into iovcnt pieces and its total size is total), it can be accessed
+// only until the callback returns
+typedef int (*shardcache_get_inplace_callback_t)(const struct iovec *iov, int iovcnt, size_t total, void *priv);
+
+// pass the value of a key to the callback without copying it, but only if
+// it's already entirely in the cache (no fetch is ever started)
+// returns the value returned by the callback, or 1 if the value is not
+// in the cache (the get needs to go through shardcache_get() then)
+// NOTE: the callback is called holding the object lock
+int shardcache_get_inplace(shardcache_t *cache, void *key, size_t klen,
+                           shardcache_get_inplace_callback_t cb, void *priv);
+
+// record a request for a key served to a peer (or a client),
+// if the key is owned by this node and it's hot it will be pushed to all the peers
+void shardcache_hot_key_access(shardcache_t *cache, void *key, size_t klen);
+
+// load a value pushed by the owner of a hot key into the local cache
+// (a copy pushed without a ttl expires as any other cached item)
+int shardcache_load_pushed(shardcache_t *cache, void *key, size_t klen, void *value, size_t vlen, uint32_t ttl);
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
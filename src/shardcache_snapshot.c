@@ -0,0 +1,466 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "shardcache.h"
+#include "shardcache_internal.h"
+#include "arc_ops.h"
+
+/*
+ * Snapshot file layout (integers are stored in host byte order,
+ * a snapshot is meant to be reloaded by the same node):
+ *
+ *   header : magic[8] | version (32) | reserved (32) | count (64) | timestamp (64)
+ *   record : klen (32) | flags (32) | vlen (64) | expire (64) | key | value
+ *
+ * The records of each arc partition are written starting from the least
+ * recently used object, so loading them in order preserves their recency.
+ */
+
+#define SHARDCACHE_SNAPSHOT_MAGIC "SHCSNAP\0"
+#define SHARDCACHE_SNAPSHOT_VERSION 1
+
+#define SHARDCACHE_SNAPSHOT_RECORD_FREQUENT (1) // the object was in the mfu list
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t timestamp;
+} shardcache_snapshot_header_t;
+
+typedef struct {
+    uint32_t klen;
+    uint32_t flags;
+    uint64_t vlen;
+    uint64_t expire; // absolute time (in seconds), 0 == never
+} shardcache_snapshot_record_t;
+
+typedef struct {
+    shardcache_t *cache;
+    FILE *out;
+    time_t now;
+    uint64_t count;
+    int error;
+} shardcache_snapshot_save_arg_t;
+
+static int
+shardcache_snapshot_save_object(arc_resource_t res, void *ptr, int frequent, void *priv)
+{
+    shardcache_snapshot_save_arg_t *arg = (shardcache_snapshot_save_arg_t *)priv;
+    shardcache_t *cache = arg->cache;
+    cached_object_t *obj = (cached_object_t *)ptr;
+
+    COBJ_LOCK(cache, obj);
+
+    // only the complete values owned by this node are worth saving
+    // (volatile keys would be lost anyway and big values partially
+    //  released by arc_ops_trim() would need to be fetched again)
+    if (!COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) || !COBJ_HAS_DATA(obj) || !obj->dlen ||
+        (obj->flags & (COBJ_FLAG_EVICTED|COBJ_FLAG_REMOTE|COBJ_FLAG_TOMBSTONE|COBJ_FLAG_STALE)) ||
+        ht_exists(cache->volatile_storage, obj->key, obj->klen))
+    {
+        COBJ_UNLOCK(cache, obj);
+        return 0;
+    }
+
+    uint32_t num_pieces = cobj_num_pieces(obj);
+    uint32_t i;
+    for (i = 0; obj->chunks && i < num_pieces; i++) {
+        if (!obj->chunks[i]) {
+            COBJ_UNLOCK(cache, obj);
+            return 0;
+        }
+    }
+
+    time_t ttl = obj->ttl ? obj->ttl : ATOMIC_READ(cache->expire_time);
+    shardcache_snapshot_record_t record = {
+        .klen = obj->klen,
+        .flags = frequent ? SHARDCACHE_SNAPSHOT_RECORD_FREQUENT : 0,
+        .vlen = obj->dlen,
+        .expire = ttl > 0 ? obj->ts_sec + ttl : 0
+    };
+
+    if (record.expire && record.expire <= arg->now) {
+        COBJ_UNLOCK(cache, obj);
+        return 0;
+    }
+
+    if (fwrite(&record, sizeof(record), 1, arg->out) != 1 ||
+        fwrite(obj->key, obj->klen, 1, arg->out) != 1)
+    {
+        arg->error = errno;
+        COBJ_UNLOCK(cache, obj);
+        return -1;
+    }
+
+    for (i = 0; i < num_pieces; i++) {
+        size_t len = 0;
+        void *piece = cobj_piece(cache, obj, i, &len, NULL);
+        if (!piece || fwrite(piece, len, 1, arg->out) != 1) {
+            arg->error = piece ? errno : EIO;
+            COBJ_UNLOCK(cache, obj);
+            return -1;
+        }
+    }
+
+    COBJ_UNLOCK(cache, obj);
+
+    arg->count++;
+    return 0;
+}
+
+int
+shardcache_snapshot_save(shardcache_t *cache, const char *path)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+        return -1;
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        SHC_ERROR("Can't open the snapshot file %s: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        SHC_ERROR("Can't open the snapshot file %s: %s", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    shardcache_snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SHARDCACHE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SHARDCACHE_SNAPSHOT_VERSION;
+    header.timestamp = time(NULL);
+
+    shardcache_snapshot_save_arg_t arg = {
+        .cache = cache,
+        .out = out,
+        .now = header.timestamp,
+        .count = 0,
+        .error = 0
+    };
+
+    // the header is written again once the number of records is known
+    if (fwrite(&header, sizeof(header), 1, out) != 1)
+        arg.error = errno;
+
+    int i;
+    int num_arcs = ATOMIC_READ(cache->num_namespaces) + 1;
+    for (i = 0; i < num_arcs && !arg.error; i++) {
+        arc_t *arc = i ? cache->namespaces[i - 1].arc : cache->arc;
+        if (arc_foreach(arc, shardcache_snapshot_save_object, &arg) == -1 && !arg.error)
+            arg.error = ENOMEM;
+    }
+
+    if (!arg.error) {
+        header.count = arg.count;
+        if (fseek(out, 0, SEEK_SET) != 0 ||
+            fwrite(&header, sizeof(header), 1, out) != 1 ||
+            fflush(out) != 0 ||
+            fsync(fd) != 0)
+        {
+            arg.error = errno;
+        }
+    }
+
+    if (fclose(out) != 0 && !arg.error)
+        arg.error = errno;
+
+    if (!arg.error && rename(tmp_path, path) != 0)
+        arg.error = errno;
+
+    if (arg.error) {
+        SHC_ERROR("Can't save the snapshot to %s: %s", path, strerror(arg.error));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    SHC_NOTICE("Saved %"PRIu64" cached objects to the snapshot %s", arg.count, path);
+    return arg.count;
+}
+
+typedef struct {
+    shardcache_t *cache;
+    char *base;
+    uint64_t *offsets;
+    uint64_t count;
+    int index;
+    int num_threads;
+    time_t now;
+    uint64_t loaded;
+} shardcache_snapshot_load_arg_t;
+
+static void *
+shardcache_snapshot_loader(void *priv)
+{
+    shardcache_snapshot_load_arg_t *arg = (shardcache_snapshot_load_arg_t *)priv;
+    shardcache_t *cache = arg->cache;
+    uint64_t i;
+
+    for (i = arg->index; i < arg->count; i += arg->num_threads) {
+        shardcache_snapshot_record_t record;
+        memcpy(&record, arg->base + arg->offsets[i], sizeof(record));
+        void *key = arg->base + arg->offsets[i] + sizeof(record);
+        void *value = (char *)key + record.klen;
+
+        time_t ttl = 0;
+        if (record.expire) {
+            if (record.expire <= arg->now)
+                continue;
+            ttl = record.expire - arg->now;
+        }
+
+        // the continuum might have changed since the snapshot has been saved
+        char node_name[1024];
+        size_t node_len = sizeof(node_name);
+        if (shardcache_test_ownership(cache, key, record.klen, node_name, &node_len) != 1)
+            continue;
+
+        arc_t *arc = shardcache_arc_for_key(cache, key, record.klen);
+
+        // never overwrite a value loaded in the meanwhile
+        void *obj_ptr = NULL;
+        arc_resource_t res = arc_lookup_nofetch(arc, key, record.klen, &obj_ptr);
+        if (res) {
+            arc_release_resource(arc, res);
+            continue;
+        }
+
+        int rc = (record.flags & SHARDCACHE_SNAPSHOT_RECORD_FREQUENT)
+               ? arc_load_frequent(arc, key, record.klen, value, record.vlen, ttl)
+               : arc_load(arc, key, record.klen, value, record.vlen, ttl);
+        if (rc < 0)
+            continue;
+
+        if (ttl && !ATOMIC_READ(cache->lazy_expiration))
+            shardcache_schedule_expiration(cache, key, record.klen, ttl, 0);
+
+        arg->loaded++;
+    }
+
+    return NULL;
+}
+
+int
+shardcache_snapshot_load(shardcache_t *cache, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        SHC_ERROR("Can't open the snapshot file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(shardcache_snapshot_header_t)) {
+        SHC_ERROR("Invalid snapshot file %s", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        SHC_ERROR("Can't map the snapshot file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    madvise(base, size, MADV_WILLNEED);
+
+    shardcache_snapshot_header_t header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, SHARDCACHE_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SHARDCACHE_SNAPSHOT_VERSION ||
+        header.count > (size - sizeof(header)) / sizeof(shardcache_snapshot_record_t))
+    {
+        SHC_ERROR("Invalid snapshot file %s", path);
+        munmap(base, size);
+        return -1;
+    }
+
+    // index the records (so that they can be split among the loader threads)
+    // checking that none of them exceeds the end of the file
+    uint64_t *offsets = malloc((header.count ? header.count : 1) * sizeof(uint64_t));
+    if (!offsets) {
+        munmap(base, size);
+        return -1;
+    }
+
+    size_t offset = sizeof(header);
+    uint64_t i;
+    for (i = 0; i < header.count; i++) {
+        shardcache_snapshot_record_t record;
+        if (size - offset < sizeof(record))
+            break;
+        memcpy(&record, base + offset, sizeof(record));
+        if (!record.klen || record.vlen > size - offset - sizeof(record) ||
+            record.klen > size - offset - sizeof(record) - record.vlen)
+        {
+            break;
+        }
+        offsets[i] = offset;
+        offset += sizeof(record) + record.klen + record.vlen;
+    }
+
+    if (i != header.count) {
+        SHC_ERROR("Truncated snapshot file %s", path);
+        free(offsets);
+        munmap(base, size);
+        return -1;
+    }
+
+    int num_threads = cache->arc_partitions < SHARDCACHE_SNAPSHOT_LOADERS_MAX
+                    ? cache->arc_partitions
+                    : SHARDCACHE_SNAPSHOT_LOADERS_MAX;
+    if (num_threads < 1)
+        num_threads = 1;
+    if ((uint64_t)num_threads > header.count)
+        num_threads = header.count ? header.count : 1;
+
+    shardcache_snapshot_load_arg_t args[num_threads];
+    pthread_t threads[num_threads];
+    time_t now = time(NULL);
+    int n;
+    for (n = 0; n < num_threads; n++) {
+        args[n].cache = cache;
+        args[n].base = base;
+        args[n].offsets = offsets;
+        args[n].count = header.count;
+        args[n].index = n;
+        args[n].num_threads = num_threads;
+        args[n].now = now;
+        args[n].loaded = 0;
+    }
+
+    // the first slice is loaded by the calling thread
+    int started = 1;
+    for (n = 1; n < num_threads; n++) {
+        if (pthread_create(&threads[n], NULL, shardcache_snapshot_loader, &args[n]) != 0) {
+            SHC_WARNING("Can't create a snapshot loader thread, loading inline");
+            break;
+        }
+        started++;
+    }
+
+    // the slices whose thread couldn't be created are loaded inline as well
+    for (n = started; n < num_threads; n++)
+        shardcache_snapshot_loader(&args[n]);
+    shardcache_snapshot_loader(&args[0]);
+
+    uint64_t loaded = args[0].loaded;
+    for (n = 1; n < num_threads; n++) {
+        if (n < started)
+            pthread_join(threads[n], NULL);
+        loaded += args[n].loaded;
+    }
+
+    free(offsets);
+    munmap(base, size);
+
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, shardcache_arc_count(cache));
+
+    SHC_NOTICE("Loaded %"PRIu64" (out of %"PRIu64") cached objects from the snapshot %s",
+               loaded, header.count, path);
+    return loaded;
+}
+
+static void *
+shardcache_snapshot_thread(void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+
+    MUTEX_LOCK(cache->snapshot_lock);
+    while (!ATOMIC_READ(cache->quit)) {
+        int interval = cache->snapshot_interval;
+        int rc = 0;
+        if (interval > 0) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            struct timespec abstime = { now.tv_sec + interval, now.tv_usec * 1000 };
+            rc = pthread_cond_timedwait(&cache->snapshot_cond, &cache->snapshot_lock, &abstime);
+        } else {
+            pthread_cond_wait(&cache->snapshot_cond, &cache->snapshot_lock);
+        }
+
+        if (rc != ETIMEDOUT || ATOMIC_READ(cache->quit) || !cache->snapshot_path)
+            continue;
+
+        // the lock is not held while saving (so that the settings can be changed)
+        char *path = strdup(cache->snapshot_path);
+        MUTEX_UNLOCK(cache->snapshot_lock);
+        if (path) {
+            shardcache_snapshot_save(cache, path);
+            free(path);
+        }
+        MUTEX_LOCK(cache->snapshot_lock);
+    }
+    MUTEX_UNLOCK(cache->snapshot_lock);
+
+    return NULL;
+}
+
+int
+shardcache_set_snapshot(shardcache_t *cache, const char *path, int interval)
+{
+    if (interval < 0)
+        return -1;
+
+    MUTEX_LOCK(cache->snapshot_lock);
+    int first = !cache->snapshot_path;
+    free(cache->snapshot_path);
+    cache->snapshot_path = path ? strdup(path) : NULL;
+    cache->snapshot_interval = path ? interval : 0;
+
+    if (path && interval > 0 && !cache->snapshot_th_started) {
+        if (pthread_create(&cache->snapshot_th, NULL, shardcache_snapshot_thread, cache) != 0) {
+            SHC_ERROR("Can't create the snapshot thread");
+            MUTEX_UNLOCK(cache->snapshot_lock);
+            return -1;
+        }
+        cache->snapshot_th_started = 1;
+    }
+    pthread_cond_signal(&cache->snapshot_cond);
+    MUTEX_UNLOCK(cache->snapshot_lock);
+
+    // warm up the cache using the snapshot saved by the previous run
+    if (path && first && access(path, F_OK) == 0)
+        shardcache_snapshot_load(cache, path);
+
+    return 0;
+}
+
+void
+shardcache_snapshot_stop(shardcache_t *cache)
+{
+    MUTEX_LOCK(cache->snapshot_lock);
+    pthread_cond_signal(&cache->snapshot_cond);
+    MUTEX_UNLOCK(cache->snapshot_lock);
+
+    if (cache->snapshot_th_started) {
+        pthread_join(cache->snapshot_th, NULL);
+        cache->snapshot_th_started = 0;
+    }
+
+    if (cache->snapshot_path) {
+        shardcache_snapshot_save(cache, cache->snapshot_path);
+        free(cache->snapshot_path);
+        cache->snapshot_path = NULL;
+    }
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
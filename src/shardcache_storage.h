@@ -87,6 +87,39 @@ typedef int (*shardcache_fetch_local_item_callback_t)
 typedef int (*shardcache_fetch_items_callback_t)
     (void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv);
 
+/**
+ * @brief Callback to provide a portion of the value for a given key.
+ *
+ *        The shardcache instance will call this callback (if set) when only
+ *        a range of the value is needed (shardcache_get_offset() on a key not
+ *        found in the cache, or a part of a big cached value which has been
+ *        released to make room for other objects) so that the storage doesn't
+ *        need to read the whole value.
+ *
+ * @param key    A valid pointer to the key
+ * @param klen   The length of the key
+ * @param offset The offset from the beginning of the value
+ * @param len    The maximum amount of data to return
+ * @param value  A pointer to where to store the pointer to the requested data.
+ *               The caller has the responsibility to release the memory
+ *               containing the data.
+ * @param vlen   The length of the returned data will be stored at the location
+ *               pointed by vlen (it's less than len only if the end of the value
+ *               has been reached)
+ * @param total  The length of the complete value will be stored at the location
+ *               pointed by total
+ * @param priv   The 'priv' pointer previously stored in the shardcache_storage_t
+ *               structure at initialization time
+ * @return 0 on success; -1 otherwise
+ *
+ * @note If the key doesn't exist the callback returns 0, storing a NULL pointer
+ *       in 'value' and 0 in 'total'
+ * @note The returned value pointer MUST be a volatile copy and the caller
+ *       WILL release its resources
+ */
+typedef int (*shardcache_fetch_item_range_callback_t)
+    (void *key, size_t klen, size_t offset, size_t len, void **value, size_t *vlen, size_t *total, void *priv);
+
 /**
  * @brief Callback to store a new value for a given key.
  *
@@ -304,7 +337,7 @@ typedef void (*shardcache_thread_start_callback_t)(void *priv);
 typedef void (*shardcache_thread_exit_callback_t)(void *priv);
 
 
-#define SHARDCACHE_STORAGE_API_VERSION 0x03
+#define SHARDCACHE_STORAGE_API_VERSION 0x04
 
 typedef struct _shardcache_storage_s shardcache_storage_t;
 typedef int (*shardcache_storage_init_t)(shardcache_storage_t *, char **);
@@ -329,6 +362,9 @@ struct _shardcache_storage_s {
     //! The fetch multiple items callback
     shardcache_fetch_items_callback_t      fetch_multi;
 
+    //! The fetch range callback (optional, partial reads fall back to the fetch callback)
+    shardcache_fetch_item_range_callback_t fetch_range;
+
     //! The store callback (optional if the storage is indended to be read-only)
     shardcache_store_item_callback_t       store;
 
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "shardcache_internal.h" // for ATOMIC_* macros
+
+#include "sketch.h"
+
+#define SKETCH_SAMPLE_FACTOR 10
+
+#define SKETCH_INDEX(_s, _h, _i) \
+    (((_i) * ((_s)->mask + 1)) + ((((uint32_t)(_h)) + (_i) * ((uint32_t)((_h) >> 32))) & (_s)->mask))
+
+int
+sketch_init(sketch_t *sketch, size_t width, uint32_t counter_max)
+{
+    size_t size = 1;
+    while (size < width)
+        size <<= 1;
+
+    sketch->wide = (counter_max > UINT8_MAX);
+    sketch->table = calloc(SKETCH_DEPTH * size, sketch->wide ? sizeof(uint32_t) : sizeof(uint8_t));
+    if (!sketch->table)
+        return -1;
+    sketch->mask = size - 1;
+    sketch->counter_max = counter_max;
+    sketch->sample_size = size * SKETCH_SAMPLE_FACTOR;
+    sketch->additions = 0;
+    return 0;
+}
+
+void
+sketch_destroy(sketch_t *sketch)
+{
+    free(sketch->table);
+    sketch->table = NULL;
+}
+
+static void
+sketch_age(sketch_t *sketch)
+{
+    size_t i;
+    size_t size = (size_t)SKETCH_DEPTH * (sketch->mask + 1);
+    if (sketch->wide) {
+        uint32_t *table = (uint32_t *)sketch->table;
+        for (i = 0; i < size; i++) {
+            uint32_t value = ATOMIC_READ(table[i]);
+            if (value)
+                ATOMIC_CAS(table[i], value, value >> 1);
+        }
+    } else {
+        uint8_t *table = (uint8_t *)sketch->table;
+        for (i = 0; i < size; i++) {
+            uint8_t value = ATOMIC_READ(table[i]);
+            if (value)
+                ATOMIC_CAS(table[i], value, value >> 1);
+        }
+    }
+    ATOMIC_DECREASE(sketch->additions, sketch->sample_size >> 1);
+}
+
+uint32_t
+sketch_add(sketch_t *sketch, uint64_t hash, int *aged)
+{
+    uint32_t estimate = sketch->counter_max;
+    int i;
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        uint32_t value;
+        if (sketch->wide) {
+            uint32_t *counter = &((uint32_t *)sketch->table)[SKETCH_INDEX(sketch, hash, i)];
+            value = ATOMIC_READ(*counter);
+            if (value < sketch->counter_max && ATOMIC_CAS(*counter, value, value + 1))
+                value++;
+        } else {
+            uint8_t *counter = &((uint8_t *)sketch->table)[SKETCH_INDEX(sketch, hash, i)];
+            value = ATOMIC_READ(*counter);
+            if (value < sketch->counter_max && ATOMIC_CAS(*counter, (uint8_t)value, (uint8_t)(value + 1)))
+                value++;
+        }
+        if (value < estimate)
+            estimate = value;
+    }
+
+    // only the thread reaching exactly the sample size ages the sketch
+    int age = (ATOMIC_INCREASE(sketch->additions, 1) == sketch->sample_size);
+    if (age)
+        sketch_age(sketch);
+    if (aged)
+        *aged = age;
+
+    return estimate;
+}
+
+uint32_t
+sketch_estimate(sketch_t *sketch, uint64_t hash)
+{
+    uint32_t estimate = sketch->counter_max;
+    int i;
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        uint32_t value = sketch->wide
+                       ? ATOMIC_READ(((uint32_t *)sketch->table)[SKETCH_INDEX(sketch, hash, i)])
+                       : ATOMIC_READ(((uint8_t *)sketch->table)[SKETCH_INDEX(sketch, hash, i)]);
+        if (value < estimate)
+            estimate = value;
+    }
+    return estimate;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
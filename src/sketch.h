@@ -0,0 +1,93 @@
+#ifndef SHARDCACHE_SKETCH_H
+#define SHARDCACHE_SKETCH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Count-min sketch estimating how many times each key has been seen recently.
+ *
+ * Counters saturate at the maximum value provided at initialization time,
+ * which also determines their width (8 bits if the maximum fits, 32 bits
+ * otherwise). All the counters are halved once the number of recorded
+ * additions reaches 10 times the width of the sketch, so that old
+ * popularity fades away.
+ *
+ * The keys are identified by their sketch_hash().
+ *
+ * NOTE: updates are lossy (concurrent increments of the same counter might be
+ *       lost), which is fine for an estimate
+ */
+
+#define SKETCH_DEPTH 4
+
+typedef struct _sketch_s {
+    void *table;          // SKETCH_DEPTH rows of (mask + 1) counters
+    uint32_t mask;
+    uint32_t counter_max; // the value at which the counters saturate
+    int wide;             // the counters are 32 bits wide (8 bits otherwise)
+    uint32_t sample_size; // number of additions after which the counters are halved
+    uint32_t additions;   // note must be accessed only via atomic functions
+} sketch_t;
+
+/* 64bit FNV-1a followed by the murmur3 finalizer, the two halves are used
+ * to derive the counter index in each row of the sketch.
+ * NOTE: also used to spread the keys among partitions (and workers), in which
+ *       case the upper half must be used, so that keys falling in the same
+ *       partition are not clustered in the same counters of its sketch */
+static inline uint64_t
+sketch_hash(const void *key, size_t klen)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *p = (const unsigned char *)key;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * @brief Initialize a sketch
+ * @param sketch : A pointer to the sketch_t structure to initialize
+ * @param width : The number of counters in each row of the sketch
+ *                (rounded up to the next power of 2)
+ * @param counter_max : The value at which the counters saturate
+ * @return 0 on success, -1 in case of errors
+ */
+int sketch_init(sketch_t *sketch, size_t width, uint32_t counter_max);
+
+/**
+ * @brief Release the resources used by a sketch
+ * @param sketch : A valid pointer to an initialized sketch_t structure
+ */
+void sketch_destroy(sketch_t *sketch);
+
+/**
+ * @brief Record an addition of the key with the given hash
+ * @param sketch : A valid pointer to an initialized sketch_t structure
+ * @param hash : The sketch_hash() of the key
+ * @param aged : If not NULL, will be set to 1 if the counters have been halved
+ *               by this call (0 otherwise)
+ * @return The estimated number of recent additions of the key (including this one)
+ */
+uint32_t sketch_add(sketch_t *sketch, uint64_t hash, int *aged);
+
+/**
+ * @brief Get the estimated number of recent additions of a key
+ * @param sketch : A valid pointer to an initialized sketch_t structure
+ * @param hash : The sketch_hash() of the key
+ * @return The estimated number of recent additions of the key
+ */
+uint32_t sketch_estimate(sketch_t *sketch, uint64_t hash);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "shardcache_internal.h" // for MUTEX_* macros
+
+#include "slab.h"
+
+#define SLAB_NUM_CLASSES_MAX 48
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_PAGE_SIZE (1<<16)
+
+/**********************************************************************
+ * A size class. The central slab of each class keeps a free list of
+ * chunks (linked through their first word) and the page currently
+ * being carved.
+ */
+typedef struct _slab_class {
+    size_t size;
+    size_t page_size;
+    void *free_list;
+    char *cursor;
+    char *end;
+    pthread_mutex_t lock;
+} slab_class_t;
+
+/**********************************************************************
+ * Per-thread caches. Each thread keeps a magazine of free chunks for
+ * each size class so that the central slabs are accessed only to refill
+ * an empty magazine or to flush half of a full one.
+ */
+typedef struct _slab_magazine {
+    int count;
+    void *items[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+typedef struct _slab_thread_cache {
+    slab_magazine_t magazines[SLAB_NUM_CLASSES_MAX];
+    // only updated by the owner thread (the chunks might be released
+    // by a different thread than the one which allocated them, so both
+    // values can go negative)
+    int64_t used;
+    int64_t requested;
+    struct _slab_thread_cache *prev, *next;
+} slab_thread_cache_t;
+
+static slab_class_t slab_classes[SLAB_NUM_CLASSES_MAX];
+static int slab_num_classes = 0;
+static uint8_t slab_class_index[(SLAB_MAX_SIZE >> 4) + 1];
+
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+static __thread slab_thread_cache_t *slab_tc = NULL;
+
+static pthread_mutex_t slab_tc_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_thread_cache_t *slab_tc_list = NULL;
+
+// bytes used/requested by threads which already exited
+static int64_t slab_orphan_used = 0;
+static int64_t slab_orphan_requested = 0;
+
+static uint64_t slab_allocated = 0;
+
+static void slab_thread_cache_destroy(void *ptr);
+
+static void
+slab_init()
+{
+    // 16 bytes steps up to 128 bytes, then grow by ~25%
+    // (rounded to 16 bytes) up to SLAB_MAX_SIZE
+    size_t size = 16;
+    while (slab_num_classes < SLAB_NUM_CLASSES_MAX) {
+        slab_class_t *sc = &slab_classes[slab_num_classes++];
+        sc->size = size;
+        sc->page_size = (size * 8 > SLAB_PAGE_SIZE) ? size * 8 : SLAB_PAGE_SIZE;
+        MUTEX_INIT(sc->lock);
+
+        if (size == SLAB_MAX_SIZE)
+            break;
+
+        size = (size < 128) ? size + 16 : ((size + (size >> 2) + 15) & ~((size_t)15));
+        if (size > SLAB_MAX_SIZE)
+            size = SLAB_MAX_SIZE;
+    }
+
+    int i;
+    int index = 0;
+    for (i = 0; i <= (SLAB_MAX_SIZE >> 4); i++) {
+        while ((size_t)(i << 4) > slab_classes[index].size)
+            index++;
+        slab_class_index[i] = index;
+    }
+
+    pthread_key_create(&slab_key, slab_thread_cache_destroy);
+}
+
+static inline slab_thread_cache_t *
+slab_thread_cache()
+{
+    if (UNLIKELY(!slab_tc)) {
+        pthread_once(&slab_once, slab_init);
+        slab_thread_cache_t *tc = calloc(1, sizeof(slab_thread_cache_t));
+        if (!tc)
+            return NULL;
+        MUTEX_LOCK(slab_tc_lock);
+        tc->next = slab_tc_list;
+        if (slab_tc_list)
+            slab_tc_list->prev = tc;
+        slab_tc_list = tc;
+        MUTEX_UNLOCK(slab_tc_lock);
+        pthread_setspecific(slab_key, tc);
+        slab_tc = tc;
+    }
+    return slab_tc;
+}
+
+static int
+slab_class_refill(slab_class_t *sc, slab_magazine_t *mag)
+{
+    MUTEX_LOCK(sc->lock);
+    while (mag->count < (SLAB_MAGAZINE_SIZE >> 1)) {
+        void *item = sc->free_list;
+        if (item) {
+            sc->free_list = *((void **)item);
+        } else {
+            if (!sc->cursor || sc->cursor + sc->size > sc->end) {
+                char *page = malloc(sc->page_size);
+                if (!page)
+                    break;
+                sc->cursor = page;
+                sc->end = page + sc->page_size;
+                ATOMIC_INCREASE(slab_allocated, sc->page_size);
+            }
+            item = sc->cursor;
+            sc->cursor += sc->size;
+        }
+        mag->items[mag->count++] = item;
+    }
+    MUTEX_UNLOCK(sc->lock);
+    return mag->count;
+}
+
+static void
+slab_class_flush(slab_class_t *sc, slab_magazine_t *mag, int count)
+{
+    MUTEX_LOCK(sc->lock);
+    while (count-- && mag->count) {
+        void *item = mag->items[--mag->count];
+        *((void **)item) = sc->free_list;
+        sc->free_list = item;
+    }
+    MUTEX_UNLOCK(sc->lock);
+}
+
+// called when a thread exits, gives back all the cached chunks
+// to the central slabs
+static void
+slab_thread_cache_destroy(void *ptr)
+{
+    slab_thread_cache_t *tc = (slab_thread_cache_t *)ptr;
+    int i;
+    for (i = 0; i < slab_num_classes; i++)
+        slab_class_flush(&slab_classes[i], &tc->magazines[i], SLAB_MAGAZINE_SIZE);
+
+    MUTEX_LOCK(slab_tc_lock);
+    if (tc->prev)
+        tc->prev->next = tc->next;
+    else
+        slab_tc_list = tc->next;
+    if (tc->next)
+        tc->next->prev = tc->prev;
+    ATOMIC_INCREASE(slab_orphan_used, tc->used);
+    ATOMIC_INCREASE(slab_orphan_requested, tc->requested);
+    MUTEX_UNLOCK(slab_tc_lock);
+
+    if (slab_tc == tc)
+        slab_tc = NULL;
+    free(tc);
+}
+
+void *
+slab_alloc(size_t size)
+{
+    if (UNLIKELY(size > SLAB_MAX_SIZE))
+        return malloc(size);
+
+    slab_thread_cache_t *tc = slab_thread_cache();
+    if (UNLIKELY(!tc))
+        return NULL;
+
+    int index = slab_class_index[(size + 15) >> 4];
+    slab_class_t *sc = &slab_classes[index];
+    slab_magazine_t *mag = &tc->magazines[index];
+
+    if (UNLIKELY(!mag->count) && !slab_class_refill(sc, mag))
+        return NULL;
+
+    tc->used += sc->size;
+    tc->requested += size;
+
+    return mag->items[--mag->count];
+}
+
+void *
+slab_calloc(size_t size)
+{
+    void *ptr = slab_alloc(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void
+slab_free(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+
+    if (UNLIKELY(size > SLAB_MAX_SIZE)) {
+        free(ptr);
+        return;
+    }
+
+    // NOTE: if the thread cache has been already released (because we are
+    //       being called by some other key destructor while the thread exits)
+    //       a new one will be created, so tc can be NULL only if we failed
+    //       allocating it and in such case the chunk goes straight back
+    //       to the central slab
+    slab_thread_cache_t *tc = slab_thread_cache();
+
+    int index = slab_class_index[(size + 15) >> 4];
+    slab_class_t *sc = &slab_classes[index];
+
+    if (UNLIKELY(!tc)) {
+        slab_magazine_t tmp = { 1, { ptr } };
+        slab_class_flush(sc, &tmp, 1);
+        return;
+    }
+
+    slab_magazine_t *mag = &tc->magazines[index];
+    if (UNLIKELY(mag->count == SLAB_MAGAZINE_SIZE))
+        slab_class_flush(sc, mag, SLAB_MAGAZINE_SIZE >> 1);
+
+    mag->items[mag->count++] = ptr;
+
+    tc->used -= sc->size;
+    tc->requested -= size;
+}
+
+void *
+slab_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+    if (!ptr)
+        return slab_alloc(new_size);
+
+    if (old_size > SLAB_MAX_SIZE && new_size > SLAB_MAX_SIZE)
+        return realloc(ptr, new_size);
+
+    if (old_size <= SLAB_MAX_SIZE && new_size <= SLAB_MAX_SIZE &&
+        slab_class_index[(old_size + 15) >> 4] == slab_class_index[(new_size + 15) >> 4])
+    {
+        // still fits in the same chunk
+        slab_thread_cache_t *tc = slab_thread_cache();
+        if (tc)
+            tc->requested += (int64_t)new_size - (int64_t)old_size;
+        return ptr;
+    }
+
+    void *new_ptr = slab_alloc(new_size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    slab_free(ptr, old_size);
+    return new_ptr;
+}
+
+void
+slab_get_stats(slab_stats_t *stats)
+{
+    int64_t used = ATOMIC_READ(slab_orphan_used);
+    int64_t requested = ATOMIC_READ(slab_orphan_requested);
+
+    MUTEX_LOCK(slab_tc_lock);
+    slab_thread_cache_t *tc = slab_tc_list;
+    while (tc) {
+        used += ATOMIC_READ(tc->used);
+        requested += ATOMIC_READ(tc->requested);
+        tc = tc->next;
+    }
+    MUTEX_UNLOCK(slab_tc_lock);
+
+    stats->allocated = ATOMIC_READ(slab_allocated);
+    stats->used = used > 0 ? used : 0;
+    stats->requested = requested > 0 ? requested : 0;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
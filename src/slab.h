@@ -0,0 +1,40 @@
+#ifndef SHARDCACHE_SLAB_H
+#define SHARDCACHE_SLAB_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Size-class slab allocator used for the memory which ends up in the cache
+ * (object headers, keys and payloads).
+ *
+ * Allocations up to SLAB_MAX_SIZE are served from per-thread magazines which
+ * are refilled from (and flushed back to) the central slabs of each size class.
+ * Bigger allocations are passed through to malloc()/free().
+ *
+ * NOTE: the allocator is process-wide and memory obtained by the central slabs
+ *       is never returned to the system, it's recycled among size classes only
+ *       through the free lists of each class.
+ *       The size provided to slab_free()/slab_realloc() MUST be the same one used
+ *       when allocating the memory.
+ */
+
+#define SLAB_MAX_SIZE (1<<14)
+
+typedef struct {
+    uint64_t allocated; // bytes obtained from the system by the central slabs
+    uint64_t used;      // bytes handed out (rounded up to the size class)
+    uint64_t requested; // bytes actually requested by the callers
+} slab_stats_t;
+
+void *slab_alloc(size_t size);
+void *slab_calloc(size_t size);
+void *slab_realloc(void *ptr, size_t old_size, size_t new_size);
+void slab_free(void *ptr, size_t size);
+
+void slab_get_stats(slab_stats_t *stats);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing_wheel.h"
+
+#define TIMING_WHEEL_LEVELS 4
+#define TIMING_WHEEL_BITS   6
+#define TIMING_WHEEL_SLOTS  (1 << TIMING_WHEEL_BITS)
+#define TIMING_WHEEL_MASK   (TIMING_WHEEL_SLOTS - 1)
+
+// the maximum distance (in ticks) a timer can be scheduled in the wheel
+#define TIMING_WHEEL_SPAN   (1ULL << (TIMING_WHEEL_LEVELS * TIMING_WHEEL_BITS))
+
+#define TIMING_WHEEL_INDEX(_t, _l) \
+    (((_t) >> ((_l) * TIMING_WHEEL_BITS)) & TIMING_WHEEL_MASK)
+
+struct _timing_wheel_s {
+    // the heads of the (circular) lists of timers in each slot
+    timing_wheel_node_t slots[TIMING_WHEEL_LEVELS][TIMING_WHEEL_SLOTS];
+    uint64_t now;  // the last tick the wheel has been advanced to
+    size_t count;
+};
+
+static inline void
+timing_wheel_slot_init(timing_wheel_node_t *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static inline void
+timing_wheel_slot_append(timing_wheel_node_t *head, timing_wheel_node_t *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+timing_wheel_t *
+timing_wheel_create(uint64_t now)
+{
+    timing_wheel_t *wheel = malloc(sizeof(timing_wheel_t));
+    if (!wheel)
+        return NULL;
+
+    int l, s;
+    for (l = 0; l < TIMING_WHEEL_LEVELS; l++)
+        for (s = 0; s < TIMING_WHEEL_SLOTS; s++)
+            timing_wheel_slot_init(&wheel->slots[l][s]);
+
+    wheel->now = now;
+    wheel->count = 0;
+    return wheel;
+}
+
+void
+timing_wheel_destroy(timing_wheel_t *wheel)
+{
+    free(wheel);
+}
+
+// if current is true timers due by the current tick are put in the
+// slot of the current tick (which is about to be processed), otherwise
+// they are put in the slot of the next tick
+static void
+timing_wheel_insert(timing_wheel_t *wheel, timing_wheel_node_t *node, int current)
+{
+    uint64_t min = current ? wheel->now : wheel->now + 1;
+    uint64_t expire = node->expire < min ? min : node->expire;
+    uint64_t delta = expire - wheel->now;
+
+    // timers too far in the future are kept in the last level
+    // (they will be put back there when cascaded if not due yet)
+    if (delta >= TIMING_WHEEL_SPAN) {
+        expire = wheel->now + TIMING_WHEEL_SPAN - 1;
+        delta = TIMING_WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (level < TIMING_WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << ((level + 1) * TIMING_WHEEL_BITS)))
+    {
+        level++;
+    }
+
+    timing_wheel_slot_append(&wheel->slots[level][TIMING_WHEEL_INDEX(expire, level)], node);
+}
+
+void
+timing_wheel_add(timing_wheel_t *wheel, timing_wheel_node_t *node, uint64_t expire)
+{
+    node->expire = expire;
+    timing_wheel_insert(wheel, node, 0);
+    wheel->count++;
+}
+
+void
+timing_wheel_remove(timing_wheel_t *wheel, timing_wheel_node_t *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    wheel->count--;
+}
+
+// move all the timers in the given slot to the lower levels,
+// returns the index of the slot
+static int
+timing_wheel_cascade(timing_wheel_t *wheel, int level)
+{
+    int index = TIMING_WHEEL_INDEX(wheel->now, level);
+    timing_wheel_node_t *head = &wheel->slots[level][index];
+    timing_wheel_node_t *node = head->next;
+
+    timing_wheel_slot_init(head);
+
+    while (node != head) {
+        timing_wheel_node_t *next = node->next;
+        timing_wheel_insert(wheel, node, 1);
+        node = next;
+    }
+
+    return index;
+}
+
+int
+timing_wheel_advance(timing_wheel_t *wheel, uint64_t now, timing_wheel_expire_callback_t cb, void *priv)
+{
+    int expired = 0;
+
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // when the first level wraps around, the timers in the current slot
+        // of the next level are moved down (and so on for the upper levels)
+        int level = 1;
+        if (TIMING_WHEEL_INDEX(wheel->now, 0) == 0) {
+            while (level < TIMING_WHEEL_LEVELS && timing_wheel_cascade(wheel, level) == 0)
+                level++;
+        }
+
+        timing_wheel_node_t *head = &wheel->slots[0][TIMING_WHEEL_INDEX(wheel->now, 0)];
+        timing_wheel_node_t *node = head->next;
+
+        timing_wheel_slot_init(head);
+
+        while (node != head) {
+            timing_wheel_node_t *next = node->next;
+            if (node->expire <= wheel->now) {
+                node->prev = node->next = NULL;
+                wheel->count--;
+                expired++;
+                cb(node, priv);
+            } else {
+                // a timer which was too far in the future
+                timing_wheel_insert(wheel, node, 0);
+            }
+            node = next;
+        }
+    }
+
+    return expired;
+}
+
+size_t
+timing_wheel_count(timing_wheel_t *wheel)
+{
+    return wheel->count;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
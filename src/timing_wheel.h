@@ -0,0 +1,92 @@
+#ifndef SHARDCACHE_TIMING_WHEEL_H
+#define SHARDCACHE_TIMING_WHEEL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel.
+ *
+ * The wheel has 4 levels of 64 slots each, the slots of the first level
+ * span one tick each, the ones of the second level 64 ticks and so on.
+ * Timers are moved (cascaded) to the lower levels as the time approaches
+ * their deadline, so adding and removing a timer is O(1) and expiring
+ * them costs O(1) per timer.
+ * Timers further than 64^4 ticks in the future are kept in the last level
+ * and cascaded again until they are due.
+ *
+ * The nodes are intrusive: they are meant to be embedded in the structure
+ * representing the timer, the wheel never allocates nor releases them.
+ *
+ * NOTE: the wheel is not thread-safe, the caller is expected
+ *       to synchronize the access to it
+ */
+
+typedef struct _timing_wheel_node_s {
+    struct _timing_wheel_node_s *prev;
+    struct _timing_wheel_node_s *next;
+    uint64_t expire; // the tick at which the timer is due
+} timing_wheel_node_t;
+
+typedef struct _timing_wheel_s timing_wheel_t;
+
+/**
+ * @brief Callback called for each expired timer
+ * @param node : The node of the expired timer (already removed from the wheel)
+ * @param priv : The priv pointer passed to timing_wheel_advance()
+ */
+typedef void (*timing_wheel_expire_callback_t)(timing_wheel_node_t *node, void *priv);
+
+/**
+ * @brief Create a new timing wheel
+ * @param now : The current tick
+ * @return A newly initialized timing_wheel_t instance, NULL in case of errors
+ */
+timing_wheel_t *timing_wheel_create(uint64_t now);
+
+/**
+ * @brief Release all the resources used by a timing wheel
+ * @param wheel : A valid pointer to an initialized timing_wheel_t structure
+ * @note The nodes still in the wheel are not touched
+ */
+void timing_wheel_destroy(timing_wheel_t *wheel);
+
+/**
+ * @brief Add a timer to the wheel
+ * @param wheel : A valid pointer to an initialized timing_wheel_t structure
+ * @param node : The node of the timer, not linked in any wheel
+ * @param expire : The tick at which the timer is due
+ * @note Timers already due will expire on the next tick
+ */
+void timing_wheel_add(timing_wheel_t *wheel, timing_wheel_node_t *node, uint64_t expire);
+
+/**
+ * @brief Remove a timer from the wheel
+ * @param wheel : A valid pointer to an initialized timing_wheel_t structure
+ * @param node : The node of a timer previously added to the wheel
+ */
+void timing_wheel_remove(timing_wheel_t *wheel, timing_wheel_node_t *node);
+
+/**
+ * @brief Move the wheel forward expiring all the timers due by the given tick
+ * @param wheel : A valid pointer to an initialized timing_wheel_t structure
+ * @param now : The current tick
+ * @param cb : The callback to call for each expired timer
+ * @param priv : A pointer which will be passed to the callback
+ * @return The number of expired timers
+ * @note The callback is called while advancing the wheel, it must
+ *       not add or remove timers to/from the same wheel
+ */
+int timing_wheel_advance(timing_wheel_t *wheel, uint64_t now, timing_wheel_expire_callback_t cb, void *priv);
+
+/**
+ * @brief Get the number of timers in the wheel
+ * @param wheel : A valid pointer to an initialized timing_wheel_t structure
+ * @return The number of timers in the wheel
+ */
+size_t timing_wheel_count(timing_wheel_t *wheel);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
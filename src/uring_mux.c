@@ -0,0 +1,706 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "uring_mux.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(IORING_FEAT_EXT_ARG)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// the operation is encoded in the low bits of the user_data
+// of the submissions (the rest is the pointer to the connection)
+#define URING_MUX_OP_ACCEPT 1
+#define URING_MUX_OP_RECV   2
+#define URING_MUX_OP_SEND   3
+#define URING_MUX_OP_CANCEL 4
+#define URING_MUX_OP_MASK   7
+
+// how long to wait for completions (in microsecs) while there are output
+// callbacks not returning any data or input not consumed by the callbacks
+#define URING_MUX_POLL_INTERVAL 100
+
+#define URING_MUX_MIN_CONNS 64
+
+/**********************************************************************
+ * A filedescriptor in the mux. Once removed from the mux a connection
+ * is kept (in the zombies list) until all the operations still in flight
+ * referencing it, and its buffers, have completed.
+ */
+typedef struct _uring_mux_conn_s {
+    int fd;
+    iomux_callbacks_t cbs;
+    int listening;
+    int removed;
+    int cancelled;
+    int ops;    // number of operations in flight
+    int calls;  // number of callbacks being executed
+    int accept_armed;
+    int recv_armed;
+    int send_armed;
+    unsigned char *in;
+    int inlen;
+    unsigned char *out;
+    int outlen;
+    int outoff;
+    int outfree;
+    struct _uring_mux_conn_s *znext;
+} uring_mux_conn_t;
+
+struct _uring_mux_s {
+    int ring_fd;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    int multishot_accept;
+    int bufsize;
+    uring_mux_conn_t **conns; // indexed by filedescriptor
+    int conns_size;
+    int num_fds;
+    uring_mux_conn_t *zombies;
+};
+
+static inline int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline unsigned
+uring_mux_sq_pending(uring_mux_t *mux)
+{
+    return mux->sq_local_tail - __atomic_load_n(mux->sq_head, __ATOMIC_ACQUIRE);
+}
+
+uring_mux_t *
+uring_mux_create(int entries, int bufsize)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // there might be up to 3 operations in flight for each filedescriptor,
+    // the kernel keeps the completions which don't fit (IORING_FEAT_NODROP)
+    // but it's slower, so make the completion queue big enough for most cases
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0)
+        return NULL;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    uring_mux_t *mux = calloc(1, sizeof(uring_mux_t));
+    mux->ring_fd = fd;
+    mux->bufsize = bufsize > 0 ? bufsize : (1<<13);
+    mux->multishot_accept = 1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    mux->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    mux->ring = mmap(NULL, mux->ring_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (mux->ring == MAP_FAILED) {
+        close(fd);
+        free(mux);
+        return NULL;
+    }
+
+    mux->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    mux->sqes = mmap(NULL, mux->sqes_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (mux->sqes == MAP_FAILED) {
+        munmap(mux->ring, mux->ring_size);
+        close(fd);
+        free(mux);
+        return NULL;
+    }
+
+    char *ring = mux->ring;
+    mux->sq_head = (unsigned *)(ring + p.sq_off.head);
+    mux->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    mux->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    mux->sq_entries = *(unsigned *)(ring + p.sq_off.ring_entries);
+    mux->sq_local_tail = *mux->sq_tail;
+    mux->cq_head = (unsigned *)(ring + p.cq_off.head);
+    mux->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    mux->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    mux->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // each slot of the submission queue always refers to the same sqe
+    unsigned *sq_array = (unsigned *)(ring + p.sq_off.array);
+    unsigned i;
+    for (i = 0; i < mux->sq_entries; i++)
+        sq_array[i] = i;
+
+    return mux;
+}
+
+static struct io_uring_sqe *
+uring_mux_get_sqe(uring_mux_t *mux)
+{
+    if (uring_mux_sq_pending(mux) >= mux->sq_entries) {
+        // the submission queue is full, submit what we have so far
+        sys_io_uring_enter(mux->ring_fd, uring_mux_sq_pending(mux), 0, 0, NULL, 0);
+        if (uring_mux_sq_pending(mux) >= mux->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &mux->sqes[mux->sq_local_tail & mux->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+static inline void
+uring_mux_commit_sqe(uring_mux_t *mux)
+{
+    __atomic_store_n(mux->sq_tail, ++mux->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static int
+uring_mux_queue_op(uring_mux_t *mux, uring_mux_conn_t *conn, int op)
+{
+    struct io_uring_sqe *sqe = uring_mux_get_sqe(mux);
+    if (!sqe)
+        return -1;
+
+    sqe->fd = conn->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+
+    switch(op) {
+        case URING_MUX_OP_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+            if (mux->multishot_accept)
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            conn->accept_armed = 1;
+            break;
+        case URING_MUX_OP_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = (uint64_t)(uintptr_t)conn->in;
+            sqe->len = mux->bufsize;
+            conn->recv_armed = 1;
+            break;
+        case URING_MUX_OP_SEND:
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (uint64_t)(uintptr_t)(conn->out + conn->outoff);
+            sqe->len = conn->outlen - conn->outoff;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            conn->send_armed = 1;
+            break;
+        default:
+            return -1;
+    }
+
+    uring_mux_commit_sqe(mux);
+    conn->ops++;
+    return 0;
+}
+
+static int
+uring_mux_queue_cancel(uring_mux_t *mux, uring_mux_conn_t *conn, int op)
+{
+    struct io_uring_sqe *sqe = uring_mux_get_sqe(mux);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)conn | op;
+    sqe->user_data = URING_MUX_OP_CANCEL;
+    uring_mux_commit_sqe(mux);
+    return 0;
+}
+
+static void
+uring_mux_conn_free(uring_mux_conn_t *conn)
+{
+    if (conn->out && conn->outfree)
+        free(conn->out);
+    free(conn->in);
+    free(conn);
+}
+
+static inline uring_mux_conn_t *
+uring_mux_conn_get(uring_mux_t *mux, int fd)
+{
+    return (fd >= 0 && fd < mux->conns_size) ? mux->conns[fd] : NULL;
+}
+
+static inline void
+uring_mux_output_reset(uring_mux_conn_t *conn)
+{
+    if (conn->out && conn->outfree)
+        free(conn->out);
+    conn->out = NULL;
+    conn->outlen = conn->outoff = conn->outfree = 0;
+}
+
+int
+uring_mux_add(uring_mux_t *mux, int fd, iomux_callbacks_t *cbs)
+{
+    if (fd < 0 || uring_mux_conn_get(mux, fd))
+        return 0;
+
+    if (fd >= mux->conns_size) {
+        int size = mux->conns_size ? mux->conns_size * 2 : URING_MUX_MIN_CONNS;
+        while (size <= fd)
+            size *= 2;
+        uring_mux_conn_t **conns = realloc(mux->conns, size * sizeof(uring_mux_conn_t *));
+        if (!conns)
+            return 0;
+        memset(conns + mux->conns_size, 0, (size - mux->conns_size) * sizeof(uring_mux_conn_t *));
+        mux->conns = conns;
+        mux->conns_size = size;
+    }
+
+    uring_mux_conn_t *conn = calloc(1, sizeof(uring_mux_conn_t));
+    conn->in = malloc(mux->bufsize);
+    if (!conn->in) {
+        free(conn);
+        return 0;
+    }
+    conn->fd = fd;
+    conn->cbs = *cbs;
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    mux->conns[fd] = conn;
+    mux->num_fds++;
+    return 1;
+}
+
+int
+uring_mux_listen(uring_mux_t *mux, int fd)
+{
+    uring_mux_conn_t *conn = uring_mux_conn_get(mux, fd);
+    if (!conn)
+        return 0;
+    conn->listening = 1;
+    return 1;
+}
+
+void
+uring_mux_remove(uring_mux_t *mux, int fd)
+{
+    uring_mux_conn_t *conn = uring_mux_conn_get(mux, fd);
+    if (!conn)
+        return;
+
+    // the operations still in flight are cancelled (see uring_mux_collect())
+    // NOTE: data already received by an in flight operation is lost
+    mux->conns[fd] = NULL;
+    mux->num_fds--;
+    conn->removed = 1;
+    conn->znext = mux->zombies;
+    mux->zombies = conn;
+}
+
+int
+uring_mux_close(uring_mux_t *mux, int fd)
+{
+    uring_mux_conn_t *conn = uring_mux_conn_get(mux, fd);
+    if (!conn)
+        return 0;
+
+    uring_mux_remove(mux, fd);
+
+    if (conn->cbs.mux_eof) {
+        conn->calls++;
+        conn->cbs.mux_eof(NULL, fd, conn->cbs.priv);
+        conn->calls--;
+    }
+    return 1;
+}
+
+void
+uring_mux_set_output_callback(uring_mux_t *mux, int fd, iomux_output_callback_t cb)
+{
+    uring_mux_conn_t *conn = uring_mux_conn_get(mux, fd);
+    if (conn)
+        conn->cbs.mux_output = cb;
+}
+
+void
+uring_mux_unset_output_callback(uring_mux_t *mux, int fd)
+{
+    uring_mux_set_output_callback(mux, fd, NULL);
+}
+
+int
+uring_mux_num_fds(uring_mux_t *mux)
+{
+    return mux->num_fds;
+}
+
+int
+uring_mux_isempty(uring_mux_t *mux)
+{
+    return (mux->num_fds == 0);
+}
+
+// free the removed connections which don't have any operation in flight
+// and cancel the operations of the others
+static void
+uring_mux_collect(uring_mux_t *mux)
+{
+    uring_mux_conn_t **prev = &mux->zombies;
+    while (*prev) {
+        uring_mux_conn_t *conn = *prev;
+        if (!conn->ops && !conn->calls) {
+            *prev = conn->znext;
+            uring_mux_conn_free(conn);
+            continue;
+        }
+        if (!conn->cancelled) {
+            int rc = 0;
+            if (conn->accept_armed)
+                rc |= uring_mux_queue_cancel(mux, conn, URING_MUX_OP_ACCEPT);
+            if (conn->recv_armed)
+                rc |= uring_mux_queue_cancel(mux, conn, URING_MUX_OP_RECV);
+            if (conn->send_armed)
+                rc |= uring_mux_queue_cancel(mux, conn, URING_MUX_OP_SEND);
+            conn->cancelled = (rc == 0);
+        }
+        prev = &conn->znext;
+    }
+}
+
+// pass the received data to the input callback,
+// returns 0 if the callback didn't consume any of it
+static int
+uring_mux_input(uring_mux_t *mux, uring_mux_conn_t *conn)
+{
+    if (!conn->cbs.mux_input) {
+        conn->inlen = 0;
+        return 1;
+    }
+
+    conn->calls++;
+    int processed = conn->cbs.mux_input(NULL, conn->fd, conn->in, conn->inlen, conn->cbs.priv);
+    conn->calls--;
+
+    if (conn->removed || processed <= 0)
+        return 0;
+
+    if (processed < conn->inlen) {
+        memmove(conn->in, conn->in + processed, conn->inlen - processed);
+        conn->inlen -= processed;
+    } else {
+        conn->inlen = 0;
+    }
+    return 1;
+}
+
+// get new data to send from the output callback,
+// returns 0 if the callback is set but didn't provide any
+static int
+uring_mux_output(uring_mux_t *mux, uring_mux_conn_t *conn)
+{
+    unsigned char *data = NULL;
+    int len = 0;
+
+    conn->calls++;
+    int mode = conn->cbs.mux_output(NULL, conn->fd, &data, &len, conn->cbs.priv);
+    conn->calls--;
+
+    if (conn->removed || len <= 0) {
+        if (data && mode == IOMUX_OUTPUT_MODE_FREE)
+            free(data);
+        return (conn->removed || !conn->cbs.mux_output);
+    }
+
+    if (mode == IOMUX_OUTPUT_MODE_COPY) {
+        conn->out = malloc(len);
+        if (!conn->out)
+            return 0;
+        memcpy(conn->out, data, len);
+        conn->outfree = 1;
+    } else {
+        conn->out = data;
+        conn->outfree = (mode == IOMUX_OUTPUT_MODE_FREE);
+    }
+    conn->outlen = len;
+    conn->outoff = 0;
+    return 1;
+}
+
+// queue the operations needed by all the filedescriptors in the mux,
+// returns 1 if some callback needs to be polled again soon
+static int
+uring_mux_arm(uring_mux_t *mux)
+{
+    int poll = 0;
+    int fd;
+
+    // NOTE: the callbacks might add or remove filedescriptors
+    //       (and reallocate the conns array)
+    for (fd = 0; fd < mux->conns_size; fd++) {
+        uring_mux_conn_t *conn = mux->conns[fd];
+        if (!conn)
+            continue;
+
+        if (conn->listening) {
+            if (!conn->accept_armed)
+                uring_mux_queue_op(mux, conn, URING_MUX_OP_ACCEPT);
+            continue;
+        }
+
+        // new data is received only once the callback consumed
+        // the previous one, so the input buffer is never moved
+        // while a receive is in flight
+        if (conn->inlen) {
+            if (!uring_mux_input(mux, conn))
+                poll = 1;
+            if (conn->removed)
+                continue;
+        }
+
+        if (!conn->inlen && !conn->recv_armed)
+            uring_mux_queue_op(mux, conn, URING_MUX_OP_RECV);
+
+        if (conn->send_armed)
+            continue;
+
+        if (!conn->outlen && conn->cbs.mux_output) {
+            if (!uring_mux_output(mux, conn))
+                poll = 1;
+            if (conn->removed)
+                continue;
+        }
+
+        if (conn->outlen)
+            uring_mux_queue_op(mux, conn, URING_MUX_OP_SEND);
+    }
+
+    return poll;
+}
+
+static void
+uring_mux_complete(uring_mux_t *mux, uint64_t user_data, int res, unsigned flags)
+{
+    int op = user_data & URING_MUX_OP_MASK;
+    uring_mux_conn_t *conn = (uring_mux_conn_t *)(uintptr_t)(user_data & ~(uint64_t)URING_MUX_OP_MASK);
+
+    if (op == URING_MUX_OP_CANCEL || !conn)
+        return;
+
+    switch(op) {
+        case URING_MUX_OP_ACCEPT:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                // not (or no longer) multishot, it has to be queued again
+                conn->accept_armed = 0;
+                conn->ops--;
+            }
+            if (res >= 0) {
+                if (conn->removed || !conn->cbs.mux_connection) {
+                    close(res);
+                    break;
+                }
+                conn->calls++;
+                conn->cbs.mux_connection(NULL, res, conn->cbs.priv);
+                conn->calls--;
+            } else if (res == -EINVAL && mux->multishot_accept) {
+                // multishot accepts not supported by the kernel
+                mux->multishot_accept = 0;
+            }
+            break;
+        case URING_MUX_OP_RECV:
+            conn->recv_armed = 0;
+            conn->ops--;
+            if (conn->removed)
+                break;
+            if (res > 0) {
+                conn->inlen = res;
+                uring_mux_input(mux, conn);
+            } else if (res == 0 || (res != -EAGAIN && res != -EINTR && res != -ECANCELED)) {
+                uring_mux_close(mux, conn->fd);
+            }
+            break;
+        case URING_MUX_OP_SEND:
+            conn->send_armed = 0;
+            conn->ops--;
+            if (conn->removed)
+                break;
+            if (res > 0) {
+                conn->outoff += res;
+                if (conn->outoff >= conn->outlen)
+                    uring_mux_output_reset(conn);
+            } else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+                uring_mux_close(mux, conn->fd);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+uring_mux_reap(uring_mux_t *mux)
+{
+    unsigned head = *mux->cq_head;
+    unsigned tail = __atomic_load_n(mux->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &mux->cqes[head & mux->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        // release the slot before running the callbacks
+        __atomic_store_n(mux->cq_head, ++head, __ATOMIC_RELEASE);
+
+        uring_mux_complete(mux, user_data, res, flags);
+    }
+}
+
+static void
+uring_mux_wait(uring_mux_t *mux, struct __kernel_timespec *ts)
+{
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)ts;
+
+    // submit all the queued operations and wait for their completions
+    // with a single syscall
+    // (errors like ETIME, EINTR or EBUSY, if the completion queue overflowed,
+    // just mean that there are no more completions than the ones in the queue)
+    sys_io_uring_enter(mux->ring_fd, uring_mux_sq_pending(mux), 1,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg));
+
+    uring_mux_reap(mux);
+}
+
+void
+uring_mux_run(uring_mux_t *mux, struct timeval *timeout)
+{
+    int poll = uring_mux_arm(mux);
+    uring_mux_collect(mux);
+
+    struct __kernel_timespec ts = { 0, 0 };
+    struct __kernel_timespec *tsp = NULL;
+    if (timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+        tsp = &ts;
+    }
+    if (poll && (!tsp || ts.tv_sec || ts.tv_nsec > URING_MUX_POLL_INTERVAL * 1000)) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = URING_MUX_POLL_INTERVAL * 1000;
+        tsp = &ts;
+    }
+
+    uring_mux_wait(mux, tsp);
+    uring_mux_collect(mux);
+}
+
+void
+uring_mux_destroy(uring_mux_t *mux)
+{
+    int fd;
+    for (fd = 0; fd < mux->conns_size; fd++) {
+        if (mux->conns[fd])
+            uring_mux_close(mux, fd);
+    }
+
+    // give the cancelled operations a chance to complete
+    int retries = 10;
+    uring_mux_collect(mux);
+    while (mux->zombies && retries--) {
+        struct __kernel_timespec ts = { 0, 10000000 };
+        uring_mux_wait(mux, &ts);
+        uring_mux_collect(mux);
+    }
+
+    // closing the ring cancels anything still in flight
+    // before the buffers are released
+    munmap(mux->sqes, mux->sqes_size);
+    munmap(mux->ring, mux->ring_size);
+    close(mux->ring_fd);
+
+    while (mux->zombies) {
+        uring_mux_conn_t *conn = mux->zombies;
+        mux->zombies = conn->znext;
+        uring_mux_conn_free(conn);
+    }
+
+    free(mux->conns);
+    free(mux);
+}
+
+#else
+
+// io_uring is not available on this platform, the callers fall back to iomux
+
+uring_mux_t *
+uring_mux_create(int entries, int bufsize)
+{
+    return NULL;
+}
+
+void uring_mux_destroy(uring_mux_t *mux) { }
+int uring_mux_add(uring_mux_t *mux, int fd, iomux_callbacks_t *cbs) { return 0; }
+int uring_mux_listen(uring_mux_t *mux, int fd) { return 0; }
+void uring_mux_remove(uring_mux_t *mux, int fd) { }
+int uring_mux_close(uring_mux_t *mux, int fd) { return 0; }
+void uring_mux_set_output_callback(uring_mux_t *mux, int fd, iomux_output_callback_t cb) { }
+void uring_mux_unset_output_callback(uring_mux_t *mux, int fd) { }
+void uring_mux_run(uring_mux_t *mux, struct timeval *timeout) { }
+int uring_mux_num_fds(uring_mux_t *mux) { return 0; }
+int uring_mux_isempty(uring_mux_t *mux) { return 1; }
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
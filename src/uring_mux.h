@@ -0,0 +1,60 @@
+#ifndef SHARDCACHE_URING_MUX_H
+#define SHARDCACHE_URING_MUX_H
+
+#include <sys/time.h>
+#include <iomux.h>
+
+/*
+ * Event loop built on io_uring, implementing the subset of the iomux API
+ * used by the serving workers.
+ *
+ * All the operations queued while running the loop (accepts, receives and
+ * sends on all the filedescriptors) are submitted at once, together with the
+ * wait for their completions, by a single io_uring_enter() call.
+ * Each filedescriptor has at most one receive in flight (into its own input
+ * buffer) and one send (of the buffer returned by its output callback).
+ * Accepts are multishot if the kernel supports it.
+ *
+ * The callbacks are the iomux ones, but they are called with a NULL iomux
+ * pointer. As with iomux the output callback (if set) is polled as long as
+ * it doesn't return any data, input left unprocessed by the input callback is
+ * provided again at the next run (no more data is received in the meanwhile).
+ *
+ * NOTE: an uring mux is not thread-safe, it must be accessed only by the
+ *       thread running it
+ */
+
+typedef struct _uring_mux_s uring_mux_t;
+
+/**
+ * @brief Create a new uring mux
+ * @param entries : The size of the submission queue
+ * @param bufsize : The size of the input buffer of each filedescriptor
+ * @return A newly created uring mux, NULL if io_uring is not available
+ *         (not supported by the platform or the kernel, or not allowed),
+ *         in which case the caller is expected to fall back to iomux
+ */
+uring_mux_t *uring_mux_create(int entries, int bufsize);
+
+/**
+ * @brief Release all the resources used by an uring mux
+ * @note The filedescriptors still in the mux are closed (calling their eof callback)
+ */
+void uring_mux_destroy(uring_mux_t *mux);
+
+// the following functions behave like their iomux counterparts
+
+int uring_mux_add(uring_mux_t *mux, int fd, iomux_callbacks_t *cbs);
+int uring_mux_listen(uring_mux_t *mux, int fd);
+void uring_mux_remove(uring_mux_t *mux, int fd);
+int uring_mux_close(uring_mux_t *mux, int fd);
+void uring_mux_set_output_callback(uring_mux_t *mux, int fd, iomux_output_callback_t cb);
+void uring_mux_unset_output_callback(uring_mux_t *mux, int fd);
+void uring_mux_run(uring_mux_t *mux, struct timeval *timeout);
+int uring_mux_num_fds(uring_mux_t *mux);
+int uring_mux_isempty(uring_mux_t *mux);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#include <epoch.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int entered;
+    int leave;
+    int nesting;
+} reader_arg_t;
+
+// enters a critical section (nesting levels) and
+// stays there until asked to leave
+static void *
+reader(void *priv)
+{
+    reader_arg_t *arg = (reader_arg_t *)priv;
+    int i;
+    for (i = 0; i < arg->nesting; i++)
+        epoch_enter();
+
+    pthread_mutex_lock(&arg->lock);
+    arg->entered = 1;
+    pthread_cond_broadcast(&arg->cond);
+    while (arg->nesting) {
+        while (!arg->leave)
+            pthread_cond_wait(&arg->cond, &arg->lock);
+        // leave one level at a time
+        epoch_exit();
+        arg->nesting--;
+        arg->leave--;
+        pthread_cond_broadcast(&arg->cond);
+    }
+    pthread_mutex_unlock(&arg->lock);
+    return NULL;
+}
+
+// ask the reader to leave count levels of its critical section
+// and wait until it did
+static void
+reader_leave(reader_arg_t *arg, int count)
+{
+    pthread_mutex_lock(&arg->lock);
+    arg->leave = count;
+    pthread_cond_broadcast(&arg->cond);
+    while (arg->leave)
+        pthread_cond_wait(&arg->cond, &arg->lock);
+    pthread_mutex_unlock(&arg->lock);
+}
+
+static void
+reader_start(pthread_t *th, reader_arg_t *arg, int nesting)
+{
+    pthread_mutex_init(&arg->lock, NULL);
+    pthread_cond_init(&arg->cond, NULL);
+    arg->entered = 0;
+    arg->leave = 0;
+    arg->nesting = nesting;
+    pthread_create(th, NULL, reader, arg);
+    pthread_mutex_lock(&arg->lock);
+    while (!arg->entered)
+        pthread_cond_wait(&arg->cond, &arg->lock);
+    pthread_mutex_unlock(&arg->lock);
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    uint64_t epoch = epoch_current();
+    ut_testing("epoch_try_advance() advances the epoch if there are no readers");
+    ut_validate_int(epoch_try_advance(), epoch + 1);
+    ut_testing("epoch_try_advance() advances the epoch again");
+    ut_validate_int(epoch_try_advance(), epoch + 2);
+
+    ut_testing("a critical section entered in the current epoch doesn't prevent advancing");
+    epoch_enter();
+    epoch = epoch_current();
+    ut_validate_int(epoch_try_advance(), epoch + 1);
+    ut_testing("but it prevents advancing further");
+    ut_validate_int(epoch_try_advance(), epoch + 1);
+    epoch_exit();
+    ut_testing("leaving the critical section allows advancing again");
+    ut_validate_int(epoch_try_advance(), epoch + 2);
+
+    // an object retired while a reader (which might still see it) is running
+    pthread_t th;
+    reader_arg_t arg;
+    reader_start(&th, &arg, 2);
+
+    uint64_t retired = epoch_current();
+    uint64_t current = epoch_try_advance();
+    current = epoch_try_advance();
+    ut_testing("an object retired while a reader is running is not safe to release");
+    ut_validate_int(epoch_is_safe(retired, current), 0);
+
+    reader_leave(&arg, 1);
+    current = epoch_try_advance();
+    ut_testing("the object is not safe to release while the reader is still in a nested section");
+    ut_validate_int(epoch_is_safe(retired, current), 0);
+
+    reader_leave(&arg, 1);
+    pthread_join(th, NULL);
+    current = epoch_try_advance();
+    ut_testing("the object is safe to release once the reader left its critical section");
+    ut_validate_int(epoch_is_safe(retired, current), 1);
+
+    ut_testing("epoch_is_safe() requires the epoch to be advanced twice");
+    ut_validate_int(!epoch_is_safe(current, current) && !epoch_is_safe(current, current + 1) &&
+                    epoch_is_safe(current, current + 2), 1);
+
+    // a reader which entered after the retirement doesn't block the release
+    retired = epoch_current();
+    epoch_try_advance();
+    reader_start(&th, &arg, 1);
+    current = epoch_try_advance();
+    ut_testing("a reader entered after an object has been retired doesn't prevent releasing it");
+    ut_validate_int(epoch_is_safe(retired, current), 1);
+    reader_leave(&arg, 1);
+    pthread_join(th, NULL);
+
+    ut_summary();
+    exit(ut_failed);
+}
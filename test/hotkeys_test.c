@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ut.h>
+#include <libgen.h>
+
+#include <sketch.h>
+#include <hotkeys.h>
+
+#define WIDTH 1024
+#define SAMPLE_SIZE (WIDTH * 10) // additions after which the counters are halved
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    sketch_t sketch;
+    ut_testing("sketch_init(&sketch, %d, 15) == 0", WIDTH);
+    ut_validate_int(sketch_init(&sketch, WIDTH, 15), 0);
+
+    uint64_t a = sketch_hash("key_a", 5);
+    uint64_t b = sketch_hash("key_b", 5);
+
+    ut_testing("the estimate of a key never added is 0");
+    ut_validate_int(sketch_estimate(&sketch, a), 0);
+
+    int i;
+    int additions = 0;
+    uint32_t estimate = 0;
+    for (i = 0; i < 10; i++, additions++)
+        estimate = sketch_add(&sketch, a, NULL);
+    ut_testing("sketch_add() returns the estimate including the new addition");
+    ut_validate_int(estimate, 10);
+    ut_testing("sketch_estimate() == 10");
+    ut_validate_int(sketch_estimate(&sketch, a), 10);
+
+    for (i = 0; i < 100; i++, additions++)
+        sketch_add(&sketch, b, NULL);
+    ut_testing("the counters saturate at the maximum");
+    ut_validate_int(sketch_estimate(&sketch, b), 15);
+
+    ut_testing("the counters are halved once the sample size is reached");
+    int aged = 0;
+    int aged_at = 0;
+    while (additions < SAMPLE_SIZE) {
+        sketch_add(&sketch, b, &aged);
+        additions++;
+        if (aged) {
+            aged_at = additions;
+            break;
+        }
+    }
+    ut_validate_int(aged_at, SAMPLE_SIZE);
+    ut_testing("the estimates are halved by the aging");
+    ut_validate_int(sketch_estimate(&sketch, a) == 5 && sketch_estimate(&sketch, b) == 7, 1);
+
+    sketch_destroy(&sketch);
+
+    ut_testing("sketch_init(&sketch, %d, UINT32_MAX) == 0 (wide counters)", WIDTH);
+    ut_validate_int(sketch_init(&sketch, WIDTH, UINT32_MAX), 0);
+    for (i = 0; i < 1000; i++)
+        sketch_add(&sketch, a, NULL);
+    ut_testing("wide counters go beyond 8 bits");
+    ut_validate_int(sketch_estimate(&sketch, a), 1000);
+    sketch_destroy(&sketch);
+
+    hotkeys_t *hk = hotkeys_create(WIDTH, 4);
+    ut_testing("hotkeys_create(%d, 4) != NULL", WIDTH);
+    ut_validate_int(hk != NULL, 1);
+
+    // key<n> is accessed 3 * n + 1 times
+    char key[32];
+    additions = 0;
+    for (i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        int n;
+        for (n = 0; n < 3 * i + 1; n++, additions++)
+            estimate = hotkeys_touch(hk, key, strlen(key));
+    }
+    ut_testing("hotkeys_touch() returns the number of recent accesses");
+    ut_validate_int(estimate, 28);
+
+    shardcache_hot_key_t *top = NULL;
+    int num_top = hotkeys_get_top(hk, &top);
+    ut_testing("hotkeys_get_top() returns the 4 hottest keys");
+    ut_validate_int(num_top, 4);
+    ut_testing("the hottest keys are sorted by decreasing frequency");
+    int failed = 0;
+    for (i = 0; i < num_top; i++) {
+        snprintf(key, sizeof(key), "key%d", 9 - i);
+        if (top[i].klen != strlen(key) || memcmp(top[i].key, key, top[i].klen) != 0 ||
+            top[i].frequency != (uint32_t)(3 * (9 - i) + 1))
+        {
+            ut_failure("Unexpected key %.*s (%u) at position %d",
+                       (int)top[i].klen, (char *)top[i].key, top[i].frequency, i);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+    shardcache_free_hot_keys(top, num_top);
+
+    // a new very hot key pushes out the coldest one,
+    // and the frequencies in the top-K are aged with the sketch
+    while (additions < SAMPLE_SIZE) {
+        hotkeys_touch(hk, "noise", 5);
+        additions++;
+    }
+    num_top = hotkeys_get_top(hk, &top);
+    ut_testing("the hottest key enters the top-K table");
+    ut_validate_int(num_top == 4 && top[0].klen == 5 && memcmp(top[0].key, "noise", 5) == 0, 1);
+    ut_testing("the frequencies in the top-K table are halved with the sketch");
+    ut_validate_int(num_top == 4 && top[1].frequency == 14 && top[2].frequency == 12 && top[3].frequency == 11, 1);
+    shardcache_free_hot_keys(top, num_top);
+
+    hotkeys_destroy(hk);
+
+    ut_summary();
+    exit(ut_failed);
+}
@@ -29,14 +29,15 @@ int main(int argc, char **argv)
 
     // create a set of servers
     for (i = 0; i < num_nodes; i++) {
-        ut_testing("shardcache_create(nodes[%d].label, nodes, num_nodes, NULL, NULL, 5, 1<<29", i);
+        ut_testing("shardcache_create(nodes[%d].label, nodes, num_nodes, NULL, NULL, 5, 1<<29, 4", i);
         servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]),
                                        nodes,
                                        num_nodes,
                                        NULL,
                                        5,
                                        0,
-                                       1<<29);
+                                       1<<29,
+                                       4);
         if (servers[i]) {
             ut_success();
             shardcache_iomux_run_timeout_low(servers[i], 5000);
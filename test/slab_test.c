@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ut.h>
+#include <libgen.h>
+
+#include <slab.h>
+
+static void
+fill(unsigned char *buf, size_t size, unsigned char seed)
+{
+    size_t i;
+    for (i = 0; i < size; i++)
+        buf[i] = (unsigned char)(seed + i);
+}
+
+static int
+check(unsigned char *buf, size_t size, unsigned char seed)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (buf[i] != (unsigned char)(seed + i))
+            return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    size_t sizes[] = { 1, 15, 16, 17, 100, 128, 129, 1000, 4096, 4097, SLAB_MAX_SIZE - 1, SLAB_MAX_SIZE };
+    int num_sizes = sizeof(sizes) / sizeof(size_t);
+    int i;
+
+    ut_testing("slab_alloc()/slab_free() round-trip for all the size classes");
+    int failed = 0;
+    for (i = 0; i < num_sizes && !failed; i++) {
+        unsigned char *ptrs[100];
+        int n;
+        for (n = 0; n < 100; n++) {
+            ptrs[n] = slab_alloc(sizes[i]);
+            if (!ptrs[n]) {
+                failed = 1;
+                break;
+            }
+            fill(ptrs[n], sizes[i], n);
+        }
+        while (n-- > 0) {
+            if (!check(ptrs[n], sizes[i], n))
+                failed = 1;
+            slab_free(ptrs[n], sizes[i]);
+        }
+        if (failed)
+            ut_failure("Bad chunk for size %lu", (unsigned long)sizes[i]);
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("a released chunk is reused by the next allocation of the same class");
+    void *ptr = slab_alloc(100);
+    slab_free(ptr, 100);
+    void *ptr2 = slab_alloc(110);
+    ut_validate_int(ptr == ptr2, 1);
+    slab_free(ptr2, 110);
+
+    ut_testing("slab_realloc() preserves the data across size classes");
+    size_t size = 10;
+    unsigned char *buf = slab_alloc(size);
+    fill(buf, size, 7);
+    failed = 0;
+    while (size < SLAB_MAX_SIZE * 4) {
+        size_t new_size = size * 3;
+        buf = slab_realloc(buf, size, new_size);
+        if (!buf || !check(buf, size, 7)) {
+            failed = 1;
+            break;
+        }
+        fill(buf, new_size, 7);
+        size = new_size;
+    }
+    while (!failed && size > 1) {
+        size_t new_size = size / 2;
+        buf = slab_realloc(buf, size, new_size);
+        if (!buf || !check(buf, new_size, 7)) {
+            failed = 1;
+            break;
+        }
+        size = new_size;
+    }
+    if (failed)
+        ut_failure("Data corrupted while reallocating %lu bytes", (unsigned long)size);
+    else
+        ut_success();
+    slab_free(buf, size);
+
+    slab_stats_t before, after;
+    slab_get_stats(&before);
+
+    unsigned char *ptrs[64];
+    for (i = 0; i < 64; i++)
+        ptrs[i] = slab_alloc(100);
+
+    // 100 bytes fall in the 112 bytes class
+    slab_get_stats(&after);
+    ut_testing("used bytes are accounted in size classes");
+    ut_validate_int(after.used - before.used, 64 * 112);
+    ut_testing("requested bytes are accounted as requested");
+    ut_validate_int(after.requested - before.requested, 64 * 100);
+    ut_testing("the memory obtained from the system covers the used bytes");
+    ut_validate_int(after.allocated >= after.used, 1);
+
+    ut_testing("slab_realloc() within the same class only updates the requested bytes");
+    ptrs[0] = slab_realloc(ptrs[0], 100, 110);
+    slab_get_stats(&after);
+    ut_validate_int(after.requested - before.requested, 63 * 100 + 110);
+    slab_free(ptrs[0], 110);
+
+    for (i = 1; i < 64; i++)
+        slab_free(ptrs[i], 100);
+
+    slab_get_stats(&after);
+    ut_testing("releasing all the chunks restores the accounting");
+    ut_validate_int(after.used == before.used && after.requested == before.requested, 1);
+
+    ut_testing("allocations bigger than SLAB_MAX_SIZE are not accounted");
+    ptr = slab_alloc(SLAB_MAX_SIZE + 1);
+    slab_get_stats(&after);
+    ut_validate_int(ptr && after.used == before.used && after.requested == before.requested, 1);
+    slab_free(ptr, SLAB_MAX_SIZE + 1);
+
+    ut_summary();
+    exit(ut_failed);
+}
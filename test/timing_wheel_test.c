@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <ut.h>
+#include <libgen.h>
+
+#include <timing_wheel.h>
+
+#define SPAN (1ULL << 24) // 64^4 ticks
+
+typedef struct {
+    timing_wheel_node_t node; // NOTE: must be the first member
+    uint64_t fired_at;
+    int fired;
+} test_timer_t;
+
+static void
+expire_cb(timing_wheel_node_t *node, void *priv)
+{
+    test_timer_t *timer = (test_timer_t *)node;
+    timer->fired_at = *((uint64_t *)priv);
+    timer->fired++;
+}
+
+// advance the wheel one tick at a time (so that the tick at which
+// each timer expires is known) up to the given tick
+static int
+advance_to(timing_wheel_t *wheel, uint64_t *now, uint64_t to)
+{
+    int expired = 0;
+    while (*now < to) {
+        (*now)++;
+        expired += timing_wheel_advance(wheel, *now, expire_cb, now);
+    }
+    return expired;
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    uint64_t start = 1000;
+    uint64_t now = start;
+    timing_wheel_t *wheel = timing_wheel_create(now);
+
+    // deadlines around the boundaries of all the levels
+    uint64_t deltas[] = { 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097,
+                          262143, 262144, 262145, 300000 };
+    int num_timers = sizeof(deltas) / sizeof(uint64_t);
+    test_timer_t timers[num_timers];
+    int i;
+    for (i = 0; i < num_timers; i++) {
+        timers[i].fired = 0;
+        timing_wheel_add(wheel, &timers[i].node, start + deltas[i]);
+    }
+
+    ut_testing("timing_wheel_count() == %d", num_timers);
+    ut_validate_int(timing_wheel_count(wheel), num_timers);
+
+    ut_testing("all the timers expire while advancing");
+    ut_validate_int(advance_to(wheel, &now, start + 300000), num_timers);
+
+    ut_testing("timers cascaded from the upper levels expire exactly at their deadline");
+    int failed = 0;
+    for (i = 0; i < num_timers; i++) {
+        if (timers[i].fired != 1 || timers[i].fired_at != start + deltas[i]) {
+            ut_failure("Timer due at +%llu fired %d times at +%llu",
+                       (unsigned long long)deltas[i], timers[i].fired,
+                       (unsigned long long)(timers[i].fired_at - start));
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("timing_wheel_count() == 0");
+    ut_validate_int(timing_wheel_count(wheel), 0);
+
+    test_timer_t past = { .fired = 0 };
+    timing_wheel_add(wheel, &past.node, now - 10);
+    ut_testing("a timer already due expires on the next tick");
+    advance_to(wheel, &now, now + 1);
+    ut_validate_int(past.fired == 1 && past.fired_at == now, 1);
+
+    test_timer_t removed = { .fired = 0 };
+    test_timer_t kept = { .fired = 0 };
+    timing_wheel_add(wheel, &removed.node, now + 5000);
+    timing_wheel_add(wheel, &kept.node, now + 5000);
+    timing_wheel_remove(wheel, &removed.node);
+    ut_testing("a removed timer doesn't expire");
+    advance_to(wheel, &now, now + 5000);
+    ut_validate_int(removed.fired == 0 && kept.fired == 1, 1);
+
+    test_timer_t jump[3] = { { .fired = 0 }, { .fired = 0 }, { .fired = 0 } };
+    timing_wheel_add(wheel, &jump[0].node, now + 10);
+    timing_wheel_add(wheel, &jump[1].node, now + 70000);
+    timing_wheel_add(wheel, &jump[2].node, now + 70001);
+    ut_testing("advancing many ticks at once expires only the due timers");
+    now += 70000;
+    int expired = timing_wheel_advance(wheel, now, expire_cb, &now);
+    ut_validate_int(expired == 2 && jump[0].fired && jump[1].fired && !jump[2].fired, 1);
+    advance_to(wheel, &now, now + 1);
+
+    // beyond the span of the wheel the timer is clamped to the last level
+    // and cascaded again until it's due
+    test_timer_t far = { .fired = 0 };
+    uint64_t far_expire = now + SPAN + 100;
+    timing_wheel_add(wheel, &far.node, far_expire);
+    ut_testing("a timer beyond the span of the wheel doesn't expire early");
+    advance_to(wheel, &now, far_expire - 1);
+    ut_validate_int(far.fired, 0);
+    ut_testing("a timer beyond the span of the wheel expires at its deadline");
+    advance_to(wheel, &now, far_expire);
+    ut_validate_int(far.fired == 1 && far.fired_at == far_expire, 1);
+
+    ut_testing("timing_wheel_count() == 0");
+    ut_validate_int(timing_wheel_count(wheel), 0);
+
+    timing_wheel_destroy(wheel);
+
+    ut_summary();
+    exit(ut_failed);
+}
@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <ut.h>
+#include <libgen.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#endif
+
+#include <uring_mux.h>
+
+typedef struct {
+    char in[64];
+    int inlen;
+    char *out;
+    int eof;
+} echo_arg_t;
+
+static int
+echo_input(iomux_t *mux, int fd, unsigned char *data, int len, void *priv)
+{
+    echo_arg_t *arg = (echo_arg_t *)priv;
+    int n = len < (int)sizeof(arg->in) - arg->inlen ? len : (int)sizeof(arg->in) - arg->inlen;
+    memcpy(arg->in + arg->inlen, data, n);
+    arg->inlen += n;
+    return len;
+}
+
+static int
+echo_output(iomux_t *mux, int fd, unsigned char **data, int *len, void *priv)
+{
+    echo_arg_t *arg = (echo_arg_t *)priv;
+    if (!arg->out) {
+        *len = 0;
+        return IOMUX_OUTPUT_MODE_NONE;
+    }
+    *data = (unsigned char *)arg->out;
+    *len = strlen(arg->out);
+    arg->out = NULL;
+    return IOMUX_OUTPUT_MODE_COPY;
+}
+
+static void
+echo_eof(iomux_t *mux, int fd, void *priv)
+{
+    echo_arg_t *arg = (echo_arg_t *)priv;
+    arg->eof = 1;
+    close(fd);
+}
+
+// run the mux until the condition is true (or 100 runs have been done)
+#define RUN_UNTIL(_mux, _cond) {\
+    int _runs = 0; \
+    while (!(_cond) && _runs++ < 100) { \
+        struct timeval _tv = { 0, 20000 }; \
+        uring_mux_run(_mux, &_tv); \
+    } \
+}
+
+// make io_uring_setup() fail as it does if io_uring
+// is not supported by the kernel (or not allowed)
+static int
+deny_io_uring()
+{
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | (ENOSYS & SECCOMP_RET_DATA)),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(filter) / sizeof(struct sock_filter),
+        .filter = filter
+    };
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0)
+        return -1;
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog);
+#else
+    return 0;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    ut_testing("uring_mux_create() returns NULL if io_uring is not available (workers fall back to iomux)");
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (deny_io_uring() != 0)
+            _exit(2);
+        uring_mux_t *mux = uring_mux_create(64, 1024);
+        _exit(mux ? 1 : 0);
+    }
+    int status = -1;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 2)
+        ut_failure("Can't deny io_uring_setup()");
+    else
+        ut_validate_int(WIFEXITED(status) ? WEXITSTATUS(status) : -1, 0);
+
+    uring_mux_t *mux = uring_mux_create(64, 1024);
+    if (!mux) {
+        // nothing else to test without io_uring
+        ut_testing("io_uring is not available, skipping the uring mux tests");
+        ut_success();
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        ut_testing("socketpair()");
+        ut_failure("Can't create the socket pair: %s", strerror(errno));
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    echo_arg_t arg;
+    memset(&arg, 0, sizeof(arg));
+    iomux_callbacks_t cbs = {
+        .mux_input = echo_input,
+        .mux_eof = echo_eof,
+        .priv = &arg
+    };
+
+    ut_testing("uring_mux_add(mux, fd, &cbs) == 1");
+    ut_validate_int(uring_mux_add(mux, fds[0], &cbs), 1);
+    ut_testing("uring_mux_num_fds(mux) == 1");
+    ut_validate_int(uring_mux_num_fds(mux), 1);
+
+    ut_testing("the input callback receives the data");
+    if (write(fds[1], "hello", 5) != 5)
+        ut_failure("Can't write to the socket pair");
+    RUN_UNTIL(mux, arg.inlen == 5);
+    ut_validate_buffer(arg.in, arg.inlen, "hello", 5);
+
+    ut_testing("the data provided by the output callback is sent");
+    arg.out = "world";
+    uring_mux_set_output_callback(mux, fds[0], echo_output);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    char buf[16];
+    ssize_t rb = 0;
+    RUN_UNTIL(mux, (rb = read(fds[1], buf, sizeof(buf))) > 0);
+    ut_validate_buffer(buf, rb > 0 ? rb : 0, "world", 5);
+    uring_mux_unset_output_callback(mux, fds[0]);
+
+    ut_testing("the eof callback is called when the peer closes the connection");
+    close(fds[1]);
+    RUN_UNTIL(mux, arg.eof);
+    ut_validate_int(arg.eof, 1);
+
+    ut_testing("uring_mux_isempty(mux) == 1");
+    ut_validate_int(uring_mux_isempty(mux), 1);
+
+    uring_mux_destroy(mux);
+
+    ut_summary();
+    exit(ut_failed);
+}
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <shardcache.h>
+#include <arc.h>
+
+/*
+ * Measures the hit throughput of the arc cache, with both the reclamation
+ * modes (reference counting and epoch based reclamation), for a growing
+ * number of threads looking up (and releasing) random keys which are all
+ * in the cache.
+ */
+
+#define DEFAULT_NUM_KEYS     100000
+#define DEFAULT_DURATION     5
+#define DEFAULT_PARTITIONS   1
+#define DEFAULT_THREADS      "1,8,32"
+#define MAX_THREAD_COUNTS    32
+#define KEY_LEN              32
+#define VALUE_SIZE           64
+
+typedef struct {
+    int num_keys;
+    int duration;
+    int partitions;
+    int loose;
+    int thread_counts[MAX_THREAD_COUNTS];
+    int num_thread_counts;
+} options_t;
+
+typedef struct {
+    arc_t *arc;
+    char (*keys)[KEY_LEN];
+    int num_keys;
+    uint64_t seed;
+    uint64_t lookups;
+} worker_thread_args_t;
+
+static int quit = 0;
+
+/* - */
+
+static void
+bench_init(const void *key, size_t klen, int async, time_t ttl, arc_resource_t res, void *ptr, void *priv)
+{
+}
+
+static int
+bench_fetch(void *obj, size_t *size, void *priv)
+{
+    *size = VALUE_SIZE;
+    return 0;
+}
+
+static void
+bench_store(void *obj, void *data, size_t size, void *priv)
+{
+}
+
+static void
+bench_evict(void *obj, void *priv)
+{
+}
+
+/* - */
+
+static void * worker_thread(void * in_args)
+{
+    worker_thread_args_t * args = (worker_thread_args_t *)in_args;
+    uint64_t x = args->seed;
+    uint64_t lookups = 0;
+
+    while (!__sync_fetch_and_add(&quit, 0)) {
+        int i;
+        for (i = 0; i < 1024; i++) {
+            // xorshift64
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            char *key = args->keys[x % args->num_keys];
+            void *ptr = NULL;
+            arc_resource_t res = arc_lookup(args->arc, key, strlen(key), &ptr, 0, 0);
+            if (res)
+                arc_release_resource(args->arc, res);
+        }
+        lookups += i;
+    }
+
+    args->lookups = lookups;
+    return NULL;
+}
+
+static double run(options_t *options, char (*keys)[KEY_LEN], arc_reclamation_t reclamation, int num_threads)
+{
+    arc_ops_t ops = {
+        .init = bench_init,
+        .fetch = bench_fetch,
+        .fetch_multi = NULL,
+        .store = bench_store,
+        .evict = bench_evict,
+        .priv = NULL
+    };
+
+    // large enough to hold all the keys
+    size_t size = (size_t)options->num_keys * (VALUE_SIZE + 256) * 4;
+    arc_t *arc = arc_create(&ops, size, sizeof(int), options->partitions,
+                            options->loose ? SHARDCACHE_ARC_MODE_LOOSE : SHARDCACHE_ARC_MODE_STRICT);
+    if (!arc || arc_set_reclamation(arc, reclamation) != 0) {
+        SHC_ERROR("Can't create the arc cache");
+        exit(-1);
+    }
+
+    for (int i = 0; i < options->num_keys; i++) {
+        arc_resource_t res = arc_lookup(arc, keys[i], strlen(keys[i]), NULL, 0, 0);
+        if (res)
+            arc_release_resource(arc, res);
+    }
+
+    pthread_t            threads     [num_threads];
+    worker_thread_args_t thread_args [num_threads];
+
+    __sync_bool_compare_and_swap(&quit, 1, 0);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        worker_thread_args_t * args = &thread_args[i];
+        args->arc = arc;
+        args->keys = keys;
+        args->num_keys = options->num_keys;
+        args->seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        args->lookups = 0;
+        if (pthread_create(&threads[i], NULL, worker_thread, args) != 0) {
+            SHC_ERROR("Cannot spawn new thread: %s\n", strerror(errno));
+            exit(-1);
+        }
+    }
+
+    sleep(options->duration);
+    __sync_bool_compare_and_swap(&quit, 0, 1);
+
+    uint64_t lookups = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        lookups += thread_args[i].lookups;
+    }
+
+    gettimeofday(&end, NULL);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    arc_destroy(arc);
+
+    return lookups / elapsed;
+}
+
+/* - */
+
+static void usage(char * prog, int rc) {
+    printf("usage: %s [OPTIONS]...\n"
+           "    -k <num_keys>         the number of keys in the cache (defaults to: %d)\n"
+           "    -d <seconds>          the duration of each run (defaults to: %d)\n"
+           "    -p <num_partitions>   the number of arc partitions (defaults to: %d)\n"
+           "    -t <threads>          comma-separated list of thread counts to test (defaults to: %s)\n"
+           "    -l                    use the loose arc mode (instead of the strict one)\n"
+           "    -h                    prints this help\n",
+           prog,
+           DEFAULT_NUM_KEYS,
+           DEFAULT_DURATION,
+           DEFAULT_PARTITIONS,
+           DEFAULT_THREADS);
+    exit(rc);
+}
+
+static void parse_thread_counts(char * str, options_t * options) {
+    char *p = str;
+    options->num_thread_counts = 0;
+    while (p && *p && options->num_thread_counts < MAX_THREAD_COUNTS) {
+        int count = strtol(p, &p, 10);
+        if (count > 0)
+            options->thread_counts[options->num_thread_counts++] = count;
+        if (*p == ',')
+            p++;
+        else
+            break;
+    }
+}
+
+static void parse_cmdline(int argc, char ** argv, options_t * options) {
+    static struct option long_options[] = {
+        { "keys",       2, 0, 'k' },
+        { "duration",   2, 0, 'd' },
+        { "partitions", 2, 0, 'p' },
+        { "threads",    2, 0, 't' },
+        { "loose",      0, 0, 'l' },
+        { "help",       0, 0, 'h' },
+        { NULL,         0, 0,  0  }
+    };
+
+    int  option_index = 0;
+    char c;
+
+    char threads[] = DEFAULT_THREADS;
+
+    memset(options, 0, sizeof(options_t));
+    options->num_keys = DEFAULT_NUM_KEYS;
+    options->duration = DEFAULT_DURATION;
+    options->partitions = DEFAULT_PARTITIONS;
+    parse_thread_counts(threads, options);
+
+    while ((c = getopt_long(argc, argv, "k:d:p:t:lh", long_options, &option_index))) {
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'k':
+                options->num_keys = strtol(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                options->duration = strtol(optarg, NULL, 10);
+                break;
+
+            case 'p':
+                options->partitions = strtol(optarg, NULL, 10);
+                break;
+
+            case 't':
+                parse_thread_counts(optarg, options);
+                break;
+
+            case 'l':
+                options->loose = 1;
+                break;
+
+            case 'h':
+                usage(argv[0], 0);
+                break;
+
+            default:
+                usage(argv[0], -1);
+        }
+    }
+
+    if (options->num_keys <= 0 || options->duration <= 0 || !options->num_thread_counts)
+        usage(argv[0], -1);
+}
+
+/* - */
+
+int main(int argc, char ** argv) {
+    options_t options;
+
+    shardcache_log_init("arc_benchmark", LOG_WARNING);
+
+    parse_cmdline(argc, argv, &options);
+
+    char (*keys)[KEY_LEN] = malloc(options.num_keys * KEY_LEN);
+    for (int i = 0; i < options.num_keys; i++)
+        snprintf(keys[i], KEY_LEN, "arc_benchmark_key_%d", i);
+
+    printf("%d keys, %d partitions, %s mode, %d seconds per run\n\n",
+           options.num_keys, options.partitions,
+           options.loose ? "loose" : "strict", options.duration);
+
+    printf("%8s %16s %16s %8s\n", "threads", "refcnt (hits/s)", "epoch (hits/s)", "speedup");
+    for (int i = 0; i < options.num_thread_counts; i++) {
+        int num_threads = options.thread_counts[i];
+        double refcnt = run(&options, keys, ARC_RECLAMATION_REFCNT, num_threads);
+        double epoch = run(&options, keys, ARC_RECLAMATION_EPOCH, num_threads);
+        printf("%8d %16.0f %16.0f %7.2fx\n", num_threads, refcnt, epoch, refcnt ? epoch / refcnt : 0);
+    }
+
+    free(keys);
+
+    return 0;
+}